@@ -37,6 +37,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0); 
 		}
 
+        TEST_METHOD(test_picohash_resize)
+        {
+            int ret = picohash_resize_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_cnxcreation)
         {
             int ret = cnxcreation_test();
@@ -44,6 +51,27 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_cnx_pool)
+        {
+            int ret = cnx_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_cnx_shard)
+        {
+            int ret = cnx_shard_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_index)
+        {
+            int ret = stream_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_parse_header)
         {
             int ret = parseheadertest();
@@ -114,6 +142,13 @@ namespace UnitTest1
 			Assert::AreEqual(ret, 0);
 		}
 
+        TEST_METHOD(test_sack_tracker)
+        {
+            int ret = sack_tracker_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_ackrange)
         {
             int ret = ackrange_test();
@@ -128,6 +163,139 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_ack_only_record)
+        {
+            int ret = ack_only_record_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_retransmit_index)
+        {
+            int ret = retransmit_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_ack_range_cost)
+        {
+            int ret = ack_range_cost_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_lost_stream_data)
+        {
+            int ret = lost_stream_data_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_scheduler)
+        {
+            int ret = stream_scheduler_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_ready_list)
+        {
+            int ret = stream_ready_list_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_priority)
+        {
+            int ret = stream_priority_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_send_ref)
+        {
+            int ret = stream_send_ref_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_pull)
+        {
+            int ret = stream_pull_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_packing)
+        {
+            int ret = stream_packing_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_send_buffer)
+        {
+            int ret = stream_send_buffer_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_posted_data)
+        {
+            int ret = stream_posted_data_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_credit_blocked)
+        {
+            int ret = stream_credit_blocked_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_reassembly)
+        {
+            int ret = stream_reassembly_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_in_order)
+        {
+            int ret = stream_in_order_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_receive_window)
+        {
+            int ret = receive_window_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_receive_budget)
+        {
+            int ret = receive_budget_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_max_stream_data_list)
+        {
+            int ret = max_stream_data_list_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_stream_gc)
+        {
+            int ret = stream_gc_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_sim_link)
         {
             int ret = sim_link_test();
@@ -352,5 +520,40 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(test_wake_time)
+        {
+            int ret = wake_time_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_ready_cnx)
+        {
+            int ret = ready_cnx_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_command_queue)
+        {
+            int ret = command_queue_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_cnx_layout)
+        {
+            int ret = cnx_layout_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_packet_pool)
+        {
+            int ret = packet_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
 	};
 }
\ No newline at end of file
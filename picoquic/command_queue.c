@@ -0,0 +1,471 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2017, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Cross thread command queue.
+ *
+ * Application threads post commands in a multiple producer, single consumer
+ * intrusive queue. Producers atomically exchange the head of the queue, then
+ * link the previous head to the new command. The network thread pops commands
+ * from the tail; a stub command keeps the queue non empty, so producers and
+ * consumer never touch the same pointer except through the head exchange.
+ *
+ * The first producer that finds the queue idle signals the wakeup descriptor.
+ * The consumer clears the signal before draining the queue, so a command posted
+ * during the drain always causes another wakeup.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#ifdef _WINDOWS
+#include <WinSock2.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+#ifdef _WINDOWS
+#define PICOQUIC_INVALID_WAKEUP INVALID_SOCKET
+#define PICOQUIC_ATOMIC_EXCHANGE_PTR(p, v) InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v))
+#define PICOQUIC_ATOMIC_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define PICOQUIC_ATOMIC_STORE_PTR(p, v) (void)InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v))
+#define PICOQUIC_ATOMIC_EXCHANGE_INT(p, v) InterlockedExchange((LONG volatile *)(p), (LONG)(v))
+#else
+#define PICOQUIC_INVALID_WAKEUP -1
+#define PICOQUIC_ATOMIC_EXCHANGE_PTR(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define PICOQUIC_ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PICOQUIC_ATOMIC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define PICOQUIC_ATOMIC_EXCHANGE_INT(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+void picoquic_init_command_queue(picoquic_quic_t * quic)
+{
+    quic->command_stub.next_command = NULL;
+    quic->command_stub.command_type = picoquic_command_stub;
+    quic->command_head = &quic->command_stub;
+    quic->command_tail = &quic->command_stub;
+    quic->command_wakeup_pending = 0;
+    quic->command_wakeup_fd[0] = PICOQUIC_INVALID_WAKEUP;
+    quic->command_wakeup_fd[1] = PICOQUIC_INVALID_WAKEUP;
+}
+
+static void picoquic_close_command_wakeup(picoquic_quic_t * quic)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (quic->command_wakeup_fd[i] != PICOQUIC_INVALID_WAKEUP)
+        {
+#ifdef _WINDOWS
+            closesocket(quic->command_wakeup_fd[i]);
+#else
+            if (i == 0 || quic->command_wakeup_fd[1] != quic->command_wakeup_fd[0])
+            {
+                close(quic->command_wakeup_fd[i]);
+            }
+#endif
+        }
+    }
+
+    quic->command_wakeup_fd[0] = PICOQUIC_INVALID_WAKEUP;
+    quic->command_wakeup_fd[1] = PICOQUIC_INVALID_WAKEUP;
+}
+
+int picoquic_open_command_wakeup(picoquic_quic_t * quic)
+{
+    int ret = 0;
+
+    if (quic->command_wakeup_fd[0] != PICOQUIC_INVALID_WAKEUP)
+    {
+        return 0;
+    }
+
+#ifdef _WINDOWS
+    {
+        /* A loopback UDP socket connected to itself, so it can be selected with the other sockets */
+        struct sockaddr_in addr;
+        int addr_len = sizeof(addr);
+        u_long non_block = 1;
+        SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (s == INVALID_SOCKET ||
+            bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            getsockname(s, (struct sockaddr *)&addr, &addr_len) != 0 ||
+            connect(s, (struct sockaddr *)&addr, addr_len) != 0 ||
+            ioctlsocket(s, FIONBIO, &non_block) != 0)
+        {
+            if (s != INVALID_SOCKET)
+            {
+                closesocket(s);
+            }
+            ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+        }
+        else
+        {
+            quic->command_wakeup_fd[0] = s;
+            quic->command_wakeup_fd[1] = s;
+        }
+    }
+#elif defined(__linux__)
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (fd < 0)
+        {
+            ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+        }
+        else
+        {
+            quic->command_wakeup_fd[0] = fd;
+            quic->command_wakeup_fd[1] = fd;
+        }
+    }
+#else
+    {
+        int fd[2];
+
+        if (pipe(fd) != 0)
+        {
+            ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+        }
+        else
+        {
+            (void)fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+            (void)fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+            quic->command_wakeup_fd[0] = fd[0];
+            quic->command_wakeup_fd[1] = fd[1];
+        }
+    }
+#endif
+
+    return ret;
+}
+
+picoquic_wakeup_fd_t picoquic_get_command_wakeup_fd(picoquic_quic_t * quic)
+{
+    return quic->command_wakeup_fd[0];
+}
+
+static void picoquic_signal_command_wakeup(picoquic_quic_t * quic)
+{
+    if (PICOQUIC_ATOMIC_EXCHANGE_INT(&quic->command_wakeup_pending, 1) == 0 &&
+        quic->command_wakeup_fd[1] != PICOQUIC_INVALID_WAKEUP)
+    {
+#ifdef _WINDOWS
+        char signal = 1;
+        (void)send(quic->command_wakeup_fd[1], &signal, 1, 0);
+#elif defined(__linux__)
+        uint64_t signal = 1;
+        (void)!write(quic->command_wakeup_fd[1], &signal, sizeof(signal));
+#else
+        uint8_t signal = 1;
+        (void)!write(quic->command_wakeup_fd[1], &signal, sizeof(signal));
+#endif
+    }
+}
+
+static void picoquic_clear_command_wakeup(picoquic_quic_t * quic)
+{
+    if (quic->command_wakeup_fd[0] != PICOQUIC_INVALID_WAKEUP)
+    {
+        uint64_t buffer[8];
+#ifdef _WINDOWS
+        while (recv(quic->command_wakeup_fd[0], (char *)buffer, sizeof(buffer), 0) > 0);
+#else
+        while (read(quic->command_wakeup_fd[0], buffer, sizeof(buffer)) > 0);
+#endif
+    }
+
+    (void)PICOQUIC_ATOMIC_EXCHANGE_INT(&quic->command_wakeup_pending, 0);
+}
+
+static void picoquic_push_command(picoquic_quic_t * quic, picoquic_command_t * command)
+{
+    picoquic_command_t * previous;
+
+    command->next_command = NULL;
+    previous = (picoquic_command_t *)PICOQUIC_ATOMIC_EXCHANGE_PTR(&quic->command_head, command);
+    PICOQUIC_ATOMIC_STORE_PTR(&previous->next_command, command);
+}
+
+/* Returns NULL if the queue is empty, or if a producer has not yet linked its command.
+ * In the latter case, that producer signals the wakeup after completing the push. */
+static picoquic_command_t * picoquic_pop_command(picoquic_quic_t * quic)
+{
+    picoquic_command_t * tail = quic->command_tail;
+    picoquic_command_t * next = (picoquic_command_t *)PICOQUIC_ATOMIC_LOAD_PTR(&tail->next_command);
+
+    if (tail == &quic->command_stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        quic->command_tail = next;
+        tail = next;
+        next = (picoquic_command_t *)PICOQUIC_ATOMIC_LOAD_PTR(&tail->next_command);
+    }
+
+    if (next != NULL)
+    {
+        quic->command_tail = next;
+        return tail;
+    }
+
+    if (tail != PICOQUIC_ATOMIC_LOAD_PTR(&quic->command_head))
+    {
+        return NULL;
+    }
+
+    /* The tail is the last command: push the stub back, so it can be popped */
+    picoquic_push_command(quic, &quic->command_stub);
+    next = (picoquic_command_t *)PICOQUIC_ATOMIC_LOAD_PTR(&tail->next_command);
+
+    if (next != NULL)
+    {
+        quic->command_tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static picoquic_command_t * picoquic_create_command(uint64_t initial_cnxid,
+    picoquic_command_enum command_type, uint64_t stream_id, size_t length)
+{
+    picoquic_command_t * command = (picoquic_command_t *)malloc(sizeof(picoquic_command_t) + length);
+
+    if (command != NULL)
+    {
+        memset(command, 0, sizeof(picoquic_command_t));
+        command->command_type = command_type;
+        command->initial_cnxid = initial_cnxid;
+        command->stream_id = stream_id;
+        command->length = length;
+        command->bytes = ((uint8_t *)command) + sizeof(picoquic_command_t);
+    }
+
+    return command;
+}
+
+static int picoquic_post_command(picoquic_quic_t * quic, picoquic_command_t * command)
+{
+    int ret = 0;
+
+    if (command == NULL)
+    {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else
+    {
+        picoquic_push_command(quic, command);
+        picoquic_signal_command_wakeup(quic);
+    }
+
+    return ret;
+}
+
+int picoquic_post_stream_data(picoquic_quic_t * quic, uint64_t initial_cnxid,
+    uint64_t stream_id, const uint8_t * data, size_t length, int set_fin)
+{
+    picoquic_command_t * command = picoquic_create_command(initial_cnxid, picoquic_command_stream_data, stream_id, length);
+
+    if (command != NULL)
+    {
+        if (length > 0)
+        {
+            memcpy(command->bytes, data, length);
+        }
+        command->set_fin = set_fin;
+    }
+
+    return picoquic_post_command(quic, command);
+}
+
+int picoquic_post_reset_stream(picoquic_quic_t * quic, uint64_t initial_cnxid,
+    uint64_t stream_id, uint16_t local_stream_error)
+{
+    picoquic_command_t * command = picoquic_create_command(initial_cnxid, picoquic_command_reset_stream, stream_id, 0);
+
+    if (command != NULL)
+    {
+        command->error_code = local_stream_error;
+    }
+
+    return picoquic_post_command(quic, command);
+}
+
+int picoquic_post_close(picoquic_quic_t * quic, uint64_t initial_cnxid, uint16_t reason_code)
+{
+    picoquic_command_t * command = picoquic_create_command(initial_cnxid, picoquic_command_close, 0, 0);
+
+    if (command != NULL)
+    {
+        command->error_code = reason_code;
+    }
+
+    return picoquic_post_command(quic, command);
+}
+
+/*
+ * Posted stream data is subject to the send buffer limits. The application thread
+ * cannot check them, so data refused with PICOQUIC_ERROR_SEND_BUFFER_FULL stays
+ * queued on the stream, and so does the data posted after it on the same stream.
+ * The deferred commands are retried when the stream becomes writable, and freed
+ * when the send queue is cleared by a reset or when the stream is deleted.
+ */
+
+static void picoquic_defer_command(picoquic_stream_head * stream, picoquic_command_t * command)
+{
+    command->next_command = NULL;
+
+    if (stream->last_deferred_command == NULL)
+    {
+        stream->first_deferred_command = command;
+    }
+    else
+    {
+        stream->last_deferred_command->next_command = command;
+    }
+    stream->last_deferred_command = command;
+}
+
+static int picoquic_process_stream_data_command(picoquic_cnx_t * cnx, picoquic_command_t * command)
+{
+    int is_deferred = 0;
+    picoquic_stream_head * stream = picoquic_find_stream(cnx, command->stream_id, 0);
+
+    if (stream == NULL || stream->first_deferred_command == NULL)
+    {
+        if (picoquic_add_to_stream(cnx, command->stream_id, command->bytes, command->length,
+            command->set_fin) == PICOQUIC_ERROR_SEND_BUFFER_FULL)
+        {
+            stream = picoquic_find_stream(cnx, command->stream_id, 0);
+            is_deferred = (stream != NULL);
+        }
+    }
+    else
+    {
+        is_deferred = 1;
+    }
+
+    if (is_deferred)
+    {
+        picoquic_defer_command(stream, command);
+    }
+
+    return is_deferred;
+}
+
+void picoquic_flush_deferred_commands(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    picoquic_command_t * command;
+
+    while ((command = stream->first_deferred_command) != NULL)
+    {
+        if (picoquic_add_to_stream(cnx, command->stream_id, command->bytes, command->length,
+            command->set_fin) == PICOQUIC_ERROR_SEND_BUFFER_FULL)
+        {
+            break;
+        }
+
+        stream->first_deferred_command = command->next_command;
+        if (stream->first_deferred_command == NULL)
+        {
+            stream->last_deferred_command = NULL;
+        }
+        free(command);
+    }
+}
+
+void picoquic_free_deferred_commands(picoquic_stream_head * stream)
+{
+    picoquic_command_t * command;
+
+    while ((command = stream->first_deferred_command) != NULL)
+    {
+        stream->first_deferred_command = command->next_command;
+        free(command);
+    }
+    stream->last_deferred_command = NULL;
+}
+
+int picoquic_process_commands(picoquic_quic_t * quic)
+{
+    int nb_commands = 0;
+    picoquic_command_t * command;
+
+    picoquic_clear_command_wakeup(quic);
+
+    while ((command = picoquic_pop_command(quic)) != NULL)
+    {
+        /* The connection is only resolved here, on the network thread. Commands
+         * for connections deleted since they were posted are not found, and discarded. */
+        picoquic_cnx_t * cnx = picoquic_cnx_by_initial_id(quic, command->initial_cnxid);
+
+        if (cnx != NULL)
+        {
+            switch (command->command_type)
+            {
+            case picoquic_command_stream_data:
+                if (picoquic_process_stream_data_command(cnx, command))
+                {
+                    /* The command is now owned by the stream */
+                    command = NULL;
+                }
+                break;
+            case picoquic_command_reset_stream:
+                (void)picoquic_reset_stream(cnx, command->stream_id, command->error_code);
+                break;
+            case picoquic_command_close:
+                (void)picoquic_close(cnx, command->error_code);
+                break;
+            default:
+                break;
+            }
+            nb_commands++;
+        }
+
+        free(command);
+    }
+
+    return nb_commands;
+}
+
+void picoquic_free_command_queue(picoquic_quic_t * quic)
+{
+    picoquic_command_t * command;
+
+    while ((command = picoquic_pop_command(quic)) != NULL)
+    {
+        free(command);
+    }
+
+    picoquic_close_command_wakeup(quic);
+}
@@ -24,9 +24,130 @@
 #include <string.h>
 #include "picoquic_internal.h"
 
+/*
+ * Stream index. Stream IDs are mostly allocated in sequence for each of the
+ * four stream types, so the streams are retrieved from a direct array per
+ * type, indexed by stream_id >> 2. Streams beyond the maximum size of the
+ * arrays, or created when an array cannot grow, are kept in a hash table.
+ */
+
+static uint64_t picoquic_stream_id_hash(void * key)
+{
+    return ((picoquic_stream_head *)key)->stream_id;
+}
+
+static int picoquic_stream_id_compare(void * key1, void * key2)
+{
+    return (((picoquic_stream_head *)key1)->stream_id == ((picoquic_stream_head *)key2)->stream_id) ? 0 : -1;
+}
+
+static int picoquic_index_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    int ret = 0;
+    int stream_type = (int)(stream->stream_id & 3);
+    uint64_t rank = stream->stream_id >> 2;
+    size_t index_size = cnx->stream_index_size[stream_type];
+
+    if (rank >= index_size && rank < PICOQUIC_STREAM_INDEX_MAX)
+    {
+        size_t new_size = (index_size == 0) ? PICOQUIC_STREAM_INDEX_MIN : 2 * index_size;
+        picoquic_stream_head ** new_index;
+
+        while (new_size <= rank)
+        {
+            new_size *= 2;
+        }
+
+        new_index = (picoquic_stream_head **)realloc(cnx->stream_index[stream_type],
+            new_size * sizeof(picoquic_stream_head *));
+
+        if (new_index != NULL)
+        {
+            memset(new_index + index_size, 0, (new_size - index_size) * sizeof(picoquic_stream_head *));
+            cnx->stream_index[stream_type] = new_index;
+            cnx->stream_index_size[stream_type] = new_size;
+            index_size = new_size;
+        }
+    }
+
+    if (rank < index_size)
+    {
+        cnx->stream_index[stream_type][rank] = stream;
+    }
+    else
+    {
+        if (cnx->stream_table == NULL)
+        {
+            cnx->stream_table = picohash_create(PICOQUIC_STREAM_TABLE_MIN,
+                picoquic_stream_id_hash, picoquic_stream_id_compare);
+        }
+
+        if (cnx->stream_table == NULL || picohash_insert(cnx->stream_table, stream) != 0)
+        {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_clear_stream_index(picoquic_cnx_t * cnx)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (cnx->stream_index[i] != NULL)
+        {
+            free(cnx->stream_index[i]);
+            cnx->stream_index[i] = NULL;
+        }
+        cnx->stream_index_size[i] = 0;
+    }
+
+    if (cnx->stream_table != NULL)
+    {
+        picohash_delete(cnx->stream_table, 0);
+        cnx->stream_table = NULL;
+    }
+
+    cnx->last_stream = NULL;
+}
+
+static void picoquic_unindex_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    int stream_type = (int)(stream->stream_id & 3);
+    uint64_t rank = stream->stream_id >> 2;
+
+    if (rank < cnx->stream_index_size[stream_type])
+    {
+        cnx->stream_index[stream_type][rank] = NULL;
+    }
+    else if (cnx->stream_table != NULL)
+    {
+        picohash_item * item = picohash_retrieve(cnx->stream_table, stream);
+
+        if (item != NULL)
+        {
+            picohash_item_delete(cnx->stream_table, item, 0);
+        }
+    }
+}
+
+/*
+ * Streams that were released are remembered as ranges of identifiers, per
+ * stream type. Streams are usually closed in about the order they were
+ * opened, so a few ranges cover all of them.
+ */
+
+int picoquic_is_stream_closed(picoquic_cnx_t * cnx, uint64_t stream_id)
+{
+    uint64_t key = (stream_id >> 2) + 1;
+
+    return stream_id != 0 && picoquic_check_sack_list(&cnx->closed_streams[stream_id & 3], key, key) != 0;
+}
+
 picoquic_stream_head * picoquic_create_stream(picoquic_cnx_t * cnx, uint64_t stream_id)
 {
-	picoquic_stream_head * stream = (picoquic_stream_head *)malloc(sizeof(picoquic_stream_head));
+	picoquic_stream_head * stream = picoquic_alloc_stream(cnx->quic);
 	if (stream != NULL)
 	{
         picoquic_stream_head * previous_stream = NULL;
@@ -36,26 +157,54 @@ picoquic_stream_head * picoquic_create_stream(picoquic_cnx_t * cnx, uint64_t str
 		stream->stream_id = stream_id;
 		stream->maxdata_local = cnx->local_parameters.initial_max_stream_data;
 		stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data;
+		stream->maxdata_window = cnx->local_parameters.initial_max_stream_data;
+		stream->sched_weight = PICOQUIC_DEFAULT_STREAM_WEIGHT;
+		stream->urgency = PICOQUIC_DEFAULT_STREAM_URGENCY;
+		stream->is_incremental = 1;
 
-        /*
-         * Make sure that the streams are open in order.
-         */
-
-        while (next_stream != NULL && next_stream->stream_id < stream_id)
-        {
-            previous_stream = next_stream;
-            next_stream = next_stream->next_stream;
-        }
-
-        stream->next_stream = next_stream;
-
-        if (previous_stream == NULL)
+        if (picoquic_index_stream(cnx, stream) != 0)
         {
-            cnx->first_stream.next_stream = stream;
+            picoquic_release_stream(cnx->quic, stream);
+            stream = NULL;
         }
         else
         {
+            /*
+             * Make sure that the streams are open in order. Streams are usually
+             * created in increasing order, so check the last stream first.
+             */
+
+            if (cnx->last_stream != NULL && cnx->last_stream->stream_id < stream_id)
+            {
+                previous_stream = cnx->last_stream;
+                next_stream = NULL;
+            }
+            else
+            {
+                while (next_stream != NULL && next_stream->stream_id < stream_id)
+                {
+                    previous_stream = next_stream;
+                    next_stream = next_stream->next_stream;
+                }
+            }
+
+            if (previous_stream == NULL)
+            {
+                previous_stream = &cnx->first_stream;
+            }
+
+            stream->next_stream = next_stream;
+            stream->previous_stream = previous_stream;
             previous_stream->next_stream = stream;
+
+            if (next_stream == NULL)
+            {
+                cnx->last_stream = stream;
+            }
+            else
+            {
+                next_stream->previous_stream = stream;
+            }
         }
 	}
 
@@ -74,6 +223,7 @@ void picoquic_update_stream_initial_remote(picoquic_cnx_t * cnx)
             stream->maxdata_remote < cnx->remote_parameters.initial_max_stream_data)
         {
             stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data;
+            picoquic_update_ready_stream(cnx, stream);
         }
         stream = stream->next_stream;
     } while (stream);
@@ -81,20 +231,34 @@ void picoquic_update_stream_initial_remote(picoquic_cnx_t * cnx)
 
 picoquic_stream_head * picoquic_find_stream(picoquic_cnx_t * cnx, uint64_t stream_id, int create)
 {
-	picoquic_stream_head * stream = &cnx->first_stream;
+	picoquic_stream_head * stream = NULL;
+	int stream_type = (int)(stream_id & 3);
+	uint64_t rank = stream_id >> 2;
 
-	do {
-		if (stream->stream_id == stream_id)
-		{
-			break;
-		}
-		else
+	if (stream_id == 0)
+	{
+		stream = &cnx->first_stream;
+	}
+	else if (rank < cnx->stream_index_size[stream_type])
+	{
+		stream = cnx->stream_index[stream_type][rank];
+	}
+
+	if (stream == NULL && stream_id != 0 && cnx->stream_table != NULL)
+	{
+		picoquic_stream_head key;
+		picohash_item * item;
+
+		key.stream_id = stream_id;
+		item = picohash_retrieve(cnx->stream_table, &key);
+
+		if (item != NULL)
 		{
-			stream = stream->next_stream;
+			stream = (picoquic_stream_head *)item->key;
 		}
-	} while (stream);
+	}
 
-	if (create != 0 && stream == NULL)
+	if (create != 0 && stream == NULL && !picoquic_is_stream_closed(cnx, stream_id))
 	{
 		stream = picoquic_create_stream(cnx, stream_id);
 	}
@@ -110,7 +274,12 @@ int picoquic_find_or_create_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
 
     *stream = picoquic_find_stream(cnx, stream_id, 0);
 
-    if (*stream == NULL)
+    if (*stream == NULL && picoquic_is_stream_closed(cnx, stream_id))
+    {
+        /* Late frame for a stream already released */
+        ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+    }
+    else if (*stream == NULL)
     {
         /* Verify the stream ID control conditions */
 
@@ -154,7 +323,7 @@ int picoquic_find_or_create_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
             {
                 /* Mark the stream as already finished in our direction */
                 (*stream)->stream_flags |= picoquic_stream_flag_fin_notified |
-                    picoquic_stream_flag_fin_sent;
+                    picoquic_stream_flag_fin_sent | picoquic_stream_flag_fin_acked;
             }
         }
     }
@@ -199,6 +368,16 @@ int picoquic_flow_control_check_stream_offset(picoquic_cnx_t * cnx, picoquic_str
 		{
 			cnx->data_received += new_bytes;
 			stream->fin_offset = new_fin_offset;
+
+            /* The peer cannot send more until credit is renewed */
+            if (new_fin_offset == stream->maxdata_local)
+            {
+                cnx->cold->flow_control_stats.nb_peer_stream_blocked++;
+            }
+            if (cnx->data_received == cnx->maxdata_local)
+            {
+                cnx->cold->flow_control_stats.nb_peer_blocked++;
+            }
 		}
 	}
 
@@ -326,7 +505,12 @@ int picoquic_decode_stream_reset_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
         {
             ret = picoquic_find_or_create_stream(cnx, stream_id, &stream, 1);
 
-            if (ret == 0)
+            if (ret == PICOQUIC_ERROR_STREAM_ALREADY_CLOSED)
+            {
+                /* Late reset of a stream already released */
+                ret = 0;
+            }
+            else if (ret == 0)
             {
                 if ((stream->stream_flags&
                     (picoquic_stream_flag_fin_received | picoquic_stream_flag_reset_received)) != 0 &&
@@ -350,6 +534,8 @@ int picoquic_decode_stream_reset_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
                                 picoquic_callback_stream_reset, cnx->callback_ctx);
                             stream->stream_flags |= picoquic_stream_flag_reset_signalled;
                         }
+
+                        picoquic_delete_stream_if_closed(cnx, stream);
                     }
                 }
             }
@@ -430,7 +616,12 @@ int picoquic_decode_stop_sending_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
             /* TODO: change stream_id to 64 bits! */
             ret = picoquic_find_or_create_stream(cnx, stream_id, &stream, 1);
 
-            if (ret == 0)
+            if (ret == PICOQUIC_ERROR_STREAM_ALREADY_CLOSED)
+            {
+                /* Nothing left to stop on a stream already released */
+                ret = 0;
+            }
+            else if (ret == 0)
             {
                 if ((stream->stream_flags&picoquic_stream_flag_stop_sending_received) == 0 &&
                     (stream->stream_flags&picoquic_stream_flag_reset_requested) == 0)
@@ -583,35 +774,148 @@ int picoquic_parse_stream_header(const uint8_t * bytes, size_t bytes_max,
     return ret;
 }
 
+/*
+ * Receive memory budget. The memory held by the reassembly buffers is counted
+ * per connection and per context. Level 0: within half of both budgets; level
+ * 1: more than half of a budget is used, the receive windows shrink; level 2:
+ * a budget is exhausted, no new credit is given to the peer.
+ */
+
+int picoquic_receive_budget_level(picoquic_cnx_t * cnx)
+{
+    int level = 0;
+    picoquic_quic_t * quic = cnx->quic;
+
+    if (cnx->receive_buffered >= quic->cnx_receive_budget ||
+        quic->receive_buffered >= quic->receive_budget)
+    {
+        level = 2;
+    }
+    else if (2 * cnx->receive_buffered > quic->cnx_receive_budget ||
+        2 * quic->receive_buffered > quic->receive_budget)
+    {
+        level = 1;
+    }
+
+    return level;
+}
+
+static void picoquic_update_receive_buffered(picoquic_cnx_t * cnx, size_t old_memory, size_t new_memory)
+{
+    cnx->receive_buffered += new_memory;
+    cnx->receive_buffered -= old_memory;
+    cnx->quic->receive_buffered += new_memory;
+    cnx->quic->receive_buffered -= old_memory;
+}
+
+/*
+ * Streams that need a MAX_STREAM_DATA update are kept in a list, so frame
+ * preparation does not have to check every stream. A stream is listed when
+ * its consumed offset crosses the update threshold, which only happens when
+ * data is delivered, and it leaves the list when the update is sent.
+ */
+
+static int picoquic_stream_needs_max_data(picoquic_stream_head * stream)
+{
+    return stream->stream_id != 0 &&
+        (stream->stream_flags&(picoquic_stream_flag_fin_received |
+            picoquic_stream_flag_reset_received)) == 0 &&
+        2 * (stream->maxdata_local - stream->consumed_offset) < stream->maxdata_window;
+}
+
+static int picoquic_is_update_stream_listed(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    return stream->previous_update_stream != NULL || cnx->first_update_stream == stream;
+}
+
+static void picoquic_insert_update_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    if (!picoquic_is_update_stream_listed(cnx, stream))
+    {
+        stream->next_update_stream = NULL;
+        stream->previous_update_stream = cnx->last_update_stream;
+
+        if (cnx->last_update_stream == NULL)
+        {
+            cnx->first_update_stream = stream;
+        }
+        else
+        {
+            cnx->last_update_stream->next_update_stream = stream;
+        }
+
+        cnx->last_update_stream = stream;
+    }
+}
+
+static void picoquic_remove_update_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    if (stream->previous_update_stream == NULL)
+    {
+        cnx->first_update_stream = stream->next_update_stream;
+    }
+    else
+    {
+        stream->previous_update_stream->next_update_stream = stream->next_update_stream;
+    }
+
+    if (stream->next_update_stream == NULL)
+    {
+        cnx->last_update_stream = stream->previous_update_stream;
+    }
+    else
+    {
+        stream->next_update_stream->previous_update_stream = stream->previous_update_stream;
+    }
+
+    stream->next_update_stream = NULL;
+    stream->previous_update_stream = NULL;
+}
+
+static void picoquic_stream_data_deliver(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+    uint8_t * bytes, size_t data_length)
+{
+    picoquic_call_back_event_t fin_now = picoquic_callback_no_event;
+
+    stream->consumed_offset += data_length;
+
+    if (picoquic_stream_needs_max_data(stream))
+    {
+        picoquic_insert_update_stream(cnx, stream);
+    }
+
+    if (stream->consumed_offset >= stream->fin_offset &&
+        (stream->stream_flags&
+        (picoquic_stream_flag_fin_received | picoquic_stream_flag_fin_signalled)) ==
+        picoquic_stream_flag_fin_received)
+    {
+        fin_now = picoquic_callback_stream_fin;
+        stream->stream_flags |= picoquic_stream_flag_fin_signalled;
+    }
+
+    cnx->callback_fn(cnx, stream->stream_id, bytes, data_length, fin_now,
+        cnx->callback_ctx);
+}
+
 void picoquic_stream_data_callback(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
 {
-	picoquic_stream_data * data = stream->stream_data;
+    uint8_t * bytes = NULL;
+    size_t data_length;
 
-	while (data != NULL && data->offset <= stream->consumed_offset)
-	{
-		size_t start = (size_t)(stream->consumed_offset - data->offset);
-		size_t data_length = data->length - start;
-		picoquic_call_back_event_t fin_now = picoquic_callback_no_event;
-		
-		stream->consumed_offset += data_length;
-
-		if (stream->consumed_offset >= stream->fin_offset &&
-			(stream->stream_flags&
-			(picoquic_stream_flag_fin_received | picoquic_stream_flag_fin_signalled)) ==
-			picoquic_stream_flag_fin_received)
-		{
-			fin_now = picoquic_callback_stream_fin;
-			stream->stream_flags |= picoquic_stream_flag_fin_signalled;
-		}
+    /* Deliver the contiguous data at the start of the reassembly buffer. This
+     * takes two rounds when the data wraps around the end of the ring. */
+    while ((data_length = picoquic_reassembly_contiguous(&stream->reassembly, stream->consumed_offset, &bytes)) > 0)
+    {
+        picoquic_reassembly_consume(&stream->reassembly, stream->consumed_offset, data_length);
+        picoquic_stream_data_deliver(cnx, stream, bytes, data_length);
+    }
 
-		cnx->callback_fn(cnx, stream->stream_id, data->bytes + start, data_length, fin_now,
-			cnx->callback_ctx);
-		
-		free(data->bytes);
-		stream->stream_data = data->next_stream_data;
-		free(data);
-		data = stream->stream_data;
-	}
+    /* Once all the out of order data is delivered, the buffer is not needed anymore */
+    if (stream->reassembly.size > 0 && stream->reassembly.end_offset <= stream->consumed_offset)
+    {
+        picoquic_update_receive_buffered(cnx, picoquic_reassembly_memory(&stream->reassembly), 0);
+        picoquic_reassembly_clear(&stream->reassembly);
+    }
 
 	/* handle the case where the fin frame does not carry any data */
 
@@ -626,6 +930,66 @@ void picoquic_stream_data_callback(picoquic_cnx_t * cnx, picoquic_stream_head *
 	}
 }
 
+/*
+ * A stream is released once it is closed in both directions: in the sending
+ * direction when a reset was sent, or when the FIN and all the data were
+ * acknowledged; in the receiving direction when a reset was received, or when
+ * all data and the FIN were delivered. The stream identifier is added to the
+ * closed streams, and the stream is removed from the lists and indexes.
+ */
+
+static int picoquic_is_stream_fully_closed(picoquic_stream_head * stream)
+{
+    int is_send_closed = (stream->stream_flags&picoquic_stream_flag_reset_sent) != 0 ||
+        ((stream->stream_flags&(picoquic_stream_flag_fin_sent | picoquic_stream_flag_fin_acked)) ==
+        (picoquic_stream_flag_fin_sent | picoquic_stream_flag_fin_acked) &&
+            stream->send_queue == NULL && stream->retransmit_queue == NULL &&
+            (stream->sent_offset == 0 ||
+                picoquic_check_sack_list(&stream->first_sack_item, 0, stream->sent_offset - 1) != 0));
+    int is_receive_closed = (stream->stream_flags&
+        (picoquic_stream_flag_fin_signalled | picoquic_stream_flag_reset_received)) != 0;
+
+    return is_send_closed && is_receive_closed;
+}
+
+void picoquic_delete_stream_if_closed(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    uint64_t key = (stream->stream_id >> 2) + 1;
+    uint64_t block_size = 0;
+
+    /* If the identifier cannot be remembered, the stream is kept */
+    if (stream->stream_id != 0 && picoquic_is_stream_fully_closed(stream) &&
+        picoquic_update_sack_list(&cnx->closed_streams[stream->stream_id & 3], key, key, &block_size) >= 0)
+    {
+        picoquic_stream_head * previous_stream = stream->previous_stream;
+
+        if (previous_stream != NULL)
+        {
+            previous_stream->next_stream = stream->next_stream;
+            if (stream->next_stream != NULL)
+            {
+                stream->next_stream->previous_stream = previous_stream;
+            }
+            else
+            {
+                cnx->last_stream = (previous_stream == &cnx->first_stream) ? NULL : previous_stream;
+            }
+        }
+
+        picoquic_unindex_stream(cnx, stream);
+        picoquic_clear_ready_stream(cnx, stream);
+        if (picoquic_is_update_stream_listed(cnx, stream))
+        {
+            picoquic_remove_update_stream(cnx, stream);
+        }
+
+        picoquic_update_receive_buffered(cnx, picoquic_reassembly_memory(&stream->reassembly), 0);
+        cnx->send_queued -= stream->send_queued;
+        picoquic_clear_stream(stream);
+        picoquic_release_stream(cnx->quic, stream);
+    }
+}
+
 int picoquic_stream_network_input(picoquic_cnx_t * cnx, uint64_t stream_id,
     uint64_t offset, int fin, uint8_t * bytes, size_t length, uint64_t current_time)
 {
@@ -670,7 +1034,46 @@ int picoquic_stream_network_input(picoquic_cnx_t * cnx, uint64_t stream_id,
 		ret = picoquic_flow_control_check_stream_offset(cnx, stream, new_fin_offset);
 	}
 
-	if (ret == 0)
+	if (ret == 0 && stream_id != 0)
+    {
+        if (offset <= stream->consumed_offset && offset + length > stream->consumed_offset &&
+            cnx->callback_fn != NULL)
+        {
+            /* In order data is delivered directly from the decrypted packet. Bytes
+             * that were also received out of order are dropped from the buffer. */
+            size_t start = (size_t)(stream->consumed_offset - offset);
+            size_t data_length = length - start;
+
+            if (stream->reassembly.end_offset > stream->consumed_offset)
+            {
+                uint64_t buffered = stream->reassembly.end_offset - stream->consumed_offset;
+
+                picoquic_reassembly_consume(&stream->reassembly, stream->consumed_offset,
+                    (buffered < data_length) ? (size_t)buffered : data_length);
+            }
+
+            cnx->latest_progress_time = current_time;
+            picoquic_stream_data_deliver(cnx, stream, bytes + start, data_length);
+            /* Deliver the buffered data that follows, or the FIN */
+            should_notify = stream_id;
+        }
+        else if (offset + length > stream->consumed_offset)
+        {
+            /* Out of order data is copied in the reassembly buffer */
+            size_t old_memory = picoquic_reassembly_memory(&stream->reassembly);
+
+            ret = picoquic_reassembly_insert(&stream->reassembly, stream->consumed_offset,
+                offset, bytes, length);
+            picoquic_update_receive_buffered(cnx, old_memory, picoquic_reassembly_memory(&stream->reassembly));
+
+            if (ret == 0)
+            {
+                should_notify = stream_id;
+                cnx->latest_progress_time = current_time;
+            }
+        }
+    }
+	else if (ret == 0)
     {
         picoquic_stream_data ** pprevious = &stream->stream_data;
         picoquic_stream_data * next = stream->stream_data;
@@ -750,6 +1153,11 @@ int picoquic_stream_network_input(picoquic_cnx_t * cnx, uint64_t stream_id,
 		/* check how much data there is to send */
 		picoquic_stream_data_callback(cnx, stream);
 	}
+
+    if (ret == 0 && stream_id != 0)
+    {
+        picoquic_delete_stream_if_closed(cnx, stream);
+    }
     
     return ret;
 }
@@ -773,6 +1181,11 @@ int picoquic_decode_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
             DBG_PRINTF("non-zero stream (%u), where only stream 0 is expected", stream_id);
             ret = picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION);
         }
+        else if (picoquic_is_stream_closed(cnx, stream_id))
+        {
+            /* Late data for a stream already released is ignored */
+            *consumed += data_length;
+        }
         else
         {
             ret = picoquic_stream_network_input(cnx, stream_id, offset, fin,
@@ -785,76 +1198,543 @@ int picoquic_decode_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 }
 
 
+/*
+ * Streams ready to send. The streams other than stream 0 that have data, a FIN
+ * or a reset to send, and that are not blocked by their own flow control, are
+ * kept in doubly linked lists, one per urgency level, in scheduling order. The
+ * lists are updated when data is queued or lost, when a reset is requested,
+ * when the flow control credit of the stream increases, and after each stream
+ * frame is prepared. Picking the next stream thus does not require visiting
+ * idle streams.
+ */
+
+static int picoquic_is_stream_ready(picoquic_stream_head * stream)
+{
+    int is_ready = 0;
+
+    if ((stream->stream_flags&picoquic_stream_flag_reset_requested) != 0)
+    {
+        is_ready = (stream->stream_flags&picoquic_stream_flag_reset_sent) == 0;
+    }
+    else if (stream->retransmit_queue != NULL)
+    {
+        is_ready = 1;
+    }
+    else if (stream->send_queue != NULL)
+    {
+        is_ready = stream->send_queue->length > stream->send_queue->offset &&
+            stream->sent_offset < stream->maxdata_remote;
+    }
+    else if ((stream->stream_flags&picoquic_stream_flag_fin_notified) != 0)
+    {
+        is_ready = (stream->stream_flags&picoquic_stream_flag_fin_sent) == 0;
+    }
+    else
+    {
+        is_ready = stream->is_active && stream->sent_offset < stream->maxdata_remote;
+    }
+
+    return is_ready;
+}
+
+static int picoquic_is_in_ready_list(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    return !stream->is_credit_blocked &&
+        (stream->previous_ready_stream != NULL || cnx->first_ready_stream[stream->urgency] == stream);
+}
+
+static void picoquic_insert_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    int urgency = stream->urgency;
+
+    stream->next_ready_stream = NULL;
+    stream->previous_ready_stream = cnx->last_ready_stream[urgency];
+
+    if (cnx->last_ready_stream[urgency] == NULL)
+    {
+        cnx->first_ready_stream[urgency] = stream;
+        cnx->ready_urgency_mask |= (uint8_t)(1 << urgency);
+    }
+    else
+    {
+        cnx->last_ready_stream[urgency]->next_ready_stream = stream;
+    }
+    cnx->last_ready_stream[urgency] = stream;
+
+    stream->sched_credit = (int64_t)stream->sched_weight * PICOQUIC_STREAM_WEIGHT_QUANTUM;
+}
+
+static void picoquic_remove_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    int urgency = stream->urgency;
+
+    if (stream->previous_ready_stream == NULL)
+    {
+        cnx->first_ready_stream[urgency] = stream->next_ready_stream;
+    }
+    else
+    {
+        stream->previous_ready_stream->next_ready_stream = stream->next_ready_stream;
+    }
+
+    if (stream->next_ready_stream == NULL)
+    {
+        cnx->last_ready_stream[urgency] = stream->previous_ready_stream;
+        if (stream->previous_ready_stream == NULL)
+        {
+            cnx->ready_urgency_mask &= (uint8_t)~(1 << urgency);
+        }
+    }
+    else
+    {
+        stream->next_ready_stream->previous_ready_stream = stream->previous_ready_stream;
+    }
+
+    stream->next_ready_stream = NULL;
+    stream->previous_ready_stream = NULL;
+}
+
+/*
+ * Streams that only have new data to send cannot be served while the connection
+ * is blocked by MAX_DATA. They are moved from the ready lists to the blocked list
+ * the first time the scheduler meets them, so it does not skip them again for each
+ * packet, and moved back when credit is received or the stream is updated.
+ */
+
+static void picoquic_block_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    picoquic_remove_ready_stream(cnx, stream);
+
+    stream->is_credit_blocked = 1;
+    stream->previous_ready_stream = cnx->last_blocked_stream;
+
+    if (cnx->last_blocked_stream == NULL)
+    {
+        cnx->first_blocked_stream = stream;
+    }
+    else
+    {
+        cnx->last_blocked_stream->next_ready_stream = stream;
+    }
+    cnx->last_blocked_stream = stream;
+}
+
+static void picoquic_remove_blocked_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    if (stream->previous_ready_stream == NULL)
+    {
+        cnx->first_blocked_stream = stream->next_ready_stream;
+    }
+    else
+    {
+        stream->previous_ready_stream->next_ready_stream = stream->next_ready_stream;
+    }
+
+    if (stream->next_ready_stream == NULL)
+    {
+        cnx->last_blocked_stream = stream->previous_ready_stream;
+    }
+    else
+    {
+        stream->next_ready_stream->previous_ready_stream = stream->previous_ready_stream;
+    }
+
+    stream->next_ready_stream = NULL;
+    stream->previous_ready_stream = NULL;
+    stream->is_credit_blocked = 0;
+}
+
+/* Called when the connection credit increases */
+void picoquic_unblock_streams(picoquic_cnx_t * cnx)
+{
+    picoquic_stream_head * stream;
+
+    while ((stream = cnx->first_blocked_stream) != NULL)
+    {
+        picoquic_remove_blocked_stream(cnx, stream);
+        picoquic_update_ready_stream(cnx, stream);
+    }
+}
+
+/* Most urgent ready list at or after the given urgency, or NULL if all are empty */
+static picoquic_stream_head * picoquic_first_ready_stream_from(picoquic_cnx_t * cnx, int * urgency)
+{
+    picoquic_stream_head * stream = NULL;
+    unsigned int mask = cnx->ready_urgency_mask >> *urgency;
+
+    if (mask != 0)
+    {
+        while ((mask & 1) == 0)
+        {
+            mask >>= 1;
+            (*urgency)++;
+        }
+        stream = cnx->first_ready_stream[*urgency];
+    }
+
+    return stream;
+}
+
+void picoquic_update_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    if (stream->stream_id != 0)
+    {
+        int is_in_list;
+
+        if (stream->is_credit_blocked)
+        {
+            /* The scheduler checks again whether the stream can be served */
+            picoquic_remove_blocked_stream(cnx, stream);
+        }
+
+        is_in_list = picoquic_is_in_ready_list(cnx, stream);
+
+        if (picoquic_is_stream_ready(stream))
+        {
+            if (!is_in_list)
+            {
+                picoquic_insert_ready_stream(cnx, stream);
+            }
+        }
+        else if (is_in_list)
+        {
+            picoquic_remove_ready_stream(cnx, stream);
+        }
+    }
+}
+
+void picoquic_clear_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    if (stream->is_credit_blocked)
+    {
+        picoquic_remove_blocked_stream(cnx, stream);
+    }
+    else if (stream->stream_id != 0 && picoquic_is_in_ready_list(cnx, stream))
+    {
+        picoquic_remove_ready_stream(cnx, stream);
+    }
+}
+
+/*
+ * After a frame was sent on a stream, update its position in the ready list.
+ * Round robin moves the stream to the end of the list after each frame. The
+ * weighted scheduler is a deficit round robin, in which each stream sends in
+ * turn its weight times PICOQUIC_STREAM_WEIGHT_QUANTUM bytes. FIFO keeps the
+ * stream at its place until it has nothing left to send, and so does any
+ * scheduler for the streams that are not incremental.
+ */
+
+static void picoquic_schedule_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream, size_t consumed)
+{
+    picoquic_update_ready_stream(cnx, stream);
+
+    if (consumed > 0 && stream->stream_id != 0 && picoquic_is_in_ready_list(cnx, stream) &&
+        stream->next_ready_stream != NULL)
+    {
+        int is_rotated = 0;
+
+        switch ((stream->is_incremental) ? cnx->stream_scheduler : picoquic_stream_scheduler_fifo)
+        {
+        case picoquic_stream_scheduler_fifo:
+            break;
+        case picoquic_stream_scheduler_weighted:
+            stream->sched_credit -= (int64_t)consumed;
+            is_rotated = stream->sched_credit <= 0;
+            break;
+        case picoquic_stream_scheduler_round_robin:
+        default:
+            is_rotated = 1;
+            break;
+        }
+
+        if (is_rotated)
+        {
+            int64_t credit = stream->sched_credit;
+
+            picoquic_remove_ready_stream(cnx, stream);
+            picoquic_insert_ready_stream(cnx, stream);
+
+            if (credit < 0)
+            {
+                /* Carry the deficit over to the next turn */
+                stream->sched_credit += credit;
+            }
+        }
+    }
+}
+
 picoquic_stream_head * picoquic_find_ready_stream(picoquic_cnx_t * cnx, int restricted)
 {
 	picoquic_stream_head * stream = &cnx->first_stream;
 
-	if (restricted == 0 && cnx->maxdata_remote > cnx->data_sent)
-	{
-		do {
-			if ((stream->send_queue != NULL &&
-				stream->send_queue->length > stream->send_queue->offset &&
-				(stream->stream_id == 0 ||
-				stream->sent_offset < stream->maxdata_remote)) ||
-				((stream->stream_flags&picoquic_stream_flag_fin_notified) != 0 &&
-				(stream->stream_flags&picoquic_stream_flag_fin_sent) == 0) ||
-				((stream->stream_flags&picoquic_stream_flag_reset_requested) != 0 &&
-				(stream->stream_flags&picoquic_stream_flag_reset_sent) == 0))
-			{
-				/* if the stream is not active yet, verify that it fits under
-				 * the max stream id limit */
+	if ((stream->send_queue == NULL ||
+		stream->send_queue->length <= stream->send_queue->offset) &&
+		((stream->stream_flags&picoquic_stream_flag_fin_notified) == 0 ||
+		(stream->stream_flags&picoquic_stream_flag_fin_sent) != 0) &&
+		((stream->stream_flags&picoquic_stream_flag_reset_requested) == 0 ||
+		(stream->stream_flags&picoquic_stream_flag_reset_sent) != 0))
+	{
+		stream = NULL;
+	}
+
+	if (restricted == 0 && stream == NULL)
+	{
+		/* Lost data was already counted against flow control, and can be sent
+		 * even if the connection is blocked */
+		int is_blocked = (cnx->maxdata_remote > cnx->data_sent) ? 0 : 1;
+		int parity = ((cnx->quic->flags&picoquic_context_server) == 0) ? 0 : 1;
+		int urgency = 0;
+
+		/* The most urgent streams are served first */
+		stream = picoquic_first_ready_stream_from(cnx, &urgency);
+
+		while (stream != NULL)
+		{
+			picoquic_stream_head * next = stream->next_ready_stream;
+
+			if (!is_blocked || stream->retransmit_queue != NULL ||
+				(stream->stream_flags&picoquic_stream_flag_reset_requested) != 0 ||
+				(stream->send_queue == NULL && !stream->is_active))
+			{
+				/* if the stream is not active yet, verify that it fits under
+				 * the max stream id limit */
+				if (((stream->stream_id & 1) ^ parity) == 0 ||
+					stream->stream_id < cnx->max_stream_id_bidir_remote)
+				{
+					break;
+				}
+			}
+			else
+			{
+				/* Only new data to send: wait for MAX_DATA out of the ready list */
+				picoquic_block_ready_stream(cnx, stream);
+			}
+
+			stream = next;
+
+			if (stream == NULL && urgency < PICOQUIC_STREAM_URGENCY_MAX)
+			{
+				urgency++;
+				stream = picoquic_first_ready_stream_from(cnx, &urgency);
+			}
+		}
+	}
+
+	return stream;
+}
+
+/*
+ * Repeat the oldest lost data of the stream. The frame carries an explicit
+ * length unless it fills the packet, and the data is split if it does not fit.
+ */
+
+static int picoquic_prepare_stream_retransmit_frame(picoquic_stream_head * stream,
+    uint8_t * bytes, size_t bytes_max, size_t * consumed)
+{
+    int ret = 0;
+    picoquic_stream_data * lost = stream->retransmit_queue;
+    size_t byte_index = 0;
+    size_t l_stream = 0;
+    size_t l_off = 0;
+    size_t length = lost->length;
+
+    if (bytes_max > byte_index)
+    {
+        bytes[byte_index++] = picoquic_frame_type_stream_range_min;
+        l_stream = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index, stream->stream_id);
+        byte_index += l_stream;
+    }
+
+    if (lost->offset > 0 && bytes_max > byte_index)
+    {
+        bytes[0] |= 4; /* Indicates presence of offset */
+        l_off = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index, lost->offset);
+        byte_index += l_off;
+    }
+
+    if (byte_index >= bytes_max || l_stream == 0 || (lost->offset > 0 && l_off == 0))
+    {
+        ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+    }
+    else
+    {
+        size_t space = bytes_max - byte_index;
+
+        if (length < space)
+        {
+            size_t l_len = 0;
+
+            bytes[0] |= 2; /* Indicates presence of length */
+            l_len = picoquic_varint_encode(bytes + byte_index, space, (uint64_t)length);
+
+            if (l_len == 0 || l_len >= space)
+            {
+                ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+            }
+            else
+            {
+                if (length + l_len > space)
+                {
+                    length = space - l_len;
+                    l_len = picoquic_varint_encode(bytes + byte_index, space, (uint64_t)length);
+                }
+                byte_index += l_len;
+            }
+        }
+        else
+        {
+            length = space;
+        }
+    }
+
+    if (ret == 0)
+    {
+        memcpy(&bytes[byte_index], lost->bytes, length);
+        byte_index += length;
+
+        lost->offset += length;
+        lost->bytes += length;
+        lost->length -= length;
+
+        if (lost->length == 0)
+        {
+            stream->retransmit_queue = lost->next_stream_data;
+
+            if (stream->retransmit_queue == NULL && stream->send_queue == NULL &&
+                lost->offset == stream->sent_offset &&
+                (stream->stream_flags&picoquic_stream_flag_fin_notified) != 0 &&
+                (stream->stream_flags&picoquic_stream_flag_fin_sent) == 0)
+            {
+                /* Repeat the fin bit with the last data */
+                stream->stream_flags |= picoquic_stream_flag_fin_sent;
+                bytes[0] |= 1;
+            }
+
+            free(lost);
+        }
+
+        *consumed = byte_index;
+    }
+    else
+    {
+        *consumed = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Ask the application for the data of an active stream. The frame header is
+ * encoded first, then the application provides the data directly in the
+ * packet, see picoquic_provide_stream_data_buffer.
+ */
+
+static int picoquic_prepare_stream_active_frame(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+    uint8_t * bytes, size_t bytes_max, size_t * consumed)
+{
+    int ret = 0;
+    picoquic_stream_data_buffer_ctx_t ctx;
+    size_t byte_index = 0;
+    size_t l_stream = 0;
+    size_t l_off = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    *consumed = 0;
+
+    if (bytes_max > byte_index)
+    {
+        bytes[byte_index++] = picoquic_frame_type_stream_range_min;
+        l_stream = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index, stream->stream_id);
+        byte_index += l_stream;
+    }
+
+    if (stream->sent_offset > 0 && bytes_max > byte_index)
+    {
+        bytes[0] |= 4; /* Indicates presence of offset */
+        l_off = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index, stream->sent_offset);
+        byte_index += l_off;
+    }
+
+    if (byte_index + 2 > bytes_max || l_stream == 0 || (stream->sent_offset > 0 && l_off == 0))
+    {
+        ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+    }
+    else if (cnx->callback_fn == NULL)
+    {
+        stream->is_active = 0;
+    }
+    else
+    {
+        ctx.bytes = bytes;
+        ctx.bytes_max = bytes_max;
+        ctx.header_length = byte_index;
+        ctx.allowed_length = bytes_max - byte_index;
+
+        /* Abide by flow control */
+        if (ctx.allowed_length > (cnx->maxdata_remote - cnx->data_sent))
+        {
+            ctx.allowed_length = (size_t)(cnx->maxdata_remote - cnx->data_sent);
+        }
+
+        if (ctx.allowed_length > (stream->maxdata_remote - stream->sent_offset))
+        {
+            ctx.allowed_length = (size_t)(stream->maxdata_remote - stream->sent_offset);
+        }
 
-				if (stream->stream_id == 0)
-				{
-					break;
-				}
-				else
-				{
-					/* Check parity */
-					int parity = ((cnx->quic->flags&picoquic_context_server) == 0) ? 0 : 1;
+        cnx->callback_fn(cnx, stream->stream_id, (uint8_t *)&ctx, ctx.allowed_length,
+            picoquic_callback_prepare_to_send, cnx->callback_ctx);
 
-					if (((stream->stream_id & 1) ^ parity) == 1)
-					{
-						if (stream->stream_id < cnx->max_stream_id_bidir_remote)
-						{
-							break;
-						}
-					}
-					else
-					{
-						break;
-					}
-				}
-			}
+        if (ctx.consumed > 0)
+        {
+            stream->sent_offset += ctx.length;
+            cnx->data_sent += ctx.length;
+            *consumed = ctx.consumed;
 
-			stream = stream->next_stream;
+            if (ctx.is_fin)
+            {
+                stream->stream_flags |= picoquic_stream_flag_fin_notified | picoquic_stream_flag_fin_sent;
+            }
+        }
 
-		} while (stream);
-	}
-	else
-	{
-		if ((stream->send_queue == NULL ||
-			stream->send_queue->length <= stream->send_queue->offset) &&
-			((stream->stream_flags&picoquic_stream_flag_fin_notified) == 0 ||
-			(stream->stream_flags&picoquic_stream_flag_fin_sent) != 0) &&
-				((stream->stream_flags&picoquic_stream_flag_reset_requested) == 0 ||
-			(stream->stream_flags&picoquic_stream_flag_reset_sent) != 0))
-		{
-			stream = NULL;
-		}
-	}
+        if (ctx.is_fin || !ctx.is_still_active)
+        {
+            stream->is_active = 0;
+        }
+    }
 
-	return stream;
+    return ret;
 }
 
-int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+static int picoquic_prepare_stream_data_frame(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
     uint8_t * bytes, size_t bytes_max, size_t * consumed)
 {
     int ret = 0;
 
     if ((stream->stream_flags&picoquic_stream_flag_reset_requested) != 0)
     {
-        return picoquic_prepare_stream_reset_frame(stream, bytes, bytes_max, consumed);
+        ret = picoquic_prepare_stream_reset_frame(stream, bytes, bytes_max, consumed);
+
+        if (ret == 0 && *consumed > 0)
+        {
+            /* The queued data will never be sent */
+            cnx->send_queued -= stream->send_queued;
+            stream->send_queued = 0;
+            picoquic_clear_send_queue(stream);
+            stream->is_active = 0;
+        }
+
+        return ret;
+    }
+
+    if (stream->retransmit_queue != NULL)
+    {
+        return picoquic_prepare_stream_retransmit_frame(stream, bytes, bytes_max, consumed);
+    }
+
+    if (stream->is_active && stream->send_queue == NULL &&
+        (stream->stream_flags&picoquic_stream_flag_fin_notified) == 0)
+    {
+        return picoquic_prepare_stream_active_frame(cnx, stream, bytes, bytes_max, consumed);
     }
 
     if ((stream->send_queue == NULL ||
@@ -963,14 +1843,13 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * s
                 stream->send_queue->offset += length;
                 if (stream->send_queue->offset >= stream->send_queue->length)
                 {
-                    picoquic_stream_data * next = stream->send_queue->next_stream_data;
-                    free(stream->send_queue->bytes);
-                    free(stream->send_queue);
-                    stream->send_queue = next;
+                    picoquic_dequeue_send_data(stream);
                 }
 
                 stream->sent_offset += length;
                 cnx->data_sent += length;
+                stream->send_queued -= length;
+                cnx->send_queued -= length;
                 *consumed = byte_index;
             }
 
@@ -980,6 +1859,18 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * s
                 /* Set the fin bit */
                 stream->stream_flags |= picoquic_stream_flag_fin_sent;
                 bytes[0] |= 1;
+
+                if (length == 0)
+                {
+                    /* A fin without data carries an explicit zero length when
+                     * there is room, so other frames can follow it */
+                    if (byte_index < bytes_max)
+                    {
+                        bytes[0] |= 2;
+                        bytes[byte_index++] = 0;
+                    }
+                    *consumed = byte_index;
+                }
             }
             else if (ret == 0 && length == 0)
             {
@@ -993,6 +1884,74 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * s
     return ret;
 }
 
+int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+    uint8_t * bytes, size_t bytes_max, size_t * consumed)
+{
+    int ret = picoquic_prepare_stream_data_frame(cnx, stream, bytes, bytes_max, consumed);
+
+    if (ret == 0 && *consumed > 0 && stream->stream_id != 0 &&
+        (stream->send_queue != NULL || stream->is_active))
+    {
+        /* Count the frames after which the peer credit stops the stream */
+        if (cnx->data_sent >= cnx->maxdata_remote)
+        {
+            cnx->cold->flow_control_stats.nb_local_blocked++;
+        }
+        else if (stream->sent_offset >= stream->maxdata_remote)
+        {
+            cnx->cold->flow_control_stats.nb_local_stream_blocked++;
+        }
+    }
+
+    picoquic_schedule_ready_stream(cnx, stream, (ret == 0) ? *consumed : 0);
+
+    if (ret == 0 && *consumed > 0 && (stream->is_write_blocked || cnx->is_write_blocked))
+    {
+        picoquic_notify_writable_streams(cnx, stream);
+    }
+
+    return ret;
+}
+
+/*
+ * Fill the remaining space of a packet with stream frames, starting with the
+ * given stream and continuing with the next ready streams. A frame that does
+ * not fill the space carries an explicit length, so another frame can follow
+ * it; a frame without length extends to the end of the packet and ends the
+ * loop.
+ */
+int picoquic_prepare_stream_frames(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+    int stream_restricted, uint8_t * bytes, size_t bytes_max, size_t * consumed)
+{
+    int ret = 0;
+    size_t byte_index = 0;
+
+    while (stream != NULL && byte_index < bytes_max)
+    {
+        size_t data_bytes = 0;
+
+        ret = picoquic_prepare_stream_frame(cnx, stream, &bytes[byte_index],
+            bytes_max - byte_index, &data_bytes);
+
+        if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
+        {
+            ret = 0;
+            break;
+        }
+        else if (ret != 0 || data_bytes == 0)
+        {
+            break;
+        }
+
+        byte_index += data_bytes;
+        stream = picoquic_find_ready_stream(cnx, stream_restricted);
+    }
+
+    *consumed = byte_index;
+
+    return ret;
+}
+
 
 /*
  * ACK Frames
@@ -1057,22 +2016,22 @@ void picoquic_check_spurious_retransmission(picoquic_cnx_t * cnx,
             uint64_t max_reorder_delay = cnx->latest_time_acknowledged - p->send_time;
             uint64_t max_reorder_gap = cnx->highest_acknowledged - p->sequence_number;
 
-            if (max_spurious_rtt > cnx->max_spurious_rtt)
+            if (max_spurious_rtt > cnx->cold->max_spurious_rtt)
             {
-                cnx->max_spurious_rtt = max_spurious_rtt;
+                cnx->cold->max_spurious_rtt = max_spurious_rtt;
             }
 
-            if (max_reorder_delay > cnx->max_reorder_delay)
+            if (max_reorder_delay > cnx->cold->max_reorder_delay)
             {
-                cnx->max_reorder_delay = max_reorder_delay;
+                cnx->cold->max_reorder_delay = max_reorder_delay;
             }
 
-            if (max_reorder_gap > cnx->max_reorder_gap)
+            if (max_reorder_gap > cnx->cold->max_reorder_gap)
             {
-                cnx->max_reorder_gap = max_reorder_gap;
+                cnx->cold->max_reorder_gap = max_reorder_gap;
             }
 
-            cnx->nb_spurious++;
+            cnx->cold->nb_spurious++;
             should_delete = p;
         }
         else if (p->send_time + PICOQUIC_SPURIOUS_RETRANSMIT_DELAY_MAX < cnx->latest_time_acknowledged)
@@ -1102,15 +2061,15 @@ void picoquic_check_spurious_retransmission(picoquic_cnx_t * cnx,
                 should_delete->next_packet->previous_packet = should_delete->previous_packet;
             }
 
-            free(should_delete);
+            picoquic_recycle_packet(cnx->quic, should_delete);
         }
     }
 }
 
-static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t largest,
+static void picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t largest,
 	uint64_t current_time, uint64_t ack_delay)
 {
-	picoquic_packet * packet = cnx->retransmit_newest;
+	picoquic_packet * packet = NULL;
 
 	/* Check whether this is a new acknowledgement */
 	if (largest > cnx->highest_acknowledged )
@@ -1122,12 +2081,29 @@ static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t larg
 			/* if the ACK is reasonably recent, use it to update the RTT */
 			/* find the stored copy of the largest acknowledged packet */
 
-			while (packet != NULL && packet->sequence_number > largest)
+			uint64_t send_time = 0;
+			int is_found = 0;
+
+			packet = picoquic_find_retransmit_packet(cnx, largest);
+
+			if (packet != NULL)
+			{
+				send_time = packet->send_time;
+				is_found = 1;
+			}
+			else
 			{
-				packet = packet->next_packet;
+				/* The largest may be an ACK only packet, which is not queued */
+				picoquic_ack_record_t * record = picoquic_find_ack_record(cnx, largest);
+
+				if (record != NULL)
+				{
+					send_time = record->send_time;
+					is_found = 1;
+				}
 			}
 
-			if (packet == NULL || packet->sequence_number < largest)
+			if (!is_found)
 			{
 				/* There is no copy of this packet in store. It may have
                  * been deleted because too old, or maybe already
@@ -1136,11 +2112,11 @@ static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t larg
 			else
 			{
 				uint64_t acknowledged_time = current_time - ack_delay;
-				int64_t rtt_estimate = acknowledged_time - packet->send_time;
+				int64_t rtt_estimate = acknowledged_time - send_time;
 
-                if (cnx->latest_time_acknowledged < packet->send_time)
+                if (cnx->latest_time_acknowledged < send_time)
                 {
-                    cnx->latest_time_acknowledged = packet->send_time;
+                    cnx->latest_time_acknowledged = send_time;
                 }
                 cnx->latest_progress_time = current_time;
 
@@ -1216,46 +2192,45 @@ static picoquic_packet * picoquic_update_rtt(picoquic_cnx_t * cnx, uint64_t larg
 			}
 		}
 	}
-
-	return packet;
 }
 
-static void picoquic_process_ack_of_ack_range(picoquic_sack_item_t * first_sack, 
+static void picoquic_process_ack_of_ack_range(picoquic_sack_tracker_t * tracker,
     uint64_t start_of_range, uint64_t end_of_range)
 {
-    if (first_sack->start_of_sack_range == start_of_range)
+    picoquic_sack_range_t * first_range = &tracker->first_range;
+
+    if (tracker->nb_ranges == 0)
+    {
+        /* Nothing to prune */
+    }
+    else if (first_range->start_of_sack_range == start_of_range)
     {
-        if (end_of_range < first_sack->end_of_sack_range)
+        if (end_of_range < first_range->end_of_sack_range)
         {
-            first_sack->start_of_sack_range = end_of_range + 1;
+            first_range->start_of_sack_range = end_of_range + 1;
         }
         else
         {
-            first_sack->start_of_sack_range = first_sack->end_of_sack_range;
+            first_range->start_of_sack_range = first_range->end_of_sack_range;
         }
     }
     else
     {
-        picoquic_sack_item_t * previous = first_sack;
-        picoquic_sack_item_t * next = previous->next_sack;
-
-        while (next != NULL)
+        for (size_t i = 1; i < tracker->nb_ranges &&
+            tracker->older_ranges[i - 1].end_of_sack_range >= end_of_range; i++)
         {
-            if (next->end_of_sack_range == end_of_range &&
-                next->start_of_sack_range == start_of_range)
-            {
-                /* Matching range should be removed */
-                previous->next_sack = next->next_sack;
-                free(next);
-                break;
-            }
-            else if (next->end_of_sack_range > end_of_range)
-            {
-                previous = next;
-                next = next->next_sack;
-            }
-            else
+            if (tracker->older_ranges[i - 1].end_of_sack_range == end_of_range &&
+                tracker->older_ranges[i - 1].start_of_sack_range == start_of_range)
             {
+                /* Matching range should be removed. If it was the lowest,
+                 * replays of these packets are now treated as duplicates */
+                if (i + 1 == tracker->nb_ranges)
+                {
+                    tracker->floor = end_of_range + 1;
+                }
+                memmove(&tracker->older_ranges[i - 1], &tracker->older_ranges[i],
+                    (tracker->nb_ranges - i - 1) * sizeof(picoquic_sack_range_t));
+                tracker->nb_ranges--;
                 break;
             }
         }
@@ -1263,7 +2238,7 @@ static void picoquic_process_ack_of_ack_range(picoquic_sack_item_t * first_sack,
 }
 
 int picoquic_process_ack_of_ack_frame(
-    picoquic_sack_item_t * first_sack,
+    picoquic_sack_tracker_t * tracker,
     uint8_t * bytes, size_t bytes_max, size_t * consumed)
 {
 	int ret;
@@ -1271,15 +2246,6 @@ int picoquic_process_ack_of_ack_frame(
 	uint64_t ack_delay;
 	uint64_t num_block;
 
-	/* Find the oldest ACK range, in order to calibrate the
-	 * extension of the largest number to 64 bits */
-
-	picoquic_sack_item_t * target_sack = first_sack;
-	while (target_sack->next_sack != NULL)
-	{
-		target_sack = target_sack->next_sack;
-	}
-
 	ret = picoquic_parse_ack_header(bytes, bytes_max,
         &num_block, &largest, &ack_delay, consumed, 0);
 
@@ -1324,7 +2290,7 @@ int picoquic_process_ack_of_ack_frame(
 
             if (range > 0)
             {
-                picoquic_process_ack_of_ack_range(first_sack, largest + 1 - range, largest);
+                picoquic_process_ack_of_ack_range(tracker, largest + 1 - range, largest);
             }
 
             if (num_block-- == 0)
@@ -1394,14 +2360,95 @@ static int picoquic_process_ack_of_stream_frame(picoquic_cnx_t * cnx, uint8_t *
         if (stream != NULL)
         {
             uint64_t blocksize;
-            (void)picoquic_update_sack_list(&stream->first_sack_item,
+
+            if (data_length > 0)
+            {
+                (void)picoquic_update_sack_list(&stream->first_sack_item,
                     offset, offset + data_length - 1, &blocksize);
+            }
+
+            if (fin)
+            {
+                stream->stream_flags |= picoquic_stream_flag_fin_acked;
+            }
+
+            picoquic_delete_stream_if_closed(cnx, stream);
+        }
+    }
+
+    return ret;
+}
+
+/* Once the reset is acknowledged, the stream may be released */
+static int picoquic_process_ack_of_reset_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
+    size_t bytes_max, size_t * consumed)
+{
+    int frame_is_pure_ack = 0;
+    uint64_t stream_id = 0;
+    int ret = picoquic_skip_frame(bytes, bytes_max, consumed, &frame_is_pure_ack);
+
+    if (ret == 0 && picoquic_varint_decode(bytes + 1, bytes_max - 1, &stream_id) > 0 && stream_id != 0)
+    {
+        picoquic_stream_head * stream = picoquic_find_stream(cnx, stream_id, 0);
+
+        if (stream != NULL)
+        {
+            picoquic_delete_stream_if_closed(cnx, stream);
         }
     }
 
     return ret;
 }
 
+/* Apply the ack of ack pruning for the ACK frames of acknowledged ACK only packets */
+static picoquic_ack_record_t ** picoquic_process_ack_range_of_records(
+    picoquic_cnx_t * cnx, uint64_t highest, uint64_t range, picoquic_ack_record_t ** pp_record)
+{
+    while (*pp_record != NULL && range > 0)
+    {
+        picoquic_ack_record_t * record = *pp_record;
+
+        if (record->sequence_number > highest)
+        {
+            pp_record = &record->next_record;
+        }
+        else if (highest - record->sequence_number >= range)
+        {
+            break;
+        }
+        else
+        {
+            int ret = 0;
+            size_t byte_index = 0;
+            size_t frame_length = 0;
+            int frame_is_pure_ack = 0;
+
+            while (ret == 0 && byte_index < record->frames_length)
+            {
+                if (record->frames[byte_index] == picoquic_frame_type_ack)
+                {
+                    ret = picoquic_process_ack_of_ack_frame(&cnx->sack_tracker, &record->frames[byte_index],
+                        record->frames_length - byte_index, &frame_length);
+                }
+                else
+                {
+                    ret = picoquic_skip_frame(&record->frames[byte_index],
+                        record->frames_length - byte_index, &frame_length, &frame_is_pure_ack);
+                }
+                byte_index += frame_length;
+            }
+
+            *pp_record = record->next_record;
+            free(record);
+            cnx->nb_ack_records--;
+            /* Any acknowledgement shows progress */
+            cnx->nb_retransmit = 0;
+        }
+    }
+
+    return pp_record;
+}
+
 void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t * cnx, picoquic_packet * p)
 {
     int ret = 0;
@@ -1417,7 +2464,7 @@ void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t * cnx, picoquic_p
 
     if (ret == 0 && ph.ptype == picoquic_packet_0rtt_protected)
     {
-        cnx->nb_zero_rtt_acked++;
+        cnx->cold->nb_zero_rtt_acked++;
     }
 
     byte_index = ph.offset;
@@ -1426,7 +2473,7 @@ void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t * cnx, picoquic_p
     {
         if (p->bytes[byte_index] == picoquic_frame_type_ack)
         {
-            ret = picoquic_process_ack_of_ack_frame(&cnx->first_sack_item, &p->bytes[byte_index],
+            ret = picoquic_process_ack_of_ack_frame(&cnx->sack_tracker, &p->bytes[byte_index],
                 p->length - byte_index, &frame_length);
             byte_index += frame_length;
         }
@@ -1436,6 +2483,11 @@ void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t * cnx, picoquic_p
             ret = picoquic_process_ack_of_stream_frame(cnx, &p->bytes[byte_index], p->length - byte_index, &frame_length);
             byte_index += frame_length;
         }
+        else if (p->bytes[byte_index] == picoquic_frame_type_reset_stream)
+        {
+            ret = picoquic_process_ack_of_reset_frame(cnx, &p->bytes[byte_index], p->length - byte_index, &frame_length);
+            byte_index += frame_length;
+        }
         else
         {
             ret = picoquic_skip_frame(&p->bytes[byte_index],
@@ -1445,45 +2497,78 @@ void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t * cnx, picoquic_p
     }
 }
 
-static picoquic_packet * picoquic_process_ack_range(
-	picoquic_cnx_t * cnx, uint64_t highest, uint64_t range, picoquic_packet * p,
-	uint64_t current_time)
+/* Dequeue the packets acknowledged by the range [highest + 1 - range, highest].
+ * Ranges are processed from the newest to the oldest. *p_next is the position
+ * left by the previous range of the same frame, NULL for the first range; it is
+ * set to the newest queued packet below the range, or NULL. Returns the number of index
+ * probes and queued packets visited. */
+size_t picoquic_process_ack_range(
+	picoquic_cnx_t * cnx, uint64_t highest, uint64_t range, picoquic_packet ** p_next, uint64_t current_time)
 {
-	/* Compare the range to the retransmit queue */
-	while (p != NULL && range > 0)
+	size_t nb_visited = 0;
+	uint64_t lowest;
+	uint64_t top;
+	uint64_t bottom;
+	picoquic_packet * p = *p_next;
+
+	if (cnx->retransmit_newest == NULL || range == 0 ||
+		highest < cnx->retransmit_oldest->sequence_number)
+	{
+		return 0;
+	}
+
+	lowest = highest + 1 - range;
+	if (lowest > cnx->retransmit_newest->sequence_number)
+	{
+		return 0;
+	}
+
+	/* Find the newest queued packet in the range. The position left by the
+	 * previous range is that packet if it is not above the range. Otherwise,
+	 * probe the index downward from the top of the range, clipped to the queue,
+	 * so the cost is bounded by the range and never by the packets above it. */
+	if (p == NULL || p->sequence_number > highest)
 	{
-		if (p->sequence_number > highest)
+		top = (highest < cnx->retransmit_newest->sequence_number) ? highest : cnx->retransmit_newest->sequence_number;
+		bottom = (lowest > cnx->retransmit_oldest->sequence_number) ? lowest : cnx->retransmit_oldest->sequence_number;
+		p = NULL;
+
+		while (p == NULL)
 		{
-			p = p->next_packet;
+			p = picoquic_find_retransmit_packet(cnx, top);
+			nb_visited++;
+			if (top-- == bottom)
+			{
+				break;
+			}
 		}
-		else
+	}
+
+	while (p != NULL && p->sequence_number >= lowest)
+	{
+		picoquic_packet * next = p->next_packet;
+
+		if (cnx->congestion_alg != NULL)
 		{
-			if (p->sequence_number == highest)
-			{
-				/* TODO: RTT Estimate */
-				picoquic_packet * next = p->next_packet;
-				if (cnx->congestion_alg != NULL)
-				{
-					cnx->congestion_alg->alg_notify(cnx,
-						picoquic_congestion_notification_acknowledgement,
-						0, p->length, 0, current_time);
-				}
+			cnx->congestion_alg->alg_notify(cnx,
+				picoquic_congestion_notification_acknowledgement,
+				0, p->length, 0, current_time);
+		}
 
-                /* If the packet contained an ACK frame, perform the ACK of ACK pruning logic */
-                picoquic_process_possible_ack_of_ack_frame(cnx, p);
+		/* If the packet contained an ACK frame, perform the ACK of ACK pruning logic */
+		picoquic_process_possible_ack_of_ack_frame(cnx, p);
 
-				picoquic_dequeue_retransmit_packet(cnx, p, 1);
-				p = next;
-				/* Any acknowledgement shows progress */
-				cnx->nb_retransmit = 0;
-			}
+		picoquic_dequeue_retransmit_packet(cnx, p, 1);
+		/* Any acknowledgement shows progress */
+		cnx->nb_retransmit = 0;
 
-			range--;
-			highest--;
-		}
+		nb_visited++;
+		p = next;
 	}
 
-	return p;
+	*p_next = p;
+
+	return nb_visited;
 }
 
 int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
@@ -1507,10 +2592,14 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
 	{
 		size_t byte_index = *consumed;
 
-		/* Attempt to update the RTT */
-		picoquic_packet * top_packet = picoquic_update_rtt(cnx, largest, current_time, ack_delay);
+		picoquic_ack_record_t ** pp_top_record = &cnx->ack_record_newest;
+		picoquic_packet * p_next_packet = NULL;
+		uint64_t largest_in_frame = largest;
 		unsigned extra_ack = 1;
 
+		/* Attempt to update the RTT */
+		picoquic_update_rtt(cnx, largest, current_time, ack_delay);
+
         while (1)
         {
             uint64_t range;
@@ -1548,7 +2637,8 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
                 break;
             }
 
-            top_packet = picoquic_process_ack_range(cnx, largest, range, top_packet, current_time);
+            (void)picoquic_process_ack_range(cnx, largest, range, &p_next_packet, current_time);
+            pp_top_record = picoquic_process_ack_range_of_records(cnx, largest, range, pp_top_record);
 
             if (range > 0)
             {
@@ -1599,6 +2689,13 @@ int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
             extra_ack = 0;
         }
 
+        if (ret == 0)
+        {
+            /* The ACK only packets below the largest that were not acknowledged are
+             * presumed lost. They are not repeated, so their records can go. */
+            picoquic_delete_ack_records(cnx, largest_in_frame);
+        }
+
 		*consumed = byte_index;
 	}
 
@@ -1614,7 +2711,8 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
     size_t l_largest = 0;
     size_t l_delay = 0;
     size_t l_first_range = 0;
-    picoquic_sack_item_t * next_sack = cnx->first_sack_item.next_sack;
+    picoquic_sack_tracker_t * tracker = &cnx->sack_tracker;
+    size_t next_range = 1;
     uint64_t ack_delay = 0;
     uint64_t ack_range = 0;
     uint64_t ack_gap = 0;
@@ -1622,8 +2720,7 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
     size_t num_block_index = 0;
 
     /* Check that there is enough room in the packet, and something to acknowledge */
-    if (cnx->first_sack_item.start_of_sack_range == 0 &&
-        cnx->first_sack_item.end_of_sack_range == 0)
+    if (tracker->nb_ranges == 0)
     {
         *consumed = 0;
     }
@@ -1643,7 +2740,7 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
         if (byte_index < bytes_max)
         {
             l_largest = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index,
-                cnx->first_sack_item.end_of_sack_range);
+                tracker->first_range.end_of_sack_range);
             byte_index += l_largest;
         }
         /* Encode the ack delay */
@@ -1664,7 +2761,7 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
         /* Encode the size of the first ack range */
         if (byte_index < bytes_max)
         {
-            ack_range = cnx->first_sack_item.end_of_sack_range - cnx->first_sack_item.start_of_sack_range;
+            ack_range = tracker->first_range.end_of_sack_range - tracker->first_range.start_of_sack_range;
             l_first_range = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index,
                 ack_range);
             byte_index += l_first_range;
@@ -1679,23 +2776,24 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
         else
         {
             /* Set the lowest acknowledged */
-            lowest_acknowledged = cnx->first_sack_item.start_of_sack_range;
+            lowest_acknowledged = tracker->first_range.start_of_sack_range;
             /* Encode the ack blocks that fir in the allocated space */
-            while (num_block < 63 && next_sack != NULL)
+            while (num_block < 63 && next_range < tracker->nb_ranges)
             {
                 size_t l_gap = 0;
                 size_t l_range = 0;
 
                 if (byte_index < bytes_max)
                 {
-                    ack_gap = lowest_acknowledged - next_sack->end_of_sack_range - 1;
+                    ack_gap = lowest_acknowledged - tracker->older_ranges[next_range - 1].end_of_sack_range - 1;
                     l_gap = picoquic_varint_encode(bytes + byte_index,
                         bytes_max - byte_index, ack_gap);
                 }
 
                 if (byte_index + l_gap < bytes_max)
                 {
-                    ack_range = next_sack->end_of_sack_range - next_sack->start_of_sack_range + 1;
+                    ack_range = tracker->older_ranges[next_range - 1].end_of_sack_range -
+                        tracker->older_ranges[next_range - 1].start_of_sack_range + 1;
                     l_range = picoquic_varint_encode(bytes + byte_index + l_gap,
                         bytes_max - byte_index - l_gap, ack_range);
                 }
@@ -1708,8 +2806,8 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
                 else
                 {
                     byte_index += l_gap + l_range;
-                    lowest_acknowledged = next_sack->start_of_sack_range;
-                    next_sack = next_sack->next_sack;
+                    lowest_acknowledged = tracker->older_ranges[next_range - 1].start_of_sack_range;
+                    next_range++;
                     num_block++;
                 }
             }
@@ -1717,7 +2815,7 @@ int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
             bytes[num_block_index] = (uint8_t) num_block;
 
             /* Remember the ACK value and time */
-            cnx->highest_ack_sent = cnx->first_sack_item.end_of_sack_range;
+            cnx->highest_ack_sent = tracker->first_range.end_of_sack_range;
             cnx->highest_ack_time = current_time;
 
             *consumed = byte_index;
@@ -1736,7 +2834,7 @@ int picoquic_is_ack_needed(picoquic_cnx_t * cnx, uint64_t current_time)
 {
 	int ret = 0;
 
-	if (cnx->highest_ack_sent + 2 <= cnx->first_sack_item.end_of_sack_range ||
+	if (cnx->highest_ack_sent + 2 <= cnx->sack_tracker.first_range.end_of_sack_range ||
 			cnx->highest_ack_time + cnx->ack_delay_local <= current_time)
 	{
 		ret = cnx->ack_needed;
@@ -1908,6 +3006,45 @@ int picoquic_decode_application_close_frame(picoquic_cnx_t * cnx, uint8_t * byte
 #define PICOQUIC_MAX_MAXDATA_1K (PICOQUIC_MAX_MAXDATA >> 10)
 #define PICOQUIC_MAX_MAXDATA_1K_MASK (PICOQUIC_MAX_MAXDATA << 10)
 
+/*
+ * Receive window auto tuning, in the manner of the TCP receive buffer tuning.
+ * Credit is renewed when less than half of the window remains, up to the
+ * consumed offset plus the window. If the previous renewal was less than two
+ * round trips before, the data arrives faster than the window allows, and the
+ * window is doubled, up to the configured maximum. When the receive budget is
+ * tight, the window is halved instead, down to its initial value.
+ */
+
+static uint64_t picoquic_tune_receive_window(picoquic_cnx_t * cnx, uint64_t window,
+    uint64_t last_update_time, uint64_t window_min, uint64_t window_max, uint64_t current_time)
+{
+    if (picoquic_receive_budget_level(cnx) > 0)
+    {
+        if (window > window_min)
+        {
+            window = (window / 2 < window_min) ? window_min : window / 2;
+        }
+    }
+    else if (last_update_time != 0 && current_time - last_update_time < 2 * cnx->smoothed_rtt &&
+        window < window_max)
+    {
+        window = (2 * window > window_max) ? window_max : 2 * window;
+    }
+
+    return window;
+}
+
+static void picoquic_commit_receive_window(picoquic_cnx_t * cnx, uint64_t * window,
+    uint64_t * last_update_time, uint64_t new_window, uint64_t current_time)
+{
+    if (new_window > *window)
+    {
+        cnx->cold->flow_control_stats.nb_window_increases++;
+    }
+    *window = new_window;
+    *last_update_time = current_time;
+}
+
 int picoquic_prepare_max_data_frame(picoquic_cnx_t * cnx, uint64_t maxdata_increase,
 	uint8_t * bytes, size_t bytes_max, size_t * consumed)
 {
@@ -1938,6 +3075,48 @@ int picoquic_prepare_max_data_frame(picoquic_cnx_t * cnx, uint64_t maxdata_incre
 	return ret;
 }
 
+int picoquic_prepare_required_max_data_frame(picoquic_cnx_t * cnx, uint64_t current_time,
+    uint8_t * bytes, size_t bytes_max, size_t * consumed)
+{
+    int ret = 0;
+
+    *consumed = 0;
+
+    if (2 * (cnx->maxdata_local - cnx->data_received) < cnx->maxdata_window &&
+        picoquic_receive_budget_level(cnx) >= 2)
+    {
+        /* No new credit until buffered data is delivered */
+        cnx->cold->flow_control_stats.nb_budget_holds++;
+    }
+    else if (picoquic_should_send_max_data(cnx))
+    {
+        uint64_t window = picoquic_tune_receive_window(cnx, cnx->maxdata_window,
+            cnx->maxdata_update_time, cnx->local_parameters.initial_max_data,
+            cnx->quic->max_connection_window, current_time);
+
+        ret = picoquic_prepare_max_data_frame(cnx, cnx->data_received + window - cnx->maxdata_local,
+            bytes, bytes_max, consumed);
+
+        if (ret == 0)
+        {
+            picoquic_commit_receive_window(cnx, &cnx->maxdata_window,
+                &cnx->maxdata_update_time, window, current_time);
+            cnx->cold->flow_control_stats.nb_max_data_sent++;
+        }
+        else
+        {
+            *consumed = 0;
+
+            if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
+            {
+                ret = 0;
+            }
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_decode_max_data_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
     size_t bytes_max, size_t * consumed)
 {
@@ -1952,6 +3131,7 @@ int picoquic_decode_max_data_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
         if (maxdata > cnx->maxdata_remote)
         {
             cnx->maxdata_remote = maxdata;
+            picoquic_unblock_streams(cnx);
         }
     }
     else
@@ -2017,6 +3197,10 @@ int picoquic_decode_max_stream_data_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
         {
             ret = PICOQUIC_ERROR_CANNOT_CONTROL_STREAM_ZERO;
         }
+        else if (picoquic_is_stream_closed(cnx, stream_id))
+        {
+            /* Credit for a stream already released is not needed anymore */
+        }
         else
         {
             stream = picoquic_find_stream(cnx, stream_id, 1);
@@ -2031,6 +3215,7 @@ int picoquic_decode_max_stream_data_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
                 if (maxdata > stream->maxdata_remote)
                 {
                     stream->maxdata_remote = maxdata;
+                    picoquic_update_ready_stream(cnx, stream);
                 }
             }
         }
@@ -2039,36 +3224,53 @@ int picoquic_decode_max_stream_data_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
     return ret;
 }
 
-int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx,
+int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx, uint64_t current_time,
 	uint8_t * bytes, size_t bytes_max, size_t * consumed)
 {
 	int ret = 0;
 	size_t byte_index = 0;
-	picoquic_stream_head * stream = &cnx->first_stream;
+	picoquic_stream_head * stream = cnx->first_update_stream;
+	int budget_level = picoquic_receive_budget_level(cnx);
 
 	while (stream != NULL && ret == 0 && byte_index < bytes_max)
 	{
-		if (stream->stream_id != 0 &&
-			(stream->stream_flags&(picoquic_stream_flag_fin_received |
-				picoquic_stream_flag_reset_received)) == 0 &&
-			2 * stream->consumed_offset > stream->maxdata_local)
+		picoquic_stream_head * next_stream = stream->next_update_stream;
+
+		if (!picoquic_stream_needs_max_data(stream))
+		{
+			/* FIN or reset received since the stream was listed */
+			picoquic_remove_update_stream(cnx, stream);
+		}
+		else if (budget_level >= 2)
+		{
+			/* No new credit until buffered data is delivered */
+			cnx->cold->flow_control_stats.nb_budget_holds++;
+		}
+		else
 		{
 			size_t bytes_in_frame = 0;
+			uint64_t window = picoquic_tune_receive_window(cnx, stream->maxdata_window,
+				stream->maxdata_update_time, cnx->local_parameters.initial_max_stream_data,
+				cnx->quic->max_stream_window, current_time);
 
 			ret = picoquic_prepare_max_stream_data_frame(stream,
 				bytes + byte_index, bytes_max - byte_index,
-				stream->maxdata_local + 2 * stream->consumed_offset,
+				stream->consumed_offset + window,
 				&bytes_in_frame);
 			if (ret == 0)
 			{
 				byte_index += bytes_in_frame;
+				picoquic_commit_receive_window(cnx, &stream->maxdata_window,
+					&stream->maxdata_update_time, window, current_time);
+				cnx->cold->flow_control_stats.nb_max_stream_data_sent++;
+				picoquic_remove_update_stream(cnx, stream);
+			}
+			else
+			{
+				break;
 			}
-            else
-            {
-                break;
-            }
 		}
-		stream = stream->next_stream;
+		stream = next_stream;
 	}
 
 	if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
@@ -2352,12 +3554,14 @@ int picoquic_decode_frames(picoquic_cnx_t * cnx, uint8_t * bytes,
                 byte_index++;
                 /* Skip the max data offset */
                 byte_index += picoquic_varint_skip(&bytes[byte_index]);
+                cnx->cold->flow_control_stats.nb_blocked_frames_received++;
                 cnx->ack_needed = 1;
                 break;
             case picoquic_frame_type_stream_blocked: /* STREAM_BLOCKED */
                 byte_index += 1 + picoquic_varint_skip(bytes + byte_index + 1);
                 /* Skip the max data offset */
                 byte_index += picoquic_varint_skip(&bytes[byte_index]);
+                cnx->cold->flow_control_stats.nb_blocked_frames_received++;
                 cnx->ack_needed = 1;
                 break;
             case picoquic_frame_type_stream_id_needed: /* STREAM_ID_NEEDED */
@@ -825,11 +825,11 @@ void picoquic_log_decrypt_encrypted(FILE* F,
     if (length > PICOQUIC_RESET_SECRET_SIZE + 10)
     {
         cmp_reset_secret = (memcmp(bytes + length - PICOQUIC_RESET_SECRET_SIZE,
-            cnx->reset_secret, PICOQUIC_RESET_SECRET_SIZE) == 0);
+            cnx->cold->reset_secret, PICOQUIC_RESET_SECRET_SIZE) == 0);
 
         if (cmp_reset_secret == 0)
         {
-            cmp_reset_secret = (memcmp(bytes + 9, cnx->reset_secret,
+            cmp_reset_secret = (memcmp(bytes + 9, cnx->cold->reset_secret,
                 PICOQUIC_RESET_SECRET_SIZE) == 0);
             cmp_reset_secret_old = cmp_reset_secret;
         }
@@ -954,7 +954,7 @@ void picoquic_log_packet(FILE* F, picoquic_quic_t * quic, picoquic_cnx_t * cnx,
 		if (cnx != NULL)
 		{
 			ph.pn64 = picoquic_get_packet_number64(
-                (receiving == 0)?cnx->send_sequence:cnx->first_sack_item.end_of_sack_range, 
+                (receiving == 0)?cnx->send_sequence:cnx->sack_tracker.first_range.end_of_sack_range, 
                 ph.pnmask, ph.pn);
 		}
 		else
@@ -1214,7 +1214,7 @@ void picoquic_log_congestion_state(FILE* F, picoquic_cnx_t * cnx, uint64_t curre
     picoquic_log_time(F, cnx, current_time, "T= ", ", ");
     fprintf(F, "cwin: %d,", (int)cnx->cwin);
     fprintf(F, "flight: %d,", (int)cnx->bytes_in_transit);;
-    fprintf(F, "nb_ret: %d,", (int)cnx->nb_retransmission_total);
+    fprintf(F, "nb_ret: %d,", (int)cnx->cold->nb_retransmission_total);
     fprintf(F, "rtt_min: %d,", (int)cnx->rtt_min);
     fprintf(F, "rtt: %d,", (int)cnx->smoothed_rtt);
     fprintf(F, "rtt_var: %d,", (int)cnx->rtt_variant);
@@ -242,6 +242,26 @@ int picoquic_parse_packet_header(
     return 0;
 }
 
+/*
+ * Find the shard of an incoming packet without any connection context. In long
+ * headers and in short headers that carry it, the connection ID starts at byte 1.
+ */
+int picoquic_get_packet_shard(const uint8_t * bytes, size_t length, uint32_t nb_shards)
+{
+    int shard = -1;
+
+    if (length >= 17 && (bytes[0] & 0x80) == 0x80)
+    {
+        shard = (int)picoquic_get_cnx_id_shard(PICOPARSE_64(bytes + 1), nb_shards);
+    }
+    else if (length >= 9 && (bytes[0] & 0xC0) == 0)
+    {
+        shard = (int)picoquic_get_cnx_id_shard(PICOPARSE_64(bytes + 1), nb_shards);
+    }
+
+    return shard;
+}
+
 /* The packet number logic */
 uint64_t picoquic_get_packet_number64(uint64_t highest, uint64_t mask, uint32_t pn)
 {
@@ -410,14 +430,14 @@ void picoquic_process_unexpected_cnxid(
 		{
 			uint8_t * bytes = sp->bytes;
 			size_t byte_index = 0;
-			size_t pad_size = (size_t)(picoquic_public_uniform_random(length - 26) + 26 - 17);
+			size_t pad_size = (size_t)(picoquic_public_uniform_random(quic, length - 26) + 26 - 17);
 			/* Packet type set to short header, with cnxid, key phase 0, 1 byte seq */
 			bytes[byte_index++] = 0x41;
 			/* Copy the connection ID */
 			picoformat_64(bytes + byte_index, ph->cnx_id);
 			byte_index += 8;
             /* Add some random bytes to look good. */
-            picoquic_public_random(bytes + byte_index, pad_size);
+            picoquic_public_random(quic, bytes + byte_index, pad_size);
             byte_index += pad_size;
 			/* Add the public reset secret */
 			(void)picoquic_create_cnxid_reset_secret(quic, ph->cnx_id, bytes + byte_index);
@@ -903,12 +923,12 @@ int picoquic_incoming_encrypted(
     {
         /* TODO: supporting two variants for now. Will need to focus on just one. */
 		/* Check the possible reset before performaing in place AEAD decrypt */
-		int cmp_reset_secret = memcmp(bytes + 9, cnx->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
+		int cmp_reset_secret = memcmp(bytes + 9, cnx->cold->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
         /* Allow for test at the end as well. */
         if (cmp_reset_secret != 0)
         {
             cmp_reset_secret = memcmp(bytes + length - PICOQUIC_RESET_SECRET_SIZE, 
-                cnx->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
+                cnx->cold->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
         }
         /* AEAD Decrypt, in place */
         decoded_length = picoquic_aead_decrypt(cnx, bytes + ph->offset,
@@ -1046,7 +1066,7 @@ int picoquic_incoming_packet(
         {
             /* Build a packet number to 64 bits */
             ph.pn64 = picoquic_get_packet_number64(
-                cnx->first_sack_item.end_of_sack_range, ph.pnmask, ph.pn);
+                cnx->sack_tracker.first_range.end_of_sack_range, ph.pnmask, ph.pn);
 
             /* verify that the packet is new */
             if (picoquic_is_pn_already_received(cnx, ph.pn64) != 0)
@@ -1056,9 +1076,9 @@ int picoquic_incoming_packet(
                 if (ph.vn == 0 && (ph.ptype == picoquic_packet_1rtt_protected_phi0 ||
                     ph.ptype == picoquic_packet_1rtt_protected_phi1) &&
                     length >= (9 + PICOQUIC_RESET_SECRET_SIZE) &&
-                    ((memcmp(bytes + 9, cnx->reset_secret, PICOQUIC_RESET_SECRET_SIZE) == 0) ||
+                    ((memcmp(bytes + 9, cnx->cold->reset_secret, PICOQUIC_RESET_SECRET_SIZE) == 0) ||
                     (memcmp(bytes + length - PICOQUIC_RESET_SECRET_SIZE,
-                        cnx->reset_secret, PICOQUIC_RESET_SECRET_SIZE) == 0)))
+                        cnx->cold->reset_secret, PICOQUIC_RESET_SECRET_SIZE) == 0)))
                 {
                     ret = picoquic_incoming_stateless_reset(cnx);
                 }
@@ -20,21 +20,198 @@
 */
 
 /*
- * Basic hash implementation, like we have seen tons off already.
+ * Open addressing hash table.
+ *
+ * The items are stored inline in a power of two array of bins, using linear
+ * probing. Insertions follow the "Robin Hood" rule: an item that is further
+ * away from its preferred bin displaces an item that is closer to its own,
+ * which keeps probe sequences short and lets lookups stop early. Deletions
+ * shift the following items back, so the table never holds tombstones.
+ *
+ * The full hash is kept in the item, so the compare function is only called
+ * when the hashes match.
+ *
+ * When the load exceeds 3/4, the table doubles in size. The old bins are not
+ * rehashed at once: they are kept aside, searched on lookups, and a few of
+ * them are migrated to the new bins at each insertion or deletion. Migrated
+ * or deleted items in the old bins are marked with a "moved" key, so that
+ * the probe sequences of the remaining items are preserved.
  */
 #include <stdlib.h>
 #include <string.h>
 #include "picohash.h"
 
+#define PICOHASH_MIN_BIN 8
+#define PICOHASH_MIGRATION_STEP 8
+
+static char picohash_moved_key;
+#define PICOHASH_MOVED_KEY ((void *)&picohash_moved_key)
+
+/* Mix the bits of the hash, since only the low order bits select the bin */
+static uint64_t picohash_scramble(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static picohash_item * picohash_create_bins(size_t nb_bin)
+{
+    picohash_item * bins = (picohash_item *)malloc(sizeof(picohash_item)*nb_bin);
+
+    if (bins != NULL)
+    {
+        (void)memset(bins, 0, sizeof(picohash_item)*nb_bin);
+    }
+
+    return bins;
+}
+
+static picohash_item * picohash_find(picohash_item * bins, size_t nb_bin, uint64_t hash, void * key,
+    int(*picohash_compare)(void *, void *))
+{
+    size_t mask = nb_bin - 1;
+    size_t bin = (size_t)hash & mask;
+    size_t distance = 0;
+    picohash_item * item = NULL;
+
+    while (bins[bin].key != NULL && distance < nb_bin)
+    {
+        if (((bin - (size_t)bins[bin].hash) & mask) < distance)
+        {
+            /* A matching item would have displaced this one */
+            break;
+        }
+        else if (bins[bin].hash == hash && bins[bin].key != PICOHASH_MOVED_KEY &&
+            picohash_compare(key, bins[bin].key) == 0)
+        {
+            item = &bins[bin];
+            break;
+        }
+
+        bin = (bin + 1) & mask;
+        distance++;
+    }
+
+    return item;
+}
+
+static void picohash_place(picohash_item * bins, size_t nb_bin, uint64_t hash, void * key)
+{
+    size_t mask = nb_bin - 1;
+    size_t bin = (size_t)hash & mask;
+    size_t distance = 0;
+    picohash_item current;
+
+    current.hash = hash;
+    current.key = key;
+
+    while (bins[bin].key != NULL)
+    {
+        size_t existing_distance = (bin - (size_t)bins[bin].hash) & mask;
+
+        if (existing_distance < distance)
+        {
+            picohash_item displaced = bins[bin];
+            bins[bin] = current;
+            current = displaced;
+            distance = existing_distance;
+        }
+
+        bin = (bin + 1) & mask;
+        distance++;
+    }
+
+    bins[bin] = current;
+}
+
+static void picohash_remove_at(picohash_item * bins, size_t nb_bin, size_t bin)
+{
+    size_t mask = nb_bin - 1;
+    size_t next = (bin + 1) & mask;
+
+    while (bins[next].key != NULL && ((next - (size_t)bins[next].hash) & mask) != 0)
+    {
+        bins[bin] = bins[next];
+        bin = next;
+        next = (next + 1) & mask;
+    }
+
+    bins[bin].hash = 0;
+    bins[bin].key = NULL;
+}
+
+static void picohash_migrate(picohash_table * hash_table, size_t nb_steps)
+{
+    while (hash_table->old_bin != NULL && hash_table->old_count > 0 &&
+        hash_table->old_index < hash_table->old_nb_bin && nb_steps > 0)
+    {
+        picohash_item * item = &hash_table->old_bin[hash_table->old_index++];
+
+        if (item->key != NULL && item->key != PICOHASH_MOVED_KEY)
+        {
+            picohash_place(hash_table->hash_bin, hash_table->nb_bin, item->hash, item->key);
+            item->key = PICOHASH_MOVED_KEY;
+            hash_table->old_count--;
+        }
+        nb_steps--;
+    }
+
+    if (hash_table->old_bin != NULL &&
+        (hash_table->old_count == 0 || hash_table->old_index >= hash_table->old_nb_bin))
+    {
+        free(hash_table->old_bin);
+        hash_table->old_bin = NULL;
+        hash_table->old_nb_bin = 0;
+        hash_table->old_count = 0;
+        hash_table->old_index = 0;
+    }
+}
+
+static int picohash_grow(picohash_table * hash_table)
+{
+    int ret = 0;
+    size_t new_nb_bin = 2 * hash_table->nb_bin;
+    picohash_item * new_bin = picohash_create_bins(new_nb_bin);
+
+    if (new_bin == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        /* Complete the previous migration before starting a new one */
+        picohash_migrate(hash_table, hash_table->old_nb_bin);
+
+        hash_table->old_bin = hash_table->hash_bin;
+        hash_table->old_nb_bin = hash_table->nb_bin;
+        hash_table->old_count = hash_table->count;
+        hash_table->old_index = 0;
+        hash_table->hash_bin = new_bin;
+        hash_table->nb_bin = new_nb_bin;
+    }
+
+    return ret;
+}
 
 picohash_table * picohash_create(size_t nb_bin,
     uint64_t(*picohash_hash) (void *),
     int(*picohash_compare)(void *, void *))
 {
     picohash_table * t = (picohash_table *)malloc(sizeof(picohash_table));
+    size_t actual_nb_bin = PICOHASH_MIN_BIN;
+
+    while (actual_nb_bin < nb_bin)
+    {
+        actual_nb_bin *= 2;
+    }
+
     if (t != NULL)
     {
-        t->hash_bin = (picohash_item **)malloc(sizeof(picohash_item *)*nb_bin);
+        memset(t, 0, sizeof(picohash_table));
+        t->hash_bin = picohash_create_bins(actual_nb_bin);
 
         if (t->hash_bin == NULL)
         {
@@ -43,8 +220,7 @@ picohash_table * picohash_create(size_t nb_bin,
         }
         else
         {
-            (void)memset(t->hash_bin, 0, sizeof(picohash_item *)*nb_bin);
-            t->nb_bin = nb_bin;
+            t->nb_bin = actual_nb_bin;
             t->count = 0;
             t->picohash_hash = picohash_hash;
             t->picohash_compare = picohash_compare;
@@ -56,20 +232,14 @@ picohash_table * picohash_create(size_t nb_bin,
 
 picohash_item * picohash_retrieve(picohash_table * hash_table, void * key)
 {
-    uint64_t hash = hash_table->picohash_hash(key);
-    uint32_t bin = hash % hash_table->nb_bin;
-    picohash_item * item = hash_table->hash_bin[bin];
+    uint64_t hash = picohash_scramble(hash_table->picohash_hash(key));
+    picohash_item * item = picohash_find(hash_table->hash_bin, hash_table->nb_bin,
+        hash, key, hash_table->picohash_compare);
 
-    while (item != NULL)
+    if (item == NULL && hash_table->old_bin != NULL)
     {
-        if (hash_table->picohash_compare(key, item->key) == 0)
-        {
-            break;
-        }
-        else
-        {
-            item = item->next_in_bin;
-        }
+        item = picohash_find(hash_table->old_bin, hash_table->old_nb_bin,
+            hash, key, hash_table->picohash_compare);
     }
 
     return item;
@@ -77,66 +247,75 @@ picohash_item * picohash_retrieve(picohash_table * hash_table, void * key)
 
 int picohash_insert(picohash_table * hash_table, void* key)
 {
-    uint64_t hash = hash_table->picohash_hash(key);
-    uint32_t bin = hash % hash_table->nb_bin;
+    uint64_t hash = picohash_scramble(hash_table->picohash_hash(key));
     int ret = 0;
-    picohash_item * item = (picohash_item *)malloc(sizeof(picohash_item));
-    
-    if (item == NULL)
+
+    if (4 * (hash_table->count + 1) > 3 * hash_table->nb_bin &&
+        picohash_grow(hash_table) != 0 &&
+        hash_table->count + 1 >= hash_table->nb_bin)
     {
+        /* Cannot grow, and no room left */
         ret = -1;
     }
     else
     {
-        item->hash = hash;
-        item->key = key;
-        item->next_in_bin = hash_table->hash_bin[bin];
-        hash_table->hash_bin[bin] = item;
+        picohash_migrate(hash_table, PICOHASH_MIGRATION_STEP);
+        picohash_place(hash_table->hash_bin, hash_table->nb_bin, hash, key);
         hash_table->count++;
     }
-    
+
     return ret;
 }
 
 void picohash_item_delete(picohash_table * hash_table, picohash_item * item, int delete_key_too)
 {
-    uint32_t bin = item->hash % hash_table->nb_bin;
-    picohash_item * previous = hash_table->hash_bin[bin];
-    
-    if (previous == item)
+    void * key = item->key;
+
+    if (hash_table->old_bin != NULL && item >= hash_table->old_bin &&
+        item < hash_table->old_bin + hash_table->old_nb_bin)
     {
-        hash_table->hash_bin[bin] = item->next_in_bin;
+        item->key = PICOHASH_MOVED_KEY;
+        hash_table->old_count--;
     }
-    else while (previous != NULL)
+    else
     {
-        if (previous->next_in_bin == item)
-        {
-            previous->next_in_bin = item->next_in_bin;
-            break;
-        }
-        else
-        {
-            previous = previous->next_in_bin;
-        }
+        picohash_remove_at(hash_table->hash_bin, hash_table->nb_bin, (size_t)(item - hash_table->hash_bin));
     }
 
+    hash_table->count--;
+
     if (delete_key_too)
     {
-        free(item->key);
+        free(key);
     }
 
-    free(item);
+    picohash_migrate(hash_table, PICOHASH_MIGRATION_STEP);
 }
 
 void picohash_delete(picohash_table * hash_table, int delete_key_too)
 {
-    for (uint32_t i = 0; i < hash_table->nb_bin; i++)
+    if (delete_key_too)
     {
-        while (hash_table->hash_bin[i] != NULL)
+        for (size_t i = 0; i < hash_table->nb_bin; i++)
         {
-            /* TODO: could be faster */
-            picohash_item_delete(hash_table, hash_table->hash_bin[i], delete_key_too);
+            if (hash_table->hash_bin[i].key != NULL)
+            {
+                free(hash_table->hash_bin[i].key);
+            }
         }
+
+        for (size_t i = 0; i < hash_table->old_nb_bin; i++)
+        {
+            if (hash_table->old_bin[i].key != NULL && hash_table->old_bin[i].key != PICOHASH_MOVED_KEY)
+            {
+                free(hash_table->old_bin[i].key);
+            }
+        }
+    }
+
+    if (hash_table->old_bin != NULL)
+    {
+        free(hash_table->old_bin);
     }
 
     free(hash_table->hash_bin);
@@ -34,10 +34,14 @@ extern "C" {
 #endif
 
 
+    /*
+     * Items are stored inline in an open addressing table, using linear
+     * probing with "Robin Hood" displacement. The pointer returned by
+     * picohash_retrieve is only valid until the next insertion or deletion.
+     */
     typedef struct _picohash_item
     {
         uint64_t hash;
-        struct _picohash_item * next_in_bin;
         void * key;
     } picohash_item;
 
@@ -45,9 +49,14 @@ extern "C" {
     typedef struct picohash_table
     {
         /* TODO: lock ! */
-        picohash_item ** hash_bin;
+        picohash_item * hash_bin;
         size_t nb_bin;
         size_t count;
+        /* Previous bins, progressively migrated after the table has grown */
+        picohash_item * old_bin;
+        size_t old_nb_bin;
+        size_t old_count;
+        size_t old_index;
         uint64_t(*picohash_hash) (void *);
         int(*picohash_compare)(void *, void *);
     } picohash_table;
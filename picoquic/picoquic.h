@@ -67,6 +67,7 @@ extern "C" {
 #define PICOQUIC_ERROR_SEND_BUFFER_TOO_SMALL (PICOQUIC_ERROR_CLASS  + 25)
 #define PICOQUIC_ERROR_UNEXPECTED_STATE (PICOQUIC_ERROR_CLASS  + 26)
 #define PICOQUIC_ERROR_UNEXPECTED_ERROR (PICOQUIC_ERROR_CLASS  + 27)
+#define PICOQUIC_ERROR_SEND_BUFFER_FULL (PICOQUIC_ERROR_CLASS  + 28)
 
 /*
  * Protocol errors defined in the QUIC spec
@@ -154,7 +155,9 @@ extern "C" {
 		picoquic_callback_stream_reset,
         picoquic_callback_stop_sending,
         picoquic_callback_close,
-        picoquic_callback_application_close
+        picoquic_callback_application_close,
+        picoquic_callback_prepare_to_send,
+        picoquic_callback_stream_writable
 	} picoquic_call_back_event_t;
 
 	/* Callback function for providing stream data to the application.
@@ -168,6 +171,26 @@ extern "C" {
 	typedef uint64_t (*cnx_id_cb_fn)(uint64_t cnx_id_local,
 			uint64_t cnx_id_remote, void *cnx_id_cb_data);
 
+    /* Sharded servers run one QUIC context per worker. The shard index is
+     * encoded in the most significant byte of the connection ID, so that
+     * incoming packets can be steered to the worker that owns the connection.
+     * Pass picoquic_shard_cnx_id_callback and a shard context to picoquic_create.
+     */
+#define PICOQUIC_MAX_SHARDS 256
+
+    typedef struct st_picoquic_shard_ctx_t {
+        uint32_t shard_index;
+        uint32_t nb_shards;
+    } picoquic_shard_ctx_t;
+
+    uint64_t picoquic_shard_cnx_id_callback(uint64_t cnx_id_local,
+        uint64_t cnx_id_remote, void * shard_ctx);
+
+    uint32_t picoquic_get_cnx_id_shard(uint64_t cnx_id, uint32_t nb_shards);
+
+    /* Returns the shard of an incoming packet, or -1 if the packet carries no connection ID */
+    int picoquic_get_packet_shard(const uint8_t * bytes, size_t length, uint32_t nb_shards);
+
 	/* QUIC context create and dispose */
 	picoquic_quic_t * picoquic_create(uint32_t nb_connections,
 		char const * cert_file_name, char const * key_file_name,
@@ -188,6 +211,9 @@ extern "C" {
     /* Set cookie mode on QUIC context when under stress */
     void picoquic_set_cookie_mode(picoquic_quic_t * quic, int cookie_mode);
 
+    /* Pre-allocate connection contexts, so that handshakes do not hit the allocator */
+    int picoquic_preallocate_cnx(picoquic_quic_t * quic, size_t nb_cnx);
+
 	/* Connection context creation and registration */
 	picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 		uint64_t cnx_id, struct sockaddr * addr, uint64_t start_time, uint32_t preferred_version,
@@ -208,6 +234,14 @@ extern "C" {
         uint64_t current_time,
         int64_t delay_max);
 
+    /* Ready set: returns the connection that needs servicing first, or NULL if no
+     * connection is due at current_time. Calling picoquic_prepare_packet on the
+     * returned connection reschedules it, so a server loop can service all the
+     * ready connections without visiting the idle ones:
+     *     while ((cnx = picoquic_get_next_ready_cnx(quic, current_time)) != NULL) ...
+     */
+    picoquic_cnx_t * picoquic_get_next_ready_cnx(picoquic_quic_t * quic, uint64_t current_time);
+
 	picoquic_state_enum picoquic_get_cnx_state(picoquic_cnx_t * cnx);
 
     int picoquic_tls_is_psk_handshake(picoquic_cnx_t * cnx);
@@ -228,6 +262,45 @@ extern "C" {
     /* Send extra frames */
     int picoquic_queue_misc_frame(picoquic_cnx_t * cnx, const uint8_t * bytes, size_t length);
 
+    /* Cross thread submission. Only the network thread that owns the QUIC context
+     * may call the connection and stream functions, but application threads can
+     * post stream data, stream resets and connection closes in a lock-free queue.
+     * The network thread executes them in batch by calling picoquic_process_commands
+     * before preparing packets. Application threads never touch the connection context:
+     * they designate the connection by its initial connection ID, obtained on the
+     * network thread with picoquic_get_initial_cnxid. The connection is looked up when
+     * the command is processed, and commands for connections that were deleted in the
+     * meantime are discarded.
+     *
+     * Posted stream data is never dropped because of the send buffer limits. Data
+     * refused with PICOQUIC_ERROR_SEND_BUFFER_FULL, and the data posted after it on
+     * the same stream, stays queued on the stream and is added again when the stream
+     * becomes writable, before picoquic_callback_stream_writable is delivered. It is
+     * discarded if the stream is reset or deleted first.
+     *
+     * The wakeup descriptor is readable when commands are pending, and can be added
+     * to the poll set of the network loop. It is an eventfd on Linux, a pipe on other
+     * Unix systems, and a connected loopback UDP socket on Windows. It must be opened
+     * by the network thread before application threads start posting.
+     */
+#ifdef _WINDOWS
+    typedef SOCKET picoquic_wakeup_fd_t;
+#else
+    typedef int picoquic_wakeup_fd_t;
+#endif
+
+    int picoquic_open_command_wakeup(picoquic_quic_t * quic);
+    picoquic_wakeup_fd_t picoquic_get_command_wakeup_fd(picoquic_quic_t * quic);
+
+    int picoquic_post_stream_data(picoquic_quic_t * quic, uint64_t initial_cnxid,
+        uint64_t stream_id, const uint8_t * data, size_t length, int set_fin);
+    int picoquic_post_reset_stream(picoquic_quic_t * quic, uint64_t initial_cnxid,
+        uint64_t stream_id, uint16_t local_stream_error);
+    int picoquic_post_close(picoquic_quic_t * quic, uint64_t initial_cnxid, uint16_t reason_code);
+
+    /* Returns the number of commands executed */
+    int picoquic_process_commands(picoquic_quic_t * quic);
+
 	/* Send and receive network packets */
 
 	picoquic_stateless_packet_t * picoquic_dequeue_stateless_packet(picoquic_quic_t * quic);
@@ -244,6 +317,29 @@ extern "C" {
 
 	picoquic_packet * picoquic_create_packet();
 
+    /* Packets are recycled through a per context pool. The pool keeps at most
+     * max_free packets; packets recycled beyond that are freed. Packets obtained
+     * from picoquic_create_packet can also be recycled. */
+#define PICOQUIC_DEFAULT_PACKET_POOL_SIZE 256
+
+    typedef struct st_picoquic_packet_pool_stats_t {
+        uint64_t nb_alloc; /* packets requested from the pool */
+        uint64_t nb_alloc_from_pool; /* requests served without calling malloc */
+        uint64_t nb_recycled; /* packets returned to the pool */
+        uint64_t nb_released; /* packets freed because the pool was full */
+        size_t nb_free; /* packets currently in the pool */
+        size_t max_free;
+    } picoquic_packet_pool_stats_t;
+
+    picoquic_packet * picoquic_alloc_packet(picoquic_quic_t * quic);
+    void picoquic_recycle_packet(picoquic_quic_t * quic, picoquic_packet * packet);
+    void picoquic_set_packet_pool_size(picoquic_quic_t * quic, size_t max_free);
+    void picoquic_get_packet_pool_stats(picoquic_quic_t * quic, picoquic_packet_pool_stats_t * stats);
+
+	/* Prepare the next packet, encrypted in send_buffer. The packet is kept for
+	 * retransmission if its length is not zero after the call; otherwise, including
+	 * when send_length is not zero but only acknowledgements were sent, the caller
+	 * should recycle it. */
 	int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 		uint64_t current_time, uint8_t * send_buffer, size_t send_buffer_max, size_t * send_length);
 
@@ -251,12 +347,110 @@ extern "C" {
 	int picoquic_add_to_stream(picoquic_cnx_t * cnx,
 		uint64_t stream_id, const uint8_t * data, size_t length, int set_fin);
 
+    /* Queue data by reference, without copying it. The buffer must remain valid
+     * until release_fn is called, once all its bytes have been copied into
+     * packets, or when the stream is reset or the connection deleted. Lost data
+     * is repeated from the packet copies, not from the buffer. If the call fails,
+     * release_fn is not called and the buffer remains owned by the caller. */
+    typedef void(*picoquic_stream_data_release_fn)(void * release_ctx, const uint8_t * bytes, size_t length);
+
+    int picoquic_add_to_stream_ref(picoquic_cnx_t * cnx,
+        uint64_t stream_id, const uint8_t * data, size_t length, int set_fin,
+        picoquic_stream_data_release_fn release_fn, void * release_ctx);
+
+    /* Pull mode. When an active stream can send, the callback receives the
+     * picoquic_callback_prepare_to_send event, with "bytes" pointing to an opaque
+     * context and "length" set to the maximum number of bytes that can be sent.
+     * The application calls picoquic_provide_stream_data_buffer with that context,
+     * and writes nb_bytes in the returned buffer, inside the packet being built.
+     * The stream stays active until the FIN is provided, or until is_still_active
+     * is set to zero or the callback returns without providing data. Queued data
+     * is sent before the data provided in pull mode. */
+    int picoquic_mark_active_stream(picoquic_cnx_t * cnx, uint64_t stream_id, int is_active);
+
+    uint8_t * picoquic_provide_stream_data_buffer(void * context, size_t nb_bytes, int is_fin, int is_still_active);
+
+    /* Send buffer limits. When the data queued and not yet sent on a stream, or on
+     * the whole connection, reaches the high mark, adding data to the stream fails
+     * with PICOQUIC_ERROR_SEND_BUFFER_FULL. Once the queued data is at or below the
+     * low marks, the callback receives picoquic_callback_stream_writable for that
+     * stream. A call may take the queued data beyond the high mark, the next one
+     * fails. A high mark of zero, the default, means no limit. */
+    int picoquic_set_stream_send_buffer_limits(picoquic_cnx_t * cnx, uint64_t stream_id,
+        uint64_t high_mark, uint64_t low_mark);
+
+    void picoquic_set_send_buffer_limits(picoquic_cnx_t * cnx, uint64_t high_mark, uint64_t low_mark);
+
 	int picoquic_reset_stream(picoquic_cnx_t * cnx,
 		uint64_t stream_id, uint16_t local_stream_error);
 
     int picoquic_stop_sending(picoquic_cnx_t * cnx,
         uint64_t stream_id, uint16_t local_stream_error);
 
+    /* Stream scheduling. Stream 0 is always served first. Other streams that
+     * have data to send are served in turn (round robin, the default), in
+     * proportion to their weight (weighted), or in the order in which they
+     * became ready to send (FIFO). */
+#define PICOQUIC_DEFAULT_STREAM_WEIGHT 16
+
+    typedef enum {
+        picoquic_stream_scheduler_round_robin = 0,
+        picoquic_stream_scheduler_weighted,
+        picoquic_stream_scheduler_fifo
+    } picoquic_stream_scheduler_t;
+
+    void picoquic_set_stream_scheduler(picoquic_cnx_t * cnx, picoquic_stream_scheduler_t scheduler);
+
+    int picoquic_set_stream_weight(picoquic_cnx_t * cnx, uint64_t stream_id, uint8_t weight);
+
+    /* Stream priority. Streams of lower urgency values are served first, from
+     * 0, the most urgent, to PICOQUIC_STREAM_URGENCY_MAX. At equal urgency,
+     * incremental streams share the connection according to the scheduler,
+     * while a stream that is not incremental is sent in full before the
+     * streams that became ready after it. Streams are created incremental,
+     * with the default urgency. */
+#define PICOQUIC_STREAM_URGENCY_MAX 7
+#define PICOQUIC_DEFAULT_STREAM_URGENCY 3
+
+    int picoquic_set_stream_priority(picoquic_cnx_t * cnx, uint64_t stream_id, uint8_t urgency, int incremental);
+
+    /* Receive window auto tuning. The connection and stream windows start at the
+     * initial values of the transport parameters. Credit is renewed when half of
+     * the window was used. If the previous renewal was less than two round trips
+     * before, the window limits the peer and is doubled, up to the maximum. */
+#define PICOQUIC_DEFAULT_MAX_CONNECTION_WINDOW 0x1000000
+#define PICOQUIC_DEFAULT_MAX_STREAM_WINDOW 0x600000
+
+    void picoquic_set_max_receive_windows(picoquic_quic_t * quic,
+        uint64_t max_connection_window, uint64_t max_stream_window);
+
+    typedef struct st_picoquic_flow_control_stats_t {
+        uint64_t connection_window; /* current receive window of the connection */
+        uint64_t nb_window_increases; /* connection or stream windows doubled */
+        uint64_t nb_max_data_sent; /* MAX_DATA frames sent */
+        uint64_t nb_max_stream_data_sent; /* MAX_STREAM_DATA frames sent */
+        uint64_t nb_peer_blocked; /* received data reached the connection limit */
+        uint64_t nb_peer_stream_blocked; /* received data reached a stream limit */
+        uint64_t nb_blocked_frames_received; /* BLOCKED or STREAM_BLOCKED received */
+        uint64_t nb_local_blocked; /* sending stopped by the peer connection limit */
+        uint64_t nb_local_stream_blocked; /* sending stopped by a peer stream limit */
+        uint64_t buffered_bytes; /* memory held for out of order stream data */
+        uint64_t nb_budget_holds; /* credit withheld because the receive budget was used */
+    } picoquic_flow_control_stats_t;
+
+    void picoquic_get_flow_control_stats(picoquic_cnx_t * cnx, picoquic_flow_control_stats_t * stats);
+
+    /* Receive memory budget, per connection and for the whole context. It covers
+     * the buffers holding out of order stream data. When more than half of a
+     * budget is used, the receive windows shrink instead of growing; when it is
+     * all used, no new credit is given to the peer until the data is delivered. */
+#define PICOQUIC_DEFAULT_CNX_RECEIVE_BUDGET 0x2000000
+#define PICOQUIC_DEFAULT_RECEIVE_BUDGET 0x40000000
+
+    void picoquic_set_receive_budget(picoquic_quic_t * quic, uint64_t cnx_budget, uint64_t context_budget);
+
+    uint64_t picoquic_get_receive_buffered_bytes(picoquic_quic_t * quic);
+
 
 	/* Congestion algorithm definition */
 	typedef enum {
@@ -44,6 +44,15 @@ extern "C" {
 #define PICOQUIC_ACK_DELAY_MAX 20000 /* 20 ms */
 
 #define PICOQUIC_SPURIOUS_RETRANSMIT_DELAY_MAX 1000000 /* one second */
+#define PICOQUIC_MAX_ACK_RECORDS 32
+#define PICOQUIC_RETRANSMIT_INDEX_MIN 64
+#define PICOQUIC_STREAM_INDEX_MIN 16
+#define PICOQUIC_STREAM_INDEX_MAX 16384
+#define PICOQUIC_STREAM_TABLE_MIN 64
+#define PICOQUIC_STREAM_WEIGHT_QUANTUM 128
+#define PICOQUIC_SACK_WINDOW_WORDS 4
+#define PICOQUIC_SACK_WINDOW_BITS (64 * PICOQUIC_SACK_WINDOW_WORDS)
+#define PICOQUIC_MAX_SACK_RANGES 8
 
 #define PICOQUIC_MICROSEC_SILENCE_MAX 120000000 /* 120 seconds for now */
 #define PICOQUIC_MICROSEC_WAIT_MAX 10000000 /* 10 seconds for now */
@@ -175,6 +184,28 @@ extern "C" {
 		picoquic_context_unconditional_cnx_id = 4
 	} picoquic_context_flags;
 
+    /*
+     * Commands posted by application threads, and executed by the network
+     * thread. Stream data is copied in the same allocation, after the header.
+     */
+    typedef enum {
+        picoquic_command_stub = 0,
+        picoquic_command_stream_data,
+        picoquic_command_reset_stream,
+        picoquic_command_close
+    } picoquic_command_enum;
+
+    typedef struct st_picoquic_command_t {
+        struct st_picoquic_command_t * next_command;
+        picoquic_command_enum command_type;
+        uint64_t initial_cnxid;
+        uint64_t stream_id;
+        uint16_t error_code;
+        int set_fin;
+        size_t length;
+        uint8_t * bytes;
+    } picoquic_command_t;
+
 	/*
 	 * QUIC context, defining the tables of connections,
 	 * open sockets, etc.
@@ -189,6 +220,9 @@ extern "C" {
         uint8_t retry_seed[PICOQUIC_RETRY_SECRET_SIZE];
         uint64_t * p_simulated_time;
         char const * ticket_file_name;
+        /* State of the non crypto random generator, see picoquic_public_random_64 */
+        uint64_t public_random_seed[16];
+        int public_random_index;
         picoquic_stored_ticket_t * p_first_ticket;
 
 		uint32_t flags;
@@ -200,8 +234,45 @@ extern "C" {
 		struct st_picoquic_cnx_t * cnx_list;
 		struct st_picoquic_cnx_t * cnx_last;
 
+        /* Binary min-heap of connections, ordered by next wake time */
+        struct st_picoquic_cnx_t ** wake_heap;
+        size_t wake_heap_count;
+        size_t wake_heap_size;
+
+        /* Pool of connection contexts, allocated by slabs */
+        struct st_picoquic_cnx_slab_t * cnx_slab_list;
+        struct st_picoquic_cnx_t * cnx_free_list;
+        size_t nb_cnx_free;
+        size_t nb_cnx_allocated;
+
+        /* Pool of stream contexts released by deleted connections */
+        struct _picoquic_stream_head * stream_free_list;
+        size_t nb_stream_free;
+
+        /* Pool of packets, linked through next_packet */
+        picoquic_packet * packet_free_list;
+        picoquic_packet_pool_stats_t packet_pool_stats;
+
+        /* Upper bounds of the auto tuned receive windows */
+        uint64_t max_connection_window;
+        uint64_t max_stream_window;
+
+        /* Receive memory budgets, and memory held by all connections */
+        uint64_t cnx_receive_budget;
+        uint64_t receive_budget;
+        uint64_t receive_buffered;
+
+        /* Multiple producer, single consumer command queue. Producers push at
+         * the head, the network thread pops at the tail. */
+        picoquic_command_t * command_head;
+        picoquic_command_t * command_tail;
+        picoquic_command_t command_stub;
+        int command_wakeup_pending;
+        picoquic_wakeup_fd_t command_wakeup_fd[2];
+
 		picohash_table * table_cnx_by_id;
 		picohash_table * table_cnx_by_net;
+        picohash_table * table_cnx_by_initial_id; /* resolves the cross thread commands */
 
 		cnx_id_cb_fn cnx_id_callback_fn;
 		void * cnx_id_callback_ctx;
@@ -236,6 +307,59 @@ extern "C" {
 		// uint64_t time_stamp_last_in_range;
 	} picoquic_sack_item_t;
 
+    /*
+     * Received packet numbers, part of connection context. The ranges are kept
+     * highest first, and are used to prepare ACK frames. The highest range and
+     * a small fixed array of older ranges are part of the tracker, so recording
+     * packets received out of order stays in the per packet fields, and
+     * picoquic_sack_get_range returns the range of a given rank. The bitmap holds the most recent packet
+     * numbers, bit (pn % window size), so duplicates are found without
+     * searching the ranges. When the array is full the lowest range is
+     * dropped, and older packets are treated as duplicates.
+     * When empty, the first range is set to zero.
+     */
+
+    typedef struct st_picoquic_sack_range_t {
+        uint64_t start_of_sack_range;
+        uint64_t end_of_sack_range;
+    } picoquic_sack_range_t;
+
+    typedef struct st_picoquic_sack_tracker_t {
+        picoquic_sack_range_t first_range;
+        size_t nb_ranges;
+        uint64_t window[PICOQUIC_SACK_WINDOW_WORDS];
+        uint64_t floor; /* lowest packet number still tracked */
+        picoquic_sack_range_t older_ranges[PICOQUIC_MAX_SACK_RANGES - 1]; /* below the first one */
+    } picoquic_sack_tracker_t;
+
+    /*
+     * Reassembly buffer for stream data received out of order, part of stream context.
+     */
+
+#define PICOQUIC_REASSEMBLY_MIN_SIZE 2048
+
+    typedef struct st_picoquic_reassembly_t {
+        uint8_t * buffer;
+        uint64_t * bitmap;
+        size_t size;
+        uint64_t end_offset;
+    } picoquic_reassembly_t;
+
+	/*
+	 * Record of a packet that only carried ACK frames. Such packets are never
+	 * retransmitted, so instead of keeping a copy in the retransmit queue we only
+	 * remember the send time, for RTT sampling, and the ACK frames, for the
+	 * ack of ack pruning of the SACK dashboard.
+	 */
+
+	typedef struct st_picoquic_ack_record_t {
+		struct st_picoquic_ack_record_t * next_record;
+		uint64_t sequence_number;
+		uint64_t send_time;
+		size_t frames_length;
+		uint8_t * frames;
+	} picoquic_ack_record_t;
+
 
 	/*
 	 * Stream head.
@@ -251,6 +375,18 @@ extern "C" {
 		uint8_t * bytes;
 	} picoquic_stream_data;
 
+    /*
+     * Items of the send queue. Copied data is allocated as a single blob, with
+     * the bytes following the header. Data queued by reference points to the
+     * application buffer, which is handed back through release_fn once all its
+     * bytes have been sent, or when the stream is cleared.
+     */
+    typedef struct _picoquic_stream_send_data {
+        picoquic_stream_data data;
+        picoquic_stream_data_release_fn release_fn;
+        void * release_ctx;
+    } picoquic_stream_send_data;
+
 	typedef enum picoquic_stream_flags {
 		picoquic_stream_flag_fin_received = 1,
 		picoquic_stream_flag_fin_signalled = 2,
@@ -263,11 +399,13 @@ extern "C" {
         picoquic_stream_flag_stop_sending_requested = 256,
         picoquic_stream_flag_stop_sending_sent = 512,
         picoquic_stream_flag_stop_sending_received = 1024,
-        picoquic_stream_flag_stop_sending_signalled = 2048
+        picoquic_stream_flag_stop_sending_signalled = 2048,
+        picoquic_stream_flag_fin_acked = 4096
 	} picoquic_stream_flags;
 
 	typedef struct _picoquic_stream_head {
 		struct _picoquic_stream_head * next_stream;
+		struct _picoquic_stream_head * previous_stream;
 		uint64_t stream_id;
 		uint64_t consumed_offset;
 		uint64_t fin_offset;
@@ -279,11 +417,57 @@ extern "C" {
         uint32_t local_stop_error;
         uint32_t remote_stop_error;
 		picoquic_stream_data * stream_data;
+        picoquic_reassembly_t reassembly;
 		uint64_t sent_offset;
 		picoquic_stream_data * send_queue;
+        picoquic_stream_data * send_queue_last;
+        /* Data lost in transmission, ordered by stream offset. Each item is
+         * a single allocation, and "offset" is the stream offset of "bytes". */
+        picoquic_stream_data * retransmit_queue;
         picoquic_sack_item_t first_sack_item;
+        /* Position in the list of streams ready to send, and scheduling state */
+        struct _picoquic_stream_head * next_ready_stream;
+        struct _picoquic_stream_head * previous_ready_stream;
+        int64_t sched_credit;
+        uint8_t sched_weight;
+        uint8_t urgency;
+        uint8_t is_incremental;
+        uint8_t is_active; /* data is provided by the application when sending */
+        uint8_t is_credit_blocked; /* in the blocked list instead of the ready list */
+        /* Receive window, and time at which credit was last renewed */
+        uint64_t maxdata_window;
+        uint64_t maxdata_update_time;
+        /* Position in the list of streams that need a MAX_STREAM_DATA update */
+        struct _picoquic_stream_head * next_update_stream;
+        struct _picoquic_stream_head * previous_update_stream;
+        /* Bytes in the send queue not yet sent, and limits */
+        uint64_t send_queued;
+        uint64_t send_high_mark;
+        uint64_t send_low_mark;
+        uint8_t is_write_blocked; /* writable event expected by the application */
+        /* Posted stream data refused because the send buffer was full, in posting order */
+        picoquic_command_t * first_deferred_command;
+        picoquic_command_t * last_deferred_command;
 	} picoquic_stream_head;
 
+    /*
+     * Context of the picoquic_callback_prepare_to_send event. The frame header
+     * is already encoded at the start of "bytes"; the length field, if any, and
+     * the data are added when the application provides the data.
+     */
+    typedef struct st_picoquic_stream_data_buffer_ctx_t {
+        uint8_t * bytes;
+        size_t bytes_max;
+        size_t header_length;
+        size_t allowed_length;
+        size_t frame_start;
+        size_t length;
+        size_t consumed;
+        int is_provided;
+        int is_fin;
+        int is_still_active;
+    } picoquic_stream_data_buffer_ctx_t;
+
     /*
      * Frame queue. This is used for miscellaneous packets, such as the PONG
      * response to a PING.
@@ -298,82 +482,81 @@ extern "C" {
     } picoquic_misc_frame_header_t;
 
 
+    /*
+     * Rarely used part of the connection context: handshake only data and
+     * statistics. It is allocated from the connection pool, in a separate
+     * array, so it does not dilute the per packet working set.
+     */
+    typedef struct st_picoquic_cnx_cold_t
+    {
+        /* On clients, document the SNI and ALPN expected from the server */
+        /* TODO: there may be a need to propose multiple ALPN */
+        char const * sni;
+        char const * alpn;
+        /* On clients, receives the maximum 0RTT size accepted by server */
+        size_t max_early_data_size;
+        uint16_t psk_cipher_suite_id;
+        uint8_t reset_secret[PICOQUIC_RESET_SECRET_SIZE];
+
+        /* Handshake encryption and decryption objects */
+        void * aead_encrypt_cleartext_ctx;
+        void * aead_decrypt_cleartext_ctx;
+        void * aead_de_encrypt_cleartext_ctx; /* used by logging functions to see what is sent. */
+        void * aead_0rtt_encrypt_ctx; /* setup on client if 0-RTT is possible */
+        void * aead_0rtt_decrypt_ctx; /* setup on server if 0-RTT is possible, also used on client for logging */
+        void * aead_de_encrypt_ctx; /* used by logging functions to see what is sent. */
+
+        /* Statistics */
+        uint32_t nb_zero_rtt_sent;
+        uint32_t nb_zero_rtt_acked;
+        uint64_t nb_retransmission_total;
+        uint64_t nb_spurious;
+        uint64_t max_spurious_rtt;
+        uint64_t max_reorder_delay;
+        uint64_t max_reorder_gap;
+        uint64_t sack_block_size_max;
+        picoquic_flow_control_stats_t flow_control_stats;
+    } picoquic_cnx_cold_t;
+
 	/*
 	 * Per connection context.
+	 * The fields read or written when sending or receiving packets are grouped
+	 * at the beginning, up to next_in_table, so they fit in a few cache lines.
+	 * They are listed in cnx_layout_test, which fails if a field is added to that
+	 * part without being listed, or if a listed field is moved out of it. Handshake
+	 * state and statistics are kept out of line, in the cold part.
 	 */
 	typedef struct st_picoquic_cnx_t
 	{
 		picoquic_quic_t * quic;
-
-		/* Management of context retrieval tables */
-		struct st_picoquic_cnx_t * next_in_table;
-		struct st_picoquic_cnx_t * previous_in_table;
-		struct st_picoquic_cnx_id_t * first_cnx_id;
-		struct st_picoquic_net_id_t * first_net_id;
-
-		/* Proposed and negotiated version. Feature flags denote version dependent features */
-		uint32_t proposed_version;
-        int version_index;
-
-		/* Local and remote parameters */
-		picoquic_transport_parameters local_parameters;
-		picoquic_transport_parameters remote_parameters;
-		/* On clients, document the SNI and ALPN expected from the server */
-		/* TODO: there may be a need to propose multiple ALPN */
-		char const * sni;
-		char const * alpn;
-        /* On clients, receives the maximum 0RTT size accepted by server, and whether 0-RTT is accepted */
-        size_t max_early_data_size;
-        int is_0RTT_accepted;
-		/* Call back function and context */
-		picoquic_stream_data_cb_fn callback_fn;
-		void * callback_ctx;
-
-        /* Peer address. To do: allow for multiple addresses */
-        struct sockaddr_storage peer_addr;
-        int peer_addr_len;
-        struct sockaddr_storage dest_addr;
-        int dest_addr_len;
-        unsigned long if_index_dest;
+        picoquic_cnx_cold_t * cold;
 
 		/* connection state, ID, etc. Todo: allow for multiple cnxid */
 		picoquic_state_enum cnx_state;
+        int version_index;
 		uint64_t initial_cnxid;
 		uint64_t server_cnxid;
-        uint64_t start_time;
-		uint8_t reset_secret[PICOQUIC_RESET_SECRET_SIZE];
-        uint32_t application_error;
-		uint32_t local_error;
-        uint32_t remote_application_error;
-		uint32_t remote_error;
 
-        /* Next time sending data is expected */
+        /* Next time sending data is expected, and position in the wake time heap */
         uint64_t next_wake_time;
+        size_t wake_heap_index;
 
-		/* TLS context, TLS Send Buffer, chain of receive buffers (todo) */
-		void * tls_ctx;
-		struct st_ptls_buffer_t * tls_sendbuf;
+		/* Call back function and context */
+		picoquic_stream_data_cb_fn callback_fn;
+		void * callback_ctx;
+
+		/* Send sequence and encryption and decryption objects */
 		uint64_t send_sequence;
 		uint32_t send_mtu;
-        uint16_t psk_cipher_suite_id;
+		void * aead_encrypt_ctx; 
+		void * aead_decrypt_ctx;
 
         /* Liveness detection */
         uint64_t latest_progress_time; /* last local time at which the connection progressed */
 
-		/* Encryption and decryption objects */
-        void * aead_encrypt_cleartext_ctx;
-        void * aead_decrypt_cleartext_ctx;
-        void * aead_de_encrypt_cleartext_ctx; /* used by logging functions to see what is sent. */
-		void * aead_encrypt_ctx; 
-		void * aead_decrypt_ctx;
-        void * aead_de_encrypt_ctx; /* used by logging functions to see what is sent. */
-        void * aead_0rtt_encrypt_ctx; /* setup on client if 0-RTT is possible */
-        void * aead_0rtt_decrypt_ctx; /* setup on server if 0-RTT is possible, also used on client for logging */
-
 		/* Receive state */
-		picoquic_sack_item_t first_sack_item;
+		picoquic_sack_tracker_t sack_tracker;
         uint64_t time_stamp_largest_received;
-		uint64_t sack_block_size_max;
 		uint64_t highest_ack_sent;
 		uint64_t highest_ack_time;
 		int ack_needed;
@@ -386,22 +569,20 @@ extern "C" {
 		uint64_t rtt_min;
         uint64_t ack_delay_local;
 
-		/* Retransmission state */
-        uint32_t nb_zero_rtt_sent;
-        uint32_t nb_zero_rtt_acked;
-        uint64_t nb_retransmission_total;
+		/* Retransmission state. The retransmitted packets are checked for spurious
+		 * retransmissions when ACKs are received, from both ends of their list. */
 		uint64_t nb_retransmit;
-        uint64_t nb_spurious;
-        uint64_t max_spurious_rtt;
-        uint64_t max_reorder_delay;
-        uint64_t max_reorder_gap;
 		uint64_t latest_retransmit_time;
 		uint64_t highest_acknowledged; 
 		uint64_t latest_time_acknowledged; /* time at which the highest acknowledged was sent */
 		picoquic_packet * retransmit_newest;
 		picoquic_packet * retransmit_oldest;
+		picoquic_packet ** retransmit_index; /* queued packets, by sequence number modulo the index size */
+		size_t retransmit_index_size;
         picoquic_packet * retransmitted_newest;
         picoquic_packet * retransmitted_oldest;
+		picoquic_ack_record_t * ack_record_newest;
+		uint32_t nb_ack_records;
 
 		/* Congestion control state */
 		uint64_t cwin;
@@ -415,23 +596,99 @@ extern "C" {
         uint64_t pacing_margin_micros;
         uint64_t next_pacing_time;
 
-		/* Flow control information */
+		/* Flow control information. The receive window is checked when data is received
+		 * and tuned when MAX_DATA is sent, the stream limits of the peer when scheduling. */
 		uint64_t data_sent;
 		uint64_t data_received;
 		uint64_t maxdata_local;
 		uint64_t maxdata_remote;
-		//uint64_t highest_stream_id_local;
-		//uint64_t highest_stream_id_remote;
-		uint64_t max_stream_id_bidir_local;
-        uint64_t max_stream_id_unidir_local;
+        uint64_t maxdata_window;
+        uint64_t maxdata_update_time;
+        uint64_t receive_buffered; /* memory held by the reassembly buffers */
 		uint64_t max_stream_id_bidir_remote;
         uint64_t max_stream_id_unidir_remote;
 
         /* Queue for frames waiting to be sent */
         picoquic_misc_frame_header_t * first_misc_frame;
 
-		/* Management of streams */
+        /* Streams other than stream 0 that have something to send, by urgency, in
+         * scheduling order. The urgencies whose list is not empty are listed in
+         * ready_urgency_mask, bit (1 << urgency), so empty lists are not read. */
+        picoquic_stream_head * first_ready_stream[PICOQUIC_STREAM_URGENCY_MAX + 1];
+        picoquic_stream_head * last_ready_stream[PICOQUIC_STREAM_URGENCY_MAX + 1];
+        uint8_t ready_urgency_mask;
+        picoquic_stream_scheduler_t stream_scheduler;
+
+        /* Streams whose consumed data crossed the MAX_STREAM_DATA update threshold */
+        picoquic_stream_head * first_update_stream;
+        picoquic_stream_head * last_update_stream;
+
+        /* Bytes queued on all streams and not yet sent, and their limits, checked
+         * when data is queued and after each stream frame is sent */
+        uint64_t send_queued;
+        uint64_t send_high_mark;
+        uint64_t send_low_mark;
+        int is_write_blocked; /* some stream waits for the connection queue to drain */
+
+        /* End of the per packet fields */
+
+		/* Management of context retrieval tables */
+		struct st_picoquic_cnx_t * next_in_table;
+		struct st_picoquic_cnx_t * previous_in_table;
+		struct st_picoquic_cnx_id_t * first_cnx_id;
+		struct st_picoquic_net_id_t * first_net_id;
+        struct st_picoquic_cnx_id_t * initial_id_key;
+
+        /* Stream limits granted to the peer, only checked when the peer opens a stream */
+		//uint64_t highest_stream_id_local;
+		//uint64_t highest_stream_id_remote;
+        uint64_t max_stream_id_bidir_local;
+        uint64_t max_stream_id_unidir_local;
+
+        /* Ready streams that only have new data to send while the connection is blocked
+         * by MAX_DATA, linked like the ready lists, and moved back when credit arrives */
+        picoquic_stream_head * first_blocked_stream;
+        picoquic_stream_head * last_blocked_stream;
+
+		/* Proposed and negotiated version. Feature flags denote version dependent features */
+		uint32_t proposed_version;
+
+        /* On clients, whether 0-RTT is accepted */
+        int is_0RTT_accepted;
+
+		/* Local and remote parameters */
+		picoquic_transport_parameters local_parameters;
+		picoquic_transport_parameters remote_parameters;
+
+        /* Peer address. To do: allow for multiple addresses */
+        struct sockaddr_storage peer_addr;
+        int peer_addr_len;
+        struct sockaddr_storage dest_addr;
+        int dest_addr_len;
+        unsigned long if_index_dest;
+
+        uint64_t start_time;
+        uint32_t application_error;
+		uint32_t local_error;
+        uint32_t remote_application_error;
+		uint32_t remote_error;
+
+		/* TLS context, TLS Send Buffer, chain of receive buffers (todo) */
+		void * tls_ctx;
+		struct st_ptls_buffer_t * tls_sendbuf;
+
+		/* Management of streams. The list is ordered by stream ID, and doubly linked
+		 * so closed streams are removed without a search. Streams are also
+		 * indexed by type, in arrays of stream_id >> 2, and in a hash table for
+		 * the streams beyond the maximum size of these arrays. */
 		picoquic_stream_head first_stream;
+		picoquic_stream_head * last_stream;
+		picoquic_stream_head ** stream_index[4];
+		size_t stream_index_size[4];
+		picohash_table * stream_table;
+		/* Streams released once closed in both directions, by type, as ranges of
+		 * (stream_id >> 2) + 1, so late frames for these streams can be ignored */
+		picoquic_sack_item_t closed_streams[4];
 
 	} picoquic_cnx_t;
 
@@ -448,6 +705,13 @@ extern "C" {
 	/* handling of retransmission queue */
 	void picoquic_enqueue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p);
 	void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p, int should_free);
+	void picoquic_index_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p);
+	picoquic_packet * picoquic_find_retransmit_packet(picoquic_cnx_t * cnx, uint64_t sequence_number);
+
+	/* handling of the records of ACK only packets */
+	int picoquic_record_ack_only_packet(picoquic_cnx_t * cnx, picoquic_packet * p, size_t header_length);
+	picoquic_ack_record_t * picoquic_find_ack_record(picoquic_cnx_t * cnx, uint64_t sequence_number);
+	void picoquic_delete_ack_records(picoquic_cnx_t * cnx, uint64_t highest_sequence);
 
 	/* Reset connection after receiving version negotiation */
 	int picoquic_reset_cnx_version(picoquic_cnx_t * cnx, uint8_t * bytes, size_t length, uint64_t current_time);
@@ -458,6 +722,7 @@ extern "C" {
 	/* Connection context retrieval functions */
 	picoquic_cnx_t * picoquic_cnx_by_id(picoquic_quic_t * quic, uint64_t cnx_id);
 	picoquic_cnx_t * picoquic_cnx_by_net(picoquic_quic_t * quic, struct sockaddr* addr);
+    picoquic_cnx_t * picoquic_cnx_by_initial_id(picoquic_quic_t * quic, uint64_t initial_cnxid);
 
     /*
      * Reset the pacing data after CWIN is updated
@@ -465,11 +730,31 @@ extern "C" {
 
     void picoquic_update_pacing_data(picoquic_cnx_t * cnx);
 
-    /* Next time is used to order the list of available connections,
-     * so ready connections are polled first */
+    /* Next time is used to order the wake time heap, so the connection
+     * that needs servicing first is found at the root of the heap */
     void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx);
 
+    picoquic_cnx_t * picoquic_get_earliest_cnx_to_wake(picoquic_quic_t * quic);
+
+    /* Called when the application queues work on the connection, so that
+     * it is serviced at the next opportunity */
+    void picoquic_wake_up_cnx(picoquic_cnx_t * cnx);
+
+    /* Command queue setup and cleanup, called when the context is created or deleted */
+    void picoquic_init_command_queue(picoquic_quic_t * quic);
+    void picoquic_free_command_queue(picoquic_quic_t * quic);
+
+    /* Posted stream data that was deferred, retried when the stream becomes writable */
+    void picoquic_flush_deferred_commands(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+    void picoquic_free_deferred_commands(picoquic_stream_head * stream);
+
+    /* Allocation of stream contexts from the per context pool */
+    picoquic_stream_head * picoquic_alloc_stream(picoquic_quic_t * quic);
+    void picoquic_release_stream(picoquic_quic_t * quic, picoquic_stream_head * stream);
+
     void picoquic_cnx_set_next_wake_time(picoquic_cnx_t * cnx, uint64_t current_time);
+    int picoquic_should_send_max_data(picoquic_cnx_t * cnx);
+    int picoquic_receive_budget_level(picoquic_cnx_t * cnx);
 
 	/* Integer parsing macros */
 #define PICOPARSE_16(b) ((((uint16_t)(b)[0])<<8)|(b)[1])
@@ -546,17 +831,34 @@ extern "C" {
      */
     int picoquic_check_sack_list(picoquic_sack_item_t * sack,
         uint64_t pn64_min, uint64_t pn64_max);
+    void picoquic_clear_sack_list(picoquic_sack_item_t * first_sack);
+
+    picoquic_sack_range_t * picoquic_sack_get_range(picoquic_sack_tracker_t * tracker, size_t rank);
 
     /*
      * Process ack of ack
      */
     int picoquic_process_ack_of_ack_frame(
-        picoquic_sack_item_t * first_sack,
+        picoquic_sack_tracker_t * tracker,
         uint8_t * bytes, size_t bytes_max, size_t * consumed);
 
+    /* Reassembly of out of order stream data */
+    int picoquic_reassembly_insert(picoquic_reassembly_t * r, uint64_t start_offset,
+        uint64_t offset, const uint8_t * bytes, size_t length);
+    size_t picoquic_reassembly_contiguous(picoquic_reassembly_t * r, uint64_t start_offset, uint8_t ** bytes);
+    void picoquic_reassembly_consume(picoquic_reassembly_t * r, uint64_t start_offset, size_t length);
+    void picoquic_reassembly_clear(picoquic_reassembly_t * r);
+    size_t picoquic_reassembly_memory(picoquic_reassembly_t * r);
+
 	/* stream management */
     picoquic_stream_head * picoquic_create_stream(picoquic_cnx_t * cnx, uint64_t stream_id);
+    void picoquic_clear_stream_index(picoquic_cnx_t * cnx);
+    int picoquic_is_stream_closed(picoquic_cnx_t * cnx, uint64_t stream_id);
+    void picoquic_delete_stream_if_closed(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
     void picoquic_update_stream_initial_remote(picoquic_cnx_t * cnx);
+    void picoquic_update_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+    void picoquic_clear_ready_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+    void picoquic_unblock_streams(picoquic_cnx_t * cnx);
 	picoquic_stream_head * picoquic_find_stream(picoquic_cnx_t * cnx, uint64_t stream_id, int create);
 	picoquic_stream_head * picoquic_find_ready_stream(picoquic_cnx_t * cnx, int restricted);
 	int picoquic_stream_network_input(picoquic_cnx_t * cnx, uint64_t stream_id,
@@ -565,16 +867,29 @@ extern "C" {
 		size_t bytes_max, int restricted, size_t * consumed, uint64_t current_time);
 	int picoquic_prepare_stream_frame(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
+    int picoquic_prepare_stream_frames(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+        int stream_restricted, uint8_t * bytes, size_t bytes_max, size_t * consumed);
+    void picoquic_dequeue_send_data(picoquic_stream_head * stream);
+    void picoquic_notify_writable_streams(picoquic_cnx_t * cnx, picoquic_stream_head * stream);
+    void picoquic_clear_send_queue(picoquic_stream_head * stream);
+    int picoquic_queue_lost_stream_data(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+        uint64_t offset, const uint8_t * bytes, size_t length, int fin);
 	int picoquic_prepare_ack_frame(picoquic_cnx_t * cnx, uint64_t current_time,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
+	int picoquic_decode_ack_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
+		size_t bytes_max, size_t * consumed, uint64_t current_time);
+    size_t picoquic_process_ack_range(picoquic_cnx_t * cnx, uint64_t highest, uint64_t range,
+        picoquic_packet ** p_next, uint64_t current_time);
 	int picoquic_prepare_connection_close_frame(picoquic_cnx_t * cnx,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
         int picoquic_prepare_application_close_frame(picoquic_cnx_t * cnx,
                 uint8_t * bytes, size_t bytes_max, size_t * consumed);
-	int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx,
+	int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t * cnx, uint64_t current_time,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
 	int picoquic_prepare_max_data_frame(picoquic_cnx_t * cnx, uint64_t maxdata_increase,
 		uint8_t * bytes, size_t bytes_max, size_t * consumed);
+    int picoquic_prepare_required_max_data_frame(picoquic_cnx_t * cnx, uint64_t current_time,
+        uint8_t * bytes, size_t bytes_max, size_t * consumed);
     void picoquic_clear_stream(picoquic_stream_head * stream);
 
     int picoquic_prepare_misc_frame(picoquic_cnx_t * cnx, uint8_t * bytes,
@@ -585,6 +900,15 @@ extern "C" {
 	int picoquic_decode_frames(picoquic_cnx_t * cnx, uint8_t * bytes,
 		size_t bytes_max, int restricted, uint64_t current_time);
 
+	size_t picoquic_create_packet_header(picoquic_cnx_t * cnx, picoquic_packet_type_enum packet_type,
+		uint64_t cnx_id, uint64_t sequence_number, uint8_t * bytes);
+
+	void picoquic_queue_for_retransmit(picoquic_cnx_t * cnx, picoquic_packet * packet,
+		size_t header_length, size_t length, uint64_t current_time);
+
+	int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
+		picoquic_packet * packet, int * is_cleartext_mode, size_t * header_length);
+
 	int picoquic_skip_frame(uint8_t * bytes, size_t bytes_max, size_t * consumed, 
         int * pure_ack);
 
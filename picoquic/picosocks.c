@@ -21,6 +21,9 @@
 
 #include "util.h"
 #include "picosocks.h"
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
 static int bind_to_port(SOCKET_TYPE fd, int af, int port)
 {
@@ -49,7 +52,7 @@ static int bind_to_port(SOCKET_TYPE fd, int af, int port)
     return bind(fd, (struct sockaddr *) &sa, addr_length);
 }
 
-int picoquic_open_server_sockets(picoquic_server_sockets_t * sockets, int port)
+static int picoquic_open_server_sockets_opt(picoquic_server_sockets_t * sockets, int port, int reuse_port)
 {
     int ret = 0;
     const int sock_af[] = { AF_INET6, AF_INET };
@@ -97,6 +100,16 @@ int picoquic_open_server_sockets(picoquic_server_sockets_t * sockets, int port)
                 ret = setsockopt(sockets->s_socket[i], IPPROTO_IP, IP_PKTINFO, (char*)&val, sizeof(int));
             }
 #endif
+            if (ret == 0 && reuse_port)
+            {
+#ifdef SO_REUSEPORT
+                int val = 1;
+                ret = setsockopt(sockets->s_socket[i], SOL_SOCKET, SO_REUSEPORT, (char*)&val, sizeof(int));
+#else
+                ret = -1;
+#endif
+            }
+
             if (ret == 0)
             {
                 ret = bind_to_port(sockets->s_socket[i], sock_af[i], port);
@@ -107,6 +120,58 @@ int picoquic_open_server_sockets(picoquic_server_sockets_t * sockets, int port)
     return ret;
 }
 
+int picoquic_open_server_sockets(picoquic_server_sockets_t * sockets, int port)
+{
+    return picoquic_open_server_sockets_opt(sockets, port, 0);
+}
+
+int picoquic_open_shard_server_sockets(picoquic_server_sockets_t * sockets, int port)
+{
+    return picoquic_open_server_sockets_opt(sockets, port, 1);
+}
+
+/*
+ * Attach a classic BPF program to the reuse port groups of the sockets, so that
+ * the kernel delivers each packet to the socket whose rank in the group matches
+ * the shard encoded in the first byte of the connection ID. The connection ID
+ * starts at offset 1 of the UDP payload in long headers and in short headers
+ * that carry it. Packets without connection ID get an invalid index, and the
+ * kernel then falls back to its default hash.
+ */
+int picoquic_attach_shard_steering(picoquic_server_sockets_t * sockets, uint32_t nb_shards)
+{
+    int ret = -1;
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x40, 3, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nb_shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF)
+    };
+    struct sock_fprog prog;
+
+    prog.len = (unsigned short)(sizeof(code) / sizeof(code[0]));
+    prog.filter = code;
+
+    if (nb_shards > 0)
+    {
+        ret = 0;
+        for (int i = 0; ret == 0 && i < PICOQUIC_NB_SERVER_SOCKETS; i++)
+        {
+            ret = setsockopt(sockets->s_socket[i], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+        }
+    }
+#else
+    (void)sockets;
+    (void)nb_shards;
+#endif
+
+    return ret;
+}
+
 void picoquic_close_server_sockets(picoquic_server_sockets_t * sockets)
 {
     for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++)
@@ -518,7 +583,7 @@ int picoquic_sendmsg(SOCKET_TYPE fd,
 }
 #endif
 
-int picoquic_select(SOCKET_TYPE * sockets, 
+int picoquic_select_ex(SOCKET_TYPE * sockets, 
 	int nb_sockets,
     struct sockaddr_storage * addr_from,
     socklen_t * from_length,
@@ -527,7 +592,8 @@ int picoquic_select(SOCKET_TYPE * sockets,
 	unsigned long * dest_if,
     uint8_t * buffer, int buffer_max,
     int64_t delta_t,
-    uint64_t * current_time)
+    uint64_t * current_time,
+    int * socket_rank)
 {
     fd_set   readfds;
     struct timeval tv;
@@ -584,6 +650,11 @@ int picoquic_select(SOCKET_TYPE * sockets,
                 bytes_recv = picoquic_recvmsg(sockets[i], addr_from, from_length, 
 				addr_dest, dest_length, dest_if, 
 				buffer, buffer_max);
+
+                if (socket_rank != NULL)
+                {
+                    *socket_rank = i;
+                }
 				// bytes_recv = recvfrom(socket[i], buffer, buffer_max, 0, addr_from, from_length);
 
                 if (bytes_recv <= 0)
@@ -615,6 +686,21 @@ int picoquic_select(SOCKET_TYPE * sockets,
     return bytes_recv;
 }
 
+int picoquic_select(SOCKET_TYPE * sockets, 
+	int nb_sockets,
+    struct sockaddr_storage * addr_from,
+    socklen_t * from_length,
+    struct sockaddr_storage * addr_dest,
+    socklen_t * dest_length,
+	unsigned long * dest_if,
+    uint8_t * buffer, int buffer_max,
+    int64_t delta_t,
+    uint64_t * current_time)
+{
+    return picoquic_select_ex(sockets, nb_sockets, addr_from, from_length,
+        addr_dest, dest_length, dest_if, buffer, buffer_max, delta_t, current_time, NULL);
+}
+
 int picoquic_send_through_server_sockets(
     picoquic_server_sockets_t * sockets,
     struct sockaddr * addr_dest, socklen_t dest_length,
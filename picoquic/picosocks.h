@@ -109,6 +109,13 @@ typedef struct st_picoquic_server_sockets_t {
 
 int picoquic_open_server_sockets(picoquic_server_sockets_t * sockets, int port);
 
+/* Sharded servers open one set of sockets per worker, all bound to the same port
+ * with SO_REUSEPORT. The steering program can be attached to the sockets of any
+ * worker once all of them are bound, and fails if not supported by the system. */
+int picoquic_open_shard_server_sockets(picoquic_server_sockets_t * sockets, int port);
+
+int picoquic_attach_shard_steering(picoquic_server_sockets_t * sockets, uint32_t nb_shards);
+
 void picoquic_close_server_sockets(picoquic_server_sockets_t * sockets);
 
 uint64_t picoquic_current_time();
@@ -123,6 +130,17 @@ int picoquic_select(SOCKET_TYPE * sockets, int nb_sockets,
     int64_t delta_t,
     uint64_t * current_time);
 
+int picoquic_select_ex(SOCKET_TYPE * sockets, int nb_sockets,
+    struct sockaddr_storage * addr_from,
+    socklen_t * from_length,
+    struct sockaddr_storage * addr_dest,
+    socklen_t * dest_length,
+    unsigned long * dest_if,
+    uint8_t * buffer, int buffer_max,
+    int64_t delta_t,
+    uint64_t * current_time,
+    int * socket_rank);
+
 int picoquic_send_through_server_sockets(
     picoquic_server_sockets_t * sockets,
     struct sockaddr * addr_dest, socklen_t addr_length,
@@ -20,6 +20,7 @@
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include "picoquic_internal.h"
 #include "tls_api.h"
@@ -31,6 +32,23 @@ extern picoquic_congestion_algorithm_t * picoquic_newreno_algorithm;
 
 #define PICOQUIC_DEFAULT_CONGESTION_ALGORITHM picoquic_newreno_algorithm;
 
+/*
+ * Connection contexts are allocated by slabs, and recycled through a free list.
+ * The slabs are only released when the QUIC context is deleted. Each slab holds
+ * a parallel array of cold parts, so the per packet fields of the connections
+ * are not interleaved with handshake data.
+ */
+#define PICOQUIC_CNX_SLAB_SIZE 16
+#define PICOQUIC_MAX_FREE_STREAMS 1024
+
+typedef struct st_picoquic_cnx_slab_t
+{
+    struct st_picoquic_cnx_slab_t * next_slab;
+    size_t nb_cnx;
+    picoquic_cnx_t * cnx_array;
+    picoquic_cnx_cold_t * cold_array;
+} picoquic_cnx_slab_t;
+
 /*
 * Structures used in the hash table of connections
 */
@@ -136,6 +154,7 @@ picoquic_quic_t * picoquic_create(uint32_t nb_connections,
         /* TODO: winsock init */
         /* TODO: open UDP sockets - maybe */
         memset(quic, 0, sizeof(picoquic_quic_t));
+        picoquic_init_command_queue(quic);
 
 		quic->default_callback_fn = default_callback_fn;
 		quic->default_callback_ctx = default_callback_ctx;
@@ -144,6 +163,11 @@ picoquic_quic_t * picoquic_create(uint32_t nb_connections,
 		quic->cnx_id_callback_fn = cnx_id_callback;
 		quic->cnx_id_callback_ctx = cnx_id_callback_ctx;
         quic->p_simulated_time = p_simulated_time;
+        quic->packet_pool_stats.max_free = PICOQUIC_DEFAULT_PACKET_POOL_SIZE;
+        quic->max_connection_window = PICOQUIC_DEFAULT_MAX_CONNECTION_WINDOW;
+        quic->max_stream_window = PICOQUIC_DEFAULT_MAX_STREAM_WINDOW;
+        quic->cnx_receive_budget = PICOQUIC_DEFAULT_CNX_RECEIVE_BUDGET;
+        quic->receive_budget = PICOQUIC_DEFAULT_RECEIVE_BUDGET;
 
 		if (cnx_id_callback != NULL)
 		{
@@ -166,8 +190,12 @@ picoquic_quic_t * picoquic_create(uint32_t nb_connections,
         quic->table_cnx_by_net = picohash_create(nb_connections * 4,
             picoquic_net_id_hash, picoquic_net_id_compare);
 
+        quic->table_cnx_by_initial_id = picohash_create(nb_connections * 4,
+            picoquic_cnx_id_hash, picoquic_cnx_id_compare);
+
         if (quic->table_cnx_by_id == NULL ||
             quic->table_cnx_by_net == NULL ||
+            quic->table_cnx_by_initial_id == NULL ||
             picoquic_master_tlscontext(quic, cert_file_name, key_file_name,
                 ticket_encryption_key, ticket_encryption_key_length) != 0)
         {
@@ -215,6 +243,9 @@ void picoquic_free(picoquic_quic_t * quic)
         /* delete the stored tickets */
         picoquic_free_tickets(&quic->p_first_ticket);
 
+        /* delete the commands that were not processed, and close the wakeup */
+        picoquic_free_command_queue(quic);
+
 		/* delete all pending packets */
 		while (quic->pending_stateless_packet != NULL)
 		{
@@ -239,6 +270,46 @@ void picoquic_free(picoquic_quic_t * quic)
             picohash_delete(quic->table_cnx_by_net, 1);
         }
 
+        if (quic->table_cnx_by_initial_id != NULL)
+        {
+            picohash_delete(quic->table_cnx_by_initial_id, 1);
+        }
+
+        if (quic->wake_heap != NULL)
+        {
+            free(quic->wake_heap);
+            quic->wake_heap = NULL;
+        }
+
+        /* Release the pools */
+        while (quic->cnx_slab_list != NULL)
+        {
+            picoquic_cnx_slab_t * slab = quic->cnx_slab_list;
+            quic->cnx_slab_list = slab->next_slab;
+            free(slab->cnx_array);
+            free(slab->cold_array);
+            free(slab);
+        }
+        quic->cnx_free_list = NULL;
+        quic->nb_cnx_free = 0;
+        quic->nb_cnx_allocated = 0;
+
+        while (quic->stream_free_list != NULL)
+        {
+            picoquic_stream_head * stream = quic->stream_free_list;
+            quic->stream_free_list = stream->next_stream;
+            free(stream);
+        }
+        quic->nb_stream_free = 0;
+
+        while (quic->packet_free_list != NULL)
+        {
+            picoquic_packet * packet = quic->packet_free_list;
+            quic->packet_free_list = packet->next_packet;
+            free(packet);
+        }
+        quic->packet_pool_stats.nb_free = 0;
+
         /* Delete the picotls context */
         if (quic->tls_master_ctx != NULL)
         {
@@ -263,6 +334,198 @@ void picoquic_set_cookie_mode(picoquic_quic_t * quic, int cookie_mode)
     }
 }
 
+/*
+ * Connection and stream pools
+ */
+static int picoquic_add_cnx_slab(picoquic_quic_t * quic, size_t nb_cnx)
+{
+    int ret = 0;
+    picoquic_cnx_slab_t * slab = (picoquic_cnx_slab_t *)malloc(sizeof(picoquic_cnx_slab_t));
+
+    if (slab == NULL)
+    {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else
+    {
+        slab->cnx_array = (picoquic_cnx_t *)malloc(nb_cnx * sizeof(picoquic_cnx_t));
+        slab->cold_array = (picoquic_cnx_cold_t *)malloc(nb_cnx * sizeof(picoquic_cnx_cold_t));
+
+        if (slab->cnx_array == NULL || slab->cold_array == NULL)
+        {
+            free(slab->cnx_array);
+            free(slab->cold_array);
+            free(slab);
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else
+        {
+            slab->nb_cnx = nb_cnx;
+            slab->next_slab = quic->cnx_slab_list;
+            quic->cnx_slab_list = slab;
+
+            for (size_t i = 0; i < nb_cnx; i++)
+            {
+                slab->cnx_array[i].cold = &slab->cold_array[i];
+                slab->cnx_array[i].next_in_table = quic->cnx_free_list;
+                quic->cnx_free_list = &slab->cnx_array[i];
+            }
+
+            quic->nb_cnx_free += nb_cnx;
+            quic->nb_cnx_allocated += nb_cnx;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_preallocate_cnx(picoquic_quic_t * quic, size_t nb_cnx)
+{
+    int ret = 0;
+
+    if (quic->nb_cnx_free < nb_cnx)
+    {
+        ret = picoquic_add_cnx_slab(quic, nb_cnx - quic->nb_cnx_free);
+    }
+
+    return ret;
+}
+
+static picoquic_cnx_t * picoquic_alloc_cnx(picoquic_quic_t * quic)
+{
+    picoquic_cnx_t * cnx = NULL;
+
+    if (quic->cnx_free_list != NULL ||
+        picoquic_add_cnx_slab(quic, PICOQUIC_CNX_SLAB_SIZE) == 0)
+    {
+        cnx = quic->cnx_free_list;
+        quic->cnx_free_list = cnx->next_in_table;
+        quic->nb_cnx_free--;
+    }
+
+    return cnx;
+}
+
+static void picoquic_release_cnx(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    /* Marks the context as free, so stale commands are not executed */
+    cnx->quic = NULL;
+    cnx->next_in_table = quic->cnx_free_list;
+    quic->cnx_free_list = cnx;
+    quic->nb_cnx_free++;
+}
+
+picoquic_stream_head * picoquic_alloc_stream(picoquic_quic_t * quic)
+{
+    picoquic_stream_head * stream = quic->stream_free_list;
+
+    if (stream != NULL)
+    {
+        quic->stream_free_list = stream->next_stream;
+        quic->nb_stream_free--;
+    }
+    else
+    {
+        stream = (picoquic_stream_head *)malloc(sizeof(picoquic_stream_head));
+    }
+
+    return stream;
+}
+
+void picoquic_release_stream(picoquic_quic_t * quic, picoquic_stream_head * stream)
+{
+    if (quic->nb_stream_free < PICOQUIC_MAX_FREE_STREAMS)
+    {
+        stream->next_stream = quic->stream_free_list;
+        quic->stream_free_list = stream;
+        quic->nb_stream_free++;
+    }
+    else
+    {
+        free(stream);
+    }
+}
+
+picoquic_packet * picoquic_alloc_packet(picoquic_quic_t * quic)
+{
+    picoquic_packet * packet = quic->packet_free_list;
+
+    quic->packet_pool_stats.nb_alloc++;
+
+    if (packet != NULL)
+    {
+        quic->packet_free_list = packet->next_packet;
+        quic->packet_pool_stats.nb_free--;
+        quic->packet_pool_stats.nb_alloc_from_pool++;
+    }
+    else
+    {
+        packet = (picoquic_packet *)malloc(sizeof(picoquic_packet));
+    }
+
+    if (packet != NULL)
+    {
+        /* The content is overwritten when the packet is prepared, only reset the header */
+        memset(packet, 0, offsetof(picoquic_packet, bytes));
+    }
+
+    return packet;
+}
+
+void picoquic_recycle_packet(picoquic_quic_t * quic, picoquic_packet * packet)
+{
+    quic->packet_pool_stats.nb_recycled++;
+
+    if (quic->packet_pool_stats.nb_free < quic->packet_pool_stats.max_free)
+    {
+        packet->next_packet = quic->packet_free_list;
+        quic->packet_free_list = packet;
+        quic->packet_pool_stats.nb_free++;
+    }
+    else
+    {
+        quic->packet_pool_stats.nb_released++;
+        free(packet);
+    }
+}
+
+void picoquic_set_packet_pool_size(picoquic_quic_t * quic, size_t max_free)
+{
+    quic->packet_pool_stats.max_free = max_free;
+
+    while (quic->packet_pool_stats.nb_free > max_free)
+    {
+        picoquic_packet * packet = quic->packet_free_list;
+        quic->packet_free_list = packet->next_packet;
+        quic->packet_pool_stats.nb_free--;
+        quic->packet_pool_stats.nb_released++;
+        free(packet);
+    }
+}
+
+void picoquic_get_packet_pool_stats(picoquic_quic_t * quic, picoquic_packet_pool_stats_t * stats)
+{
+    *stats = quic->packet_pool_stats;
+}
+
+void picoquic_set_max_receive_windows(picoquic_quic_t * quic,
+    uint64_t max_connection_window, uint64_t max_stream_window)
+{
+    quic->max_connection_window = max_connection_window;
+    quic->max_stream_window = max_stream_window;
+}
+
+void picoquic_set_receive_budget(picoquic_quic_t * quic, uint64_t cnx_budget, uint64_t context_budget)
+{
+    quic->cnx_receive_budget = cnx_budget;
+    quic->receive_budget = context_budget;
+}
+
+uint64_t picoquic_get_receive_buffered_bytes(picoquic_quic_t * quic)
+{
+    return quic->receive_buffered;
+}
+
 picoquic_stateless_packet_t * picoquic_create_stateless_packet(picoquic_quic_t * quic)
 {
 	return (picoquic_stateless_packet_t *)malloc(sizeof(picoquic_stateless_packet_t));
@@ -334,6 +597,55 @@ int picoquic_register_cnx_id(picoquic_quic_t * quic, picoquic_cnx_t * cnx, uint6
         }
     }
 
+    if (key != NULL && ret != 0)
+    {
+        free(key);
+    }
+
+    return ret;
+}
+
+/* The initial connection ID designates the connection in the commands posted by
+ * application threads. If two connections share an initial ID, only the first one
+ * is registered. */
+static int picoquic_register_initial_id(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    int ret = 0;
+    picohash_item * item;
+    picoquic_cnx_id * key = (picoquic_cnx_id *)malloc(sizeof(picoquic_cnx_id));
+
+    if (key == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        key->cnx_id = cnx->initial_cnxid;
+        key->cnx = cnx;
+        key->next_cnx_id = NULL;
+
+        item = picohash_retrieve(quic->table_cnx_by_initial_id, key);
+
+        if (item != NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            ret = picohash_insert(quic->table_cnx_by_initial_id, key);
+
+            if (ret == 0)
+            {
+                cnx->initial_id_key = key;
+            }
+        }
+    }
+
+    if (key != NULL && ret != 0)
+    {
+        free(key);
+    }
+
     return ret;
 }
 
@@ -407,44 +719,152 @@ void picoquic_init_transport_parameters(picoquic_transport_parameters * tp, int
     tp->ack_delay_exponent = 3;
 }
 
-static void picoquic_insert_cnx_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+/*
+ * Connections are kept in two structures. The list "cnx_list" keeps them
+ * in creation order, for iteration. The wake time heap is a binary min-heap
+ * keyed on next_wake_time, in which each connection remembers its own
+ * position. Updating the wake time of a connection only moves it up or down
+ * the heap, so the cost is O(log n) instead of a walk through all connections.
+ */
+
+static void picoquic_wake_heap_set(picoquic_quic_t * quic, size_t index, picoquic_cnx_t * cnx)
 {
-    picoquic_cnx_t * cnx_next = quic->cnx_list;
-    picoquic_cnx_t * previous = NULL;
-    while (cnx_next != NULL &&
-        cnx_next->next_wake_time <= cnx->next_wake_time)
+    quic->wake_heap[index] = cnx;
+    cnx->wake_heap_index = index;
+}
+
+static void picoquic_wake_heap_sift_up(picoquic_quic_t * quic, size_t index)
+{
+    picoquic_cnx_t * cnx = quic->wake_heap[index];
+
+    while (index > 0)
     {
-        previous = cnx_next;
-        cnx_next = cnx_next->next_in_table;
+        size_t parent = (index - 1) / 2;
+
+        if (quic->wake_heap[parent]->next_wake_time <= cnx->next_wake_time)
+        {
+            break;
+        }
+
+        picoquic_wake_heap_set(quic, index, quic->wake_heap[parent]);
+        index = parent;
     }
 
-    cnx->previous_in_table = previous;
-    if (previous == NULL)
+    picoquic_wake_heap_set(quic, index, cnx);
+}
+
+static void picoquic_wake_heap_sift_down(picoquic_quic_t * quic, size_t index)
+{
+    picoquic_cnx_t * cnx = quic->wake_heap[index];
+
+    for (;;)
     {
-        quic->cnx_list = cnx;
+        size_t child = 2 * index + 1;
+
+        if (child >= quic->wake_heap_count)
+        {
+            break;
+        }
+
+        if (child + 1 < quic->wake_heap_count &&
+            quic->wake_heap[child + 1]->next_wake_time < quic->wake_heap[child]->next_wake_time)
+        {
+            child++;
+        }
+
+        if (cnx->next_wake_time <= quic->wake_heap[child]->next_wake_time)
+        {
+            break;
+        }
+
+        picoquic_wake_heap_set(quic, index, quic->wake_heap[child]);
+        index = child;
     }
-    else
+
+    picoquic_wake_heap_set(quic, index, cnx);
+}
+
+static int picoquic_wake_heap_insert(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    int ret = 0;
+
+    if (quic->wake_heap_count >= quic->wake_heap_size)
+    {
+        size_t new_size = (quic->wake_heap_size == 0) ? 16 : 2 * quic->wake_heap_size;
+        picoquic_cnx_t ** new_heap = (picoquic_cnx_t **)realloc(quic->wake_heap,
+            new_size * sizeof(picoquic_cnx_t *));
+
+        if (new_heap == NULL)
+        {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else
+        {
+            quic->wake_heap = new_heap;
+            quic->wake_heap_size = new_size;
+        }
+    }
+
+    if (ret == 0)
     {
-        previous->next_in_table = cnx;
+        picoquic_wake_heap_set(quic, quic->wake_heap_count, cnx);
+        quic->wake_heap_count++;
+        picoquic_wake_heap_sift_up(quic, cnx->wake_heap_index);
     }
 
-    cnx->next_in_table = cnx_next;
+    return ret;
+}
+
+static void picoquic_wake_heap_remove(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    size_t index = cnx->wake_heap_index;
 
-    if (cnx_next == NULL)
+    if (index < quic->wake_heap_count && quic->wake_heap[index] == cnx)
     {
-        quic->cnx_last = cnx;
+        quic->wake_heap_count--;
+
+        if (index < quic->wake_heap_count)
+        {
+            picoquic_wake_heap_set(quic, index, quic->wake_heap[quic->wake_heap_count]);
+            picoquic_reinsert_by_wake_time(quic, quic->wake_heap[index]);
+        }
     }
-    else
+}
+
+static int picoquic_insert_cnx_in_list(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    int ret = picoquic_wake_heap_insert(quic, cnx);
+
+    if (ret == 0)
     {
-        cnx_next->previous_in_table = cnx;
+        cnx->next_in_table = NULL;
+        cnx->previous_in_table = quic->cnx_last;
+
+        if (quic->cnx_last == NULL)
+        {
+            quic->cnx_list = cnx;
+        }
+        else
+        {
+            quic->cnx_last->next_in_table = cnx;
+        }
+
+        quic->cnx_last = cnx;
     }
+
+    return ret;
 }
 
-void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+static void picoquic_remove_cnx_from_list(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
 {
+    picoquic_wake_heap_remove(quic, cnx);
+
     if (cnx->next_in_table == NULL)
     {
-        quic->cnx_last = cnx->previous_in_table;
+        if (quic->cnx_last == cnx)
+        {
+            quic->cnx_last = cnx->previous_in_table;
+        }
     }
     else
     {
@@ -453,14 +873,69 @@ void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx
 
     if (cnx->previous_in_table == NULL)
     {
-        quic->cnx_list = cnx->next_in_table;
+        if (quic->cnx_list == cnx)
+        {
+            quic->cnx_list = cnx->next_in_table;
+        }
     }
     else
     {
         cnx->previous_in_table->next_in_table = cnx->next_in_table;
     }
 
-    picoquic_insert_cnx_by_wake_time(quic, cnx);
+    cnx->next_in_table = NULL;
+    cnx->previous_in_table = NULL;
+}
+
+void picoquic_reinsert_by_wake_time(picoquic_quic_t * quic, picoquic_cnx_t * cnx)
+{
+    size_t index = cnx->wake_heap_index;
+
+    if (index < quic->wake_heap_count && quic->wake_heap[index] == cnx)
+    {
+        if (index > 0 &&
+            quic->wake_heap[(index - 1) / 2]->next_wake_time > cnx->next_wake_time)
+        {
+            picoquic_wake_heap_sift_up(quic, index);
+        }
+        else
+        {
+            picoquic_wake_heap_sift_down(quic, index);
+        }
+    }
+}
+
+picoquic_cnx_t * picoquic_get_earliest_cnx_to_wake(picoquic_quic_t * quic)
+{
+    return (quic->wake_heap_count > 0) ? quic->wake_heap[0] : NULL;
+}
+
+/*
+ * The wake time is recomputed each time a packet is received or prepared.
+ * Work queued by the application in between, such as new stream data or a
+ * close request, makes the connection ready immediately. This is not done
+ * in the closing states, in which the wake time schedules the repeats of
+ * the closing frames.
+ */
+void picoquic_wake_up_cnx(picoquic_cnx_t * cnx)
+{
+    if (cnx->cnx_state < picoquic_state_closing_received && cnx->next_wake_time > 0)
+    {
+        cnx->next_wake_time = 0;
+        picoquic_reinsert_by_wake_time(cnx->quic, cnx);
+    }
+}
+
+picoquic_cnx_t * picoquic_get_next_ready_cnx(picoquic_quic_t * quic, uint64_t current_time)
+{
+    picoquic_cnx_t * cnx = picoquic_get_earliest_cnx_to_wake(quic);
+
+    if (cnx != NULL && cnx->next_wake_time > current_time)
+    {
+        cnx = NULL;
+    }
+
+    return cnx;
 }
 
 
@@ -484,18 +959,26 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
     uint64_t cnx_id, struct sockaddr * addr, uint64_t start_time, uint32_t preferred_version,
 	char const * sni, char const * alpn)
 {
-    picoquic_cnx_t * cnx = (picoquic_cnx_t *)malloc(sizeof(picoquic_cnx_t));
+    picoquic_cnx_t * cnx = picoquic_alloc_cnx(quic);
     uint32_t random_sequence;
 
     if (cnx != NULL)
     {
+        picoquic_cnx_cold_t * cold = cnx->cold;
+
         memset(cnx, 0, sizeof(picoquic_cnx_t));
+        memset(cold, 0, sizeof(picoquic_cnx_cold_t));
+        cnx->cold = cold;
 
         cnx->next_wake_time = start_time;
         cnx->start_time = start_time;
 
         cnx->quic = quic;
-        picoquic_insert_cnx_by_wake_time(quic, cnx);
+        if (picoquic_insert_cnx_in_list(quic, cnx) != 0)
+        {
+            picoquic_release_cnx(quic, cnx);
+            cnx = NULL;
+        }
     }
 
     if (cnx != NULL)
@@ -515,6 +998,7 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 		/* Initialize local flow control variables to advertised values */
         
         cnx->maxdata_local = ((uint64_t)cnx->local_parameters.initial_max_data);
+        cnx->maxdata_window = cnx->maxdata_local;
 		cnx->max_stream_id_bidir_local = cnx->local_parameters.initial_max_stream_id_bidir;
         cnx->max_stream_id_unidir_local = cnx->local_parameters.initial_max_stream_id_unidir;
 
@@ -528,12 +1012,12 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 
 		if (sni != NULL)
 		{
-			cnx->sni = picoquic_string_duplicate(sni);
+			cnx->cold->sni = picoquic_string_duplicate(sni);
 		}
 
 		if (alpn != NULL)
 		{
-			cnx->alpn = picoquic_string_duplicate(alpn);
+			cnx->cold->alpn = picoquic_string_duplicate(alpn);
 		}
 
 		cnx->callback_fn = quic->default_callback_fn;
@@ -585,11 +1069,12 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 			 * will prevent spurious matches to an all zero value, for example.
 			 * The real value will be set when receiving the transport parameters. 
 			 */
-            picoquic_public_random(cnx->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
+            picoquic_public_random(quic, cnx->cold->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
 		}
         else
         {
             cnx->first_stream.send_queue = NULL;
+            cnx->first_stream.send_queue_last = NULL;
             cnx->cnx_state = picoquic_state_server_init;
             cnx->initial_cnxid = cnx_id;
 			picoquic_crypto_random(quic, &cnx->server_cnxid, sizeof(uint64_t));
@@ -599,7 +1084,7 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 						quic->cnx_id_callback_ctx);
 
 			(void)picoquic_create_cnxid_reset_secret(quic, cnx->server_cnxid,
-				cnx->reset_secret);
+				cnx->cold->reset_secret);
 
             cnx->version_index = picoquic_get_version_index(preferred_version);
             if (cnx->version_index < 0)
@@ -616,10 +1101,8 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 
 		if (cnx != NULL)
 		{
-			cnx->first_sack_item.start_of_sack_range = 0;
-			cnx->first_sack_item.end_of_sack_range = 0;
-			cnx->first_sack_item.next_sack = NULL;
-			cnx->sack_block_size_max = 0;
+			memset(&cnx->sack_tracker, 0, sizeof(picoquic_sack_tracker_t));
+			cnx->cold->sack_block_size_max = 0;
 			cnx->highest_ack_sent = 0;
 			cnx->highest_ack_time = start_time;
             cnx->time_stamp_largest_received = start_time;
@@ -629,6 +1112,7 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 			cnx->first_stream.stream_flags = 0;
 			cnx->first_stream.fin_offset = 0;
 			cnx->first_stream.next_stream = NULL;
+			cnx->first_stream.previous_stream = NULL;
 			cnx->first_stream.stream_data = NULL;
 			cnx->first_stream.sent_offset = 0;
 			cnx->first_stream.local_error = 0;
@@ -638,7 +1122,7 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 
 			cnx->aead_decrypt_ctx = NULL;
 			cnx->aead_encrypt_ctx = NULL;
-            cnx->aead_de_encrypt_ctx = NULL;
+            cnx->cold->aead_de_encrypt_ctx = NULL;
 
             /* Set the initial sequence randomly between 1 and 2^31 - 1 
              * The spec does not require avoiding the value 0, but doing
@@ -646,7 +1130,7 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
              */
             do
             {
-                random_sequence = (uint32_t)(0x7FFFFFFF & picoquic_public_random_64());
+                random_sequence = (uint32_t)(0x7FFFFFFF & picoquic_public_random_64(quic));
             } while (random_sequence == 0);
             cnx->send_sequence = random_sequence;
 
@@ -692,7 +1176,11 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 
 	/* Only initialize TLS after all parameters have been set */
 
-	if (picoquic_tlscontext_create(quic, cnx, start_time) != 0)
+	if (cnx == NULL)
+	{
+		/* Could not allocate or register the context */
+	}
+	else if (picoquic_tlscontext_create(quic, cnx, start_time) != 0)
 	{
 		/* Cannot just do partial creation! */
 		picoquic_delete_cnx(cnx);
@@ -713,9 +1201,9 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
 
     if (cnx != NULL)
     {
-        cnx->aead_encrypt_cleartext_ctx = NULL;
-        cnx->aead_decrypt_cleartext_ctx = NULL;
-        cnx->aead_de_encrypt_cleartext_ctx = NULL;
+        cnx->cold->aead_encrypt_cleartext_ctx = NULL;
+        cnx->cold->aead_decrypt_cleartext_ctx = NULL;
+        cnx->cold->aead_de_encrypt_cleartext_ctx = NULL;
 
         if (picoquic_setup_cleartext_aead_contexts(cnx,
             (quic->flags &picoquic_context_server) != 0) != 0)
@@ -733,6 +1221,8 @@ picoquic_cnx_t * picoquic_create_cnx(picoquic_quic_t * quic,
             (void)picoquic_register_cnx_id(quic, cnx, cnx->server_cnxid);
         }
 
+        (void)picoquic_register_initial_id(quic, cnx);
+
         if (addr != NULL)
         {
             (void)picoquic_register_net_id(quic, cnx, addr);
@@ -792,6 +1282,13 @@ uint64_t picoquic_get_cnx_start_time(picoquic_cnx_t * cnx)
     return cnx->start_time;
 }
 
+void picoquic_get_flow_control_stats(picoquic_cnx_t * cnx, picoquic_flow_control_stats_t * stats)
+{
+    *stats = cnx->cold->flow_control_stats;
+    stats->connection_window = cnx->maxdata_window;
+    stats->buffered_bytes = cnx->receive_buffered;
+}
+
 picoquic_state_enum picoquic_get_cnx_state(picoquic_cnx_t * cnx)
 {
 	return cnx->cnx_state;
@@ -813,12 +1310,13 @@ int64_t picoquic_get_next_wake_delay(picoquic_quic_t * quic,
     uint64_t current_time, int64_t delay_max)
 {
     int64_t wake_delay;
+    picoquic_cnx_t * cnx = picoquic_get_earliest_cnx_to_wake(quic);
 
-    if (quic->cnx_list != NULL)
+    if (cnx != NULL)
     {
-        if (quic->cnx_list->next_wake_time > current_time)
+        if (cnx->next_wake_time > current_time)
         {
-            wake_delay = quic->cnx_list->next_wake_time - current_time;
+            wake_delay = cnx->next_wake_time - current_time;
 
             if (wake_delay > delay_max)
             {
@@ -862,6 +1360,7 @@ int picoquic_queue_misc_frame(picoquic_cnx_t * cnx, const uint8_t * bytes, size_
         memcpy(misc_frame + sizeof(picoquic_misc_frame_header_t), bytes, length);
         head->next_misc_frame = cnx->first_misc_frame;
         cnx->first_misc_frame = head;
+        picoquic_wake_up_cnx(cnx);
     }
 
     return ret;
@@ -869,24 +1368,29 @@ int picoquic_queue_misc_frame(picoquic_cnx_t * cnx, const uint8_t * bytes, size_
 
 void picoquic_clear_stream(picoquic_stream_head * stream)
 {
-    picoquic_stream_data ** pdata[2];
-    pdata[0] = &stream->stream_data;
-    pdata[1] = &stream->send_queue;
+    picoquic_stream_data * next;
 
-    for (int i = 0; i < 2; i++)
+    while ((next = stream->stream_data) != NULL)
     {
-        picoquic_stream_data * next; 
+        stream->stream_data = next->next_stream_data;
 
-        while ((next = *pdata[i]) != NULL)
+        if (next->bytes != NULL)
         {
-            *pdata[i] = next->next_stream_data;
-
-            if (next->bytes != NULL)
-            {
-                free(next->bytes);
-            }
-            free(next);
+            free(next->bytes);
         }
+        free(next);
+    }
+
+    picoquic_reassembly_clear(&stream->reassembly);
+    picoquic_clear_send_queue(stream);
+    picoquic_clear_sack_list(&stream->first_sack_item);
+
+    /* Lost data is allocated as a single blob */
+    while (stream->retransmit_queue != NULL)
+    {
+        picoquic_stream_data * next = stream->retransmit_queue->next_stream_data;
+        free(stream->retransmit_queue);
+        stream->retransmit_queue = next;
     }
 }
 
@@ -905,12 +1409,20 @@ void picoquic_enqueue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet *
 	p->next_packet = NULL;
 	cnx->retransmit_oldest = p;
 
+	picoquic_index_retransmit_packet(cnx, p);
+
 	/* Account for bytes in transit, for congestion control */
 	cnx->bytes_in_transit += p->length;
 }
 
 void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p, int should_free)
 {
+	if (cnx->retransmit_index_size > 0 &&
+		cnx->retransmit_index[p->sequence_number & (cnx->retransmit_index_size - 1)] == p)
+	{
+		cnx->retransmit_index[p->sequence_number & (cnx->retransmit_index_size - 1)] = NULL;
+	}
+
 	if (p->previous_packet == NULL)
 	{
 		cnx->retransmit_newest = p->next_packet;
@@ -950,7 +1462,7 @@ void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet *
 
     if (should_free)
     {
-        free(p);
+        picoquic_recycle_packet(cnx->quic, p);
     }
     else
     {
@@ -971,6 +1483,184 @@ void picoquic_dequeue_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet *
     }
 }
 
+/*
+ * The packets in the retransmit queue are indexed by sequence number, so that
+ * ACK processing does not need to walk the queue. The index is a ring buffer
+ * whose size is a power of 2, larger than the span of sequence numbers between
+ * the oldest and the newest packet in the queue. Call after linking the packet.
+ */
+void picoquic_index_retransmit_packet(picoquic_cnx_t * cnx, picoquic_packet * p)
+{
+	uint64_t span = cnx->retransmit_newest->sequence_number - cnx->retransmit_oldest->sequence_number + 1;
+
+	if (span > cnx->retransmit_index_size)
+	{
+		size_t new_size = (cnx->retransmit_index_size > 0) ? cnx->retransmit_index_size : PICOQUIC_RETRANSMIT_INDEX_MIN;
+		picoquic_packet ** new_index = NULL;
+
+		while (new_size < span)
+		{
+			new_size *= 2;
+		}
+
+		new_index = (picoquic_packet **)malloc(new_size * sizeof(picoquic_packet *));
+
+		if (new_index != NULL)
+		{
+			picoquic_packet * next = cnx->retransmit_newest;
+
+			memset(new_index, 0, new_size * sizeof(picoquic_packet *));
+			while (next != NULL)
+			{
+				new_index[next->sequence_number & (new_size - 1)] = next;
+				next = next->next_packet;
+			}
+		}
+		else
+		{
+			/* Without index, the lookups fall back to walking the queue */
+			new_size = 0;
+		}
+
+		if (cnx->retransmit_index != NULL)
+		{
+			free(cnx->retransmit_index);
+		}
+		cnx->retransmit_index = new_index;
+		cnx->retransmit_index_size = new_size;
+	}
+	else
+	{
+		cnx->retransmit_index[p->sequence_number & (cnx->retransmit_index_size - 1)] = p;
+	}
+}
+
+picoquic_packet * picoquic_find_retransmit_packet(picoquic_cnx_t * cnx, uint64_t sequence_number)
+{
+	picoquic_packet * p = NULL;
+
+	if (cnx->retransmit_newest != NULL &&
+		sequence_number <= cnx->retransmit_newest->sequence_number &&
+		sequence_number >= cnx->retransmit_oldest->sequence_number)
+	{
+		if (cnx->retransmit_index_size > 0)
+		{
+			p = cnx->retransmit_index[sequence_number & (cnx->retransmit_index_size - 1)];
+		}
+		else
+		{
+			p = cnx->retransmit_newest;
+			while (p != NULL && p->sequence_number > sequence_number)
+			{
+				p = p->next_packet;
+			}
+		}
+
+		if (p != NULL && p->sequence_number != sequence_number)
+		{
+			p = NULL;
+		}
+	}
+
+	return p;
+}
+
+/*
+ * Packets that only contain ACK frames are not kept in the retransmit queue.
+ * Returns 1 if the packet was recorded, 0 if it should be queued as usual.
+ */
+int picoquic_record_ack_only_packet(picoquic_cnx_t * cnx, picoquic_packet * p, size_t header_length)
+{
+    int ret = 0;
+    int is_pure_ack = 1;
+    int frame_is_pure_ack = 0;
+    size_t byte_index = header_length;
+    size_t frame_length = 0;
+    picoquic_ack_record_t * record = NULL;
+
+    while (ret == 0 && is_pure_ack && byte_index < p->length)
+    {
+        ret = picoquic_skip_frame(&p->bytes[byte_index],
+            p->length - byte_index, &frame_length, &frame_is_pure_ack);
+        is_pure_ack &= frame_is_pure_ack;
+        byte_index += frame_length;
+    }
+
+    if (ret != 0 || !is_pure_ack || p->length <= header_length)
+    {
+        return 0;
+    }
+
+    /* The frames are copied just after the record, in the same allocation */
+    record = (picoquic_ack_record_t *)malloc(sizeof(picoquic_ack_record_t) + p->length - header_length);
+    if (record == NULL)
+    {
+        return 0;
+    }
+
+    record->sequence_number = p->sequence_number;
+    record->send_time = p->send_time;
+    record->frames_length = p->length - header_length;
+    record->frames = ((uint8_t *)record) + sizeof(picoquic_ack_record_t);
+    memcpy(record->frames, &p->bytes[header_length], record->frames_length);
+    record->next_record = cnx->ack_record_newest;
+    cnx->ack_record_newest = record;
+    cnx->nb_ack_records++;
+
+    /* The peer does not acknowledge ACK only packets until it has data to send,
+     * so the number of records is capped by forgetting the oldest one. */
+    if (cnx->nb_ack_records > PICOQUIC_MAX_ACK_RECORDS)
+    {
+        picoquic_ack_record_t * last = record;
+
+        while (last->next_record->next_record != NULL)
+        {
+            last = last->next_record;
+        }
+        free(last->next_record);
+        last->next_record = NULL;
+        cnx->nb_ack_records--;
+    }
+
+    return 1;
+}
+
+picoquic_ack_record_t * picoquic_find_ack_record(picoquic_cnx_t * cnx, uint64_t sequence_number)
+{
+    picoquic_ack_record_t * record = cnx->ack_record_newest;
+
+    while (record != NULL && record->sequence_number > sequence_number)
+    {
+        record = record->next_record;
+    }
+
+    if (record != NULL && record->sequence_number != sequence_number)
+    {
+        record = NULL;
+    }
+
+    return record;
+}
+
+/* Delete the records of all packets numbered up to the highest sequence */
+void picoquic_delete_ack_records(picoquic_cnx_t * cnx, uint64_t highest_sequence)
+{
+    picoquic_ack_record_t ** pp_record = &cnx->ack_record_newest;
+
+    while (*pp_record != NULL && (*pp_record)->sequence_number > highest_sequence)
+    {
+        pp_record = &(*pp_record)->next_record;
+    }
+
+    while (*pp_record != NULL)
+    {
+        picoquic_ack_record_t * record = *pp_record;
+        *pp_record = record->next_record;
+        free(record);
+        cnx->nb_ack_records--;
+    }
+}
+
 /*
 * Reset the version to a new supported value.
 *
@@ -1018,6 +1708,7 @@ int picoquic_reset_cnx_version(picoquic_cnx_t * cnx, uint8_t * bytes, size_t len
 					{
 						picoquic_dequeue_retransmit_packet(cnx, cnx->retransmit_newest, 1);
 					}
+					picoquic_delete_ack_records(cnx, UINT64_MAX);
 
 					/* Reset the streams */
 					picoquic_clear_stream(&cnx->first_stream);
@@ -1036,34 +1727,34 @@ int picoquic_reset_cnx_version(picoquic_cnx_t * cnx, uint8_t * bytes, size_t len
 						ret = picoquic_initialize_stream_zero(cnx);
 					}
 
-                    if (cnx->aead_encrypt_cleartext_ctx != NULL)
+                    if (cnx->cold->aead_encrypt_cleartext_ctx != NULL)
                     {
-                        picoquic_aead_free(cnx->aead_encrypt_cleartext_ctx);
-                        cnx->aead_encrypt_cleartext_ctx = NULL;
+                        picoquic_aead_free(cnx->cold->aead_encrypt_cleartext_ctx);
+                        cnx->cold->aead_encrypt_cleartext_ctx = NULL;
                     }
 
-                    if (cnx->aead_decrypt_cleartext_ctx != NULL)
+                    if (cnx->cold->aead_decrypt_cleartext_ctx != NULL)
                     {
-                        picoquic_aead_free(cnx->aead_decrypt_cleartext_ctx);
-                        cnx->aead_decrypt_cleartext_ctx = NULL;
+                        picoquic_aead_free(cnx->cold->aead_decrypt_cleartext_ctx);
+                        cnx->cold->aead_decrypt_cleartext_ctx = NULL;
                     }
 
-                    if (cnx->aead_de_encrypt_cleartext_ctx != NULL)
+                    if (cnx->cold->aead_de_encrypt_cleartext_ctx != NULL)
                     {
-                        picoquic_aead_free(cnx->aead_de_encrypt_cleartext_ctx);
-                        cnx->aead_de_encrypt_cleartext_ctx = NULL;
+                        picoquic_aead_free(cnx->cold->aead_de_encrypt_cleartext_ctx);
+                        cnx->cold->aead_de_encrypt_cleartext_ctx = NULL;
                     }
 
-                    if (cnx->aead_0rtt_decrypt_ctx != NULL)
+                    if (cnx->cold->aead_0rtt_decrypt_ctx != NULL)
                     {
-                        picoquic_aead_free(cnx->aead_0rtt_decrypt_ctx);
-                        cnx->aead_0rtt_decrypt_ctx = NULL;
+                        picoquic_aead_free(cnx->cold->aead_0rtt_decrypt_ctx);
+                        cnx->cold->aead_0rtt_decrypt_ctx = NULL;
                     }
 
-                    if (cnx->aead_0rtt_encrypt_ctx != NULL)
+                    if (cnx->cold->aead_0rtt_encrypt_ctx != NULL)
                     {
-                        picoquic_aead_free(cnx->aead_0rtt_encrypt_ctx);
-                        cnx->aead_0rtt_encrypt_ctx = NULL;
+                        picoquic_aead_free(cnx->cold->aead_0rtt_encrypt_ctx);
+                        cnx->cold->aead_0rtt_encrypt_ctx = NULL;
                     }
 
                     if (ret == 0)
@@ -1109,16 +1800,16 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
 
     if (cnx != NULL)
     {
-		if (cnx->alpn != NULL)
+		if (cnx->cold->alpn != NULL)
 		{
-			free((void*)cnx->alpn);
-			cnx->alpn = NULL;
+			free((void*)cnx->cold->alpn);
+			cnx->cold->alpn = NULL;
 		}
 
-		if (cnx->sni != NULL)
+		if (cnx->cold->sni != NULL)
 		{
-			free((void*)cnx->sni);
-			cnx->sni = NULL;
+			free((void*)cnx->cold->sni);
+			cnx->cold->sni = NULL;
 		}
 
         while (cnx->first_cnx_id != NULL)
@@ -1135,6 +1826,16 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
             }
         }
 
+        if (cnx->initial_id_key != NULL)
+        {
+            picohash_item * item = picohash_retrieve(cnx->quic->table_cnx_by_initial_id, cnx->initial_id_key);
+            if (item != NULL)
+            {
+                picohash_item_delete(cnx->quic->table_cnx_by_initial_id, item, 1);
+            }
+            cnx->initial_id_key = NULL;
+        }
+
         while (cnx->first_net_id != NULL)
         {
             picohash_item * item;
@@ -1149,40 +1850,24 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
             }
         }
 
-        if (cnx->next_in_table == NULL)
-        {
-            cnx->quic->cnx_last = cnx->previous_in_table;
-        }
-        else
-        {
-            cnx->next_in_table->previous_in_table = cnx->previous_in_table;
-        }
+        picoquic_remove_cnx_from_list(cnx->quic, cnx);
 
-        if (cnx->previous_in_table == NULL)
+        if (cnx->cold->aead_encrypt_cleartext_ctx != NULL)
         {
-            cnx->quic->cnx_list = cnx->next_in_table;
-        }
-        else
-        {
-            cnx->previous_in_table->next_in_table = cnx->next_in_table;
+            picoquic_aead_free(cnx->cold->aead_encrypt_cleartext_ctx);
+            cnx->cold->aead_encrypt_cleartext_ctx = NULL;
         }
 
-        if (cnx->aead_encrypt_cleartext_ctx != NULL)
+        if (cnx->cold->aead_decrypt_cleartext_ctx != NULL)
         {
-            picoquic_aead_free(cnx->aead_encrypt_cleartext_ctx);
-            cnx->aead_encrypt_cleartext_ctx = NULL;
+            picoquic_aead_free(cnx->cold->aead_decrypt_cleartext_ctx);
+            cnx->cold->aead_decrypt_cleartext_ctx = NULL;
         }
 
-        if (cnx->aead_decrypt_cleartext_ctx != NULL)
+        if (cnx->cold->aead_de_encrypt_cleartext_ctx != NULL)
         {
-            picoquic_aead_free(cnx->aead_decrypt_cleartext_ctx);
-            cnx->aead_decrypt_cleartext_ctx = NULL;
-        }
-
-        if (cnx->aead_de_encrypt_cleartext_ctx != NULL)
-        {
-            picoquic_aead_free(cnx->aead_de_encrypt_cleartext_ctx);
-            cnx->aead_de_encrypt_cleartext_ctx = NULL;
+            picoquic_aead_free(cnx->cold->aead_de_encrypt_cleartext_ctx);
+            cnx->cold->aead_de_encrypt_cleartext_ctx = NULL;
         }
 
         if (cnx->aead_decrypt_ctx != NULL)
@@ -1197,9 +1882,9 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
             cnx->aead_encrypt_ctx = NULL;
         }
 
-        if (cnx->aead_de_encrypt_ctx != NULL)
+        if (cnx->cold->aead_de_encrypt_ctx != NULL)
         {
-            picoquic_aead_free(cnx->aead_de_encrypt_ctx);
+            picoquic_aead_free(cnx->cold->aead_de_encrypt_ctx);
             cnx->aead_encrypt_ctx = NULL;
         }
 
@@ -1208,11 +1893,20 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
 			picoquic_dequeue_retransmit_packet(cnx, cnx->retransmit_newest, 1);
 		}
 
+        picoquic_delete_ack_records(cnx, UINT64_MAX);
+
+        if (cnx->retransmit_index != NULL)
+        {
+            free(cnx->retransmit_index);
+            cnx->retransmit_index = NULL;
+            cnx->retransmit_index_size = 0;
+        }
+
         while (cnx->retransmitted_newest != NULL)
         {
             picoquic_packet * p = cnx->retransmitted_newest;
             cnx->retransmitted_newest = p->next_packet;
-            free(p);
+            picoquic_recycle_packet(cnx->quic, p);
         }
         cnx->retransmitted_oldest = NULL;
 
@@ -1226,9 +1920,16 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
         {
             cnx->first_stream.next_stream = stream->next_stream;
             picoquic_clear_stream(stream);
-            free(stream);
+            picoquic_release_stream(cnx->quic, stream);
         }
         picoquic_clear_stream(&cnx->first_stream);
+        picoquic_clear_stream_index(cnx);
+        for (int i = 0; i < 4; i++)
+        {
+            picoquic_clear_sack_list(&cnx->closed_streams[i]);
+        }
+        cnx->quic->receive_buffered -= cnx->receive_buffered;
+        cnx->receive_buffered = 0;
 
         if (cnx->tls_ctx != NULL)
         {
@@ -1241,7 +1942,7 @@ void picoquic_delete_cnx(picoquic_cnx_t * cnx)
 			cnx->congestion_alg->alg_delete(cnx);
 		}
 
-        free(cnx);
+        picoquic_release_cnx(cnx->quic, cnx);
     }
 }
 
@@ -1262,6 +1963,22 @@ picoquic_cnx_t * picoquic_cnx_by_id(picoquic_quic_t * quic, uint64_t cnx_id)
     return ret;
 }
 
+picoquic_cnx_t * picoquic_cnx_by_initial_id(picoquic_quic_t * quic, uint64_t initial_cnxid)
+{
+    picoquic_cnx_t * ret = NULL;
+    picohash_item * item;
+    picoquic_cnx_id key = { 0 };
+    key.cnx_id = initial_cnxid;
+
+    item = picohash_retrieve(quic->table_cnx_by_initial_id, &key);
+
+    if (item != NULL)
+    {
+        ret = ((picoquic_cnx_id *)item->key)->cnx;
+    }
+    return ret;
+}
+
 picoquic_cnx_t * picoquic_cnx_by_net(picoquic_quic_t * quic, struct sockaddr* addr)
 {
     picoquic_cnx_t * ret = NULL;
@@ -1286,6 +2003,26 @@ picoquic_cnx_t * picoquic_cnx_by_net(picoquic_quic_t * quic, struct sockaddr* ad
     return ret;
 }
 
+/*
+ * Connection ID based sharding. The shard index replaces the most significant
+ * byte of the locally chosen connection ID. Client initial connection IDs are
+ * random, so the same byte modulo the number of shards selects the worker that
+ * creates the server side context.
+ */
+uint64_t picoquic_shard_cnx_id_callback(uint64_t cnx_id_local, uint64_t cnx_id_remote, void * shard_ctx)
+{
+    picoquic_shard_ctx_t * ctx = (picoquic_shard_ctx_t *)shard_ctx;
+
+    (void)cnx_id_remote;
+
+    return (cnx_id_local & 0x00FFFFFFFFFFFFFFull) | (((uint64_t)(ctx->shard_index & 0xFF)) << 56);
+}
+
+uint32_t picoquic_get_cnx_id_shard(uint64_t cnx_id, uint32_t nb_shards)
+{
+    return (nb_shards <= 1) ? 0 : (uint32_t)((cnx_id >> 56) % nb_shards);
+}
+
 /*
  * Set or reset the congestion control algorithm
  */
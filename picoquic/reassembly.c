@@ -0,0 +1,318 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+/*
+ * Reassembly of stream data received out of order.
+ *
+ * The data is copied in a ring buffer, at the position of its stream offset
+ * modulo the size of the buffer. A bitmap records which bytes were received.
+ * The buffer starts at the consumed offset of the stream, and covers at least
+ * the data received so far; it grows by doubling if data arrives beyond its
+ * end, which flow control bounds to the stream window. Overlapping and
+ * repeated data is simply written again at the same place. Inserting and
+ * delivering data costs in proportion to the number of bytes, independently
+ * of the number of fragments, and does not allocate memory unless the
+ * buffer grows.
+ */
+
+#define PICOQUIC_REASSEMBLY_WORD_BITS 64
+
+static void picoquic_reassembly_mark_linear(uint64_t * bitmap, size_t index, size_t length, int value)
+{
+    while (length > 0)
+    {
+        size_t word = index / PICOQUIC_REASSEMBLY_WORD_BITS;
+        size_t bit = index % PICOQUIC_REASSEMBLY_WORD_BITS;
+        size_t nb_bits = PICOQUIC_REASSEMBLY_WORD_BITS - bit;
+        uint64_t mask;
+
+        if (nb_bits > length)
+        {
+            nb_bits = length;
+        }
+
+        mask = (nb_bits == PICOQUIC_REASSEMBLY_WORD_BITS) ? ~((uint64_t)0) :
+            ((((uint64_t)1) << nb_bits) - 1) << bit;
+
+        if (value)
+        {
+            bitmap[word] |= mask;
+        }
+        else
+        {
+            bitmap[word] &= ~mask;
+        }
+
+        index += nb_bits;
+        length -= nb_bits;
+    }
+}
+
+/* Set or clear the bits of a range, which may wrap around the end of the ring */
+static void picoquic_reassembly_mark(picoquic_reassembly_t * r, uint64_t offset, size_t length, int value)
+{
+    size_t index = (size_t)(offset & (r->size - 1));
+    size_t first = r->size - index;
+
+    if (first >= length)
+    {
+        picoquic_reassembly_mark_linear(r->bitmap, index, length, value);
+    }
+    else
+    {
+        picoquic_reassembly_mark_linear(r->bitmap, index, first, value);
+        picoquic_reassembly_mark_linear(r->bitmap, 0, length - first, value);
+    }
+}
+
+static void picoquic_reassembly_copy(picoquic_reassembly_t * r, uint64_t offset, const uint8_t * bytes, size_t length)
+{
+    size_t index = (size_t)(offset & (r->size - 1));
+    size_t first = r->size - index;
+
+    if (first >= length)
+    {
+        memcpy(r->buffer + index, bytes, length);
+    }
+    else
+    {
+        memcpy(r->buffer + index, bytes, first);
+        memcpy(r->buffer, bytes + first, length - first);
+    }
+}
+
+static int picoquic_reassembly_grow(picoquic_reassembly_t * r, uint64_t start_offset, size_t needed)
+{
+    int ret = 0;
+    size_t new_size = (r->size == 0) ? PICOQUIC_REASSEMBLY_MIN_SIZE : 2 * r->size;
+    uint8_t * new_buffer;
+    uint64_t * new_bitmap;
+
+    while (new_size < needed)
+    {
+        new_size *= 2;
+    }
+
+    new_buffer = (uint8_t *)malloc(new_size);
+    new_bitmap = (uint64_t *)malloc(new_size / 8);
+
+    if (new_buffer == NULL || new_bitmap == NULL)
+    {
+        if (new_buffer != NULL)
+        {
+            free(new_buffer);
+        }
+        if (new_bitmap != NULL)
+        {
+            free(new_bitmap);
+        }
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else
+    {
+        picoquic_reassembly_t old = *r;
+
+        memset(new_bitmap, 0, new_size / 8);
+        r->buffer = new_buffer;
+        r->bitmap = new_bitmap;
+        r->size = new_size;
+
+        /* Move the pending data and its bits to their place in the new ring */
+        if (old.size > 0)
+        {
+            if (old.end_offset > start_offset)
+            {
+                uint64_t offset = start_offset;
+
+                while (offset < old.end_offset)
+                {
+                    size_t index = (size_t)(offset & (old.size - 1));
+                    size_t length = old.size - index;
+                    size_t bit;
+
+                    if (length > old.end_offset - offset)
+                    {
+                        length = (size_t)(old.end_offset - offset);
+                    }
+
+                    picoquic_reassembly_copy(r, offset, old.buffer + index, length);
+
+                    for (bit = 0; bit < length; bit++)
+                    {
+                        size_t old_index = index + bit;
+
+                        if ((old.bitmap[old_index / PICOQUIC_REASSEMBLY_WORD_BITS] >>
+                            (old_index % PICOQUIC_REASSEMBLY_WORD_BITS)) & 1)
+                        {
+                            picoquic_reassembly_mark(r, offset + bit, 1, 1);
+                        }
+                    }
+
+                    offset += length;
+                }
+            }
+
+            free(old.buffer);
+            free(old.bitmap);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_reassembly_insert(picoquic_reassembly_t * r, uint64_t start_offset,
+    uint64_t offset, const uint8_t * bytes, size_t length)
+{
+    int ret = 0;
+
+    /* Data before the start was already delivered */
+    if (offset < start_offset)
+    {
+        if (offset + length <= start_offset)
+        {
+            length = 0;
+        }
+        else
+        {
+            bytes += (size_t)(start_offset - offset);
+            length -= (size_t)(start_offset - offset);
+            offset = start_offset;
+        }
+    }
+
+    if (length > 0)
+    {
+        uint64_t needed = offset + length - start_offset;
+
+        if (needed > r->size)
+        {
+            if (needed > (uint64_t)((size_t)-1) / 2)
+            {
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else
+            {
+                ret = picoquic_reassembly_grow(r, start_offset, (size_t)needed);
+            }
+        }
+
+        if (ret == 0)
+        {
+            picoquic_reassembly_copy(r, offset, bytes, length);
+            picoquic_reassembly_mark(r, offset, length, 1);
+
+            if (offset + length > r->end_offset)
+            {
+                r->end_offset = offset + length;
+            }
+        }
+    }
+
+    return ret;
+}
+
+size_t picoquic_reassembly_contiguous(picoquic_reassembly_t * r, uint64_t start_offset, uint8_t ** bytes)
+{
+    size_t length = 0;
+
+    if (r->size > 0 && r->end_offset > start_offset)
+    {
+        size_t index = (size_t)(start_offset & (r->size - 1));
+        size_t limit = r->size - index;
+
+        if (limit > r->end_offset - start_offset)
+        {
+            limit = (size_t)(r->end_offset - start_offset);
+        }
+
+        /* Count the received bytes from the start, a word at a time when possible */
+        while (length < limit)
+        {
+            size_t bit_index = index + length;
+            size_t bit = bit_index % PICOQUIC_REASSEMBLY_WORD_BITS;
+            uint64_t word = r->bitmap[bit_index / PICOQUIC_REASSEMBLY_WORD_BITS] >> bit;
+            size_t nb_bits = PICOQUIC_REASSEMBLY_WORD_BITS - bit;
+
+            if (nb_bits > limit - length)
+            {
+                nb_bits = limit - length;
+            }
+
+            if (nb_bits == PICOQUIC_REASSEMBLY_WORD_BITS && word == ~((uint64_t)0))
+            {
+                length += nb_bits;
+            }
+            else
+            {
+                size_t nb_ones = 0;
+
+                while (nb_ones < nb_bits && (word & 1) != 0)
+                {
+                    nb_ones++;
+                    word >>= 1;
+                }
+
+                length += nb_ones;
+
+                if (nb_ones < nb_bits)
+                {
+                    break;
+                }
+            }
+        }
+
+        *bytes = r->buffer + index;
+    }
+
+    return length;
+}
+
+void picoquic_reassembly_consume(picoquic_reassembly_t * r, uint64_t start_offset, size_t length)
+{
+    if (length > 0)
+    {
+        picoquic_reassembly_mark(r, start_offset, length, 0);
+    }
+}
+
+size_t picoquic_reassembly_memory(picoquic_reassembly_t * r)
+{
+    return r->size + r->size / 8;
+}
+
+void picoquic_reassembly_clear(picoquic_reassembly_t * r)
+{
+    if (r->buffer != NULL)
+    {
+        free(r->buffer);
+    }
+
+    if (r->bitmap != NULL)
+    {
+        free(r->bitmap);
+    }
+
+    memset(r, 0, sizeof(picoquic_reassembly_t));
+}
@@ -20,6 +20,7 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include "picoquic_internal.h"
 
 
@@ -33,30 +34,59 @@
 */
 
 /*
- * Check whether the packet was already received.
+ * Check whether the packet was already received. Recent packets are found in
+ * the bitmap, older ones in the ranges. Packets below the floor are too old
+ * to be tracked, and are treated as duplicates.
  */
+
+static int picoquic_sack_window_test(picoquic_sack_tracker_t * tracker, uint64_t pn64)
+{
+    uint64_t bit = pn64 % PICOQUIC_SACK_WINDOW_BITS;
+
+    return (tracker->window[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static void picoquic_sack_window_set(picoquic_sack_tracker_t * tracker, uint64_t pn64)
+{
+    uint64_t bit = pn64 % PICOQUIC_SACK_WINDOW_BITS;
+
+    tracker->window[bit >> 6] |= 1ull << (bit & 63);
+}
+
+picoquic_sack_range_t * picoquic_sack_get_range(picoquic_sack_tracker_t * tracker, size_t rank)
+{
+    return (rank == 0) ? &tracker->first_range : &tracker->older_ranges[rank - 1];
+}
+
 int picoquic_is_pn_already_received(picoquic_cnx_t * cnx, uint64_t pn64)
 {
     int is_received = 0;
-    picoquic_sack_item_t * sack = &cnx->first_sack_item;
+    picoquic_sack_tracker_t * tracker = &cnx->sack_tracker;
+    uint64_t highest = tracker->first_range.end_of_sack_range;
 
-    do
+    if (tracker->nb_ranges == 0 || pn64 > highest)
+    {
+        is_received = 0;
+    }
+    else if (pn64 < tracker->floor)
     {
-        if (pn64 > sack->end_of_sack_range)
-            break;
-        else if (pn64 >= sack->start_of_sack_range)
+        is_received = 1;
+    }
+    else if (highest - pn64 < PICOQUIC_SACK_WINDOW_BITS)
+    {
+        is_received = picoquic_sack_window_test(tracker, pn64);
+    }
+    else
+    {
+        for (size_t i = 0; i + 1 < tracker->nb_ranges && pn64 <= tracker->older_ranges[i].end_of_sack_range; i++)
         {
-            if (sack->start_of_sack_range == 0 && sack->end_of_sack_range == 0)
-                is_received = 0;
-            else
+            if (pn64 >= tracker->older_ranges[i].start_of_sack_range)
+            {
                 is_received = 1;
-            break;
-        }
-        else
-        {
-            sack = sack->next_sack;
+                break;
+            }
         }
-    } while (sack != NULL);
+    }
 
     return is_received;
 }
@@ -254,19 +284,159 @@ int picoquic_update_sack_list(picoquic_sack_item_t * sack,
     return ret;
 }
 
+/*
+ * Insert a new range at the specified rank. If the ranges are full, the lowest
+ * range is forgotten, and the floor is raised above it. If the new range would
+ * be the lowest, the packet is not recorded, and the function returns 1 so it
+ * is dropped as a duplicate.
+ */
+
+static int picoquic_sack_insert_range(picoquic_sack_tracker_t * tracker, size_t rank, uint64_t pn64)
+{
+    int ret = 0;
+
+    if (tracker->nb_ranges >= PICOQUIC_MAX_SACK_RANGES && rank >= tracker->nb_ranges)
+    {
+        ret = 1;
+    }
+    else
+    {
+        if (tracker->nb_ranges >= PICOQUIC_MAX_SACK_RANGES)
+        {
+            tracker->nb_ranges--;
+            tracker->floor = picoquic_sack_get_range(tracker, tracker->nb_ranges)->end_of_sack_range + 1;
+        }
+
+        if (tracker->nb_ranges > rank)
+        {
+            if (rank == 0)
+            {
+                memmove(&tracker->older_ranges[1], &tracker->older_ranges[0],
+                    (tracker->nb_ranges - 1) * sizeof(picoquic_sack_range_t));
+                tracker->older_ranges[0] = tracker->first_range;
+            }
+            else
+            {
+                memmove(&tracker->older_ranges[rank], &tracker->older_ranges[rank - 1],
+                    (tracker->nb_ranges - rank) * sizeof(picoquic_sack_range_t));
+            }
+        }
+        picoquic_sack_get_range(tracker, rank)->start_of_sack_range = pn64;
+        picoquic_sack_get_range(tracker, rank)->end_of_sack_range = pn64;
+        tracker->nb_ranges++;
+    }
+
+    return ret;
+}
+
+static void picoquic_sack_remove_range(picoquic_sack_tracker_t * tracker, size_t rank)
+{
+    if (rank == 0 && tracker->nb_ranges > 1)
+    {
+        tracker->first_range = tracker->older_ranges[0];
+        rank = 1;
+    }
+    if (rank > 0)
+    {
+        memmove(&tracker->older_ranges[rank - 1], &tracker->older_ranges[rank],
+            (tracker->nb_ranges - rank - 1) * sizeof(picoquic_sack_range_t));
+    }
+    tracker->nb_ranges--;
+}
+
+/*
+ * Add a packet number to the ranges. New packets usually extend the first
+ * range, so the search is short. Returns 1 if the packet cannot be recorded.
+ */
+
+static int picoquic_sack_add_to_ranges(picoquic_sack_tracker_t * tracker, uint64_t pn64,
+    uint64_t * sack_block_size_max)
+{
+    int ret = 0;
+    size_t rank = 0;
+    picoquic_sack_range_t * range = NULL;
+
+    /* Skip the ranges that are above the packet number, with a gap */
+    while (rank < tracker->nb_ranges &&
+        pn64 + 1 < (range = picoquic_sack_get_range(tracker, rank))->start_of_sack_range)
+    {
+        rank++;
+        range = NULL;
+    }
+
+    if (range != NULL && pn64 + 1 == range->start_of_sack_range)
+    {
+        /* Extend the range down, and merge it with the next one if the hole is filled */
+        range->start_of_sack_range = pn64;
+
+        if (rank + 1 < tracker->nb_ranges && tracker->older_ranges[rank].end_of_sack_range + 1 == pn64)
+        {
+            range->start_of_sack_range = tracker->older_ranges[rank].start_of_sack_range;
+            picoquic_sack_remove_range(tracker, rank + 1);
+        }
+    }
+    else if (range != NULL && pn64 == range->end_of_sack_range + 1)
+    {
+        range->end_of_sack_range = pn64;
+    }
+    else
+    {
+        ret = picoquic_sack_insert_range(tracker, rank, pn64);
+        range = (ret == 0) ? picoquic_sack_get_range(tracker, rank) : NULL;
+    }
+
+    if (range != NULL &&
+        range->end_of_sack_range - range->start_of_sack_range > *sack_block_size_max)
+    {
+        *sack_block_size_max = range->end_of_sack_range - range->start_of_sack_range;
+    }
+
+    return ret;
+}
+
 int picoquic_record_pn_received(picoquic_cnx_t * cnx, uint64_t pn64, uint64_t current_microsec)
 {
-    picoquic_sack_item_t * sack = &cnx->first_sack_item;
+    int ret = 0;
+    picoquic_sack_tracker_t * tracker = &cnx->sack_tracker;
+    uint64_t highest = tracker->first_range.end_of_sack_range;
+    int is_in_window = tracker->nb_ranges == 0 || pn64 + PICOQUIC_SACK_WINDOW_BITS > highest;
 
-    if ((sack->start_of_sack_range == 0 &&
-        sack->end_of_sack_range == 0) ||
-        pn64 > sack->end_of_sack_range)
+    if (tracker->nb_ranges == 0 || pn64 > highest)
     {
-        /* This is the first packet ever received.. */
+        /* This is the largest packet received so far. Clear the bits that it
+         * pushes out of the window, as they are now reused for new numbers. */
         cnx->time_stamp_largest_received = current_microsec;
+
+        if (tracker->nb_ranges == 0 || pn64 - highest >= PICOQUIC_SACK_WINDOW_BITS)
+        {
+            memset(tracker->window, 0, sizeof(tracker->window));
+        }
+        else
+        {
+            while (highest < pn64)
+            {
+                uint64_t bit = (++highest) % PICOQUIC_SACK_WINDOW_BITS;
+                tracker->window[bit >> 6] &= ~(1ull << (bit & 63));
+            }
+        }
+    }
+    else if (picoquic_is_pn_already_received(cnx, pn64))
+    {
+        ret = 1;
     }
 
-    return picoquic_update_sack_list(sack, pn64, pn64, &cnx->sack_block_size_max);
+    if (ret == 0)
+    {
+        /* A packet older than all the ranges, when they are full, is dropped as a duplicate */
+        ret = picoquic_sack_add_to_ranges(tracker, pn64, &cnx->cold->sack_block_size_max);
+
+        if (ret == 0 && is_in_window)
+        {
+            picoquic_sack_window_set(tracker, pn64);
+        }
+    }
+
+    return ret;
 }
 
 /*
@@ -319,6 +489,23 @@ int picoquic_check_sack_list(picoquic_sack_item_t * sack,
     return ret;
 }
 
+/*
+ * Release the ranges chained after the first item, and reset the list.
+ */
+void picoquic_clear_sack_list(picoquic_sack_item_t * first_sack)
+{
+    picoquic_sack_item_t * next;
+
+    while ((next = first_sack->next_sack) != NULL)
+    {
+        first_sack->next_sack = next->next_sack;
+        free(next);
+    }
+
+    first_sack->start_of_sack_range = 0;
+    first_sack->end_of_sack_range = 0;
+}
+
 /*
  * Float16 format required for encoding the time deltas in current QUIC draft.
  *
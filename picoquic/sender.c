@@ -45,8 +45,13 @@
  * subject to flow control.
  */
 
-int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint64_t stream_id, 
-	const uint8_t * data, size_t length, int set_fin)
+/*
+ * Find the stream on which the application wants to send, or create it if it
+ * is a new local stream that fits under the limits set by the peer.
+ */
+
+static int picoquic_find_or_create_local_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
+    picoquic_stream_head ** pstream)
 {
     int ret = 0;
     int is_unidir = 0;
@@ -60,7 +65,11 @@ int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
     {
         stream = picoquic_find_stream(cnx, stream_id, 0);
 
-        if (stream == NULL)
+        if (stream == NULL && picoquic_is_stream_closed(cnx, stream_id))
+        {
+            ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+        }
+        else if (stream == NULL)
         {
             /* Need to check that the ID is authorized */
 
@@ -108,6 +117,109 @@ int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
         }
     }
 
+    *pstream = stream;
+
+    return ret;
+}
+
+/*
+ * Send buffer limits. A stream is marked write blocked when the application
+ * hits a high mark, and notified once the queues are at or below the low marks.
+ */
+
+static int picoquic_is_send_buffer_full(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    return (stream->send_high_mark > 0 && stream->send_queued >= stream->send_high_mark) ||
+        (cnx->send_high_mark > 0 && cnx->send_queued >= cnx->send_high_mark);
+}
+
+static void picoquic_set_write_blocked(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    stream->is_write_blocked = 1;
+
+    if (cnx->send_high_mark > 0 && cnx->send_queued >= cnx->send_high_mark)
+    {
+        cnx->is_write_blocked = 1;
+    }
+}
+
+static int picoquic_is_send_buffer_low(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    return (stream->send_high_mark == 0 || stream->send_queued <= stream->send_low_mark) &&
+        (cnx->send_high_mark == 0 || cnx->send_queued <= cnx->send_low_mark);
+}
+
+static void picoquic_notify_writable_stream(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    if (stream->is_write_blocked && picoquic_is_send_buffer_low(cnx, stream))
+    {
+        stream->is_write_blocked = 0;
+
+        /* Posted data that was deferred is queued before the application is notified */
+        picoquic_flush_deferred_commands(cnx, stream);
+
+        if (!stream->is_write_blocked && cnx->callback_fn != NULL &&
+            (stream->stream_flags&(picoquic_stream_flag_reset_requested | picoquic_stream_flag_fin_notified)) == 0)
+        {
+            cnx->callback_fn(cnx, stream->stream_id, NULL, 0, picoquic_callback_stream_writable, cnx->callback_ctx);
+        }
+    }
+}
+
+/* Called after data of the stream was sent. All streams are only visited if
+ * some were blocked by the connection limit, and that limit is released. */
+void picoquic_notify_writable_streams(picoquic_cnx_t * cnx, picoquic_stream_head * stream)
+{
+    picoquic_notify_writable_stream(cnx, stream);
+
+    if (cnx->is_write_blocked && cnx->send_queued <= cnx->send_low_mark)
+    {
+        picoquic_stream_head * next = cnx->first_stream.next_stream;
+
+        cnx->is_write_blocked = 0;
+
+        while (next != NULL)
+        {
+            picoquic_notify_writable_stream(cnx, next);
+            next = next->next_stream;
+        }
+    }
+}
+
+int picoquic_set_stream_send_buffer_limits(picoquic_cnx_t * cnx, uint64_t stream_id,
+    uint64_t high_mark, uint64_t low_mark)
+{
+    picoquic_stream_head * stream = NULL;
+    int ret = picoquic_find_or_create_local_stream(cnx, stream_id, &stream);
+
+    if (ret == 0)
+    {
+        stream->send_high_mark = high_mark;
+        stream->send_low_mark = low_mark;
+    }
+
+    return ret;
+}
+
+void picoquic_set_send_buffer_limits(picoquic_cnx_t * cnx, uint64_t high_mark, uint64_t low_mark)
+{
+    cnx->send_high_mark = high_mark;
+    cnx->send_low_mark = low_mark;
+}
+
+static int picoquic_add_to_stream_ex(picoquic_cnx_t * cnx, uint64_t stream_id,
+    const uint8_t * data, size_t length, int set_fin, int is_ref,
+    picoquic_stream_data_release_fn release_fn, void * release_ctx)
+{
+    picoquic_stream_head * stream = NULL;
+    int ret = picoquic_find_or_create_local_stream(cnx, stream_id, &stream);
+
+    if (ret == 0 && length > 0 && picoquic_is_send_buffer_full(cnx, stream))
+    {
+        picoquic_set_write_blocked(cnx, stream);
+        ret = PICOQUIC_ERROR_SEND_BUFFER_FULL;
+    }
+
     if (ret == 0 && set_fin)
     {
         if ((stream->stream_flags&picoquic_stream_flag_fin_notified) != 0)
@@ -126,43 +238,268 @@ int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
 
 	if (ret == 0 && length > 0)
     {
-        picoquic_stream_data * stream_data = (picoquic_stream_data *)malloc(sizeof(picoquic_stream_data));
+        picoquic_stream_send_data * send_data = (picoquic_stream_send_data *)malloc(
+            sizeof(picoquic_stream_send_data) + ((is_ref) ? 0 : length));
 
-        if (stream_data == 0)
+        if (send_data == NULL)
         {
             ret = -1;
         }
         else
         {
-            stream_data->bytes = (uint8_t *)malloc(length);
+            if (is_ref)
+            {
+                send_data->data.bytes = (uint8_t *)data;
+                send_data->release_fn = release_fn;
+                send_data->release_ctx = release_ctx;
+            }
+            else
+            {
+                send_data->data.bytes = ((uint8_t *)send_data) + sizeof(picoquic_stream_send_data);
+                memcpy(send_data->data.bytes, data, length);
+                send_data->release_fn = NULL;
+                send_data->release_ctx = NULL;
+            }
+            send_data->data.length = length;
+            send_data->data.offset = 0;
+            send_data->data.next_stream_data = NULL;
 
-            if (stream_data->bytes == NULL)
+            /* Append at the tail of the queue */
+            if (stream->send_queue_last == NULL)
             {
-                free(stream_data);
-                stream_data = NULL;
-                ret = -1;
+                stream->send_queue = &send_data->data;
             }
             else
             {
-                picoquic_stream_data ** pprevious = &stream->send_queue;
-                picoquic_stream_data * next = stream->send_queue;
+                stream->send_queue_last->next_stream_data = &send_data->data;
+            }
+            stream->send_queue_last = &send_data->data;
 
-                memcpy(stream_data->bytes, data, length);
-                stream_data->length = length;
-                stream_data->offset = 0;
-                stream_data->next_stream_data = NULL;
+            stream->send_queued += length;
+            cnx->send_queued += length;
+            if (picoquic_is_send_buffer_full(cnx, stream))
+            {
+                picoquic_set_write_blocked(cnx, stream);
+            }
+        }
+    }
+    else if (ret == 0 && is_ref && release_fn != NULL)
+    {
+        /* Nothing to send from this buffer */
+        release_fn(release_ctx, data, length);
+    }
 
-                while (next != NULL)
-                {
-                    pprevious = &next->next_stream_data;
-                    next = next->next_stream_data;
-                }
+    if (ret == 0)
+    {
+        picoquic_update_ready_stream(cnx, stream);
+        picoquic_wake_up_cnx(cnx);
+    }
+
+    return ret;
+}
+
+int picoquic_add_to_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
+    const uint8_t * data, size_t length, int set_fin)
+{
+    return picoquic_add_to_stream_ex(cnx, stream_id, data, length, set_fin, 0, NULL, NULL);
+}
+
+int picoquic_add_to_stream_ref(picoquic_cnx_t * cnx, uint64_t stream_id,
+    const uint8_t * data, size_t length, int set_fin,
+    picoquic_stream_data_release_fn release_fn, void * release_ctx)
+{
+    return picoquic_add_to_stream_ex(cnx, stream_id, data, length, set_fin, 1, release_fn, release_ctx);
+}
+
+/*
+ * Pull mode. Active streams are asked for data when a stream frame is being
+ * prepared, through the picoquic_callback_prepare_to_send event. The data is
+ * written directly in the packet, within the limits of the packet size and of
+ * the flow control credit.
+ */
+
+int picoquic_mark_active_stream(picoquic_cnx_t * cnx, uint64_t stream_id, int is_active)
+{
+    picoquic_stream_head * stream = NULL;
+    int ret = 0;
+
+    if (stream_id == 0)
+    {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else
+    {
+        ret = picoquic_find_or_create_local_stream(cnx, stream_id, &stream);
+    }
+
+    if (ret == 0)
+    {
+        if (is_active && (stream->stream_flags&(picoquic_stream_flag_fin_notified |
+            picoquic_stream_flag_reset_requested)) != 0)
+        {
+            ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+        }
+        else
+        {
+            stream->is_active = (is_active) ? 1 : 0;
+            picoquic_update_ready_stream(cnx, stream);
+
+            if (is_active)
+            {
+                picoquic_wake_up_cnx(cnx);
+            }
+        }
+    }
+
+    return ret;
+}
+
+uint8_t * picoquic_provide_stream_data_buffer(void * context, size_t nb_bytes, int is_fin, int is_still_active)
+{
+    picoquic_stream_data_buffer_ctx_t * ctx = (picoquic_stream_data_buffer_ctx_t *)context;
+    uint8_t * buffer = NULL;
+    size_t space = ctx->bytes_max - ctx->header_length;
+
+    if (ctx->is_provided || nb_bytes > ctx->allowed_length)
+    {
+        return NULL;
+    }
+
+    ctx->is_provided = 1;
+    ctx->is_still_active = is_still_active;
+
+    if (nb_bytes == 0 && !is_fin)
+    {
+        /* Nothing to send now */
+        return NULL;
+    }
+
+    ctx->length = nb_bytes;
+    ctx->is_fin = is_fin;
+
+    if (nb_bytes == space)
+    {
+        /* The frame fills the packet, the length is implicit */
+        buffer = ctx->bytes + ctx->header_length;
+        ctx->consumed = ctx->bytes_max;
+    }
+    else
+    {
+        size_t l_len = picoquic_varint_encode(ctx->bytes + ctx->header_length, space, (uint64_t)nb_bytes);
+
+        if (l_len > 0 && l_len + nb_bytes <= space)
+        {
+            ctx->bytes[0] |= 2; /* Indicates presence of length */
+            buffer = ctx->bytes + ctx->header_length + l_len;
+            ctx->consumed = ctx->header_length + l_len + nb_bytes;
+        }
+        else
+        {
+            /* The length does not fit. Insert padding before the frame, so that
+             * it extends to the end of the packet without a length field. */
+            size_t padding = space - nb_bytes;
+
+            memmove(ctx->bytes + padding, ctx->bytes, ctx->header_length);
+            memset(ctx->bytes, picoquic_frame_type_padding, padding);
+            ctx->frame_start = padding;
+            buffer = ctx->bytes + padding + ctx->header_length;
+            ctx->consumed = ctx->bytes_max;
+        }
+    }
+
+    if (is_fin)
+    {
+        ctx->bytes[ctx->frame_start] |= 1;
+    }
+
+    return buffer;
+}
+
+/*
+ * Remove the first item of the send queue, once all its data was sent, and
+ * hand back the application buffer if the data was queued by reference.
+ */
+
+void picoquic_dequeue_send_data(picoquic_stream_head * stream)
+{
+    picoquic_stream_send_data * send_data = (picoquic_stream_send_data *)stream->send_queue;
+
+    if (send_data != NULL)
+    {
+        stream->send_queue = send_data->data.next_stream_data;
+        if (stream->send_queue == NULL)
+        {
+            stream->send_queue_last = NULL;
+        }
+
+        if (send_data->release_fn != NULL)
+        {
+            send_data->release_fn(send_data->release_ctx, send_data->data.bytes,
+                send_data->data.length);
+        }
+
+        free(send_data);
+    }
+}
+
+void picoquic_clear_send_queue(picoquic_stream_head * stream)
+{
+    while (stream->send_queue != NULL)
+    {
+        picoquic_dequeue_send_data(stream);
+    }
+
+    picoquic_free_deferred_commands(stream);
+}
+
+/*
+ * Queue data that was lost in transmission, so it can be sent again in new
+ * stream frames, possibly together with new data. The queue is ordered by
+ * stream offset, so the oldest data is repeated first. If the lost frame
+ * carried the FIN bit, the FIN will be sent again after the data.
+ */
+
+int picoquic_queue_lost_stream_data(picoquic_cnx_t * cnx, picoquic_stream_head * stream,
+    uint64_t offset, const uint8_t * bytes, size_t length, int fin)
+{
+    int ret = 0;
+
+    if (fin)
+    {
+        stream->stream_flags &= ~picoquic_stream_flag_fin_sent;
+    }
+
+    if (length > 0)
+    {
+        picoquic_stream_data * stream_data = (picoquic_stream_data *)malloc(sizeof(picoquic_stream_data) + length);
+
+        if (stream_data == NULL)
+        {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else
+        {
+            picoquic_stream_data ** pprevious = &stream->retransmit_queue;
+            picoquic_stream_data * next = stream->retransmit_queue;
 
-                *pprevious = stream_data;
+            stream_data->bytes = ((uint8_t *)stream_data) + sizeof(picoquic_stream_data);
+            memcpy(stream_data->bytes, bytes, length);
+            stream_data->length = length;
+            stream_data->offset = offset;
+
+            while (next != NULL && next->offset <= offset)
+            {
+                pprevious = &next->next_stream_data;
+                next = next->next_stream_data;
             }
+
+            stream_data->next_stream_data = next;
+            *pprevious = stream_data;
         }
     }
 
+    picoquic_update_ready_stream(cnx, stream);
+
     return ret;
 }
 
@@ -176,6 +513,11 @@ int picoquic_reset_stream(picoquic_cnx_t * cnx,
 	{
 		ret = PICOQUIC_ERROR_CANNOT_RESET_STREAM_ZERO;
 	}
+	else if (picoquic_is_stream_closed(cnx, stream_id))
+	{
+		/* The stream was closed in both directions and released */
+		ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+	}
 	else
 	{
 		stream = picoquic_find_stream(cnx, stream_id, 1);
@@ -192,6 +534,8 @@ int picoquic_reset_stream(picoquic_cnx_t * cnx,
 		{
 			stream->local_error = local_stream_error;
 			stream->stream_flags |= picoquic_stream_flag_reset_requested;
+			picoquic_update_ready_stream(cnx, stream);
+			picoquic_wake_up_cnx(cnx);
 		}
 	}
 
@@ -208,6 +552,11 @@ int picoquic_stop_sending(picoquic_cnx_t * cnx,
     {
         ret = PICOQUIC_ERROR_CANNOT_STOP_STREAM_ZERO;
     }
+    else if (picoquic_is_stream_closed(cnx, stream_id))
+    {
+        /* The stream was closed in both directions and released */
+        ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+    }
     else
     {
         stream = picoquic_find_stream(cnx, stream_id, 1);
@@ -224,12 +573,56 @@ int picoquic_stop_sending(picoquic_cnx_t * cnx,
         {
             stream->local_stop_error = local_stream_error;
             stream->stream_flags |= picoquic_stream_flag_stop_sending_requested;
+            picoquic_wake_up_cnx(cnx);
         }
     }
 
     return ret;
 }
 
+void picoquic_set_stream_scheduler(picoquic_cnx_t * cnx, picoquic_stream_scheduler_t scheduler)
+{
+    cnx->stream_scheduler = scheduler;
+}
+
+int picoquic_set_stream_weight(picoquic_cnx_t * cnx, uint64_t stream_id, uint8_t weight)
+{
+    int ret = 0;
+    picoquic_stream_head * stream = NULL;
+
+    if (stream_id == 0 || (stream = picoquic_find_stream(cnx, stream_id, 0)) == NULL)
+    {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else
+    {
+        stream->sched_weight = (weight == 0) ? 1 : weight;
+    }
+
+    return ret;
+}
+
+int picoquic_set_stream_priority(picoquic_cnx_t * cnx, uint64_t stream_id, uint8_t urgency, int incremental)
+{
+    int ret = 0;
+    picoquic_stream_head * stream = NULL;
+
+    if (stream_id == 0 || (stream = picoquic_find_stream(cnx, stream_id, 0)) == NULL)
+    {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else
+    {
+        /* Move the stream to the ready list of its new urgency */
+        picoquic_clear_ready_stream(cnx, stream);
+        stream->urgency = (urgency > PICOQUIC_STREAM_URGENCY_MAX) ? PICOQUIC_STREAM_URGENCY_MAX : urgency;
+        stream->is_incremental = (incremental) ? 1 : 0;
+        picoquic_update_ready_stream(cnx, stream);
+    }
+
+    return ret;
+}
+
 picoquic_packet * picoquic_create_packet()
 {
     picoquic_packet * packet = (picoquic_packet *)malloc(sizeof(picoquic_packet));
@@ -397,7 +790,7 @@ size_t picoquic_get_checksum_length(picoquic_cnx_t * cnx, int is_cleartext_mode)
 
     if (is_cleartext_mode )
     {
-        ret = picoquic_aead_get_checksum_length(cnx->aead_encrypt_cleartext_ctx);
+        ret = picoquic_aead_get_checksum_length(cnx->cold->aead_encrypt_cleartext_ctx);
     }
     else
     {
@@ -450,24 +843,35 @@ void picoquic_update_pacing_after_send(picoquic_cnx_t * cnx, uint64_t current_ti
  */
 
 void picoquic_queue_for_retransmit(picoquic_cnx_t * cnx, picoquic_packet * packet,
-    size_t length, uint64_t current_time)
+    size_t header_length, size_t length, uint64_t current_time)
 {
-    /* Account for bytes in transit, for congestion control */
-    cnx->bytes_in_transit += length;
-
-    /* Manage the double linked packet list for retransmissions */
-    packet->previous_packet = NULL;
-    if (cnx->retransmit_newest == NULL)
+    if (picoquic_record_ack_only_packet(cnx, packet, header_length))
     {
-        packet->next_packet = NULL;
-        cnx->retransmit_oldest = packet;
+        /* ACK only packets are never repeated and are not counted in transit.
+         * The packet is not queued, and its length is reset so the caller recycles it. */
+        packet->length = 0;
     }
     else
     {
-        packet->next_packet = cnx->retransmit_newest;
-        packet->next_packet->previous_packet = packet;
+        /* Account for bytes in transit, for congestion control */
+        cnx->bytes_in_transit += length;
+
+        /* Manage the double linked packet list for retransmissions */
+        packet->previous_packet = NULL;
+        if (cnx->retransmit_newest == NULL)
+        {
+            packet->next_packet = NULL;
+            cnx->retransmit_oldest = packet;
+        }
+        else
+        {
+            packet->next_packet = cnx->retransmit_newest;
+            packet->next_packet->previous_packet = packet;
+        }
+        cnx->retransmit_newest = packet;
+
+        picoquic_index_retransmit_packet(cnx, packet);
     }
-    cnx->retransmit_newest = packet;
 
     /* Update the pacing data */
     picoquic_update_pacing_after_send(cnx, current_time);
@@ -542,13 +946,78 @@ static int picoquic_retransmit_needed_by_packet(picoquic_cnx_t * cnx,
     return should_retransmit;
 }
 
+/*
+ * Stream data found in lost 1-RTT packets is not copied to the new packet. It is
+ * queued again on its stream, and will be sent in new stream frames, possibly
+ * together with new data. Returns 1 if the frame does not need to be copied,
+ * either because its data was queued or because the stream was reset.
+ */
+
+static int picoquic_requeue_lost_stream_frame(picoquic_cnx_t * cnx, uint8_t * bytes, size_t bytes_max)
+{
+    int is_requeued = 0;
+    uint64_t stream_id = 0;
+    uint64_t offset = 0;
+    size_t data_length = 0;
+    int fin = 0;
+    size_t consumed = 0;
+
+    if (bytes[0] >= picoquic_frame_type_stream_range_min &&
+        bytes[0] <= picoquic_frame_type_stream_range_max &&
+        picoquic_parse_stream_header(bytes, bytes_max, &stream_id, &offset, &data_length, &fin, &consumed) == 0 &&
+        stream_id != 0)
+    {
+        picoquic_stream_head * stream = picoquic_find_stream(cnx, stream_id, 0);
+
+        if (stream == NULL || (stream->stream_flags&picoquic_stream_flag_reset_requested) != 0 ||
+            picoquic_queue_lost_stream_data(cnx, stream, offset, bytes + consumed, data_length, fin) == 0)
+        {
+            is_requeued = 1;
+        }
+    }
+
+    return is_requeued;
+}
+
+/*
+ * Copy a stream frame that extended to the end of the lost packet, adding an
+ * explicit length so it does not need to be preceded by padding.
+ * Returns 0 if the frame does not fit.
+ */
+
+static size_t picoquic_copy_stream_frame_with_length(uint8_t * bytes, size_t bytes_max,
+    uint8_t * frame, size_t frame_length)
+{
+    size_t length = 0;
+    uint64_t stream_id = 0;
+    uint64_t offset = 0;
+    size_t data_length = 0;
+    int fin = 0;
+    size_t consumed = 0;
+    uint8_t l_bytes[8];
+    size_t l_len = 0;
+
+    if (picoquic_parse_stream_header(frame, frame_length, &stream_id, &offset, &data_length, &fin, &consumed) == 0 &&
+        (l_len = picoquic_varint_encode(l_bytes, sizeof(l_bytes), (uint64_t)data_length)) > 0 &&
+        consumed + l_len + data_length <= bytes_max)
+    {
+        bytes[0] = frame[0] | 2;
+        memcpy(bytes + 1, frame + 1, consumed - 1);
+        memcpy(bytes + consumed, l_bytes, l_len);
+        memcpy(bytes + consumed + l_len, frame + consumed, data_length);
+        length = consumed + l_len + data_length;
+    }
+
+    return length;
+}
+
 int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time, 
 	picoquic_packet * packet, int * is_cleartext_mode, size_t * header_length)
 {
     picoquic_packet * p = cnx->retransmit_oldest;
 	size_t length = 0;
+    int is_timer_counted = 0;
 
-	/* TODO: while packets are pure ACK, drop them from retransmit queue */
     while (p != NULL)
     {
         int should_retransmit = 0;
@@ -573,6 +1042,7 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
             picoquic_packet_header ph;
             int ret = 0;
             int packet_is_pure_ack = 1;
+            int is_requeued = 0;
             int frame_is_pure_ack = 0;
             uint8_t * bytes = packet->bytes;
             size_t frame_length = 0;
@@ -639,19 +1109,38 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
                         ret = picoquic_skip_frame(&p->bytes[byte_index],
                             p->length - byte_index, &frame_length, &frame_is_pure_ack);
 
-                        if (!frame_is_pure_ack)
+                        if (!frame_is_pure_ack && *is_cleartext_mode == 0 &&
+                            picoquic_requeue_lost_stream_frame(cnx, &p->bytes[byte_index], frame_length))
                         {
+                            is_requeued = 1;
+                        }
+                        else if (!frame_is_pure_ack)
+                        {
+                            size_t copied_length = 0;
+
                             if (picoquic_test_stream_frame_unlimited(&p->bytes[byte_index]) != 0)
                             {
-                                /* Need to PAD to the end of the frame to avoid sending extra bytes */
-                                while (checksum_length + length + frame_length < cnx->send_mtu)
+                                copied_length = picoquic_copy_stream_frame_with_length(&bytes[length],
+                                    (checksum_length + length < cnx->send_mtu) ? cnx->send_mtu - checksum_length - length : 0,
+                                    &p->bytes[byte_index], frame_length);
+
+                                if (copied_length == 0)
                                 {
-                                    bytes[length] = picoquic_frame_type_padding;
-                                    length++;
+                                    /* Need to PAD to the end of the frame to avoid sending extra bytes */
+                                    while (checksum_length + length + frame_length < cnx->send_mtu)
+                                    {
+                                        bytes[length] = picoquic_frame_type_padding;
+                                        length++;
+                                    }
                                 }
                             }
-                            memcpy(&bytes[length], &p->bytes[byte_index], frame_length);
-                            length += frame_length;
+
+                            if (copied_length == 0)
+                            {
+                                memcpy(&bytes[length], &p->bytes[byte_index], frame_length);
+                                copied_length = frame_length;
+                            }
+                            length += copied_length;
                             packet_is_pure_ack = 0;
                         }
                         byte_index += frame_length;
@@ -661,18 +1150,20 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
                 /* Update the number of bytes in transit and remove old packet from queue */
                 /* If not pure ack, the packet will be placed in the "retransmitted" queue,
                  * in order to enable detection of spurious restransmissions */
-                picoquic_dequeue_retransmit_packet(cnx, p, packet_is_pure_ack == 0);
+                picoquic_dequeue_retransmit_packet(cnx, p, packet_is_pure_ack == 0 || is_requeued);
 
                 /* If we have a good packet, return it */
-                if (packet_is_pure_ack)
+                if (packet_is_pure_ack && !is_requeued)
                 {
                     length = 0;
                     should_retransmit = 0;
                 }
                 else
                 {
-                    if (timer_based_retransmit != 0)
+                    if (timer_based_retransmit != 0 && !is_timer_counted)
                     {
+                        is_timer_counted = 1;
+
                         if (cnx->nb_retransmit > 4)
                         {
                             /*
@@ -696,16 +1187,7 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
 
                     if (should_retransmit != 0)
                     {
-                        /* special case for the client initial */
-                        if (ph.ptype == picoquic_packet_client_initial)
-                        {
-                            while (length < (cnx->send_mtu - checksum_length))
-                            {
-                                bytes[length++] = 0;
-                            }
-                        }
-                        packet->length = length;
-                        cnx->nb_retransmission_total++;
+                        cnx->cold->nb_retransmission_total++;
 
                         if (cnx->congestion_alg != NULL)
                         {
@@ -716,7 +1198,26 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
                                 0, 0, lost_packet_number, current_time);
                         }
 
-                        break;
+                        if (packet_is_pure_ack)
+                        {
+                            /* All the lost data was queued on the streams, look at the next candidate */
+                            length = 0;
+                            should_retransmit = 0;
+                        }
+                        else
+                        {
+                            /* special case for the client initial */
+                            if (ph.ptype == picoquic_packet_client_initial)
+                            {
+                                while (length < (cnx->send_mtu - checksum_length))
+                                {
+                                    bytes[length++] = 0;
+                                }
+                            }
+                            packet->length = length;
+
+                            break;
+                        }
                     }
                 }
             }
@@ -736,51 +1237,18 @@ int picoquic_retransmit_needed(picoquic_cnx_t * cnx, uint64_t current_time,
  */
 int picoquic_is_cnx_backlog_empty(picoquic_cnx_t * cnx)
 {
-    picoquic_packet * p = cnx->retransmit_oldest;
-    int backlog_empty = 1;
-
-    while (p != NULL && backlog_empty == 1)
-    {
-        /* check if this is an ACK only packet */
-        picoquic_packet_header ph;
-        int ret = 0;
-        int frame_is_pure_ack = 0;
-        size_t frame_length = 0;
-        size_t byte_index = 0; /* Used when parsing the old packet */
-        picoquic_cnx_t * pcnx = cnx;
-
-        /* Get the packet type */
-        ret = picoquic_parse_packet_header(cnx->quic, p->bytes, (uint32_t)p->length, NULL,
-            ((cnx->quic->flags&picoquic_context_server) == 0) ? 1 : 0, &ph, &pcnx);
-
-        /* Copy the relevant bytes from one packet to the next */
-        byte_index = ph.offset;
-
-        while (ret == 0 && byte_index < p->length)
-        {
-            ret = picoquic_skip_frame(&p->bytes[byte_index],
-                p->length - ph.offset, &frame_length, &frame_is_pure_ack);
-
-            if (!frame_is_pure_ack)
-            {
-                backlog_empty = 0;
-                break;
-            }
-            byte_index += frame_length;
-        }
-
-        p = p->previous_packet;
-    }
-
-    return backlog_empty;
+    /* ACK only packets are not queued, so anything in the queue may need repeating */
+    return (cnx->retransmit_oldest == NULL) ? 1 : 0;
 }
 
-/* Decide whether MAX data need to be sent or not */
+/* Decide whether MAX data need to be sent or not: less than half the window
+ * remains, and the receive budget is not exhausted */
 int picoquic_should_send_max_data(picoquic_cnx_t * cnx)
 {
     int ret = 0;
 
-    if (2 * cnx->data_received > cnx->maxdata_local)
+    if (2 * (cnx->maxdata_local - cnx->data_received) < cnx->maxdata_window &&
+        picoquic_receive_budget_level(cnx) < 2)
         ret = 1;
 
     return ret;
@@ -891,7 +1359,7 @@ int picoquic_prepare_packet_0rtt(picoquic_cnx_t * cnx, picoquic_packet * packet,
     size_t header_length = 0;
     uint8_t * bytes = packet->bytes;
     size_t length = 0;
-    size_t checksum_overhead = picoquic_aead_get_checksum_length(cnx->aead_0rtt_encrypt_ctx);
+    size_t checksum_overhead = picoquic_aead_get_checksum_length(cnx->cold->aead_0rtt_encrypt_ctx);
 
     stream = picoquic_find_ready_stream(cnx, stream_restricted);
 
@@ -924,15 +1392,12 @@ int picoquic_prepare_packet_0rtt(picoquic_cnx_t * cnx, picoquic_packet * packet,
                 break;
             }
         }
-        /* Encode the stream frame */
-        if (stream != NULL)
+        /* Encode the stream frames */
+        ret = picoquic_prepare_stream_frames(cnx, stream, stream_restricted, &bytes[length],
+            cnx->send_mtu - checksum_overhead - length, &data_bytes);
+        if (ret == 0)
         {
-            ret = picoquic_prepare_stream_frame(cnx, stream, &bytes[length],
-                cnx->send_mtu - checksum_overhead - length, &data_bytes);
-            if (ret == 0)
-            {
-                length += data_bytes;
-            }
+            length += data_bytes;
         }
     }
 
@@ -951,10 +1416,10 @@ int picoquic_prepare_packet_0rtt(picoquic_cnx_t * cnx, picoquic_packet * packet,
         packet->checksum_overhead = checksum_overhead;
         *send_length = length;
 
-        picoquic_queue_for_retransmit(cnx, packet, length, current_time);
+        picoquic_queue_for_retransmit(cnx, packet, header_length, length, current_time);
 
         /* Accounting of zero rtt packets sent */
-        cnx->nb_zero_rtt_sent++;
+        cnx->cold->nb_zero_rtt_sent++;
     }
     else
     {
@@ -1120,7 +1585,7 @@ int picoquic_prepare_packet_client_init(picoquic_cnx_t * cnx, picoquic_packet *
         }
     }
 
-    if (ret == 0 && length == 0 && cnx->aead_0rtt_encrypt_ctx != NULL)
+    if (ret == 0 && length == 0 && cnx->cold->aead_0rtt_encrypt_ctx != NULL)
     {
         /* Consider sending 0-RTT */
         ret = picoquic_prepare_packet_0rtt(cnx, packet, current_time, send_buffer, send_length);
@@ -1154,7 +1619,7 @@ int picoquic_prepare_packet_client_init(picoquic_cnx_t * cnx, picoquic_packet *
             packet->checksum_overhead = checksum_overhead;
             *send_length = length;
 
-            picoquic_queue_for_retransmit(cnx, packet, length, current_time);
+            picoquic_queue_for_retransmit(cnx, packet, header_length, length, current_time);
         }
         else
         {
@@ -1298,7 +1763,7 @@ int picoquic_prepare_packet_server_init(picoquic_cnx_t * cnx, picoquic_packet *
         packet->checksum_overhead = checksum_overhead;
         *send_length = length;
 
-        picoquic_queue_for_retransmit(cnx, packet, length, current_time);
+        picoquic_queue_for_retransmit(cnx, packet, header_length, length, current_time);
     }
     else
     {
@@ -1392,7 +1857,7 @@ int picoquic_prepare_packet_closing(picoquic_cnx_t * cnx, picoquic_packet * pack
         {
             cnx->cnx_state = picoquic_state_disconnected;
         }
-        else if (current_time > cnx->next_wake_time)
+        else if (current_time >= cnx->next_wake_time)
         {
             uint64_t delta_t = cnx->rtt_min;
             if (delta_t * 2 < cnx->retransmit_timer)
@@ -1542,7 +2007,7 @@ int picoquic_prepare_packet_closing(picoquic_cnx_t * cnx, picoquic_packet * pack
         packet->checksum_overhead = checksum_overhead;
         *send_length = length;
 
-        picoquic_queue_for_retransmit(cnx, packet, length, current_time);
+        picoquic_queue_for_retransmit(cnx, packet, header_length, length, current_time);
     }
     else
     {
@@ -1557,7 +2022,6 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t * cnx, picoquic_packet * packet
     uint64_t current_time, uint8_t * send_buffer, size_t * send_length)
 {
     int ret = 0;
-    /* TODO: manage multiple streams. */
     picoquic_stream_head * stream = NULL;
     int stream_restricted = 0;
     picoquic_packet_type_enum packet_type = picoquic_packet_1rtt_protected_phi0;
@@ -1570,8 +2034,6 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t * cnx, picoquic_packet * packet
     size_t length = 0;
     size_t checksum_overhead = picoquic_get_checksum_length(cnx, is_cleartext_mode);
 
-    stream = picoquic_find_ready_stream(cnx, stream_restricted);
-
     if (ret == 0 && retransmit_possible &&
         (length = picoquic_retransmit_needed(cnx, current_time, packet, &is_cleartext_mode, &header_length)) > 0)
     {
@@ -1590,6 +2052,9 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t * cnx, picoquic_packet * packet
     }
     else if (ret == 0)
     {
+        /* Look for the stream after processing losses, which may have queued data */
+        stream = picoquic_find_ready_stream(cnx, stream_restricted);
+
         length = picoquic_create_packet_header(
             cnx, packet_type, cnx_id, cnx->send_sequence, bytes);
         header_length = length;
@@ -1604,10 +2069,17 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t * cnx, picoquic_packet * packet
         }
         else
         {
+            int is_ack_needed = picoquic_is_ack_needed(cnx, current_time);
+            uint64_t highest_ack_sent = cnx->highest_ack_sent;
+            uint64_t highest_ack_time = cnx->highest_ack_time;
+            int ack_needed = cnx->ack_needed;
+            size_t ack_end = length;
+
             if (picoquic_prepare_ack_frame(cnx, current_time, &bytes[length],
                 cnx->send_mtu - checksum_overhead - length, &data_bytes) == 0)
             {
                 length += data_bytes;
+                ack_end = length;
             }
 
             if (cnx->cwin > cnx->bytes_in_transit)
@@ -1631,43 +2103,45 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t * cnx, picoquic_packet * packet
                     }
                 }
                 /* If necessary, encode the max data frame */
-                if (ret == 0 && 2 * cnx->data_received > cnx->maxdata_local)
+                if (ret == 0)
                 {
-                    ret = picoquic_prepare_max_data_frame(cnx, 2 * cnx->data_received, &bytes[length],
+                    ret = picoquic_prepare_required_max_data_frame(cnx, current_time, &bytes[length],
                         cnx->send_mtu - checksum_overhead - length, &data_bytes);
 
                     if (ret == 0)
                     {
                         length += data_bytes;
                     }
-                    else if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
-                    {
-                        ret = 0;
-                    }
                 }
                 /* If necessary, encode the max stream data frames */
-                ret = picoquic_prepare_required_max_stream_data_frames(cnx, &bytes[length],
+                ret = picoquic_prepare_required_max_stream_data_frames(cnx, current_time, &bytes[length],
                     cnx->send_mtu - checksum_overhead - length, &data_bytes);
 
                 if (ret == 0)
                 {
                     length += data_bytes;
                 }
-                /* Encode the stream frame */
-                if (stream != NULL)
+                /* Encode the stream frames */
+                if (ret == 0)
                 {
-                    ret = picoquic_prepare_stream_frame(cnx, stream, &bytes[length],
+                    ret = picoquic_prepare_stream_frames(cnx, stream, stream_restricted, &bytes[length],
                         cnx->send_mtu - checksum_overhead - length, &data_bytes);
 
-                    if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL)
+                    if (ret == 0)
                     {
-                        ret = 0;
+                        length += data_bytes;
                     }
                 }
             }
-            if (ret == 0)
+
+            if (ret == 0 && length == ack_end && !is_ack_needed)
             {
-                length += data_bytes;
+                /* Nothing could be added to an ACK that is not yet due, e.g. because the
+                 * stream is blocked by flow control. Do not send it, and keep the ACK pending. */
+                length = 0;
+                cnx->highest_ack_sent = highest_ack_sent;
+                cnx->highest_ack_time = highest_ack_time;
+                cnx->ack_needed = ack_needed;
             }
         }
     }
@@ -1700,7 +2174,7 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t * cnx, picoquic_packet * packet
         packet->checksum_overhead = checksum_overhead;
         *send_length = length;
 
-        picoquic_queue_for_retransmit(cnx, packet, length, current_time);
+        picoquic_queue_for_retransmit(cnx, packet, header_length, length, current_time);
     }
     else
     {
@@ -2164,6 +2638,8 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
 {
     int ret = 0;
 
+    *send_length = 0;
+
     /* Check that the connection is still alive */
     if (cnx->cnx_state < picoquic_state_disconnecting &&
         (current_time - cnx->latest_progress_time) > PICOQUIC_MICROSEC_SILENCE_MAX)
@@ -2223,6 +2699,16 @@ int picoquic_prepare_packet(picoquic_cnx_t * cnx, picoquic_packet * packet,
         }
     }
 
+    /* A connection that has nothing to send at this time shall not be found
+     * ready again before the time moves on. The closing states set the wake
+     * time directly, so the connection is always repositioned in the heap. */
+    if (ret == 0 && *send_length == 0 && cnx->next_wake_time <= current_time)
+    {
+        cnx->next_wake_time = current_time + 1;
+    }
+
+    picoquic_reinsert_by_wake_time(cnx->quic, cnx);
+
 	return ret;
 }
 #endif
@@ -2246,5 +2732,10 @@ int picoquic_close(picoquic_cnx_t * cnx, uint16_t reason_code)
         ret = -1;
     }
 
+    if (ret == 0)
+    {
+        picoquic_wake_up_cnx(cnx);
+    }
+
     return ret;
 }
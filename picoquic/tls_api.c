@@ -198,37 +198,38 @@ uint64_t picoquic_crypto_uniform_random(picoquic_quic_t * quic, uint64_t rnd_max
  * adequate for non critical random numbers, such as sequence numbers or padding.
  *
  * The following is an implementation of xorshift1024* suggested by Vigna.
- * The state must be seeded so that it is not everywhere zero. */
-
-static uint64_t public_random_seed[16];
-static int public_random_index = 0;
-
-uint64_t picoquic_public_random_64(void) {
-    const uint64_t s0 = public_random_seed[public_random_index++];
-    uint64_t s1 = public_random_seed[public_random_index &= 15];
+ * The state must be seeded so that it is not everywhere zero. It is kept in the
+ * QUIC context, so each thread running its own context has its own generator. */
+
+uint64_t picoquic_public_random_64(picoquic_quic_t * quic) {
+    const uint64_t s0 = quic->public_random_seed[quic->public_random_index];
+    uint64_t s1;
+    quic->public_random_index = (quic->public_random_index + 1) & 15;
+    s1 = quic->public_random_seed[quic->public_random_index];
     s1 ^= s1 << 31; // a
     s1 ^= s1 >> 11; // b
     s1 ^= s0 ^ (s0 >> 30); // c
-    public_random_seed[public_random_index] = s1;
+    quic->public_random_seed[quic->public_random_index] = s1;
     return s1 * (uint64_t)1181783497276652981;
 }
 
 void picoquic_public_random_seed(picoquic_quic_t * quic)
 {
-    picoquic_crypto_random(quic, public_random_seed, sizeof(public_random_seed));
+    picoquic_crypto_random(quic, quic->public_random_seed, sizeof(quic->public_random_seed));
+    quic->public_random_index = 0;
     for (int i = 0; i < 16; i++)
     {
-        (void)picoquic_public_random_64();
+        (void)picoquic_public_random_64(quic);
     }
 }
 
-void picoquic_public_random(void * buf, size_t len)
+void picoquic_public_random(picoquic_quic_t * quic, void * buf, size_t len)
 {
     uint8_t *x = buf;
 
     while (len > 0)
     {
-        uint64_t y = picoquic_public_random_64();
+        uint64_t y = picoquic_public_random_64(quic);
         for (int i = 0; i < 8 && len > 0; i++)
         {
             *x++ = (uint8_t)( y & 255);
@@ -238,13 +239,13 @@ void picoquic_public_random(void * buf, size_t len)
     }
 }
 
-uint64_t picoquic_public_uniform_random(uint64_t rnd_max)
+uint64_t picoquic_public_uniform_random(picoquic_quic_t * quic, uint64_t rnd_max)
 {
     uint64_t rnd;
     uint64_t rnd_min = ((uint64_t)((int64_t)-1)) % rnd_max;
 
     do {
-        rnd = picoquic_public_random_64();
+        rnd = picoquic_public_random_64(quic);
     } while (rnd < rnd_min);
 
     return rnd%rnd_max;
@@ -420,7 +421,7 @@ int picoquic_server_encrypt_ticket_call_back(ptls_encrypt_ticket_t * encrypt_tic
         else if ((ret = ptls_buffer_reserve(dst, 8 + src.len + aead_enc->algo->tag_size)) == 0)
         {
             /* Create and store the ticket sequence number */
-            uint64_t seq_num = picoquic_public_random_64();
+            uint64_t seq_num = picoquic_public_random_64(quic);
             picoformat_64(dst->base + dst->off, seq_num);
             dst->off += 8;
             /* Run AEAD encryption */
@@ -739,36 +740,36 @@ int picoquic_tlscontext_create(picoquic_quic_t * quic, picoquic_cnx_t * cnx, uin
 		}
 		else if (ctx->client_mode)
 		{
-			if (cnx->sni != NULL)
+			if (cnx->cold->sni != NULL)
 			{
-				ptls_set_server_name(ctx->tls, cnx->sni, strlen(cnx->sni));
+				ptls_set_server_name(ctx->tls, cnx->cold->sni, strlen(cnx->cold->sni));
 			}
 
-			if (cnx->alpn != NULL)
+			if (cnx->cold->alpn != NULL)
 			{
-				ctx->alpn_vec.base = (uint8_t *) cnx->alpn;
-				ctx->alpn_vec.len = strlen(cnx->alpn);
+				ctx->alpn_vec.base = (uint8_t *) cnx->cold->alpn;
+				ctx->alpn_vec.len = strlen(cnx->cold->alpn);
 				ctx->handshake_properties.client.negotiated_protocols.count = 1;
 				ctx->handshake_properties.client.negotiated_protocols.list = &ctx->alpn_vec;
 			}
 
 			picoquic_tls_set_extensions(cnx, ctx);
 
-            if (cnx->sni != NULL && cnx->alpn != NULL)
+            if (cnx->cold->sni != NULL && cnx->cold->alpn != NULL)
             {
                 uint8_t * ticket = NULL;
                 uint16_t ticket_length = 0;
 
                 if (picoquic_get_ticket(cnx->quic->p_first_ticket, current_time,
-                    cnx->sni, (uint16_t)strlen(cnx->sni), cnx->alpn, (uint16_t)strlen(cnx->alpn),
+                    cnx->cold->sni, (uint16_t)strlen(cnx->cold->sni), cnx->cold->alpn, (uint16_t)strlen(cnx->cold->alpn),
                     &ticket, &ticket_length) == 0)
                 { 
                     ctx->handshake_properties.client.session_ticket.base = ticket;
                     ctx->handshake_properties.client.session_ticket.len = ticket_length;
 
-                    ctx->handshake_properties.client.max_early_data_size = &cnx->max_early_data_size;
+                    ctx->handshake_properties.client.max_early_data_size = &cnx->cold->max_early_data_size;
 
-                    cnx->psk_cipher_suite_id = PICOPARSE_16(ticket + 8);
+                    cnx->cold->psk_cipher_suite_id = PICOPARSE_16(ticket + 8);
                 }
             }
 		}
@@ -950,10 +951,10 @@ int picoquic_setup_0RTT_aead_contexts(picoquic_cnx_t * cnx, int is_server)
 
         if (ret == 0 && is_server == 0)
         {
-            cnx->aead_0rtt_encrypt_ctx = (void *)
+            cnx->cold->aead_0rtt_encrypt_ctx = (void *)
                 ptls_aead_new(cipher->aead, cipher->hash, 1, secret);
 
-            if (cnx->aead_0rtt_encrypt_ctx == NULL)
+            if (cnx->cold->aead_0rtt_encrypt_ctx == NULL)
             {
                 ret = PICOQUIC_ERROR_MEMORY;
             }
@@ -961,7 +962,7 @@ int picoquic_setup_0RTT_aead_contexts(picoquic_cnx_t * cnx, int is_server)
 
         if (ret == 0)
         {
-            cnx->aead_0rtt_decrypt_ctx = (void *)
+            cnx->cold->aead_0rtt_decrypt_ctx = (void *)
                 ptls_aead_new(cipher->aead, cipher->hash, 0, secret);
         }
     }
@@ -1003,7 +1004,7 @@ int picoquic_setup_1RTT_aead_contexts(picoquic_cnx_t * cnx, int is_server)
                 ret = PICOQUIC_ERROR_MEMORY;
             }
 
-            cnx->aead_de_encrypt_ctx = (void *)
+            cnx->cold->aead_de_encrypt_ctx = (void *)
                 ptls_aead_new(cipher->aead, cipher->hash, 0, secret);
         }
 
@@ -1101,28 +1102,28 @@ size_t picoquic_aead_de_encrypt(picoquic_cnx_t *cnx, uint8_t * output, uint8_t *
     uint64_t seq_num, uint8_t * auth_data, size_t auth_data_length)
 {
     return picoquic_aead_decrypt_generic(output, input, input_length, seq_num,
-        auth_data, auth_data_length, cnx->aead_de_encrypt_ctx);
+        auth_data, auth_data_length, cnx->cold->aead_de_encrypt_ctx);
 }
 
 size_t picoquic_aead_0rtt_decrypt(picoquic_cnx_t *cnx, uint8_t * output, uint8_t * input, size_t input_length,
     uint64_t seq_num, uint8_t * auth_data, size_t auth_data_length)
 {
     return picoquic_aead_decrypt_generic(output, input, input_length, seq_num,
-        auth_data, auth_data_length, cnx->aead_0rtt_decrypt_ctx);
+        auth_data, auth_data_length, cnx->cold->aead_0rtt_decrypt_ctx);
 }
 
 size_t picoquic_aead_cleartext_decrypt(picoquic_cnx_t *cnx, uint8_t * output, uint8_t * input, size_t input_length,
     uint64_t seq_num, uint8_t * auth_data, size_t auth_data_length)
 {
     return picoquic_aead_decrypt_generic(output, input, input_length, seq_num,
-        auth_data, auth_data_length, cnx->aead_decrypt_cleartext_ctx);
+        auth_data, auth_data_length, cnx->cold->aead_decrypt_cleartext_ctx);
 }
 
 size_t picoquic_aead_cleartext_de_encrypt(picoquic_cnx_t *cnx, uint8_t * output, uint8_t * input, size_t input_length,
     uint64_t seq_num, uint8_t * auth_data, size_t auth_data_length)
 {
     return picoquic_aead_decrypt_generic(output, input, input_length, seq_num,
-        auth_data, auth_data_length, cnx->aead_de_encrypt_cleartext_ctx);
+        auth_data, auth_data_length, cnx->cold->aead_de_encrypt_cleartext_ctx);
 }
 
 size_t picoquic_aead_encrypt_generic(uint8_t * output, uint8_t * input, size_t input_length,
@@ -1148,7 +1149,7 @@ size_t picoquic_aead_0rtt_encrypt(picoquic_cnx_t *cnx, uint8_t * output, uint8_t
     uint64_t seq_num, uint8_t * auth_data, size_t auth_data_length)
 {
     return picoquic_aead_encrypt_generic(output, input, input_length, seq_num,
-        auth_data, auth_data_length, cnx->aead_0rtt_encrypt_ctx);
+        auth_data, auth_data_length, cnx->cold->aead_0rtt_encrypt_ctx);
 }
 
 
@@ -1156,7 +1157,7 @@ size_t picoquic_aead_cleartext_encrypt(picoquic_cnx_t *cnx, uint8_t * output, ui
     uint64_t seq_num, uint8_t * auth_data, size_t auth_data_length)
 {
     return picoquic_aead_encrypt_generic(output, input, input_length, seq_num,
-        auth_data, auth_data_length, cnx->aead_encrypt_cleartext_ctx);
+        auth_data, auth_data_length, cnx->cold->aead_encrypt_cleartext_ctx);
 }
 
 
@@ -1300,11 +1301,11 @@ int picoquic_setup_cleartext_aead_contexts(picoquic_cnx_t * cnx, int is_server)
         if (ret == 0)
         {
             /* Create the AEAD contexts */
-            cnx->aead_encrypt_cleartext_ctx = (void *)
+            cnx->cold->aead_encrypt_cleartext_ctx = (void *)
                 ptls_aead_new(aead, algo, 1, secret1);
-            cnx->aead_decrypt_cleartext_ctx = (void *)
+            cnx->cold->aead_decrypt_cleartext_ctx = (void *)
                 ptls_aead_new(aead, algo, 0, secret2);
-            cnx->aead_de_encrypt_cleartext_ctx = (void *)
+            cnx->cold->aead_de_encrypt_cleartext_ctx = (void *)
                 ptls_aead_new(aead, algo, 0, secret1);
         }
     }
@@ -1407,6 +1408,7 @@ int picoquic_tlsinput_stream_zero(picoquic_cnx_t * cnx)
 		{
 			picoquic_dequeue_retransmit_packet(cnx, cnx->retransmit_newest, 1);
 		}
+		picoquic_delete_ack_records(cnx, UINT64_MAX);
 
 		/* Reset the streams */
 		picoquic_clear_stream(&cnx->first_stream);
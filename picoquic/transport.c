@@ -203,7 +203,7 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t * cnx, int extension_mo
 			byte_index += 2;
 			picoformat_16(bytes + byte_index, PICOQUIC_RESET_SECRET_SIZE);
 			byte_index += 2;
-			memcpy(bytes + byte_index, cnx->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
+			memcpy(bytes + byte_index, cnx->cold->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
 			byte_index += PICOQUIC_RESET_SECRET_SIZE;
 		}
 
@@ -402,6 +402,7 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t * cnx, int extension_mo
 						{
 							cnx->remote_parameters.initial_max_data = PICOPARSE_32(bytes + byte_index);
                             cnx->maxdata_remote = cnx->remote_parameters.initial_max_data;
+                            picoquic_unblock_streams(cnx);
 							cnx->max_stream_id_bidir_remote = cnx->local_parameters.initial_max_stream_id_bidir;
 						}
 						break;
@@ -465,7 +466,7 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t * cnx, int extension_mo
 						}
 						else
 						{
-							memcpy(cnx->reset_secret, bytes + byte_index, PICOQUIC_RESET_SECRET_SIZE);
+							memcpy(cnx->cold->reset_secret, bytes + byte_index, PICOQUIC_RESET_SECRET_SIZE);
 						}
 						break;
                     case picoquic_transport_parameter_ack_delay_exponent:
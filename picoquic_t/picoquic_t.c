@@ -32,7 +32,11 @@ typedef struct st_picoquic_test_def_t {
 
 static picoquic_test_def_t test_table[] = {
     { "picohash", picohash_test },
+    { "picohash_resize", picohash_resize_test },
     { "cnxcreation", cnxcreation_test },
+    { "cnx_pool", cnx_pool_test },
+    { "cnx_shard", cnx_shard_test },
+    { "stream_index", stream_index_test },
     { "parseheader", parseheadertest },
     { "pn2pn64", pn2pn64test },
     { "intformat", intformattest},
@@ -43,8 +47,28 @@ static picoquic_test_def_t test_table[] = {
     { "StreamZeroFrame", StreamZeroFrameTest },
     { "sack", sacktest },
     { "sendack", sendacktest },
+    { "sack_tracker", sack_tracker_test },
     { "ackrange", ackrange_test },
     { "ack_of_ack", ack_of_ack_test },
+    { "ack_only_record", ack_only_record_test },
+    { "retransmit_index", retransmit_index_test },
+    { "ack_range_cost", ack_range_cost_test },
+    { "lost_stream_data", lost_stream_data_test },
+    { "stream_scheduler", stream_scheduler_test },
+    { "stream_ready_list", stream_ready_list_test },
+    { "stream_priority", stream_priority_test },
+    { "stream_send_ref", stream_send_ref_test },
+    { "stream_pull", stream_pull_test },
+    { "stream_packing", stream_packing_test },
+    { "stream_send_buffer", stream_send_buffer_test },
+    { "stream_posted_data", stream_posted_data_test },
+    { "stream_credit_blocked", stream_credit_blocked_test },
+    { "stream_reassembly", stream_reassembly_test },
+    { "stream_in_order", stream_in_order_test },
+    { "receive_window", receive_window_test },
+    { "receive_budget", receive_budget_test },
+    { "max_stream_data_list", max_stream_data_list_test },
+    { "stream_gc", stream_gc_test },
     { "sim_link", sim_link_test },
     { "logger", logger_test },
     { "tls_api", tls_api_test },
@@ -76,7 +100,12 @@ static picoquic_test_def_t test_table[] = {
     { "sockets", socket_test },
     { "ticket_store", ticket_store_test },
     { "session_resume", session_resume_test},
-    { "zero_rtt", zero_rtt_test }
+    { "zero_rtt", zero_rtt_test },
+    { "wake_time", wake_time_test },
+    { "ready_cnx", ready_cnx_test },
+    { "command_queue", command_queue_test },
+    { "cnx_layout", cnx_layout_test },
+    { "packet_pool", packet_pool_test }
 };
 
 static size_t nb_tests = sizeof(test_table) / sizeof(picoquic_test_def_t);
@@ -100,6 +100,40 @@ static const char *default_server_key_file  = "certs/key.pem";
 
 #endif
 
+/* Worker threads of the sharded server and of the benchmark */
+#ifdef _WINDOWS
+typedef HANDLE demo_thread_t;
+typedef DWORD (WINAPI * demo_thread_fn)(LPVOID);
+#define DEMO_THREAD_FN(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define DEMO_THREAD_RETURN return 0
+#else
+#include <pthread.h>
+typedef pthread_t demo_thread_t;
+typedef void * (*demo_thread_fn)(void *);
+#define DEMO_THREAD_FN(name, arg) static void * name(void * arg)
+#define DEMO_THREAD_RETURN return NULL
+#endif
+
+static int demo_thread_start(demo_thread_t * thread, demo_thread_fn thread_fn, void * arg)
+{
+#ifdef _WINDOWS
+    *thread = CreateThread(NULL, 0, thread_fn, arg, 0, NULL);
+    return (*thread == NULL) ? -1 : 0;
+#else
+    return pthread_create(thread, NULL, thread_fn, arg);
+#endif
+}
+
+static void demo_thread_join(demo_thread_t thread)
+{
+#ifdef _WINDOWS
+    (void)WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    (void)pthread_join(thread, NULL);
+#endif
+}
+
 static const int   default_server_port = 4443;
 static const char *default_server_name = "::";
 static const char *ticket_store_filename = "demo_ticket_store.bin";
@@ -224,9 +258,14 @@ static void first_server_callback_delete_context(picoquic_first_server_callback_
         free(stream_ctx);
     }
 
+    free(ctx->buffer);
     free(ctx);
 }
 
+/* The sharded server and the benchmark run many connections in parallel,
+ * and do not log the individual stream events */
+static int first_server_quiet = 0;
+
 static void first_server_callback(picoquic_cnx_t * cnx,
     uint64_t stream_id, uint8_t * bytes, size_t length,
     picoquic_call_back_event_t fin_or_event, void * callback_ctx)
@@ -235,8 +274,11 @@ static void first_server_callback(picoquic_cnx_t * cnx,
         (picoquic_first_server_callback_ctx_t*)callback_ctx;
     picoquic_first_server_stream_ctx_t * stream_ctx = NULL;
 
-    printf("Server CB, Stream: %" PRIu64 ", %" PRIst " bytes, fin=%d\n",
-        stream_id, length, fin_or_event);
+    if (first_server_quiet == 0)
+    {
+        printf("Server CB, Stream: %" PRIu64 ", %" PRIst " bytes, fin=%d\n",
+            stream_id, length, fin_or_event);
+    }
 
     if (fin_or_event == picoquic_callback_close ||
         fin_or_event == picoquic_callback_application_close)
@@ -342,8 +384,11 @@ static void first_server_callback(picoquic_cnx_t * cnx,
             char buf[256];
 
             stream_ctx->command[stream_ctx->command_length] = 0;
-            printf("Server CB, Stream: %" PRIu64 ", Processing command: %s\n",
-                stream_id, strip_endofline(buf, sizeof(buf), (char *)&stream_ctx->command));
+            if (first_server_quiet == 0)
+            {
+                printf("Server CB, Stream: %" PRIu64 ", Processing command: %s\n",
+                    stream_id, strip_endofline(buf, sizeof(buf), (char *)&stream_ctx->command));
+            }
             /* if data generated, just send it. Otherwise, just FIN the stream. */
             stream_ctx->status = picoquic_first_server_stream_status_finished;
             if (http0dot9_get(stream_ctx->command, stream_ctx->command_length,
@@ -362,8 +407,11 @@ static void first_server_callback(picoquic_cnx_t * cnx,
             char buf[256];
 
             stream_ctx->command[stream_ctx->command_length] = 0;
-            printf("Server CB, Stream: %" PRIu64 ", Partial command: %s\n",
-                stream_id, strip_endofline(buf, sizeof(buf), (char *)&stream_ctx->command));
+            if (first_server_quiet == 0)
+            {
+                printf("Server CB, Stream: %" PRIu64 ", Partial command: %s\n",
+                    stream_id, strip_endofline(buf, sizeof(buf), (char *)&stream_ctx->command));
+            }
         }
     }
 
@@ -512,11 +560,10 @@ int quic_server(const char * server_name, int server_port,
                     picoquic_delete_stateless_packet(sp);
                 }
 
-                cnx_next = picoquic_get_first_cnx(qserver);
-
-                while (ret == 0 && cnx_next != NULL)
+                /* Only the connections that are due are serviced */
+                while (ret == 0 && (cnx_next = picoquic_get_next_ready_cnx(qserver, current_time)) != NULL)
                 {
-                    p = picoquic_create_packet();
+                    p = picoquic_alloc_packet(qserver);
 
                     if (p == NULL)
                     {
@@ -530,12 +577,12 @@ int quic_server(const char * server_name, int server_port,
                         if (ret == PICOQUIC_ERROR_DISCONNECTED)
                         {
                             ret = 0;
-                            free(p);
+                            picoquic_recycle_packet(qserver, p);
 
                             printf("%" PRIx64 ": ", picoquic_get_initial_cnxid(cnx_next));
                             printf("retrans= %d, spurious= %d, max sp gap = %d, max sp delay = %d\n",
-                                (int)cnx_next->nb_retransmission_total, (int)cnx_next->nb_spurious,
-                                (int)cnx_next->max_reorder_gap, (int)cnx_next->max_spurious_rtt);
+                                (int)cnx_next->cold->nb_retransmission_total, (int)cnx_next->cold->nb_spurious,
+                                (int)cnx_next->cold->max_reorder_gap, (int)cnx_next->cold->max_spurious_rtt);
 
                             picoquic_delete_cnx(cnx_next);
                             break;
@@ -547,7 +594,7 @@ int quic_server(const char * server_name, int server_port,
                             int local_addr_len = 0;
                             struct sockaddr * local_addr;
 
-                            if (p->length > 0)
+                            if (send_length > 0)
                             {
                                 if (just_once != 0)
                                 {
@@ -570,9 +617,11 @@ int quic_server(const char * server_name, int server_port,
                                         0, send_buffer, send_length, current_time);
                                 }
                             }
-                            else
+
+                            if (p->length == 0)
                             {
-                                free(p);
+                                /* The packet was not queued for retransmission */
+                                picoquic_recycle_packet(qserver, p);
                                 p = NULL;
                             }
                         }
@@ -581,8 +630,6 @@ int quic_server(const char * server_name, int server_port,
                         {
                             break;
                         }
-
-                        cnx_next = picoquic_get_next_cnx(cnx_next);
                     }
                 }
             }
@@ -602,6 +649,747 @@ int quic_server(const char * server_name, int server_port,
 }
 
 
+/*
+ * Sharded server. Each worker thread runs its own QUIC context and its own
+ * set of sockets, all bound to the server port with SO_REUSEPORT. The shard
+ * index of the worker is encoded in the connection IDs that it allocates.
+ * When the kernel supports it, a steering program delivers the packets to
+ * the right worker. Otherwise, or for packets that reach the wrong worker,
+ * the packets are forwarded to the owner through a loopback socket, prefixed
+ * by the addresses on which they were received.
+ */
+
+typedef struct st_demo_forward_header_t {
+    struct sockaddr_storage addr_from;
+    struct sockaddr_storage addr_to;
+    unsigned long if_index_to;
+} demo_forward_header_t;
+
+typedef struct st_demo_shard_t {
+    picoquic_shard_ctx_t shard_ctx;
+    struct st_demo_shard_t * shards;
+    picoquic_server_sockets_t server_sockets;
+    SOCKET_TYPE forward_socket;
+    struct sockaddr_in forward_addr;
+    const char * pem_cert;
+    const char * pem_key;
+    int do_hrr;
+    uint8_t * reset_seed;
+    demo_thread_t thread;
+    int ret;
+} demo_shard_t;
+
+/* The forwarding socket is bound to the loopback address, so that only local
+ * senders can reach it */
+static int demo_open_forward_socket(SOCKET_TYPE * forward_socket, struct sockaddr_in * forward_addr)
+{
+    int ret = 0;
+    socklen_t addr_length = sizeof(struct sockaddr_in);
+
+    memset(forward_addr, 0, sizeof(struct sockaddr_in));
+    forward_addr->sin_family = AF_INET;
+    forward_addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    *forward_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (*forward_socket == INVALID_SOCKET ||
+        bind(*forward_socket, (struct sockaddr *)forward_addr, addr_length) != 0 ||
+        getsockname(*forward_socket, (struct sockaddr *)forward_addr, &addr_length) != 0)
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static void demo_shard_forward(demo_shard_t * shard, demo_shard_t * target,
+    uint8_t * bytes, int length, struct sockaddr_storage * addr_from,
+    struct sockaddr_storage * addr_to, unsigned long if_index_to)
+{
+    uint8_t forward_buffer[sizeof(demo_forward_header_t) + 1536];
+    demo_forward_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(&header.addr_from, addr_from, sizeof(struct sockaddr_storage));
+    memcpy(&header.addr_to, addr_to, sizeof(struct sockaddr_storage));
+    header.if_index_to = if_index_to;
+
+    if (length > 0 && (size_t)length <= sizeof(forward_buffer) - sizeof(header))
+    {
+        memcpy(forward_buffer, &header, sizeof(header));
+        memcpy(forward_buffer + sizeof(header), bytes, length);
+
+        (void)sendto(shard->forward_socket, (const char *)forward_buffer, (int)(sizeof(header) + length), 0,
+            (struct sockaddr *)&target->forward_addr, sizeof(struct sockaddr_in));
+    }
+}
+
+/* Forwarded packets are only accepted from the forwarding socket of another shard,
+ * since the header carries the peer addresses that the server will trust */
+static int demo_is_shard_forwarder(demo_shard_t * shard, struct sockaddr_storage * addr_from)
+{
+    int is_forwarder = 0;
+    struct sockaddr_in * from4 = (struct sockaddr_in *)addr_from;
+
+    if (addr_from->ss_family == AF_INET && from4->sin_addr.s_addr == htonl(INADDR_LOOPBACK))
+    {
+        for (uint32_t i = 0; i < shard->shard_ctx.nb_shards; i++)
+        {
+            if (i != shard->shard_ctx.shard_index &&
+                shard->shards[i].forward_addr.sin_port == from4->sin_port)
+            {
+                is_forwarder = 1;
+                break;
+            }
+        }
+    }
+
+    return is_forwarder;
+}
+
+DEMO_THREAD_FN(demo_shard_worker, arg)
+{
+    demo_shard_t * shard = (demo_shard_t *)arg;
+    int ret = 0;
+    picoquic_quic_t *qserver = NULL;
+    picoquic_cnx_t *cnx = NULL;
+    SOCKET_TYPE sockets[PICOQUIC_NB_SERVER_SOCKETS + 1];
+    struct sockaddr_storage addr_from;
+    struct sockaddr_storage addr_to;
+    unsigned long if_index_to;
+    socklen_t from_length;
+    socklen_t to_length;
+    uint8_t buffer[sizeof(demo_forward_header_t) + 1536];
+    uint8_t send_buffer[1536];
+    size_t send_length = 0;
+    int bytes_recv;
+    int socket_rank;
+    picoquic_packet * p = NULL;
+    uint64_t current_time = picoquic_current_time();
+    uint64_t last_report_time = current_time;
+    uint64_t nb_handshakes = 0;
+    uint64_t nb_bytes_sent = 0;
+    uint64_t nb_forwarded = 0;
+    picoquic_stateless_packet_t * sp;
+    const int64_t report_interval = 1000000;
+
+    for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++)
+    {
+        sockets[i] = shard->server_sockets.s_socket[i];
+    }
+    sockets[PICOQUIC_NB_SERVER_SOCKETS] = shard->forward_socket;
+
+    qserver = picoquic_create(64, shard->pem_cert, shard->pem_key, NULL, first_server_callback, NULL,
+        picoquic_shard_cnx_id_callback, &shard->shard_ctx, shard->reset_seed, current_time, NULL, NULL, NULL, 0);
+
+    if (qserver == NULL)
+    {
+        printf("Could not create server context for shard %u\n", shard->shard_ctx.shard_index);
+        ret = -1;
+    }
+    else if (shard->do_hrr != 0)
+    {
+        picoquic_set_cookie_mode(qserver, 1);
+    }
+
+    while (ret == 0)
+    {
+        int64_t delta_t = picoquic_get_next_wake_delay(qserver, current_time, report_interval);
+        uint8_t * bytes = buffer;
+
+        from_length = to_length = sizeof(struct sockaddr_storage);
+        if_index_to = 0;
+        socket_rank = -1;
+
+        bytes_recv = picoquic_select_ex(sockets, PICOQUIC_NB_SERVER_SOCKETS + 1,
+            &addr_from, &from_length,
+            &addr_to, &to_length, &if_index_to,
+            buffer, sizeof(buffer),
+            delta_t, &current_time, &socket_rank);
+
+        if (bytes_recv < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        if (bytes_recv > 0 && socket_rank == PICOQUIC_NB_SERVER_SOCKETS)
+        {
+            /* Packet forwarded by another shard, never forwarded again */
+            if ((size_t)bytes_recv <= sizeof(demo_forward_header_t) ||
+                !demo_is_shard_forwarder(shard, &addr_from))
+            {
+                bytes_recv = 0;
+            }
+            else
+            {
+                demo_forward_header_t header;
+
+                memcpy(&header, buffer, sizeof(header));
+                memcpy(&addr_from, &header.addr_from, sizeof(struct sockaddr_storage));
+                memcpy(&addr_to, &header.addr_to, sizeof(struct sockaddr_storage));
+                if_index_to = header.if_index_to;
+                bytes = buffer + sizeof(demo_forward_header_t);
+                bytes_recv -= (int)sizeof(demo_forward_header_t);
+            }
+        }
+        else if (bytes_recv > 0)
+        {
+            int target = picoquic_get_packet_shard(bytes, (size_t)bytes_recv, shard->shard_ctx.nb_shards);
+
+            if (target >= 0 && (uint32_t)target != shard->shard_ctx.shard_index)
+            {
+                demo_shard_forward(shard, &shard->shards[target], bytes, bytes_recv,
+                    &addr_from, &addr_to, if_index_to);
+                nb_forwarded++;
+                bytes_recv = 0;
+            }
+        }
+
+        if (bytes_recv > 0)
+        {
+            /* Submit the packet to the server, ignoring errors as the single server loop does */
+            (void)picoquic_incoming_packet(qserver, bytes,
+                (size_t)bytes_recv, (struct sockaddr *) &addr_from,
+                (struct sockaddr *) &addr_to, if_index_to,
+                current_time);
+        }
+
+        while ((sp = picoquic_dequeue_stateless_packet(qserver)) != NULL)
+        {
+            (void)picoquic_send_through_server_sockets(&shard->server_sockets,
+                (struct sockaddr *) &sp->addr_to,
+                (sp->addr_to.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
+                (struct sockaddr *) &sp->addr_local,
+                (sp->addr_local.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
+                sp->if_index_local,
+                (const char *)sp->bytes, (int)sp->length);
+            picoquic_delete_stateless_packet(sp);
+        }
+
+        while (ret == 0 && (cnx = picoquic_get_next_ready_cnx(qserver, current_time)) != NULL)
+        {
+            p = picoquic_alloc_packet(qserver);
+
+            if (p == NULL)
+            {
+                ret = -1;
+            }
+            else
+            {
+                picoquic_state_enum previous_state = picoquic_get_cnx_state(cnx);
+
+                ret = picoquic_prepare_packet(cnx, p, current_time,
+                    send_buffer, sizeof(send_buffer), &send_length);
+
+                /* The server becomes ready when it sends its last handshake data,
+                 * and each connection that does counts as one handshake */
+                if (previous_state != picoquic_state_server_ready &&
+                    picoquic_get_cnx_state(cnx) == picoquic_state_server_ready)
+                {
+                    nb_handshakes++;
+                }
+
+                if (ret == PICOQUIC_ERROR_DISCONNECTED)
+                {
+                    ret = 0;
+                    picoquic_recycle_packet(qserver, p);
+                    picoquic_delete_cnx(cnx);
+                }
+                else if (ret == 0)
+                {
+                    if (send_length > 0)
+                    {
+                        int peer_addr_len = 0;
+                        struct sockaddr * peer_addr;
+                        int local_addr_len = 0;
+                        struct sockaddr * local_addr;
+
+                        picoquic_get_peer_addr(cnx, &peer_addr, &peer_addr_len);
+                        picoquic_get_local_addr(cnx, &local_addr, &local_addr_len);
+
+                        (void)picoquic_send_through_server_sockets(&shard->server_sockets,
+                            peer_addr, peer_addr_len, local_addr, local_addr_len,
+                            picoquic_get_local_if_index(cnx),
+                            (const char *)send_buffer, (int)send_length);
+                        nb_bytes_sent += send_length;
+                    }
+
+                    if (p->length == 0)
+                    {
+                        picoquic_recycle_packet(qserver, p);
+                    }
+                }
+                else
+                {
+                    picoquic_recycle_packet(qserver, p);
+                }
+            }
+        }
+
+        if (current_time >= last_report_time + report_interval)
+        {
+            double elapsed = (double)(current_time - last_report_time);
+
+            if (nb_handshakes > 0 || nb_bytes_sent > 0 || nb_forwarded > 0)
+            {
+                printf("Shard %u: %.1f handshakes/s, %.3f Gbps, %" PRIu64 " packets forwarded\n",
+                    shard->shard_ctx.shard_index, ((double)nb_handshakes) * 1000000.0 / elapsed,
+                    ((double)nb_bytes_sent) * 8.0 / (elapsed * 1000.0), nb_forwarded);
+                fflush(stdout);
+            }
+            nb_handshakes = 0;
+            nb_bytes_sent = 0;
+            nb_forwarded = 0;
+            last_report_time = current_time;
+        }
+    }
+
+    if (qserver != NULL)
+    {
+        picoquic_free(qserver);
+    }
+
+    shard->ret = ret;
+
+    DEMO_THREAD_RETURN;
+}
+
+int quic_server_sharded(int server_port, const char * pem_cert, const char * pem_key,
+    int do_hrr, uint8_t reset_seed[PICOQUIC_RESET_SECRET_SIZE], uint32_t nb_shards)
+{
+    int ret = 0;
+    uint32_t nb_started = 0;
+    demo_shard_t * shards = (demo_shard_t *)malloc(nb_shards * sizeof(demo_shard_t));
+
+    if (shards == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        memset(shards, 0, nb_shards * sizeof(demo_shard_t));
+
+        for (uint32_t i = 0; i < nb_shards; i++)
+        {
+            shards[i].forward_socket = INVALID_SOCKET;
+            for (int j = 0; j < PICOQUIC_NB_SERVER_SOCKETS; j++)
+            {
+                shards[i].server_sockets.s_socket[j] = INVALID_SOCKET;
+            }
+        }
+
+        /* The sockets are bound in shard order, so that the rank of each socket
+         * in the reuse port group matches the shard index. */
+        for (uint32_t i = 0; ret == 0 && i < nb_shards; i++)
+        {
+            shards[i].shard_ctx.shard_index = i;
+            shards[i].shard_ctx.nb_shards = nb_shards;
+            shards[i].shards = shards;
+            shards[i].pem_cert = pem_cert;
+            shards[i].pem_key = pem_key;
+            shards[i].do_hrr = do_hrr;
+            shards[i].reset_seed = reset_seed;
+
+            ret = picoquic_open_shard_server_sockets(&shards[i].server_sockets, server_port);
+
+            if (ret == 0)
+            {
+                ret = demo_open_forward_socket(&shards[i].forward_socket, &shards[i].forward_addr);
+            }
+
+            if (ret != 0)
+            {
+                printf("Could not open the sockets of shard %u\n", i);
+            }
+        }
+
+        if (ret == 0)
+        {
+            if (picoquic_attach_shard_steering(&shards[0].server_sockets, nb_shards) == 0)
+            {
+                printf("Packets are steered to the %u shards by the kernel\n", nb_shards);
+            }
+            else
+            {
+                printf("Packets are forwarded between the %u shards\n", nb_shards);
+            }
+        }
+
+        for (; ret == 0 && nb_started < nb_shards; nb_started++)
+        {
+            ret = demo_thread_start(&shards[nb_started].thread, demo_shard_worker, &shards[nb_started]);
+        }
+
+        for (uint32_t i = 0; i < nb_started; i++)
+        {
+            demo_thread_join(shards[i].thread);
+            if (shards[i].ret != 0)
+            {
+                ret = shards[i].ret;
+            }
+        }
+
+        for (uint32_t i = 0; i < nb_shards; i++)
+        {
+            picoquic_close_server_sockets(&shards[i].server_sockets);
+            if (shards[i].forward_socket != INVALID_SOCKET)
+            {
+                SOCKET_CLOSE(shards[i].forward_socket);
+            }
+        }
+
+        free(shards);
+    }
+
+    return ret;
+}
+
+/*
+ * Benchmark of the sharded design, without network. Each worker thread runs
+ * a server context configured as one shard, and a client context that opens
+ * connections whose initial ID maps to that shard. The packets are passed
+ * directly between the contexts, using simulated time, so the measure reflects
+ * the CPU cost of the handshakes and of the transfers. The benchmark runs with
+ * an increasing number of workers, to show how the throughput scales.
+ */
+
+#define DEMO_BENCH_NB_CNX 256
+#define DEMO_BENCH_NB_PARALLEL 16
+#define DEMO_BENCH_DOC_SIZE 100000
+#define DEMO_BENCH_SNI "picoquic.test"
+
+typedef struct st_demo_bench_slot_t {
+    picoquic_cnx_t * cnx;
+    struct sockaddr_in client_addr;
+    struct sockaddr_in server_addr;
+    int is_requested;
+} demo_bench_slot_t;
+
+typedef struct st_demo_bench_worker_t {
+    picoquic_shard_ctx_t shard_ctx;
+    const char * pem_cert;
+    const char * pem_key;
+    uint64_t nb_handshakes;
+    uint64_t nb_bytes;
+    uint64_t nb_misrouted;
+    demo_thread_t thread;
+    int ret;
+} demo_bench_worker_t;
+
+static void demo_bench_client_callback(picoquic_cnx_t * cnx,
+    uint64_t stream_id, uint8_t * bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void * callback_ctx)
+{
+    demo_bench_worker_t * worker = (demo_bench_worker_t *)callback_ctx;
+
+    (void)bytes;
+
+    if (stream_id != 0)
+    {
+        worker->nb_bytes += length;
+
+        if (fin_or_event == picoquic_callback_stream_fin)
+        {
+            worker->nb_handshakes++;
+            (void)picoquic_close(cnx, 0);
+        }
+        else if (fin_or_event == picoquic_callback_stream_reset)
+        {
+            (void)picoquic_close(cnx, 0);
+        }
+    }
+}
+
+static void demo_bench_set_addr(struct sockaddr_in * addr, uint8_t host, uint16_t port)
+{
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0A000000 | host);
+    addr->sin_port = htons(port);
+}
+
+DEMO_THREAD_FN(demo_bench_worker, arg)
+{
+    demo_bench_worker_t * worker = (demo_bench_worker_t *)arg;
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_quic_t * qserver = NULL;
+    picoquic_quic_t * qclient = NULL;
+    demo_bench_slot_t slot[DEMO_BENCH_NB_PARALLEL];
+    uint8_t send_buffer[1536];
+    size_t send_length = 0;
+    char request[64];
+    int request_length;
+    int nb_created = 0;
+    int nb_active = 0;
+    picoquic_stateless_packet_t * sp;
+
+    memset(slot, 0, sizeof(slot));
+    request_length = snprintf(request, sizeof(request), "GET /doc-%d.html\r\n", DEMO_BENCH_DOC_SIZE);
+
+    qserver = picoquic_create(DEMO_BENCH_NB_PARALLEL, worker->pem_cert, worker->pem_key, NULL,
+        first_server_callback, NULL, picoquic_shard_cnx_id_callback, &worker->shard_ctx,
+        NULL, simulated_time, &simulated_time, NULL, NULL, 0);
+    qclient = picoquic_create(DEMO_BENCH_NB_PARALLEL, NULL, NULL, NULL,
+        NULL, NULL, picoquic_shard_cnx_id_callback, &worker->shard_ctx,
+        NULL, simulated_time, &simulated_time, NULL, NULL, 0);
+
+    if (qserver == NULL || qclient == NULL ||
+        picoquic_preallocate_cnx(qserver, DEMO_BENCH_NB_PARALLEL) != 0 ||
+        picoquic_preallocate_cnx(qclient, DEMO_BENCH_NB_PARALLEL) != 0)
+    {
+        ret = -1;
+    }
+
+    while (ret == 0 && (nb_created < DEMO_BENCH_NB_CNX || nb_active > 0 ||
+        picoquic_get_first_cnx(qserver) != NULL))
+    {
+        int was_active = 0;
+        picoquic_cnx_t * cnx;
+
+        /* Open new connections in the free slots, with a new client address each time */
+        for (int i = 0; ret == 0 && i < DEMO_BENCH_NB_PARALLEL && nb_created < DEMO_BENCH_NB_CNX; i++)
+        {
+            if (slot[i].cnx == NULL)
+            {
+                demo_bench_set_addr(&slot[i].client_addr, 2, (uint16_t)(1024 + nb_created));
+                demo_bench_set_addr(&slot[i].server_addr, 1, (uint16_t)(4443 + i));
+                slot[i].is_requested = 0;
+                slot[i].cnx = picoquic_create_client_cnx(qclient, (struct sockaddr *)&slot[i].server_addr,
+                    simulated_time, 0, DEMO_BENCH_SNI, NULL, demo_bench_client_callback, worker);
+
+                if (slot[i].cnx == NULL)
+                {
+                    ret = -1;
+                }
+                else
+                {
+                    nb_created++;
+                    nb_active++;
+                }
+            }
+        }
+
+        /* Client to server */
+        for (int i = 0; ret == 0 && i < DEMO_BENCH_NB_PARALLEL; i++)
+        {
+            picoquic_packet * p;
+
+            if (slot[i].cnx == NULL)
+            {
+                continue;
+            }
+
+            if (slot[i].is_requested == 0 && picoquic_get_cnx_state(slot[i].cnx) == picoquic_state_client_ready)
+            {
+                slot[i].is_requested = 1;
+                ret = picoquic_add_to_stream(slot[i].cnx, 4, (const uint8_t *)request, request_length, 1);
+            }
+
+            if (ret == 0 && (p = picoquic_alloc_packet(qclient)) == NULL)
+            {
+                ret = -1;
+            }
+            else if (ret == 0)
+            {
+                ret = picoquic_prepare_packet(slot[i].cnx, p, simulated_time,
+                    send_buffer, sizeof(send_buffer), &send_length);
+
+                if (ret == PICOQUIC_ERROR_DISCONNECTED)
+                {
+                    ret = 0;
+                    picoquic_recycle_packet(qclient, p);
+                    picoquic_delete_cnx(slot[i].cnx);
+                    slot[i].cnx = NULL;
+                    nb_active--;
+                    was_active = 1;
+                }
+                else if (ret == 0)
+                {
+                    if (send_length > 0)
+                    {
+                        was_active = 1;
+
+                        if (picoquic_get_packet_shard(send_buffer, send_length, worker->shard_ctx.nb_shards) !=
+                            (int)worker->shard_ctx.shard_index)
+                        {
+                            worker->nb_misrouted++;
+                        }
+
+                        (void)picoquic_incoming_packet(qserver, send_buffer, (uint32_t)send_length,
+                            (struct sockaddr *)&slot[i].client_addr, (struct sockaddr *)&slot[i].server_addr, 0,
+                            simulated_time);
+                    }
+
+                    if (p->length == 0)
+                    {
+                        picoquic_recycle_packet(qclient, p);
+                    }
+                }
+                else
+                {
+                    picoquic_recycle_packet(qclient, p);
+                }
+            }
+        }
+
+        /* Server to client */
+        while ((sp = picoquic_dequeue_stateless_packet(qserver)) != NULL)
+        {
+            was_active = 1;
+            (void)picoquic_incoming_packet(qclient, sp->bytes, (uint32_t)sp->length,
+                (struct sockaddr *)&sp->addr_local, (struct sockaddr *)&sp->addr_to, 0, simulated_time);
+            picoquic_delete_stateless_packet(sp);
+        }
+
+        while (ret == 0 && (cnx = picoquic_get_next_ready_cnx(qserver, simulated_time)) != NULL)
+        {
+            picoquic_packet * p = picoquic_alloc_packet(qserver);
+
+            if (p == NULL)
+            {
+                ret = -1;
+            }
+            else
+            {
+                ret = picoquic_prepare_packet(cnx, p, simulated_time,
+                    send_buffer, sizeof(send_buffer), &send_length);
+
+                if (ret == PICOQUIC_ERROR_DISCONNECTED)
+                {
+                    ret = 0;
+                    picoquic_recycle_packet(qserver, p);
+                    picoquic_delete_cnx(cnx);
+                    was_active = 1;
+                }
+                else if (ret == 0)
+                {
+                    if (send_length > 0)
+                    {
+                        int peer_addr_len = 0;
+                        struct sockaddr * peer_addr;
+                        int local_addr_len = 0;
+                        struct sockaddr * local_addr;
+
+                        was_active = 1;
+                        picoquic_get_peer_addr(cnx, &peer_addr, &peer_addr_len);
+                        picoquic_get_local_addr(cnx, &local_addr, &local_addr_len);
+
+                        (void)picoquic_incoming_packet(qclient, send_buffer, (uint32_t)send_length,
+                            local_addr, peer_addr, 0, simulated_time);
+                    }
+
+                    if (p->length == 0)
+                    {
+                        picoquic_recycle_packet(qserver, p);
+                    }
+                }
+                else
+                {
+                    picoquic_recycle_packet(qserver, p);
+                }
+            }
+        }
+
+        /* When nothing happens, jump to the next timer */
+        if (ret == 0 && was_active == 0)
+        {
+            int64_t delta_client = picoquic_get_next_wake_delay(qclient, simulated_time, 10000000);
+            int64_t delta_server = picoquic_get_next_wake_delay(qserver, simulated_time, 10000000);
+            int64_t delta_t = (delta_client < delta_server) ? delta_client : delta_server;
+
+            simulated_time += (delta_t > 0) ? delta_t : 1;
+
+            if (simulated_time > 100000000ull * DEMO_BENCH_NB_CNX)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    if (qclient != NULL)
+    {
+        picoquic_free(qclient);
+    }
+
+    if (qserver != NULL)
+    {
+        picoquic_free(qserver);
+    }
+
+    worker->ret = ret;
+
+    DEMO_THREAD_RETURN;
+}
+
+int quic_server_benchmark(const char * pem_cert, const char * pem_key, uint32_t max_workers)
+{
+    int ret = 0;
+    demo_bench_worker_t * workers = (demo_bench_worker_t *)malloc(max_workers * sizeof(demo_bench_worker_t));
+
+    if (workers == NULL)
+    {
+        ret = -1;
+    }
+
+    for (uint32_t nb_workers = 1; ret == 0 && nb_workers <= max_workers;
+        nb_workers = (nb_workers < max_workers && 2 * nb_workers > max_workers) ? max_workers : 2 * nb_workers)
+    {
+        uint32_t nb_started = 0;
+        uint64_t nb_handshakes = 0;
+        uint64_t nb_bytes = 0;
+        uint64_t nb_misrouted = 0;
+        uint64_t start_time = picoquic_current_time();
+        double elapsed;
+
+        memset(workers, 0, nb_workers * sizeof(demo_bench_worker_t));
+
+        for (; ret == 0 && nb_started < nb_workers; nb_started++)
+        {
+            workers[nb_started].shard_ctx.shard_index = nb_started;
+            workers[nb_started].shard_ctx.nb_shards = nb_workers;
+            workers[nb_started].pem_cert = pem_cert;
+            workers[nb_started].pem_key = pem_key;
+            ret = demo_thread_start(&workers[nb_started].thread, demo_bench_worker, &workers[nb_started]);
+        }
+
+        for (uint32_t i = 0; i < nb_started; i++)
+        {
+            demo_thread_join(workers[i].thread);
+            if (workers[i].ret != 0)
+            {
+                ret = workers[i].ret;
+            }
+            nb_handshakes += workers[i].nb_handshakes;
+            nb_bytes += workers[i].nb_bytes;
+            nb_misrouted += workers[i].nb_misrouted;
+        }
+
+        elapsed = (double)(picoquic_current_time() - start_time);
+        if (elapsed <= 0)
+        {
+            elapsed = 1;
+        }
+
+        printf("Workers: %u, handshakes: %" PRIu64 ", %.1f handshakes/s, %.3f Gbps, misrouted packets: %" PRIu64 "%s\n",
+            nb_workers, nb_handshakes, ((double)nb_handshakes) * 1000000.0 / elapsed,
+            ((double)nb_bytes) * 8.0 / (elapsed * 1000.0), nb_misrouted, (ret == 0) ? "" : ", error");
+
+        if (nb_workers == max_workers)
+        {
+            break;
+        }
+    }
+
+    if (workers != NULL)
+    {
+        free(workers);
+    }
+
+    return ret;
+}
+
 typedef struct st_demo_stream_desc_t {
     uint32_t stream_id;
     uint32_t previous_stream_id;
@@ -954,7 +1742,7 @@ int quic_client(const char * ip_address_text, int server_port, uint32_t proposed
 		{
             picoquic_set_callback(cnx_client, first_client_callback, &callback_ctx);
 
-			p = picoquic_create_packet();
+			p = picoquic_alloc_packet(qclient);
 
 			if (p == NULL)
 			{
@@ -980,9 +1768,10 @@ int quic_client(const char * ip_address_text, int server_port, uint32_t proposed
                     quic_client_launch_scenario(cnx_client, &callback_ctx);
 
 				}
-				else
+
+				if (ret != 0 || p->length == 0)
 				{
-					free(p);
+					picoquic_recycle_packet(qclient, p);
 				}
 			}
 		}
@@ -1086,10 +1875,10 @@ int quic_client(const char * ip_address_text, int server_port, uint32_t proposed
                     {
                         if (callback_ctx.nb_open_streams == 0)
                         {
-                            if (cnx_client->nb_zero_rtt_sent != 0)
+                            if (cnx_client->cold->nb_zero_rtt_sent != 0)
                             {
                                 fprintf(stdout, "Out of %d zero RTT packets, %d were acked by the server.\n",
-                                    cnx_client->nb_zero_rtt_sent, cnx_client->nb_zero_rtt_acked);
+                                    cnx_client->cold->nb_zero_rtt_sent, cnx_client->cold->nb_zero_rtt_acked);
                             }
                             fprintf(stdout, "All done, Closing the connection.\n");
                             ret = picoquic_close(cnx_client, 0);
@@ -1107,7 +1896,7 @@ int quic_client(const char * ip_address_text, int server_port, uint32_t proposed
 
                 if (ret == 0)
                 {
-                    p = picoquic_create_packet();
+                    p = picoquic_alloc_packet(qclient);
 
                     if (p == NULL)
                     {
@@ -1128,9 +1917,10 @@ int quic_client(const char * ip_address_text, int server_port, uint32_t proposed
                                 0, send_buffer, send_length, current_time);
 
                         }
-                        else
+
+                        if (ret != 0 || p->length == 0)
                         {
-                            free(p);
+                            picoquic_recycle_packet(qclient, p);
                         }
                     }
                 }
@@ -1214,6 +2004,8 @@ void usage()
 	fprintf(stderr, "                            0: picoquic_cnx_id_random\n");
 	fprintf(stderr, "                            1: picoquic_cnx_id_remote (client)\n");
 	fprintf(stderr, "  -v version            Version proposed by client, e.g. -v ff000008\n");
+    fprintf(stderr, "  -w nb_workers         Sharded server, one worker thread per shard\n");
+    fprintf(stderr, "  -b max_workers        Benchmark the sharded server with up to max_workers\n");
     fprintf(stderr, "  -l file               Log file\n");
 	fprintf(stderr, "  -h                    This help message\n");
 	exit(1);
@@ -1250,6 +2042,8 @@ int main(int argc, char ** argv)
     int is_client = 0;
     int just_once = 0;
     int do_hrr = 0;
+    int nb_workers = 0;
+    int bench_workers = 0;
     cnx_id_callback_ctx_t cnx_id_cbdata = {
     		.cnx_id_select = 0,
     		.cnx_id_mask = UINT64_MAX,
@@ -1268,7 +2062,7 @@ int main(int argc, char ** argv)
 
     /* Get the parameters */
 	int opt;
-	while( (opt = getopt(argc, argv, "c:k:p:v:1rhi:s:l:")) != -1 )
+	while( (opt = getopt(argc, argv, "c:k:p:v:1rhi:s:l:w:b:")) != -1 )
 	{
 		switch (opt)
 		{
@@ -1327,6 +2121,20 @@ int main(int argc, char ** argv)
                     usage();
                 }
                 log_file = optarg;
+                break;
+            case 'w':
+                if ((nb_workers = atoi(optarg)) <= 0 || nb_workers > PICOQUIC_MAX_SHARDS)
+                {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'b':
+                if ((bench_workers = atoi(optarg)) <= 0 || bench_workers > PICOQUIC_MAX_SHARDS)
+                {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    usage();
+                }
                 break;
 			case 'h':
 				usage();
@@ -1362,7 +2170,24 @@ int main(int argc, char ** argv)
     }
 #endif
 
-    if (is_client == 0)
+    if (bench_workers > 0)
+    {
+        /* Measure the handshake rate and throughput for 1 to bench_workers shards */
+        first_server_quiet = 1;
+        ret = quic_server_benchmark(server_cert_file, server_key_file, (uint32_t)bench_workers);
+        printf("Benchmark exit with code = %d\n", ret);
+    }
+    else if (is_client == 0 && nb_workers > 0)
+    {
+        /* Run as sharded server */
+        printf("Starting PicoQUIC sharded server on port %d, %d workers, hrr= %d\n",
+            server_port, nb_workers, do_hrr);
+        first_server_quiet = 1;
+        ret = quic_server_sharded(server_port, server_cert_file, server_key_file, do_hrr,
+            (uint8_t *)reset_seed, (uint32_t)nb_workers);
+        printf("Server exit with code = %d\n", ret);
+    }
+    else if (is_client == 0)
     {
         /* Run as server */
         printf("Starting PicoQUIC server on port %d, server name = %s, just_once = %d, hrr= %d\n", 
@@ -20,7 +20,8 @@
 */
 
 #include <stdlib.h>
-#include "../picoquic/picoquic_internal.h"
+#include <string.h>
+#include "picoquictest_internal.h"
 
 /*
  * The purpose of the ACK of ACK logic is to prune the sack list from blocks that
@@ -41,11 +42,6 @@
  * tail of the "largest" range.
  */
 
-typedef struct st_test_ack_range_t {
-    uint64_t start_of_sack_range;
-    uint64_t end_of_sack_range;
-} test_ack_range_t;
-
 static const test_ack_range_t test_range_in_1[] = {
     { 1, 9}
 };
@@ -118,82 +114,44 @@ static const test_ack_of_ack_t test_ack_of_ack_list[] = {
 };
 
 /*
- * Fill a structured SACK list from a test range 
+ * Fill a SACK tracker from a test range
  */
 
-static void fill_test_sack_list(picoquic_sack_item_t * sack_head,
+void fill_test_sack_tracker(picoquic_sack_tracker_t * tracker,
     test_ack_range_t const * ranges, size_t nb_ranges)
 {
-    picoquic_sack_item_t ** previous;
-
-    sack_head->start_of_sack_range = ranges[0].start_of_sack_range;
-    sack_head->end_of_sack_range = ranges[0].end_of_sack_range;
-    sack_head->next_sack = NULL;
-    previous = &sack_head->next_sack;
+    memset(tracker, 0, sizeof(picoquic_sack_tracker_t));
 
-    for (size_t i = 1; i < nb_ranges; i++)
+    for (size_t i = 0; i < nb_ranges && i < PICOQUIC_MAX_SACK_RANGES; i++)
     {
-        picoquic_sack_item_t * range = (picoquic_sack_item_t *)malloc(sizeof(picoquic_sack_item_t));
-
-        if (range == NULL)
-        {
-            break;
-        }
-        else
-        {
-            *previous = range;
-            range->start_of_sack_range = ranges[i].start_of_sack_range;
-            range->end_of_sack_range = ranges[i].end_of_sack_range;
-            range->next_sack = NULL;
-            previous = &range->next_sack;
-        }
+        picoquic_sack_get_range(tracker, i)->start_of_sack_range = ranges[i].start_of_sack_range;
+        picoquic_sack_get_range(tracker, i)->end_of_sack_range = ranges[i].end_of_sack_range;
+        tracker->nb_ranges++;
     }
 }
 
 /*
- * Release the memory still allocated in a sack list
- */
-static void free_test_sack_list(picoquic_sack_item_t * sack_head)
-{
-    picoquic_sack_item_t * next;
-    while ((next = sack_head->next_sack) != NULL)
-    {
-        sack_head->next_sack = next->next_sack;
-        free(next);
-    }
-}
-/*
- * Compare a structured list to a test range
+ * Compare a SACK tracker to a test range
  */
 
-static int cmp_test_sack_list(picoquic_sack_item_t * sack_head,
+int cmp_test_sack_tracker(picoquic_sack_tracker_t * tracker,
     test_ack_range_t const * ranges, size_t nb_ranges)
 {
-    size_t nb_compared = 0;
-    picoquic_sack_item_t * next = sack_head;
+    int ret = (tracker->nb_ranges == nb_ranges) ? 0 : -1;
 
-    for (size_t i = 0; i < nb_ranges; i++)
+    for (size_t i = 0; ret == 0 && i < nb_ranges; i++)
     {
-        if (next->start_of_sack_range != ranges[i].start_of_sack_range ||
-            next->end_of_sack_range != ranges[i].end_of_sack_range)
-        {
-            break;
-        }
-
-        nb_compared++;
-
-        next = next->next_sack;
-
-        if (next == NULL)
+        if (picoquic_sack_get_range(tracker, i)->start_of_sack_range != ranges[i].start_of_sack_range ||
+            picoquic_sack_get_range(tracker, i)->end_of_sack_range != ranges[i].end_of_sack_range)
         {
-            break;
+            ret = -1;
         }
     }
 
-    return (next == NULL && nb_compared == nb_ranges) ? 0 : -1;
+    return ret;
 }
 
-static size_t build_test_ack(test_ack_range_t const * ranges, size_t nb_ranges,
+size_t build_test_ack(test_ack_range_t const * ranges, size_t nb_ranges,
     uint8_t * bytes, size_t bytes_max, uint32_t version_flags)
 {
     size_t byte_index = 0;
@@ -227,24 +185,22 @@ static size_t build_test_ack(test_ack_range_t const * ranges, size_t nb_ranges,
 static int ack_of_ack_do_one_test(test_ack_of_ack_t const * sample)
 {
     int ret = 0;
-    picoquic_sack_item_t sack_head;
+    picoquic_sack_tracker_t tracker;
     uint8_t ack[1024];
     size_t ack_length;
     size_t consumed;
 
-    fill_test_sack_list(&sack_head, sample->initial, sample->nb_initial);
+    fill_test_sack_tracker(&tracker, sample->initial, sample->nb_initial);
     ack_length = build_test_ack(sample->ack, sample->nb_ack, ack, sizeof(ack),
         sample->version_flags);
 
-    ret = picoquic_process_ack_of_ack_frame(&sack_head, ack, ack_length, &consumed);
+    ret = picoquic_process_ack_of_ack_frame(&tracker, ack, ack_length, &consumed);
 
     if (ret == 0)
     {
-        ret = cmp_test_sack_list(&sack_head, sample->result, sample->nb_result);
+        ret = cmp_test_sack_tracker(&tracker, sample->result, sample->nb_result);
     }
 
-    free_test_sack_list(&sack_head);
-
     return ret;
 }
 
@@ -267,4 +223,4 @@ int ack_of_ack_test()
     }
 
     return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,172 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquictest_internal.h"
+
+/*
+ * Packets that only carry ACK frames are not queued for retransmission. Check that
+ * they are recorded instead, that the record provides the RTT sample, that the ack
+ * of ack pruning still happens when the peer acknowledges them, and that records
+ * of lost packets and excess records are dropped.
+ */
+
+static const test_ack_range_t test_ack_only_sack[] = {
+    { 1, 9 }
+};
+
+static const test_ack_range_t test_ack_only_ack[] = {
+    { 1, 8 }
+};
+
+static const test_ack_range_t test_ack_only_res[] = {
+    { 9, 9 }
+};
+
+static int ack_only_send_test_packet(picoquic_cnx_t * cnx, uint64_t current_time)
+{
+    int ret = 0;
+    size_t header_length = 8;
+    picoquic_packet * p = picoquic_alloc_packet(cnx->quic);
+
+    if (p == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        memset(p->bytes, 0, header_length);
+        p->sequence_number = cnx->send_sequence++;
+        p->send_time = current_time;
+        p->length = header_length + build_test_ack(test_ack_only_ack, 1,
+            &p->bytes[header_length], sizeof(p->bytes) - header_length, 0);
+
+        picoquic_queue_for_retransmit(cnx, p, header_length, p->length, current_time);
+
+        if (p->length == 0)
+        {
+            picoquic_recycle_packet(cnx->quic, p);
+        }
+        else
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int ack_only_record_test()
+{
+    int ret = 0;
+    uint64_t current_time = 1000000;
+    uint64_t rtt = 20000;
+    uint64_t first_sequence = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+
+    ret = picoquictest_create_ready_cnx(current_time, &quic, &cnx);
+
+    if (ret == 0)
+    {
+        fill_test_sack_tracker(&cnx->sack_tracker, test_ack_only_sack, 1);
+        first_sequence = cnx->send_sequence;
+    }
+
+    /* A packet with a PING frame is queued, a pure ACK is only recorded */
+    if (ret == 0)
+    {
+        ret = picoquictest_queue_ping_packet(cnx, current_time);
+    }
+
+    if (ret == 0)
+    {
+        ret = ack_only_send_test_packet(cnx, current_time);
+    }
+
+    if (ret == 0 && (cnx->nb_ack_records != 1 || cnx->retransmit_newest == NULL ||
+        cnx->retransmit_newest->next_packet != NULL || picoquic_is_cnx_backlog_empty(cnx)))
+    {
+        ret = -1;
+    }
+
+    /* The largest acknowledged is the pure ACK, so the RTT comes from its record */
+    if (ret == 0)
+    {
+        ret = picoquictest_receive_ack(cnx, first_sequence, first_sequence + 1, current_time + rtt);
+    }
+
+    if (ret == 0 && (cnx->nb_ack_records != 0 || cnx->ack_record_newest != NULL ||
+        cnx->retransmit_newest != NULL || cnx->bytes_in_transit != 0 ||
+        !picoquic_is_cnx_backlog_empty(cnx) || cnx->smoothed_rtt != rtt))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0)
+    {
+        ret = cmp_test_sack_tracker(&cnx->sack_tracker, test_ack_only_res, 1);
+    }
+
+    /* Records below the largest acknowledged are presumed lost */
+    if (ret == 0)
+    {
+        ret = ack_only_send_test_packet(cnx, current_time);
+    }
+
+    if (ret == 0)
+    {
+        ret = ack_only_send_test_packet(cnx, current_time);
+    }
+
+    if (ret == 0)
+    {
+        ret = picoquictest_receive_ack(cnx, first_sequence + 3, first_sequence + 3, current_time + rtt);
+    }
+
+    if (ret == 0 && (cnx->nb_ack_records != 0 || cnx->ack_record_newest != NULL))
+    {
+        ret = -1;
+    }
+
+    /* The number of records is capped */
+    for (int i = 0; ret == 0 && i < 2 * PICOQUIC_MAX_ACK_RECORDS; i++)
+    {
+        ret = ack_only_send_test_packet(cnx, current_time);
+    }
+
+    if (ret == 0 && (cnx->nb_ack_records != PICOQUIC_MAX_ACK_RECORDS ||
+        picoquic_find_ack_record(cnx, cnx->send_sequence - 1) == NULL ||
+        picoquic_find_ack_record(cnx, cnx->send_sequence - PICOQUIC_MAX_ACK_RECORDS) == NULL ||
+        picoquic_find_ack_record(cnx, cnx->send_sequence - PICOQUIC_MAX_ACK_RECORDS - 1) != NULL))
+    {
+        ret = -1;
+    }
+
+    /* The remaining records are freed with the connection */
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -25,6 +25,7 @@
 #include <malloc.h>
 #endif
 #include <string.h>
+#include <stddef.h>
 
 /* 
  * Cnx creation unit test
@@ -216,3 +217,611 @@ int cnxcreation_test()
 
     return ret;
 }
+
+/*
+ * Connection pool unit test
+ * - Pre-allocate a set of connection contexts.
+ * - Verify that connections are created from the pool without growing it.
+ * - Verify that deleted connections are returned to the pool and reused.
+ */
+
+int cnx_pool_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * test_cnx[20];
+    struct sockaddr_in test_addr;
+    size_t nb_allocated = 0;
+
+    memset(test_cnx, 0, sizeof(test_cnx));
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || picoquic_preallocate_cnx(quic, 20) != 0 || quic->nb_cnx_free != 20)
+    {
+        ret = -1;
+    }
+    else
+    {
+        nb_allocated = quic->nb_cnx_allocated;
+    }
+
+    for (int i = 0; ret == 0 && i < 20; i++)
+    {
+        test_addr.sin_port = (uint16_t)(1000 + i);
+        test_cnx[i] = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+        if (test_cnx[i] == NULL || quic->nb_cnx_free != (size_t)(19 - i))
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && quic->nb_cnx_allocated != nb_allocated)
+    {
+        ret = -1;
+    }
+
+    /* Delete half of the connections, and create them again from the pool */
+    for (int i = 0; ret == 0 && i < 20; i += 2)
+    {
+        picoquic_delete_cnx(test_cnx[i]);
+        test_cnx[i] = NULL;
+    }
+
+    if (ret == 0 && quic->nb_cnx_free != 10)
+    {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < 20; i += 2)
+    {
+        test_addr.sin_port = (uint16_t)(1000 + i);
+        test_cnx[i] = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+        if (test_cnx[i] == NULL || picoquic_cnx_by_net(quic, (struct sockaddr *)&test_addr) != test_cnx[i])
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (quic->nb_cnx_free != 0 || quic->nb_cnx_allocated != nb_allocated))
+    {
+        ret = -1;
+    }
+
+    /* One more connection forces the allocation of a new slab */
+    if (ret == 0)
+    {
+        picoquic_cnx_t * cnx;
+
+        test_addr.sin_port = 2000;
+        cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+
+        if (cnx == NULL || quic->nb_cnx_allocated <= nb_allocated)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Packet pool unit test
+ * - Verify that recycled packets are reused, up to the size of the pool.
+ * - Verify that packets beyond the size of the pool are released.
+ * - Verify that reused packets have a clean header.
+ */
+
+int packet_pool_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_packet * packets[8];
+    picoquic_packet_pool_stats_t stats;
+
+    memset(packets, 0, sizeof(packets));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        picoquic_get_packet_pool_stats(quic, &stats);
+        if (stats.max_free != PICOQUIC_DEFAULT_PACKET_POOL_SIZE || stats.nb_free != 0)
+        {
+            ret = -1;
+        }
+        picoquic_set_packet_pool_size(quic, 4);
+    }
+
+    for (int i = 0; ret == 0 && i < 8; i++)
+    {
+        packets[i] = picoquic_alloc_packet(quic);
+        if (packets[i] == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            packets[i]->sequence_number = i + 1;
+            packets[i]->length = 100;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < 8; i++)
+    {
+        picoquic_recycle_packet(quic, packets[i]);
+        packets[i] = NULL;
+    }
+
+    if (ret == 0)
+    {
+        picoquic_get_packet_pool_stats(quic, &stats);
+        if (stats.nb_alloc != 8 || stats.nb_alloc_from_pool != 0 || stats.nb_recycled != 8 ||
+            stats.nb_released != 4 || stats.nb_free != 4)
+        {
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < 2; i++)
+    {
+        packets[i] = picoquic_alloc_packet(quic);
+        if (packets[i] == NULL || packets[i]->sequence_number != 0 || packets[i]->length != 0 ||
+            packets[i]->next_packet != NULL || packets[i]->previous_packet != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        picoquic_get_packet_pool_stats(quic, &stats);
+        if (stats.nb_alloc != 10 || stats.nb_alloc_from_pool != 2 || stats.nb_free != 2)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Shrinking the pool releases the extra packets */
+    if (ret == 0)
+    {
+        picoquic_set_packet_pool_size(quic, 1);
+        picoquic_get_packet_pool_stats(quic, &stats);
+        if (stats.nb_free != 1 || stats.nb_released != 5)
+        {
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (packets[i] != NULL)
+        {
+            picoquic_recycle_packet(quic, packets[i]);
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Connection ID sharding unit test
+ * - Verify that the shard callback encodes the shard index in connection IDs.
+ * - Create connections in a context configured as one shard, and verify that
+ *   packets carrying their IDs are steered to that shard.
+ * - Verify that packets without connection ID are not steered.
+ */
+
+int cnx_shard_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_shard_ctx_t shard_ctx;
+    struct sockaddr_in test_addr;
+    uint8_t bytes[32];
+
+    memset(bytes, 0, sizeof(bytes));
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+    shard_ctx.shard_index = 3;
+    shard_ctx.nb_shards = 5;
+
+    for (uint64_t i = 0; ret == 0 && i < 256; i++)
+    {
+        uint64_t cnx_id_local = (i << 56) | ((0x0123456789ABCDEFull * i) & 0x00FFFFFFFFFFFFFFull);
+        uint64_t cnx_id = picoquic_shard_cnx_id_callback(cnx_id_local, 0xFEDCBA9876543210ull, &shard_ctx);
+
+        if (picoquic_get_cnx_id_shard(cnx_id, shard_ctx.nb_shards) != 3 ||
+            (cnx_id & 0x00FFFFFFFFFFFFFFull) != (cnx_id_local & 0x00FFFFFFFFFFFFFFull) ||
+            picoquic_get_cnx_id_shard(cnx_id_local, shard_ctx.nb_shards) != (uint32_t)(i % 5))
+        {
+            ret = -1;
+        }
+    }
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, picoquic_shard_cnx_id_callback, &shard_ctx,
+        NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < 16; i++)
+    {
+        picoquic_cnx_t * cnx;
+
+        test_addr.sin_port = (uint16_t)(1000 + i);
+        cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            /* Long header, then short header with connection ID */
+            bytes[0] = 0xFF;
+            picoformat_64(bytes + 1, picoquic_get_initial_cnxid(cnx));
+            if (picoquic_get_packet_shard(bytes, sizeof(bytes), shard_ctx.nb_shards) != 3)
+            {
+                ret = -1;
+            }
+            bytes[0] = 0x01;
+            if (picoquic_get_packet_shard(bytes, sizeof(bytes), shard_ctx.nb_shards) != 3)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    /* Packets without connection ID, or too short, cannot be steered */
+    if (ret == 0)
+    {
+        bytes[0] = 0x41;
+        if (picoquic_get_packet_shard(bytes, sizeof(bytes), shard_ctx.nb_shards) != -1)
+        {
+            ret = -1;
+        }
+        bytes[0] = 0xFF;
+        if (picoquic_get_packet_shard(bytes, 16, shard_ctx.nb_shards) != -1)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Connection layout unit test
+ * - Verify that the per packet part of the connection context, before
+ *   next_in_table, holds exactly the fields listed below, in that order.
+ *   These are the fields read or written when sending or receiving packets.
+ *   Adding a field to that part, or moving a listed field out of it, must
+ *   come with an update of the list.
+ * - Verify that the cold part is allocated with the connection, and
+ *   cleared when the connection context is reused.
+ */
+
+typedef struct st_cnx_layout_test_field_t {
+    char const * name;
+    size_t offset;
+    size_t size;
+} cnx_layout_test_field_t;
+
+#define CNX_LAYOUT_TEST_FIELD(f) { #f, offsetof(picoquic_cnx_t, f), sizeof(((picoquic_cnx_t *)0)->f) }
+
+static const cnx_layout_test_field_t cnx_layout_test_hot[] = {
+    /* Contexts, state and connection IDs, checked for every packet */
+    CNX_LAYOUT_TEST_FIELD(quic),
+    CNX_LAYOUT_TEST_FIELD(cold),
+    CNX_LAYOUT_TEST_FIELD(cnx_state),
+    CNX_LAYOUT_TEST_FIELD(version_index),
+    CNX_LAYOUT_TEST_FIELD(initial_cnxid),
+    CNX_LAYOUT_TEST_FIELD(server_cnxid),
+    CNX_LAYOUT_TEST_FIELD(next_wake_time),
+    CNX_LAYOUT_TEST_FIELD(wake_heap_index),
+    CNX_LAYOUT_TEST_FIELD(callback_fn),
+    CNX_LAYOUT_TEST_FIELD(callback_ctx),
+    /* Packet protection */
+    CNX_LAYOUT_TEST_FIELD(send_sequence),
+    CNX_LAYOUT_TEST_FIELD(send_mtu),
+    CNX_LAYOUT_TEST_FIELD(aead_encrypt_ctx),
+    CNX_LAYOUT_TEST_FIELD(aead_decrypt_ctx),
+    CNX_LAYOUT_TEST_FIELD(latest_progress_time),
+    /* Receive path and ACK preparation */
+    CNX_LAYOUT_TEST_FIELD(sack_tracker),
+    CNX_LAYOUT_TEST_FIELD(time_stamp_largest_received),
+    CNX_LAYOUT_TEST_FIELD(highest_ack_sent),
+    CNX_LAYOUT_TEST_FIELD(highest_ack_time),
+    CNX_LAYOUT_TEST_FIELD(ack_needed),
+    /* ACK processing: RTT, retransmission and congestion control */
+    CNX_LAYOUT_TEST_FIELD(max_ack_delay),
+    CNX_LAYOUT_TEST_FIELD(smoothed_rtt),
+    CNX_LAYOUT_TEST_FIELD(rtt_variant),
+    CNX_LAYOUT_TEST_FIELD(retransmit_timer),
+    CNX_LAYOUT_TEST_FIELD(rtt_min),
+    CNX_LAYOUT_TEST_FIELD(ack_delay_local),
+    CNX_LAYOUT_TEST_FIELD(nb_retransmit),
+    CNX_LAYOUT_TEST_FIELD(latest_retransmit_time),
+    CNX_LAYOUT_TEST_FIELD(highest_acknowledged),
+    CNX_LAYOUT_TEST_FIELD(latest_time_acknowledged),
+    CNX_LAYOUT_TEST_FIELD(retransmit_newest),
+    CNX_LAYOUT_TEST_FIELD(retransmit_oldest),
+    CNX_LAYOUT_TEST_FIELD(retransmit_index),
+    CNX_LAYOUT_TEST_FIELD(retransmit_index_size),
+    CNX_LAYOUT_TEST_FIELD(retransmitted_newest),
+    CNX_LAYOUT_TEST_FIELD(retransmitted_oldest),
+    CNX_LAYOUT_TEST_FIELD(ack_record_newest),
+    CNX_LAYOUT_TEST_FIELD(nb_ack_records),
+    CNX_LAYOUT_TEST_FIELD(cwin),
+    CNX_LAYOUT_TEST_FIELD(bytes_in_transit),
+    CNX_LAYOUT_TEST_FIELD(congestion_alg_state),
+    CNX_LAYOUT_TEST_FIELD(congestion_alg),
+    /* Send path: pacing, flow control and stream scheduling */
+    CNX_LAYOUT_TEST_FIELD(packet_time_nano_sec),
+    CNX_LAYOUT_TEST_FIELD(pacing_reminder_nano_sec),
+    CNX_LAYOUT_TEST_FIELD(pacing_margin_micros),
+    CNX_LAYOUT_TEST_FIELD(next_pacing_time),
+    CNX_LAYOUT_TEST_FIELD(data_sent),
+    CNX_LAYOUT_TEST_FIELD(data_received),
+    CNX_LAYOUT_TEST_FIELD(maxdata_local),
+    CNX_LAYOUT_TEST_FIELD(maxdata_remote),
+    CNX_LAYOUT_TEST_FIELD(maxdata_window),
+    CNX_LAYOUT_TEST_FIELD(maxdata_update_time),
+    CNX_LAYOUT_TEST_FIELD(receive_buffered),
+    CNX_LAYOUT_TEST_FIELD(max_stream_id_bidir_remote),
+    CNX_LAYOUT_TEST_FIELD(max_stream_id_unidir_remote),
+    CNX_LAYOUT_TEST_FIELD(first_misc_frame),
+    CNX_LAYOUT_TEST_FIELD(first_ready_stream),
+    CNX_LAYOUT_TEST_FIELD(last_ready_stream),
+    CNX_LAYOUT_TEST_FIELD(ready_urgency_mask),
+    CNX_LAYOUT_TEST_FIELD(stream_scheduler),
+    CNX_LAYOUT_TEST_FIELD(first_update_stream),
+    CNX_LAYOUT_TEST_FIELD(last_update_stream),
+    CNX_LAYOUT_TEST_FIELD(send_queued),
+    CNX_LAYOUT_TEST_FIELD(send_high_mark),
+    CNX_LAYOUT_TEST_FIELD(send_low_mark),
+    CNX_LAYOUT_TEST_FIELD(is_write_blocked)
+};
+
+static const size_t nb_cnx_layout_test_hot = sizeof(cnx_layout_test_hot) / sizeof(cnx_layout_test_field_t);
+
+/* Each field must follow the previous one, with at most the padding required by
+ * its alignment, so no other field can sit between two listed fields. */
+static int cnx_layout_test_is_next(size_t end, size_t offset, size_t size)
+{
+    size_t alignment = (size >= 8) ? 8 : ((size >= 4) ? 4 : ((size >= 2) ? 2 : 1));
+
+    return offset >= end && offset - end < alignment && offset % alignment == 0;
+}
+
+static int cnx_layout_test_fields()
+{
+    int ret = 0;
+    size_t end = 0;
+
+    for (size_t i = 0; ret == 0 && i < nb_cnx_layout_test_hot; i++)
+    {
+        if (!cnx_layout_test_is_next(end, cnx_layout_test_hot[i].offset, cnx_layout_test_hot[i].size))
+        {
+            DBG_PRINTF("Connection field %s is not where expected\n", cnx_layout_test_hot[i].name);
+            ret = -1;
+        }
+        else
+        {
+            end = cnx_layout_test_hot[i].offset + cnx_layout_test_hot[i].size;
+        }
+    }
+
+    if (ret == 0 && !cnx_layout_test_is_next(end, offsetof(picoquic_cnx_t, next_in_table),
+        sizeof(((picoquic_cnx_t *)0)->next_in_table)))
+    {
+        DBG_PRINTF("%s", "Unlisted fields before next_in_table\n");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int cnx_layout_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_cnx_cold_t * cold = NULL;
+    struct sockaddr_in test_addr;
+
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+    test_addr.sin_port = 1000;
+
+    if (cnx_layout_test_fields() != 0)
+    {
+        ret = -1;
+    }
+    else
+    {
+        quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+        if (quic == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, "test.example.com", "hq-09");
+
+        if (cnx == NULL || cnx->cold == NULL || cnx->cold->sni == NULL || cnx->cold->alpn == NULL ||
+            cnx->cold->aead_encrypt_cleartext_ctx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            cold = cnx->cold;
+            cold->nb_spurious = 1;
+            picoquic_delete_cnx(cnx);
+        }
+    }
+
+    if (ret == 0)
+    {
+        cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+
+        if (cnx == NULL || cnx->cold != cold || cold->sni != NULL || cold->alpn != NULL ||
+            cold->nb_spurious != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Stream index test. Create streams of all four types, in sequence and out of
+ * order, including streams beyond the direct index, and verify that they can
+ * be found by ID, and that the stream list remains ordered.
+ */
+
+#define STREAM_INDEX_TEST_NB_STREAMS 1000
+
+static const uint64_t stream_index_test_sparse[] = {
+    4 * PICOQUIC_STREAM_INDEX_MAX, 4 * PICOQUIC_STREAM_INDEX_MAX + 1, 1000000, 0x3FFFFFFF
+};
+
+int stream_index_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    struct sockaddr_in test_addr;
+    size_t nb_sparse = sizeof(stream_index_test_sparse) / sizeof(uint64_t);
+    size_t nb_found = 0;
+
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+    test_addr.sin_port = 4433;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Sparse streams first, then dense streams in decreasing order for odd types */
+    for (size_t i = 0; ret == 0 && i < nb_sparse; i++)
+    {
+        if (picoquic_create_stream(cnx, stream_index_test_sparse[i]) == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    for (uint64_t i = 1; ret == 0 && i <= STREAM_INDEX_TEST_NB_STREAMS; i++)
+    {
+        uint64_t stream_id = (i & 1) ? 4 * i : 4 * (STREAM_INDEX_TEST_NB_STREAMS + 1 - i) + 2;
+
+        if (picoquic_create_stream(cnx, stream_id) == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* All streams can be found, and no other */
+    for (uint64_t i = 1; ret == 0 && i <= STREAM_INDEX_TEST_NB_STREAMS; i++)
+    {
+        uint64_t stream_id = (i & 1) ? 4 * i : 4 * (STREAM_INDEX_TEST_NB_STREAMS + 1 - i) + 2;
+
+        stream = picoquic_find_stream(cnx, stream_id, 0);
+        if (stream == NULL || stream->stream_id != stream_id ||
+            picoquic_find_stream(cnx, stream_id + 1, 0) != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_sparse; i++)
+    {
+        stream = picoquic_find_stream(cnx, stream_index_test_sparse[i], 0);
+        if (stream == NULL || stream->stream_id != stream_index_test_sparse[i] ||
+            picoquic_find_stream(cnx, stream_index_test_sparse[i] + 4, 0) != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && picoquic_find_stream(cnx, 0, 0) != &cnx->first_stream)
+    {
+        ret = -1;
+    }
+
+    /* The list is still ordered by stream ID */
+    if (ret == 0)
+    {
+        stream = cnx->first_stream.next_stream;
+        while (ret == 0 && stream != NULL)
+        {
+            nb_found++;
+            if (stream->next_stream == NULL)
+            {
+                if (cnx->last_stream != stream)
+                {
+                    ret = -1;
+                }
+            }
+            else if (stream->next_stream->stream_id <= stream->stream_id)
+            {
+                ret = -1;
+            }
+            stream = stream->next_stream;
+        }
+
+        if (ret == 0 && nb_found != STREAM_INDEX_TEST_NB_STREAMS + nb_sparse)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -0,0 +1,309 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../picoquic/picoquic_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WINDOWS
+#include <Windows.h>
+#define CMD_TEST_THREAD_T HANDLE
+#define CMD_TEST_THREAD_FN DWORD WINAPI
+#define CMD_TEST_THREAD_RETURN 0
+#else
+#include <pthread.h>
+#include <sys/select.h>
+#define CMD_TEST_THREAD_T pthread_t
+#define CMD_TEST_THREAD_FN void *
+#define CMD_TEST_THREAD_RETURN NULL
+#endif
+
+/*
+ * Command queue unit test
+ * - Several threads post stream data on the same connection, while the
+ *   main thread drains the queue. Verify that no command is lost and that
+ *   the commands of each thread are executed in order.
+ * - Verify that the wakeup descriptor is signalled when commands are
+ *   pending, and cleared after processing.
+ * - Verify that commands posted for a deleted connection are discarded,
+ *   even if the connection context was reused.
+ */
+
+#define CMD_TEST_NB_THREADS 4
+#define CMD_TEST_NB_COMMANDS 1000
+
+typedef struct st_cmd_test_thread_t {
+    picoquic_quic_t * quic;
+    uint64_t initial_cnxid;
+    uint8_t thread_id;
+    int ret;
+} cmd_test_thread_t;
+
+static CMD_TEST_THREAD_FN cmd_test_producer(void * arg)
+{
+    cmd_test_thread_t * ctx = (cmd_test_thread_t *)arg;
+    uint8_t data[3];
+
+    data[0] = ctx->thread_id;
+
+    for (int i = 0; ctx->ret == 0 && i < CMD_TEST_NB_COMMANDS; i++)
+    {
+        data[1] = (uint8_t)(i >> 8);
+        data[2] = (uint8_t)(i & 0xFF);
+        ctx->ret = picoquic_post_stream_data(ctx->quic, ctx->initial_cnxid, 0, data, sizeof(data), 0);
+    }
+
+    return CMD_TEST_THREAD_RETURN;
+}
+
+static int cmd_test_start_thread(CMD_TEST_THREAD_T * thread, cmd_test_thread_t * ctx)
+{
+#ifdef _WINDOWS
+    *thread = CreateThread(NULL, 0, cmd_test_producer, ctx, 0, NULL);
+    return (*thread == NULL) ? -1 : 0;
+#else
+    return pthread_create(thread, NULL, cmd_test_producer, ctx);
+#endif
+}
+
+static void cmd_test_join_thread(CMD_TEST_THREAD_T thread)
+{
+#ifdef _WINDOWS
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+static int cmd_test_is_signalled(picoquic_quic_t * quic)
+{
+    fd_set readfds;
+    struct timeval tv;
+    picoquic_wakeup_fd_t fd = picoquic_get_command_wakeup_fd(quic);
+
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    return select((int)(fd + 1), &readfds, NULL, NULL, &tv) > 0;
+}
+
+static size_t cmd_test_queue_length(picoquic_cnx_t * cnx)
+{
+    size_t nb_data = 0;
+    picoquic_stream_data * data = cnx->first_stream.send_queue;
+
+    while (data != NULL)
+    {
+        nb_data++;
+        data = data->next_stream_data;
+    }
+
+    return nb_data;
+}
+
+/* Check that the data queued after the handshake data contains all the commands,
+ * in order for each thread */
+static int cmd_test_verify_stream(picoquic_cnx_t * cnx, size_t nb_handshake_data, int nb_expected)
+{
+    int ret = 0;
+    int nb_found = 0;
+    int next_index[CMD_TEST_NB_THREADS];
+    picoquic_stream_data * data = cnx->first_stream.send_queue;
+
+    for (size_t i = 0; data != NULL && i < nb_handshake_data; i++)
+    {
+        data = data->next_stream_data;
+    }
+
+    memset(next_index, 0, sizeof(next_index));
+
+    while (ret == 0 && data != NULL)
+    {
+        if (data->length != 3 || data->bytes[0] >= CMD_TEST_NB_THREADS ||
+            ((data->bytes[1] << 8) | data->bytes[2]) != next_index[data->bytes[0]])
+        {
+            ret = -1;
+        }
+        else
+        {
+            next_index[data->bytes[0]]++;
+            nb_found++;
+            data = data->next_stream_data;
+        }
+    }
+
+    if (ret == 0 && nb_found != nb_expected)
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int command_queue_test()
+{
+    int ret = 0;
+    int nb_processed = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    struct sockaddr_in test_addr;
+    uint64_t current_time = 1000000;
+    CMD_TEST_THREAD_T thread[CMD_TEST_NB_THREADS];
+    cmd_test_thread_t thread_ctx[CMD_TEST_NB_THREADS];
+    int nb_started = 0;
+    size_t nb_handshake_data = 0;
+
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+    test_addr.sin_port = 4433;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, current_time, NULL, NULL, NULL, 0);
+    if (quic == NULL || picoquic_open_command_wakeup(quic) != 0)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, current_time, 0, NULL, NULL);
+        if (cnx == NULL || cmd_test_is_signalled(quic))
+        {
+            ret = -1;
+        }
+        else
+        {
+            nb_handshake_data = cmd_test_queue_length(cnx);
+        }
+    }
+
+    /* Post from several threads, while draining the queue */
+    for (int i = 0; ret == 0 && i < CMD_TEST_NB_THREADS; i++)
+    {
+        thread_ctx[i].quic = quic;
+        thread_ctx[i].initial_cnxid = picoquic_get_initial_cnxid(cnx);
+        thread_ctx[i].thread_id = (uint8_t)i;
+        thread_ctx[i].ret = 0;
+        if (cmd_test_start_thread(&thread[i], &thread_ctx[i]) != 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            nb_started++;
+        }
+    }
+
+    while (ret == 0 && nb_processed < CMD_TEST_NB_THREADS * CMD_TEST_NB_COMMANDS / 2)
+    {
+        nb_processed += picoquic_process_commands(quic);
+    }
+
+    for (int i = 0; i < nb_started; i++)
+    {
+        cmd_test_join_thread(thread[i]);
+        if (thread_ctx[i].ret != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    /* All remaining commands are signalled, and executed in a single batch */
+    if (ret == 0 && nb_processed < CMD_TEST_NB_THREADS * CMD_TEST_NB_COMMANDS)
+    {
+        if (!cmd_test_is_signalled(quic))
+        {
+            ret = -1;
+        }
+        else
+        {
+            nb_processed += picoquic_process_commands(quic);
+        }
+    }
+
+    if (ret == 0 && (nb_processed != CMD_TEST_NB_THREADS * CMD_TEST_NB_COMMANDS ||
+        picoquic_process_commands(quic) != 0 || cmd_test_is_signalled(quic)))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0)
+    {
+        ret = cmd_test_verify_stream(cnx, nb_handshake_data, CMD_TEST_NB_THREADS * CMD_TEST_NB_COMMANDS);
+    }
+
+    /* Posting a close makes the connection ready */
+    if (ret == 0)
+    {
+        cnx->next_wake_time = current_time + 1000000;
+        picoquic_reinsert_by_wake_time(quic, cnx);
+
+        if (picoquic_post_close(quic, picoquic_get_initial_cnxid(cnx), 0) != 0 ||
+            picoquic_process_commands(quic) != 1 ||
+            cnx->cnx_state != picoquic_state_handshake_failure ||
+            picoquic_get_next_ready_cnx(quic, current_time) != cnx)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Commands for a deleted connection are discarded, even if the context is reused */
+    if (ret == 0)
+    {
+        uint64_t old_cnxid = picoquic_get_initial_cnxid(cnx);
+
+        if (picoquic_post_stream_data(quic, old_cnxid, 0, (const uint8_t *)"abc", 3, 0) != 0 ||
+            picoquic_post_reset_stream(quic, old_cnxid, 4, 0) != 0 ||
+            picoquic_post_close(quic, old_cnxid + 1, 0) != 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            picoquic_cnx_t * old_cnx = cnx;
+
+            picoquic_delete_cnx(cnx);
+            cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, current_time, 0, NULL, NULL);
+
+            if (cnx == NULL || cnx != old_cnx ||
+                picoquic_get_initial_cnxid(cnx) == old_cnxid ||
+                picoquic_process_commands(quic) != 0 ||
+                cmd_test_queue_length(cnx) != nb_handshake_data)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    /* Pending commands are freed with the context */
+    if (ret == 0 &&
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 0, (const uint8_t *)"abc", 3, 0) != 0)
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -154,3 +154,81 @@ int picohash_test()
 
     return ret;
 }
+
+/*
+ * Verify that the table grows as needed, starting from a very small size,
+ * and that items remain accessible while the old bins are being migrated.
+ */
+int picohash_resize_test()
+{
+    int ret = 0;
+    const uint64_t nb_items = 1000;
+    picohash_table * t = picohash_create(4, hashtest_hash, hashtest_compare);
+
+    if (t == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        struct hashtestkey hk;
+
+        for (uint64_t i = 0; ret == 0 && i < nb_items; i++)
+        {
+            ret = picohash_insert(t, hashtest_item(i));
+
+            /* All previous items shall remain visible during the migration */
+            for (uint64_t j = (i > 16) ? i - 16 : 0; ret == 0 && j <= i; j++)
+            {
+                hk.x = j;
+                ret = (picohash_retrieve(t, &hk) != NULL) ? 0 : -1;
+            }
+        }
+
+        if (ret == 0 && (t->count != nb_items || 4 * t->count > 3 * t->nb_bin))
+        {
+            ret = -1;
+        }
+
+        /* Delete the odd values */
+        for (uint64_t i = 1; ret == 0 && i < nb_items; i += 2)
+        {
+            hk.x = i;
+            picohash_item * pi = picohash_retrieve(t, &hk);
+
+            if (pi == NULL)
+            {
+                ret = -1;
+            }
+            else
+            {
+                picohash_item_delete(t, pi, 1);
+            }
+        }
+
+        /* Check that only the even values remain */
+        for (uint64_t i = 0; ret == 0 && i < nb_items; i++)
+        {
+            hk.x = i;
+            picohash_item * pi = picohash_retrieve(t, &hk);
+
+            if ((i & 1) == 0)
+            {
+                ret = (pi != NULL && ((struct hashtestkey *)pi->key)->x == i) ? 0 : -1;
+            }
+            else
+            {
+                ret = (pi == NULL) ? 0 : -1;
+            }
+        }
+
+        if (ret == 0 && t->count != nb_items / 2)
+        {
+            ret = -1;
+        }
+
+        picohash_delete(t, 1);
+    }
+
+    return ret;
+}
@@ -0,0 +1,234 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquictest_internal.h"
+
+/*
+ * Lost stream data is queued again on its stream instead of being copied.
+ * - Data of a lost 1-RTT packet is queued on the stream, other frames are copied.
+ * - Stream zero frames that extended to the end of the packet are copied with
+ *   an explicit length, without padding.
+ * - The lost data is sent again in offset order, split to fit the packet,
+ *   and the FIN bit is repeated with the last data.
+ */
+
+#define LOST_STREAM_TEST_STREAM_ID 4
+
+static int lost_stream_send_test_packet(picoquic_cnx_t * cnx, uint64_t stream_id, uint64_t offset,
+    size_t data_length, int is_ping, uint64_t current_time)
+{
+    int ret = 0;
+    size_t header_length = 0;
+    size_t length = 0;
+    picoquic_packet * p = picoquic_alloc_packet(cnx->quic);
+
+    if (p == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        p->sequence_number = cnx->send_sequence++;
+        p->send_time = current_time;
+        header_length = picoquic_create_packet_header(cnx, picoquic_packet_1rtt_protected_phi0,
+            cnx->server_cnxid, p->sequence_number, p->bytes);
+        length = header_length;
+
+        if (is_ping)
+        {
+            /* Ping frame, with an empty payload */
+            p->bytes[length++] = picoquic_frame_type_ping;
+            p->bytes[length++] = 0;
+        }
+
+        /* Stream frame extending to the end of the packet, with the FIN bit */
+        p->bytes[length++] = picoquic_frame_type_stream_range_min | 4 | 1;
+        length += picoquic_varint_encode(&p->bytes[length], sizeof(p->bytes) - length, stream_id);
+        length += picoquic_varint_encode(&p->bytes[length], sizeof(p->bytes) - length, offset);
+
+        for (size_t i = 0; i < data_length; i++)
+        {
+            p->bytes[length++] = (uint8_t)(offset + i);
+        }
+
+        p->length = length;
+        picoquic_queue_for_retransmit(cnx, p, header_length, length, current_time);
+    }
+
+    return ret;
+}
+
+static int lost_stream_check_frame(uint8_t * bytes, size_t length, uint64_t expected_offset,
+    size_t expected_length, int expected_fin)
+{
+    int ret = 0;
+    uint64_t stream_id = 0;
+    uint64_t offset = 0;
+    size_t data_length = 0;
+    int fin = 0;
+    size_t consumed = 0;
+
+    if (picoquic_parse_stream_header(bytes, length, &stream_id, &offset, &data_length, &fin, &consumed) != 0 ||
+        stream_id != LOST_STREAM_TEST_STREAM_ID || offset != expected_offset ||
+        data_length != expected_length || fin != expected_fin || consumed + data_length != length)
+    {
+        ret = -1;
+    }
+
+    for (size_t i = 0; ret == 0 && i < data_length; i++)
+    {
+        if (bytes[consumed + i] != (uint8_t)(offset + i))
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int lost_stream_data_test()
+{
+    int ret = 0;
+    uint64_t current_time = 1000000;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    picoquic_packet * packet = NULL;
+    int is_cleartext_mode = 1;
+    size_t header_length = 0;
+    size_t length = 0;
+    size_t consumed = 0;
+    uint8_t bytes[256];
+    uint8_t lost_bytes[50];
+    uint64_t stream_id = 0;
+    uint64_t offset = 0;
+    size_t data_length = 0;
+    int fin = 0;
+
+    for (size_t i = 0; i < sizeof(lost_bytes); i++)
+    {
+        lost_bytes[i] = (uint8_t)(100 + i);
+    }
+
+    ret = picoquictest_create_ready_cnx(current_time, &quic, &cnx);
+
+    if (ret == 0)
+    {
+        packet = picoquic_alloc_packet(quic);
+        stream = picoquic_create_stream(cnx, LOST_STREAM_TEST_STREAM_ID);
+        if (packet == NULL || stream == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            stream->sent_offset = 300;
+            stream->stream_flags |= picoquic_stream_flag_fin_notified | picoquic_stream_flag_fin_sent;
+        }
+    }
+
+    /* Lose a packet with a ping and stream data, and a packet with stream zero data */
+    if (ret == 0)
+    {
+        ret = lost_stream_send_test_packet(cnx, LOST_STREAM_TEST_STREAM_ID, 200, 100, 1, current_time);
+    }
+
+    if (ret == 0)
+    {
+        ret = lost_stream_send_test_packet(cnx, 0, 1000, 100, 0, current_time);
+    }
+
+    if (ret == 0)
+    {
+        cnx->highest_acknowledged = cnx->send_sequence + 8;
+        cnx->latest_time_acknowledged = current_time;
+
+        length = picoquic_retransmit_needed(cnx, current_time, packet, &is_cleartext_mode, &header_length);
+
+        /* Only the ping is copied */
+        if (length != header_length + 2 || is_cleartext_mode != 0 ||
+            packet->bytes[header_length] != picoquic_frame_type_ping ||
+            stream->retransmit_queue == NULL || stream->retransmit_queue->offset != 200 ||
+            stream->retransmit_queue->length != 100 ||
+            (stream->stream_flags&picoquic_stream_flag_fin_sent) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        length = picoquic_retransmit_needed(cnx, current_time, packet, &is_cleartext_mode, &header_length);
+
+        /* The stream zero frame gets an explicit length, instead of padding */
+        if (length == 0 || (packet->bytes[header_length] & 2) == 0 ||
+            picoquic_parse_stream_header(&packet->bytes[header_length], length - header_length,
+                &stream_id, &offset, &data_length, &fin, &consumed) != 0 ||
+            stream_id != 0 || offset != 1000 || data_length != 100 || fin != 1 ||
+            header_length + consumed + data_length != length ||
+            cnx->retransmit_newest != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Data lost later with a lower offset is sent first */
+    if (ret == 0 && picoquic_queue_lost_stream_data(cnx, stream, 100, lost_bytes, sizeof(lost_bytes), 0) != 0)
+    {
+        ret = -1;
+    }
+
+    if (ret == 0 && (picoquic_find_ready_stream(cnx, 0) != stream ||
+        picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+        lost_stream_check_frame(bytes, consumed, 100, 50, 0) != 0))
+    {
+        ret = -1;
+    }
+
+    /* The remaining data is split, and the fin is set on the last frame */
+    if (ret == 0 && (picoquic_prepare_stream_frame(cnx, stream, bytes, 64, &consumed) != 0 ||
+        consumed != 64 || lost_stream_check_frame(bytes, consumed, 200, 60, 0) != 0))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0 && (picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+        lost_stream_check_frame(bytes, consumed, 260, 40, 1) != 0 ||
+        stream->retransmit_queue != NULL ||
+        (stream->stream_flags&picoquic_stream_flag_fin_sent) == 0))
+    {
+        ret = -1;
+    }
+
+    if (packet != NULL)
+    {
+        picoquic_recycle_packet(quic, packet);
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -27,7 +27,11 @@ extern "C" {
 #endif
 
     int picohash_test();
+    int picohash_resize_test();
     int cnxcreation_test();
+    int cnx_pool_test();
+    int cnx_shard_test();
+    int stream_index_test();
     int parseheadertest();
     int pn2pn64test();
     int intformattest();
@@ -36,6 +40,7 @@ extern "C" {
     int float16test();
     int StreamZeroFrameTest();
 	int sendacktest();
+    int sack_tracker_test();
     int tls_api_test(); 
 	int tls_api_loss_test(uint64_t mask);
     int tls_api_client_first_loss_test();
@@ -60,6 +65,25 @@ extern "C" {
     int tls_api_hrr_test();
     int ackrange_test();
     int ack_of_ack_test();
+    int ack_only_record_test();
+    int retransmit_index_test();
+    int ack_range_cost_test();
+    int lost_stream_data_test();
+    int stream_scheduler_test();
+    int stream_ready_list_test();
+    int stream_priority_test();
+    int stream_send_ref_test();
+    int stream_pull_test();
+    int stream_packing_test();
+    int stream_send_buffer_test();
+    int stream_posted_data_test();
+    int stream_credit_blocked_test();
+    int stream_reassembly_test();
+    int stream_in_order_test();
+    int receive_window_test();
+    int receive_budget_test();
+    int max_stream_data_list_test();
+    int stream_gc_test();
     int tls_api_two_connections_test();
     int cleartext_aead_test();
     int tls_api_multiple_versions_test();
@@ -74,6 +98,11 @@ extern "C" {
     int ticket_store_test();
     int session_resume_test();
     int zero_rtt_test();
+    int wake_time_test();
+    int ready_cnx_test();
+    int command_queue_test();
+    int cnx_layout_test();
+    int packet_pool_test();
 
 #ifdef  __cplusplus
 }
@@ -74,6 +74,31 @@ extern "C" {
 
 	void picoquictest_sim_link_submit(picoquictest_sim_link_t * link, picoquictest_sim_packet_t * packet,
 		uint64_t current_time);
+
+	/*
+	 * Helpers shared by the tests of the ACK and retransmission logic.
+	 * A test range lists packet numbers, from the highest range to the lowest.
+	 */
+
+	typedef struct st_test_ack_range_t {
+		uint64_t start_of_sack_range;
+		uint64_t end_of_sack_range;
+	} test_ack_range_t;
+
+	void fill_test_sack_tracker(picoquic_sack_tracker_t * tracker,
+		test_ack_range_t const * ranges, size_t nb_ranges);
+
+	int cmp_test_sack_tracker(picoquic_sack_tracker_t * tracker,
+		test_ack_range_t const * ranges, size_t nb_ranges);
+
+	size_t build_test_ack(test_ack_range_t const * ranges, size_t nb_ranges,
+		uint8_t * bytes, size_t bytes_max, uint32_t version_flags);
+
+	int picoquictest_create_ready_cnx(uint64_t current_time, picoquic_quic_t ** p_quic, picoquic_cnx_t ** p_cnx);
+
+	int picoquictest_queue_ping_packet(picoquic_cnx_t * cnx, uint64_t current_time);
+
+	int picoquictest_receive_ack(picoquic_cnx_t * cnx, uint64_t low, uint64_t high, uint64_t current_time);
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,264 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquictest_internal.h"
+
+/*
+ * The retransmit queue is indexed by sequence number. Queue enough packets to
+ * force the index to grow, acknowledge them with a multi-range ACK, and verify
+ * that exactly the acknowledged packets were removed, in any order.
+ */
+
+#define RETRANSMIT_INDEX_TEST_NB_PACKETS 1000
+
+static const test_ack_range_t test_index_ack[] = {
+    { 990, 999 },
+    { 500, 509 },
+    { 0, 9 }
+};
+
+static size_t retransmit_index_count_queue(picoquic_cnx_t * cnx)
+{
+    size_t nb_queued = 0;
+    picoquic_packet * p = cnx->retransmit_newest;
+
+    while (p != NULL)
+    {
+        nb_queued++;
+        p = p->next_packet;
+    }
+
+    return nb_queued;
+}
+
+static int retransmit_index_check_queue(picoquic_cnx_t * cnx, uint64_t first_sequence, size_t nb_expected)
+{
+    int ret = 0;
+    size_t nb_found = 0;
+    picoquic_packet * p = cnx->retransmit_newest;
+
+    while (ret == 0 && p != NULL)
+    {
+        if (picoquic_find_retransmit_packet(cnx, p->sequence_number) != p ||
+            (p->next_packet != NULL && p->next_packet->sequence_number >= p->sequence_number))
+        {
+            ret = -1;
+        }
+        nb_found++;
+        p = p->next_packet;
+    }
+
+    for (uint64_t i = 0; ret == 0 && i < RETRANSMIT_INDEX_TEST_NB_PACKETS; i++)
+    {
+        int is_acked = 0;
+
+        for (size_t j = 0; j < sizeof(test_index_ack) / sizeof(test_ack_range_t); j++)
+        {
+            if (i >= test_index_ack[j].start_of_sack_range && i <= test_index_ack[j].end_of_sack_range)
+            {
+                is_acked = 1;
+            }
+        }
+
+        if ((picoquic_find_retransmit_packet(cnx, first_sequence + i) == NULL) != (is_acked || nb_expected == 0))
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (nb_found != nb_expected ||
+        picoquic_find_retransmit_packet(cnx, first_sequence - 1) != NULL ||
+        picoquic_find_retransmit_packet(cnx, first_sequence + RETRANSMIT_INDEX_TEST_NB_PACKETS) != NULL))
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int retransmit_index_test()
+{
+    int ret = 0;
+    uint64_t current_time = 1000000;
+    uint64_t first_sequence = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    test_ack_range_t ack_ranges[3];
+    uint8_t ack[256];
+    size_t ack_length = 0;
+    size_t consumed = 0;
+    size_t nb_acked = 0;
+
+    ret = picoquictest_create_ready_cnx(current_time, &quic, &cnx);
+
+    if (ret == 0)
+    {
+        first_sequence = cnx->send_sequence;
+    }
+
+    for (int i = 0; ret == 0 && i < RETRANSMIT_INDEX_TEST_NB_PACKETS; i++)
+    {
+        ret = picoquictest_queue_ping_packet(cnx, current_time);
+    }
+
+    if (ret == 0 && cnx->retransmit_index_size < RETRANSMIT_INDEX_TEST_NB_PACKETS)
+    {
+        ret = -1;
+    }
+
+    /* Acknowledge a few ranges, expressed as sequence numbers */
+    if (ret == 0)
+    {
+        for (size_t j = 0; j < sizeof(test_index_ack) / sizeof(test_ack_range_t); j++)
+        {
+            ack_ranges[j].start_of_sack_range = first_sequence + test_index_ack[j].start_of_sack_range;
+            ack_ranges[j].end_of_sack_range = first_sequence + test_index_ack[j].end_of_sack_range;
+            nb_acked += (size_t)(test_index_ack[j].end_of_sack_range - test_index_ack[j].start_of_sack_range + 1);
+        }
+
+        ack_length = build_test_ack(ack_ranges, 3, ack, sizeof(ack), 0);
+        ret = picoquic_decode_ack_frame(cnx, ack, ack_length, &consumed, current_time + 20000);
+    }
+
+    if (ret == 0)
+    {
+        ret = retransmit_index_check_queue(cnx, first_sequence, RETRANSMIT_INDEX_TEST_NB_PACKETS - nb_acked);
+    }
+
+    /* Acknowledge everything */
+    if (ret == 0)
+    {
+        ack_ranges[0].start_of_sack_range = first_sequence;
+        ack_ranges[0].end_of_sack_range = first_sequence + RETRANSMIT_INDEX_TEST_NB_PACKETS - 1;
+        ack_length = build_test_ack(ack_ranges, 1, ack, sizeof(ack), 0);
+        ret = picoquic_decode_ack_frame(cnx, ack, ack_length, &consumed, current_time + 40000);
+    }
+
+    if (ret == 0)
+    {
+        ret = retransmit_index_check_queue(cnx, first_sequence, 0);
+    }
+
+    if (ret == 0 && cnx->bytes_in_transit != 0)
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * The cost of an ACK range is bounded by the range, even when the packets above
+ * it are still queued: ranges already acknowledged, inside a hole or below the
+ * oldest queued packet, do not walk the queue from its head.
+ */
+
+typedef struct st_ack_range_cost_test_t {
+    uint64_t highest;
+    uint64_t range;
+    size_t nb_acked;
+    size_t nb_visited_max;
+} ack_range_cost_test_t;
+
+/* Offsets from the first sequence number, ranges of a frame from the newest to the oldest.
+ * The packets 100 to 109 and 500 to 509 are acknowledged before the test, and the
+ * newest packets, at the head of the queue, stay unacknowledged. The third range
+ * starts from the position left by the second one, without probing the index. */
+static const ack_range_cost_test_t ack_range_cost_test_ranges[] = {
+    { 509, 10, 0, 10 },
+    { 609, 100, 100, 102 },
+    { 505, 206, 200, 201 },
+    { 109, 10, 0, 10 },
+    { 49, 50, 50, 51 },
+    { 29, 30, 0, 0 },
+};
+
+int ack_range_cost_test()
+{
+    int ret = 0;
+    uint64_t current_time = 1000000;
+    uint64_t first_sequence = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_packet * p_next = NULL;
+    size_t nb_queued = RETRANSMIT_INDEX_TEST_NB_PACKETS - 20;
+
+    ret = picoquictest_create_ready_cnx(current_time, &quic, &cnx);
+
+    if (ret == 0)
+    {
+        first_sequence = cnx->send_sequence;
+    }
+
+    for (int i = 0; ret == 0 && i < RETRANSMIT_INDEX_TEST_NB_PACKETS; i++)
+    {
+        ret = picoquictest_queue_ping_packet(cnx, current_time);
+    }
+
+    if (ret == 0)
+    {
+        (void)picoquic_process_ack_range(cnx, first_sequence + 509, 10, &p_next, current_time);
+        (void)picoquic_process_ack_range(cnx, first_sequence + 109, 10, &p_next, current_time);
+
+        if (retransmit_index_count_queue(cnx) != nb_queued)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Each range visits at most the packets it covers, the one below it and one index probe */
+    p_next = NULL;
+    for (size_t i = 0; ret == 0 && i < sizeof(ack_range_cost_test_ranges) / sizeof(ack_range_cost_test_t); i++)
+    {
+        size_t nb_visited = picoquic_process_ack_range(cnx, first_sequence + ack_range_cost_test_ranges[i].highest,
+            ack_range_cost_test_ranges[i].range, &p_next, current_time);
+
+        nb_queued -= ack_range_cost_test_ranges[i].nb_acked;
+
+        if (nb_visited > ack_range_cost_test_ranges[i].nb_visited_max ||
+            retransmit_index_count_queue(cnx) != nb_queued)
+        {
+            DBG_PRINTF("Range %d, visited %d packets\n", (int)i, (int)nb_visited);
+            ret = -1;
+        }
+    }
+
+    /* A range below the oldest queued packet returns immediately */
+    if (ret == 0 && (cnx->retransmit_oldest == NULL ||
+        picoquic_process_ack_range(cnx, cnx->retransmit_oldest->sequence_number - 1, 1, &p_next, current_time) != 0))
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -70,11 +70,14 @@ int sacktest()
 {
     int ret = 0;
     picoquic_cnx_t cnx;
+    picoquic_cnx_cold_t cold;
     uint64_t current_time;
     uint64_t highest_seen = 0;
     uint64_t highest_seen_time = 0;
 
     memset(&cnx, 0, sizeof(cnx));
+    memset(&cold, 0, sizeof(cold));
+    cnx.cold = &cold;
 
     for (size_t i = 0; ret == 0 && i < nb_test_pn64; i++)
     {
@@ -115,10 +118,10 @@ int sacktest()
 
     if (ret == 0)
     {
-        if (cnx.first_sack_item.end_of_sack_range != 21 ||
-            cnx.first_sack_item.start_of_sack_range != 1 ||
+        if (cnx.sack_tracker.first_range.end_of_sack_range != 21 ||
+            cnx.sack_tracker.first_range.start_of_sack_range != 1 ||
             cnx.time_stamp_largest_received != highest_seen_time ||
-            cnx.first_sack_item.next_sack != NULL)
+            cnx.sack_tracker.nb_ranges != 1)
         {
             ret = -1;
         }
@@ -284,12 +287,15 @@ int sendacktest()
 {
     int ret = 0;
     picoquic_cnx_t cnx;
+    picoquic_cnx_cold_t cold;
     uint64_t current_time;
     uint64_t received_mask = 0;
     uint8_t bytes[256];
     size_t consumed;
 
     memset(&cnx, 0, sizeof(cnx));
+    memset(&cold, 0, sizeof(cold));
+    cnx.cold = &cold;
 
     for (size_t i = 0; ret == 0 && i < nb_test_pn64; i++)
     {
@@ -394,3 +400,189 @@ int ackrange_test()
 
     return ret;
 }
+
+/*
+ * Test the fixed size tracker of received packets under heavy random loss and
+ * reordering. The tracker state is compared to a reference array. Once the
+ * ranges overflow, packets below the floor, or below all the ranges when they
+ * are full, must be reported as duplicates.
+ */
+
+#define SACK_TRACKER_TEST_NB_PN 2048
+
+static int sack_tracker_check(picoquic_cnx_t * cnx, uint8_t const * received, uint64_t highest)
+{
+    int ret = 0;
+    picoquic_sack_tracker_t * tracker = &cnx->sack_tracker;
+
+    if (tracker->nb_ranges == 0 || tracker->nb_ranges > PICOQUIC_MAX_SACK_RANGES ||
+        tracker->first_range.end_of_sack_range != highest)
+    {
+        ret = -1;
+    }
+
+    /* Ranges are ordered, separated by holes, and only hold received packets */
+    for (size_t i = 0; ret == 0 && i < tracker->nb_ranges; i++)
+    {
+        picoquic_sack_range_t * range = picoquic_sack_get_range(tracker, i);
+
+        if (range->start_of_sack_range > range->end_of_sack_range ||
+            range->start_of_sack_range < tracker->floor ||
+            (i > 0 && range->end_of_sack_range + 1 >= picoquic_sack_get_range(tracker, i - 1)->start_of_sack_range))
+        {
+            ret = -1;
+        }
+
+        for (uint64_t pn = range->start_of_sack_range;
+            ret == 0 && pn <= range->end_of_sack_range; pn++)
+        {
+            if (received[pn] == 0)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    for (uint64_t pn = 0; ret == 0 && pn < SACK_TRACKER_TEST_NB_PN; pn++)
+    {
+        int expected = (pn < tracker->floor) ? 1 : received[pn];
+
+        if (picoquic_is_pn_already_received(cnx, pn) != expected)
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int sack_tracker_test()
+{
+    int ret = 0;
+    picoquic_cnx_t cnx;
+    picoquic_cnx_cold_t cold;
+    uint8_t received[SACK_TRACKER_TEST_NB_PN];
+    uint64_t order[SACK_TRACKER_TEST_NB_PN];
+    uint64_t highest = 0;
+    uint64_t random_state = 0xDEADBEEFCAFEBABEull;
+
+    memset(&cnx, 0, sizeof(cnx));
+    memset(&cold, 0, sizeof(cold));
+    cnx.cold = &cold;
+    memset(received, 0, sizeof(received));
+
+    /* Packet number zero must not be confused with the empty state */
+    if (picoquic_is_pn_already_received(&cnx, 0) != 0 ||
+        picoquic_record_pn_received(&cnx, 0, 0) != 0 ||
+        picoquic_is_pn_already_received(&cnx, 0) != 1 ||
+        picoquic_record_pn_received(&cnx, 0, 0) != 1 ||
+        cnx.sack_tracker.nb_ranges != 1)
+    {
+        ret = -1;
+    }
+    received[0] = 1;
+
+    /* Deliver one packet in three, with local reordering */
+    for (size_t i = 0; i < SACK_TRACKER_TEST_NB_PN; i++)
+    {
+        order[i] = i;
+    }
+
+    for (size_t i = 1; i + 1 < SACK_TRACKER_TEST_NB_PN; i += 2)
+    {
+        random_state = random_state * 6364136223846793005ull + 1442695040888963407ull;
+
+        if (((random_state >> 33) & 1) != 0)
+        {
+            uint64_t x = order[i];
+            order[i] = order[i + 1];
+            order[i + 1] = x;
+        }
+    }
+
+    for (size_t i = 1; ret == 0 && i < SACK_TRACKER_TEST_NB_PN; i++)
+    {
+        uint64_t pn = order[i];
+        int expected;
+
+        random_state = random_state * 6364136223846793005ull + 1442695040888963407ull;
+
+        if (((random_state >> 33) % 3) != 0)
+        {
+            continue;
+        }
+
+        expected = (pn < cnx.sack_tracker.floor ||
+            (cnx.sack_tracker.nb_ranges == PICOQUIC_MAX_SACK_RANGES &&
+                pn < picoquic_sack_get_range(&cnx.sack_tracker, PICOQUIC_MAX_SACK_RANGES - 1)->start_of_sack_range)) ? 1 : 0;
+
+        if (picoquic_record_pn_received(&cnx, pn, i) != expected ||
+            picoquic_record_pn_received(&cnx, pn, i) != 1)
+        {
+            ret = -1;
+        }
+        else
+        {
+            received[pn] |= (expected == 0);
+
+            if (pn > highest)
+            {
+                highest = pn;
+            }
+
+            ret = sack_tracker_check(&cnx, received, highest);
+        }
+    }
+
+    /* That much loss overflows the ranges */
+    if (ret == 0 && (cnx.sack_tracker.nb_ranges != PICOQUIC_MAX_SACK_RANGES ||
+        cnx.sack_tracker.floor == 0))
+    {
+        ret = -1;
+    }
+
+    /* Packets older than the window are still found in the ranges */
+    if (ret == 0)
+    {
+        uint64_t old_pn = picoquic_sack_get_range(&cnx.sack_tracker, 1)->start_of_sack_range;
+        uint64_t old_hole = picoquic_sack_get_range(&cnx.sack_tracker, 1)->end_of_sack_range + 1;
+
+        if (picoquic_record_pn_received(&cnx, highest + 4 * PICOQUIC_SACK_WINDOW_BITS, 0) != 0 ||
+            picoquic_record_pn_received(&cnx, old_pn, 0) != 1 ||
+            picoquic_is_pn_already_received(&cnx, old_hole) != 0 ||
+            picoquic_record_pn_received(&cnx, old_hole, 0) != 0 ||
+            picoquic_is_pn_already_received(&cnx, old_hole) != 1)
+        {
+            ret = -1;
+        }
+    }
+
+    /* A late packet below all the full ranges is dropped as a duplicate */
+    if (ret == 0)
+    {
+        uint64_t late_pn = 1000;
+
+        memset(&cnx, 0, sizeof(cnx));
+        memset(&cold, 0, sizeof(cold));
+        cnx.cold = &cold;
+
+        for (uint64_t i = 0; ret == 0 && i < PICOQUIC_MAX_SACK_RANGES; i++)
+        {
+            if (picoquic_record_pn_received(&cnx, late_pn + 2 * PICOQUIC_SACK_WINDOW_BITS + 2 * i, 0) != 0)
+            {
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && (cnx.sack_tracker.nb_ranges != PICOQUIC_MAX_SACK_RANGES ||
+            picoquic_record_pn_received(&cnx, late_pn, 0) != 1 ||
+            cnx.sack_tracker.floor != 0 ||
+            cnx.sack_tracker.nb_ranges != PICOQUIC_MAX_SACK_RANGES ||
+            picoquic_is_pn_already_received(&cnx, late_pn) != 0))
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,247 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquictest_internal.h"
+
+/*
+ * Streams are released once closed in both directions, and their identifiers
+ * are remembered as closed.
+ * - A stream that received its FIN is released when its data and FIN are acked.
+ * - A stream that sent a reset is released when the peer's reset arrives, or
+ *   when its reset is acked after the FIN was received.
+ * - Late frames for released streams are ignored, and the application cannot
+ *   open them again.
+ * - A stream released between two open streams is unlinked from both.
+ */
+
+#define STREAM_GC_TEST_LENGTH 100
+
+static void stream_gc_test_callback(picoquic_cnx_t * cnx,
+    uint64_t stream_id, uint8_t * bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void * callback_ctx)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+    UNREFERENCED_PARAMETER(fin_or_event);
+    UNREFERENCED_PARAMETER(callback_ctx);
+#endif
+}
+
+static int stream_gc_send_test_packet(picoquic_cnx_t * cnx, uint64_t stream_id, uint64_t current_time)
+{
+    int ret = 0;
+    size_t header_length = 0;
+    size_t consumed = 0;
+    picoquic_stream_head * stream = picoquic_find_stream(cnx, stream_id, 0);
+    picoquic_packet * p = picoquic_alloc_packet(cnx->quic);
+
+    if (p == NULL || stream == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        p->sequence_number = cnx->send_sequence++;
+        p->send_time = current_time;
+        header_length = picoquic_create_packet_header(cnx, picoquic_packet_1rtt_protected_phi0,
+            cnx->server_cnxid, p->sequence_number, p->bytes);
+
+        if (picoquic_prepare_stream_frame(cnx, stream, &p->bytes[header_length],
+            sizeof(p->bytes) - header_length, &consumed) != 0 || consumed == 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            p->length = header_length + consumed;
+            picoquic_queue_for_retransmit(cnx, p, header_length, p->length, current_time);
+            p = NULL;
+        }
+    }
+
+    if (p != NULL)
+    {
+        picoquic_recycle_packet(cnx->quic, p);
+    }
+
+    return ret;
+}
+
+static int stream_gc_receive_test_reset(picoquic_cnx_t * cnx, uint64_t stream_id, uint64_t final_offset)
+{
+    uint8_t bytes[32];
+    size_t length = 0;
+
+    bytes[length++] = picoquic_frame_type_reset_stream;
+    length += picoquic_varint_encode(&bytes[length], sizeof(bytes) - length, stream_id);
+    picoformat_16(&bytes[length], 1);
+    length += 2;
+    length += picoquic_varint_encode(&bytes[length], sizeof(bytes) - length, final_offset);
+
+    return picoquic_decode_frames(cnx, bytes, length, 0, 0);
+}
+
+int stream_gc_test()
+{
+    int ret = 0;
+    uint64_t current_time = 1000000;
+    uint64_t first_sequence = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    uint8_t data[STREAM_GC_TEST_LENGTH];
+    uint8_t frame[STREAM_GC_TEST_LENGTH + 16];
+    size_t frame_length = 0;
+    size_t consumed = 0;
+
+    memset(data, 0x5A, sizeof(data));
+
+    ret = picoquictest_create_ready_cnx(current_time, &quic, &cnx);
+
+    if (ret == 0)
+    {
+        cnx->maxdata_local = 0x100000;
+        cnx->maxdata_remote = 0x100000;
+        cnx->local_parameters.initial_max_stream_data = 0x100000;
+        cnx->remote_parameters.initial_max_stream_data = 0x100000;
+        cnx->max_stream_id_bidir_remote = 1024;
+        picoquic_set_callback(cnx, stream_gc_test_callback, NULL);
+        first_sequence = cnx->send_sequence;
+    }
+
+    /* Request and response on stream 4: kept until the response is acked */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 4, data, sizeof(data), 1) != 0 ||
+        stream_gc_send_test_packet(cnx, 4, current_time) != 0 ||
+        picoquic_stream_network_input(cnx, 4, 0, 1, data, sizeof(data), current_time) != 0 ||
+        picoquic_find_stream(cnx, 4, 0) == NULL))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0 && (
+        picoquictest_receive_ack(cnx, first_sequence, first_sequence, current_time + 20000) != 0 ||
+        picoquic_find_stream(cnx, 4, 0) != NULL || !picoquic_is_stream_closed(cnx, 4) ||
+        cnx->first_stream.next_stream != NULL || cnx->last_stream != NULL))
+    {
+        ret = -1;
+    }
+
+    /* Stream 8 is reset in both directions, and released when the peer's reset arrives */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 8, data, sizeof(data), 0) != 0 ||
+        picoquic_reset_stream(cnx, 8, 1) != 0 ||
+        stream_gc_send_test_packet(cnx, 8, current_time) != 0 ||
+        picoquic_find_stream(cnx, 8, 0) == NULL ||
+        stream_gc_receive_test_reset(cnx, 8, 0) != 0 ||
+        picoquic_find_stream(cnx, 8, 0) != NULL || !picoquic_is_stream_closed(cnx, 8)))
+    {
+        ret = -1;
+    }
+
+    /* Stream 12 receives a FIN, then is reset, and released when the reset is acked */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 12, data, sizeof(data), 0) != 0 ||
+        picoquic_stream_network_input(cnx, 12, 0, 1, data, sizeof(data), current_time) != 0 ||
+        picoquic_reset_stream(cnx, 12, 1) != 0 ||
+        stream_gc_send_test_packet(cnx, 12, current_time) != 0 ||
+        picoquic_find_stream(cnx, 12, 0) == NULL ||
+        picoquictest_receive_ack(cnx, first_sequence + 2, first_sequence + 2, current_time + 40000) != 0 ||
+        picoquic_find_stream(cnx, 12, 0) != NULL || !picoquic_is_stream_closed(cnx, 12)))
+    {
+        ret = -1;
+    }
+
+    /* The closed streams are remembered as one range, and stream 16 is still open */
+    if (ret == 0 && (cnx->closed_streams[0].start_of_sack_range != 2 ||
+        cnx->closed_streams[0].end_of_sack_range != 4 || cnx->closed_streams[0].next_sack != NULL ||
+        picoquic_is_stream_closed(cnx, 16) || picoquic_is_stream_closed(cnx, 5)))
+    {
+        ret = -1;
+    }
+
+    /* Late frames for the released streams are ignored */
+    if (ret == 0)
+    {
+        frame[frame_length++] = picoquic_frame_type_stream_range_min | 4 | 2;
+        frame_length += picoquic_varint_encode(&frame[frame_length], sizeof(frame) - frame_length, 4);
+        frame_length += picoquic_varint_encode(&frame[frame_length], sizeof(frame) - frame_length, 0);
+        frame_length += picoquic_varint_encode(&frame[frame_length], sizeof(frame) - frame_length, sizeof(data));
+        memcpy(&frame[frame_length], data, sizeof(data));
+        frame_length += sizeof(data);
+
+        if (picoquic_decode_stream_frame(cnx, frame, frame_length, 0, &consumed, current_time) != 0 ||
+            consumed != frame_length || stream_gc_receive_test_reset(cnx, 12, STREAM_GC_TEST_LENGTH) != 0 ||
+            picoquic_find_stream(cnx, 4, 0) != NULL || picoquic_find_stream(cnx, 12, 0) != NULL ||
+            cnx->first_stream.next_stream != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* The application cannot reopen them */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 4, data, sizeof(data), 1) != PICOQUIC_ERROR_STREAM_ALREADY_CLOSED ||
+        picoquic_reset_stream(cnx, 4, 0) != PICOQUIC_ERROR_STREAM_ALREADY_CLOSED ||
+        picoquic_stop_sending(cnx, 12, 0) != PICOQUIC_ERROR_STREAM_ALREADY_CLOSED ||
+        picoquic_find_stream(cnx, 8, 1) != NULL || cnx->first_stream.next_stream != NULL))
+    {
+        ret = -1;
+    }
+
+    /* A stream released between two open streams is unlinked from both */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 16, data, sizeof(data), 0) != 0 ||
+        picoquic_add_to_stream(cnx, 20, data, sizeof(data), 0) != 0 ||
+        picoquic_add_to_stream(cnx, 24, data, sizeof(data), 0) != 0 ||
+        picoquic_reset_stream(cnx, 20, 1) != 0 ||
+        stream_gc_send_test_packet(cnx, 20, current_time) != 0 ||
+        stream_gc_receive_test_reset(cnx, 20, 0) != 0 ||
+        picoquic_find_stream(cnx, 20, 0) != NULL))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0)
+    {
+        picoquic_stream_head * stream_16 = picoquic_find_stream(cnx, 16, 0);
+        picoquic_stream_head * stream_24 = picoquic_find_stream(cnx, 24, 0);
+
+        if (stream_16 == NULL || stream_24 == NULL ||
+            cnx->first_stream.next_stream != stream_16 || stream_16->previous_stream != &cnx->first_stream ||
+            stream_16->next_stream != stream_24 || stream_24->previous_stream != stream_16 ||
+            stream_24->next_stream != NULL || cnx->last_stream != stream_24)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -0,0 +1,810 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "../picoquic/picoquic_internal.h"
+
+/*
+ * Stream reassembly test. Deliver the data of a stream in fragments, out of
+ * order, with overlaps and repeats, and check that the application receives
+ * exactly the stream content, in order, with the FIN on the last byte.
+ */
+
+#define STREAM_REASSEMBLY_TEST_LENGTH 20000
+#define STREAM_REASSEMBLY_TEST_FRAGMENT 1000
+#define STREAM_REASSEMBLY_TEST_ID 5
+
+typedef struct st_stream_reassembly_test_ctx_t {
+    uint8_t received[STREAM_REASSEMBLY_TEST_LENGTH];
+    size_t nb_received;
+    uint8_t * last_bytes;
+    int nb_fin;
+    int error;
+} stream_reassembly_test_ctx_t;
+
+static void stream_reassembly_test_callback(picoquic_cnx_t * cnx,
+    uint64_t stream_id, uint8_t * bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void * callback_ctx)
+{
+    stream_reassembly_test_ctx_t * ctx = (stream_reassembly_test_ctx_t *)callback_ctx;
+
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+#endif
+
+    if (stream_id != STREAM_REASSEMBLY_TEST_ID || ctx->nb_fin != 0 ||
+        (fin_or_event != picoquic_callback_no_event && fin_or_event != picoquic_callback_stream_fin) ||
+        ctx->nb_received + length > STREAM_REASSEMBLY_TEST_LENGTH)
+    {
+        ctx->error = 1;
+    }
+    else
+    {
+        if (length > 0)
+        {
+            memcpy(ctx->received + ctx->nb_received, bytes, length);
+            ctx->last_bytes = bytes;
+            ctx->nb_received += length;
+        }
+
+        if (fin_or_event == picoquic_callback_stream_fin)
+        {
+            ctx->nb_fin++;
+        }
+    }
+}
+
+static picoquic_cnx_t * stream_reassembly_test_cnx(picoquic_quic_t * quic, stream_reassembly_test_ctx_t * ctx)
+{
+    picoquic_cnx_t * cnx = NULL;
+    struct sockaddr_in test_addr;
+
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+    test_addr.sin_port = 4433;
+
+    cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+
+    if (cnx != NULL)
+    {
+        cnx->cnx_state = picoquic_state_client_ready;
+        cnx->maxdata_local = 0x100000;
+        cnx->local_parameters.initial_max_stream_data = 0x100000;
+        cnx->max_stream_id_bidir_local = 1024;
+        picoquic_set_callback(cnx, stream_reassembly_test_callback, ctx);
+    }
+
+    return cnx;
+}
+
+/* Test the ring buffer directly, with data wrapping around its end */
+static int stream_reassembly_buffer_test(uint8_t * data)
+{
+    int ret = 0;
+    picoquic_reassembly_t r;
+    uint64_t start = 0;
+    uint8_t * bytes = NULL;
+    size_t length;
+
+    memset(&r, 0, sizeof(r));
+
+    /* Fill and consume most of the minimal buffer, so the next data wraps */
+    if (picoquic_reassembly_insert(&r, start, 0, data, 1500) != 0 ||
+        picoquic_reassembly_contiguous(&r, start, &bytes) != 1500 ||
+        memcmp(bytes, data, 1500) != 0)
+    {
+        ret = -1;
+    }
+    else
+    {
+        picoquic_reassembly_consume(&r, start, 1500);
+        start = 1500;
+    }
+
+    /* A hole at the start: nothing can be delivered, and the buffer does not grow */
+    if (ret == 0 && (picoquic_reassembly_insert(&r, start, 1600, data + 1600, 1000) != 0 ||
+        picoquic_reassembly_contiguous(&r, start, &bytes) != 0 ||
+        r.size != PICOQUIC_REASSEMBLY_MIN_SIZE))
+    {
+        ret = -1;
+    }
+
+    /* Data overlapping already delivered bytes fills the hole */
+    if (ret == 0 && picoquic_reassembly_insert(&r, start, 1400, data + 1400, 300) != 0)
+    {
+        ret = -1;
+    }
+
+    /* The data wraps, and is delivered in two parts */
+    if (ret == 0)
+    {
+        length = picoquic_reassembly_contiguous(&r, start, &bytes);
+        if (length != PICOQUIC_REASSEMBLY_MIN_SIZE - 1500 || memcmp(bytes, data + start, length) != 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            picoquic_reassembly_consume(&r, start, length);
+            start += length;
+            length = picoquic_reassembly_contiguous(&r, start, &bytes);
+            if (start + length != 2600 || memcmp(bytes, data + start, length) != 0)
+            {
+                ret = -1;
+            }
+            else
+            {
+                picoquic_reassembly_consume(&r, start, length);
+                start += length;
+            }
+        }
+    }
+
+    /* Data far beyond the end forces the buffer to grow, pending data is preserved */
+    if (ret == 0 && (picoquic_reassembly_insert(&r, start, 2700, data + 2700, 100) != 0 ||
+        picoquic_reassembly_insert(&r, start, 9000, data + 9000, 1000) != 0 ||
+        r.size < 10000 - start ||
+        picoquic_reassembly_insert(&r, start, 2600, data + 2600, 100) != 0 ||
+        picoquic_reassembly_contiguous(&r, start, &bytes) != 200 ||
+        memcmp(bytes, data + 2600, 200) != 0))
+    {
+        ret = -1;
+    }
+
+    picoquic_reassembly_clear(&r);
+
+    return ret;
+}
+
+int stream_reassembly_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    stream_reassembly_test_ctx_t * ctx = NULL;
+    uint8_t * data = (uint8_t *)malloc(STREAM_REASSEMBLY_TEST_LENGTH);
+    /* Order in which the fragments are delivered. Fragment 0 comes 13th, so
+     * most of the stream is buffered before the first delivery. */
+    static const int fragment_order[] = { 3, 1, 19, 2, 5, 4, 7, 6, 9, 8, 11, 10, 0, 13, 12, 15, 14, 17, 16, 18 };
+    size_t nb_fragments = sizeof(fragment_order) / sizeof(int);
+
+    if (data == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        for (size_t i = 0; i < STREAM_REASSEMBLY_TEST_LENGTH; i++)
+        {
+            data[i] = (uint8_t)(i + (i >> 8));
+        }
+
+        ret = stream_reassembly_buffer_test(data);
+    }
+
+    if (ret == 0)
+    {
+        ctx = (stream_reassembly_test_ctx_t *)malloc(sizeof(stream_reassembly_test_ctx_t));
+        quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+        if (ctx == NULL || quic == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            memset(ctx, 0, sizeof(stream_reassembly_test_ctx_t));
+            cnx = stream_reassembly_test_cnx(quic, ctx);
+
+            if (cnx == NULL)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    /* Deliver each fragment, extended to overlap the next one, and repeat some */
+    for (size_t i = 0; ret == 0 && i < nb_fragments; i++)
+    {
+        size_t offset = fragment_order[i] * STREAM_REASSEMBLY_TEST_FRAGMENT;
+        size_t length = STREAM_REASSEMBLY_TEST_FRAGMENT + 100;
+        int fin = 0;
+
+        if (offset + length >= STREAM_REASSEMBLY_TEST_LENGTH)
+        {
+            length = STREAM_REASSEMBLY_TEST_LENGTH - offset;
+            fin = 1;
+        }
+
+        ret = picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, offset, fin,
+            data + offset, length, 0);
+
+        if (ret == 0 && (i % 4) == 0)
+        {
+            ret = picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, offset, fin,
+                data + offset, length, 0);
+        }
+
+        if (ret == 0 && ctx->nb_received != 0 && i < 12)
+        {
+            /* Nothing can be delivered before fragment 0 arrives */
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (ctx->error != 0 || ctx->nb_fin != 1 ||
+        ctx->nb_received != STREAM_REASSEMBLY_TEST_LENGTH ||
+        memcmp(ctx->received, data, STREAM_REASSEMBLY_TEST_LENGTH) != 0))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0)
+    {
+        picoquic_stream_head * stream = picoquic_find_stream(cnx, STREAM_REASSEMBLY_TEST_ID, 0);
+
+        if (stream == NULL || stream->consumed_offset != STREAM_REASSEMBLY_TEST_LENGTH ||
+            stream->reassembly.size != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    if (ctx != NULL)
+    {
+        free(ctx);
+    }
+
+    if (data != NULL)
+    {
+        free(data);
+    }
+
+    return ret;
+}
+
+/*
+ * In order data is passed to the application directly from the packet, and
+ * is never copied in the reassembly buffer. Only out of order data is.
+ */
+
+int stream_in_order_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    stream_reassembly_test_ctx_t * ctx = (stream_reassembly_test_ctx_t *)malloc(sizeof(stream_reassembly_test_ctx_t));
+    uint8_t * data = (uint8_t *)malloc(STREAM_REASSEMBLY_TEST_LENGTH);
+    size_t offset = 0;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (ctx == NULL || data == NULL || quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        memset(ctx, 0, sizeof(stream_reassembly_test_ctx_t));
+
+        for (size_t i = 0; i < STREAM_REASSEMBLY_TEST_LENGTH; i++)
+        {
+            data[i] = (uint8_t)(i + (i >> 8));
+        }
+
+        cnx = stream_reassembly_test_cnx(quic, ctx);
+
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* The first fragments arrive in order */
+    while (ret == 0 && offset < 3 * STREAM_REASSEMBLY_TEST_FRAGMENT)
+    {
+        ret = picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, offset, 0,
+            data + offset, STREAM_REASSEMBLY_TEST_FRAGMENT, 0);
+
+        if (ret == 0)
+        {
+            stream = picoquic_find_stream(cnx, STREAM_REASSEMBLY_TEST_ID, 0);
+
+            if (stream == NULL || stream->reassembly.size != 0 ||
+                ctx->last_bytes != data + offset || ctx->nb_received != offset + STREAM_REASSEMBLY_TEST_FRAGMENT)
+            {
+                ret = -1;
+            }
+        }
+
+        offset += STREAM_REASSEMBLY_TEST_FRAGMENT;
+    }
+
+    /* A fragment arrives early, and is buffered */
+    if (ret == 0)
+    {
+        size_t early_offset = offset + STREAM_REASSEMBLY_TEST_FRAGMENT;
+
+        ret = picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, early_offset, 1,
+            data + early_offset, STREAM_REASSEMBLY_TEST_LENGTH - early_offset, 0);
+
+        if (ret == 0 && (stream->reassembly.size == 0 || ctx->nb_received != offset))
+        {
+            ret = -1;
+        }
+    }
+
+    /* The missing fragment overlaps the buffered data. It is delivered from the
+     * packet, then the rest of the stream from the buffer, which is released. */
+    if (ret == 0)
+    {
+        ret = picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, offset, 0,
+            data + offset, STREAM_REASSEMBLY_TEST_FRAGMENT + 100, 0);
+
+        if (ret == 0 && (stream->reassembly.size != 0 || ctx->error != 0 || ctx->nb_fin != 1 ||
+            ctx->nb_received != STREAM_REASSEMBLY_TEST_LENGTH ||
+            memcmp(ctx->received, data, STREAM_REASSEMBLY_TEST_LENGTH) != 0))
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    if (ctx != NULL)
+    {
+        free(ctx);
+    }
+
+    if (data != NULL)
+    {
+        free(data);
+    }
+
+    return ret;
+}
+
+/*
+ * Receive window auto tuning. Credit is renewed when half of the window is
+ * used, and the window doubles if the renewals are less than two round trips
+ * apart, up to the configured maximum.
+ */
+
+#define RECEIVE_WINDOW_TEST_RTT 100000
+#define RECEIVE_WINDOW_TEST_STREAM_WINDOW 0x4000
+#define RECEIVE_WINDOW_TEST_STREAM_MAX 0x6000
+#define RECEIVE_WINDOW_TEST_LENGTH 0x10000
+
+static int receive_window_test_input(picoquic_cnx_t * cnx, uint8_t * data,
+    uint64_t * offset, uint64_t next_offset)
+{
+    int ret = picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, *offset, 0,
+        data + *offset, (size_t)(next_offset - *offset), 0);
+
+    *offset = next_offset;
+
+    return ret;
+}
+
+int receive_window_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    stream_reassembly_test_ctx_t * ctx = (stream_reassembly_test_ctx_t *)malloc(sizeof(stream_reassembly_test_ctx_t));
+    uint8_t * data = (uint8_t *)malloc(RECEIVE_WINDOW_TEST_LENGTH);
+    uint8_t bytes[256];
+    size_t consumed = 0;
+    uint64_t offset = 0;
+    picoquic_flow_control_stats_t stats;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (ctx == NULL || data == NULL || quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        memset(ctx, 0, sizeof(stream_reassembly_test_ctx_t));
+        memset(data, 0, RECEIVE_WINDOW_TEST_LENGTH);
+        picoquic_set_max_receive_windows(quic, PICOQUIC_DEFAULT_MAX_CONNECTION_WINDOW, RECEIVE_WINDOW_TEST_STREAM_MAX);
+
+        cnx = stream_reassembly_test_cnx(quic, ctx);
+
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            cnx->smoothed_rtt = RECEIVE_WINDOW_TEST_RTT;
+            cnx->local_parameters.initial_max_stream_data = RECEIVE_WINDOW_TEST_STREAM_WINDOW;
+        }
+    }
+
+    /* Half the window is not used yet: no update */
+    if (ret == 0 && (receive_window_test_input(cnx, data, &offset, 0x2000) != 0 ||
+        (stream = picoquic_find_stream(cnx, STREAM_REASSEMBLY_TEST_ID, 0)) == NULL ||
+        picoquic_prepare_required_max_stream_data_frames(cnx, 1000, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed != 0))
+    {
+        ret = -1;
+    }
+
+    /* First renewal, the window keeps its initial size */
+    if (ret == 0 && (receive_window_test_input(cnx, data, &offset, 0x3000) != 0 ||
+        picoquic_prepare_required_max_stream_data_frames(cnx, 1000, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed == 0 || stream->maxdata_local != 0x3000 + RECEIVE_WINDOW_TEST_STREAM_WINDOW ||
+        stream->maxdata_window != RECEIVE_WINDOW_TEST_STREAM_WINDOW))
+    {
+        ret = -1;
+    }
+
+    /* The peer uses all the credit, renewed less than two RTT later: the window
+     * grows, capped by the maximum */
+    if (ret == 0 && (receive_window_test_input(cnx, data, &offset, 0x7000) != 0 ||
+        picoquic_prepare_required_max_stream_data_frames(cnx, 1000 + RECEIVE_WINDOW_TEST_RTT,
+            bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed == 0 || stream->maxdata_window != RECEIVE_WINDOW_TEST_STREAM_MAX ||
+        stream->maxdata_local != 0x7000 + RECEIVE_WINDOW_TEST_STREAM_MAX))
+    {
+        ret = -1;
+    }
+
+    /* Slow consumption, the window does not grow anymore */
+    if (ret == 0 && (receive_window_test_input(cnx, data, &offset, 0xA800) != 0 ||
+        picoquic_prepare_required_max_stream_data_frames(cnx, 10 * RECEIVE_WINDOW_TEST_RTT,
+            bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed == 0 || stream->maxdata_window != RECEIVE_WINDOW_TEST_STREAM_MAX ||
+        stream->maxdata_local != 0xA800 + RECEIVE_WINDOW_TEST_STREAM_MAX))
+    {
+        ret = -1;
+    }
+
+    /* Connection window: renewed after half is used, doubled if renewed quickly */
+    if (ret == 0)
+    {
+        cnx->maxdata_local = 0x10000;
+        cnx->maxdata_window = 0x10000;
+        cnx->maxdata_update_time = 1000;
+        cnx->data_received = 0x9000;
+
+        if (picoquic_prepare_required_max_data_frame(cnx, 2000, bytes, sizeof(bytes), &consumed) != 0 ||
+            consumed == 0 || cnx->maxdata_window != 0x20000 || cnx->maxdata_local != 0x29000 ||
+            picoquic_prepare_required_max_data_frame(cnx, 3000, bytes, sizeof(bytes), &consumed) != 0 ||
+            consumed != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        picoquic_get_flow_control_stats(cnx, &stats);
+
+        if (stats.connection_window != 0x20000 || stats.nb_max_data_sent != 1 ||
+            stats.nb_max_stream_data_sent != 3 || stats.nb_window_increases != 2 ||
+            stats.nb_peer_stream_blocked != 1)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    if (ctx != NULL)
+    {
+        free(ctx);
+    }
+
+    if (data != NULL)
+    {
+        free(data);
+    }
+
+    return ret;
+}
+
+/*
+ * Receive memory budget. Out of order data held in reassembly buffers counts
+ * against the connection budget; above half the budget the windows shrink,
+ * and once it is exhausted no new credit is sent until the data is delivered.
+ */
+
+#define RECEIVE_BUDGET_TEST_CNX_BUDGET 0x4000
+#define RECEIVE_BUDGET_TEST_WINDOW 0x10000
+
+int receive_budget_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    stream_reassembly_test_ctx_t * ctx = (stream_reassembly_test_ctx_t *)malloc(sizeof(stream_reassembly_test_ctx_t));
+    uint8_t * data = (uint8_t *)malloc(STREAM_REASSEMBLY_TEST_LENGTH);
+    uint8_t bytes[256];
+    size_t consumed = 0;
+    picoquic_flow_control_stats_t stats;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (ctx == NULL || data == NULL || quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        memset(ctx, 0, sizeof(stream_reassembly_test_ctx_t));
+        memset(data, 0, STREAM_REASSEMBLY_TEST_LENGTH);
+        picoquic_set_receive_budget(quic, RECEIVE_BUDGET_TEST_CNX_BUDGET, PICOQUIC_DEFAULT_RECEIVE_BUDGET);
+
+        cnx = stream_reassembly_test_cnx(quic, ctx);
+
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            cnx->local_parameters.initial_max_data = 0x4000;
+            cnx->maxdata_local = RECEIVE_WINDOW_TEST_LENGTH;
+            cnx->maxdata_window = RECEIVE_BUDGET_TEST_WINDOW;
+        }
+    }
+
+    /* Two out of order fragments use the whole budget */
+    if (ret == 0 && (
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, 0x1000, 0, data, 0x1000, 0) != 0 ||
+        picoquic_receive_budget_level(cnx) != 1 ||
+        picoquic_get_receive_buffered_bytes(quic) != cnx->receive_buffered ||
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, 0x3000, 0, data, 0x1000, 0) != 0 ||
+        picoquic_receive_budget_level(cnx) != 2))
+    {
+        ret = -1;
+    }
+
+    /* The connection needs credit, which is withheld */
+    if (ret == 0)
+    {
+        cnx->data_received = cnx->maxdata_local - 0x1000;
+
+        if (picoquic_should_send_max_data(cnx) ||
+            picoquic_prepare_required_max_data_frame(cnx, 1000, bytes, sizeof(bytes), &consumed) != 0 ||
+            consumed != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Filling the holes delivers the data, and releases the buffer */
+    if (ret == 0 && (
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, 0, 0, data, 0x1000, 0) != 0 ||
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, 0x2000, 0, data, 0x1000, 0) != 0 ||
+        cnx->receive_buffered != 0 || picoquic_get_receive_buffered_bytes(quic) != 0 ||
+        ctx->nb_received != 0x4000 ||
+        picoquic_prepare_required_max_data_frame(cnx, 2000, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed == 0 || cnx->maxdata_window != RECEIVE_BUDGET_TEST_WINDOW))
+    {
+        ret = -1;
+    }
+
+    /* With more than half the budget in use, the window shrinks */
+    if (ret == 0)
+    {
+        if (picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID, 0x5000, 0, data, 0x100, 0) != 0 ||
+            picoquic_receive_budget_level(cnx) != 1)
+        {
+            ret = -1;
+        }
+        else
+        {
+            cnx->data_received = cnx->maxdata_local - 0x1000;
+
+            if (picoquic_prepare_required_max_data_frame(cnx, 3000, bytes, sizeof(bytes), &consumed) != 0 ||
+                consumed == 0 || cnx->maxdata_window != RECEIVE_BUDGET_TEST_WINDOW / 2)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0)
+    {
+        picoquic_get_flow_control_stats(cnx, &stats);
+
+        if (stats.nb_budget_holds != 1 || stats.buffered_bytes != cnx->receive_buffered ||
+            stats.buffered_bytes == 0)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Deleting the connection returns its memory to the context */
+    if (ret == 0)
+    {
+        picoquic_delete_cnx(cnx);
+
+        if (picoquic_get_receive_buffered_bytes(quic) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    if (ctx != NULL)
+    {
+        free(ctx);
+    }
+
+    if (data != NULL)
+    {
+        free(data);
+    }
+
+    return ret;
+}
+
+/*
+ * MAX_STREAM_DATA updates are prepared from the list of streams that crossed
+ * their update threshold. Only the streams that consumed enough data are
+ * listed, they leave the list once the update is sent, and streams that
+ * received a FIN in the meantime are dropped without an update.
+ */
+
+#define MAX_STREAM_DATA_LIST_TEST_NB_STREAMS 64
+#define MAX_STREAM_DATA_LIST_TEST_WINDOW 0x1000
+
+static void max_stream_data_list_test_callback(picoquic_cnx_t * cnx,
+    uint64_t stream_id, uint8_t * bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void * callback_ctx)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+    UNREFERENCED_PARAMETER(fin_or_event);
+    UNREFERENCED_PARAMETER(callback_ctx);
+#endif
+}
+
+int max_stream_data_list_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream_a = NULL;
+    picoquic_stream_head * stream_b = NULL;
+    picoquic_stream_head * stream_c = NULL;
+    uint8_t data[MAX_STREAM_DATA_LIST_TEST_WINDOW];
+    uint8_t bytes[256];
+    size_t consumed = 0;
+    picoquic_flow_control_stats_t stats;
+
+    memset(data, 0, sizeof(data));
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = stream_reassembly_test_cnx(quic, NULL);
+
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            picoquic_set_callback(cnx, max_stream_data_list_test_callback, NULL);
+            cnx->local_parameters.initial_max_stream_data = MAX_STREAM_DATA_LIST_TEST_WINDOW;
+        }
+    }
+
+    /* Some data on many streams, none crosses the threshold */
+    for (int i = 0; ret == 0 && i < MAX_STREAM_DATA_LIST_TEST_NB_STREAMS; i++)
+    {
+        if (picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID + 4 * i, 0, 0, data, 0x100, 0) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (cnx->first_update_stream != NULL ||
+        picoquic_prepare_required_max_stream_data_frames(cnx, 1000, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed != 0))
+    {
+        ret = -1;
+    }
+
+    /* Two streams consume more than half their window, and are listed */
+    if (ret == 0 && (
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID + 4, 0x100, 0, data, 0x800, 0) != 0 ||
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID + 40, 0x100, 0, data, 0x800, 0) != 0 ||
+        (stream_a = picoquic_find_stream(cnx, STREAM_REASSEMBLY_TEST_ID + 4, 0)) == NULL ||
+        (stream_b = picoquic_find_stream(cnx, STREAM_REASSEMBLY_TEST_ID + 40, 0)) == NULL ||
+        cnx->first_update_stream != stream_a || cnx->last_update_stream != stream_b ||
+        stream_a->next_update_stream != stream_b))
+    {
+        ret = -1;
+    }
+
+    /* Both get an update, and leave the list */
+    if (ret == 0 && (
+        picoquic_prepare_required_max_stream_data_frames(cnx, 1000, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed == 0 || cnx->first_update_stream != NULL || cnx->last_update_stream != NULL ||
+        stream_a->maxdata_local != 0x900 + MAX_STREAM_DATA_LIST_TEST_WINDOW ||
+        stream_b->maxdata_local != 0x900 + MAX_STREAM_DATA_LIST_TEST_WINDOW))
+    {
+        ret = -1;
+    }
+
+    /* A stream listed before its FIN arrives gets no update */
+    if (ret == 0 && (
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID + 8, 0x100, 0, data, 0x800, 0) != 0 ||
+        (stream_c = picoquic_find_stream(cnx, STREAM_REASSEMBLY_TEST_ID + 8, 0)) == NULL ||
+        cnx->first_update_stream != stream_c ||
+        picoquic_stream_network_input(cnx, STREAM_REASSEMBLY_TEST_ID + 8, 0x900, 1, data, 0, 0) != 0 ||
+        picoquic_prepare_required_max_stream_data_frames(cnx, 1000, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed != 0 || cnx->first_update_stream != NULL ||
+        stream_c->maxdata_local != MAX_STREAM_DATA_LIST_TEST_WINDOW))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0)
+    {
+        picoquic_get_flow_control_stats(cnx, &stats);
+
+        if (stats.nb_max_stream_data_sent != 2)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
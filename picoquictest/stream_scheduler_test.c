@@ -0,0 +1,1113 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "../picoquic/picoquic_internal.h"
+
+/*
+ * Stream scheduler tests. Queue data on several streams of a connection, then
+ * prepare stream frames as the packet builder would, and check which stream
+ * is served for each frame.
+ */
+
+#define STREAM_SCHED_TEST_NB_STREAMS 3
+#define STREAM_SCHED_TEST_DATA_LENGTH 40000
+#define STREAM_SCHED_TEST_FRAME_SIZE 500
+
+static const uint64_t stream_sched_test_id[STREAM_SCHED_TEST_NB_STREAMS] = { 4, 8, 12 };
+
+static picoquic_cnx_t * stream_sched_test_cnx(picoquic_quic_t * quic, picoquic_stream_scheduler_t scheduler)
+{
+    picoquic_cnx_t * cnx = NULL;
+    struct sockaddr_in test_addr;
+
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+    test_addr.sin_port = 4433;
+
+    cnx = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, 0, 0, NULL, NULL);
+
+    if (cnx != NULL)
+    {
+        cnx->cnx_state = picoquic_state_client_ready;
+        picoquic_clear_stream(&cnx->first_stream);
+        cnx->maxdata_remote = 0x100000;
+        cnx->max_stream_id_bidir_remote = 1024;
+        cnx->remote_parameters.initial_max_stream_data = 0x100000;
+        picoquic_set_stream_scheduler(cnx, scheduler);
+    }
+
+    return cnx;
+}
+
+static int stream_sched_test_queue(picoquic_cnx_t * cnx)
+{
+    int ret = 0;
+    uint8_t * data = (uint8_t *)malloc(STREAM_SCHED_TEST_DATA_LENGTH);
+
+    if (data == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        memset(data, 0x5A, STREAM_SCHED_TEST_DATA_LENGTH);
+
+        for (int i = 0; ret == 0 && i < STREAM_SCHED_TEST_NB_STREAMS; i++)
+        {
+            ret = picoquic_add_to_stream(cnx, stream_sched_test_id[i], data, STREAM_SCHED_TEST_DATA_LENGTH, 1);
+        }
+
+        free(data);
+    }
+
+    return ret;
+}
+
+/* Prepare the next stream frame, and return the index of the stream that was served */
+static int stream_sched_test_next(picoquic_cnx_t * cnx, size_t * consumed)
+{
+    int stream_index = -1;
+    uint8_t bytes[STREAM_SCHED_TEST_FRAME_SIZE];
+    picoquic_stream_head * stream = picoquic_find_ready_stream(cnx, 0);
+
+    *consumed = 0;
+
+    if (stream != NULL &&
+        picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), consumed) == 0 &&
+        *consumed > 0)
+    {
+        for (int i = 0; i < STREAM_SCHED_TEST_NB_STREAMS; i++)
+        {
+            if (stream->stream_id == stream_sched_test_id[i])
+            {
+                stream_index = i;
+                break;
+            }
+        }
+    }
+
+    return stream_index;
+}
+
+/* Serve all the queued data, verify that all streams were drained and the ready list emptied */
+static int stream_sched_test_drain(picoquic_cnx_t * cnx)
+{
+    int ret = 0;
+    size_t consumed = 0;
+    int nb_frames = 0;
+
+    while (ret == 0 && picoquic_find_ready_stream(cnx, 0) != NULL)
+    {
+        if (stream_sched_test_next(cnx, &consumed) < 0 ||
+            ++nb_frames > 4 * STREAM_SCHED_TEST_NB_STREAMS * STREAM_SCHED_TEST_DATA_LENGTH / STREAM_SCHED_TEST_FRAME_SIZE)
+        {
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < STREAM_SCHED_TEST_NB_STREAMS; i++)
+    {
+        picoquic_stream_head * stream = picoquic_find_stream(cnx, stream_sched_test_id[i], 0);
+
+        if (stream == NULL || stream->sent_offset != STREAM_SCHED_TEST_DATA_LENGTH ||
+            (stream->stream_flags&picoquic_stream_flag_fin_sent) == 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (cnx->first_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != NULL ||
+        cnx->last_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != NULL))
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int stream_sched_one_test(picoquic_stream_scheduler_t scheduler)
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    size_t consumed = 0;
+    size_t nb_bytes[STREAM_SCHED_TEST_NB_STREAMS];
+
+    memset(nb_bytes, 0, sizeof(nb_bytes));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, scheduler)) == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        ret = stream_sched_test_queue(cnx);
+    }
+
+    if (ret == 0 && scheduler == picoquic_stream_scheduler_weighted)
+    {
+        if (picoquic_set_stream_weight(cnx, stream_sched_test_id[0], 2 * PICOQUIC_DEFAULT_STREAM_WEIGHT) != 0 ||
+            picoquic_set_stream_weight(cnx, stream_sched_test_id[2], PICOQUIC_DEFAULT_STREAM_WEIGHT / 4) != 0 ||
+            picoquic_set_stream_weight(cnx, 0, PICOQUIC_DEFAULT_STREAM_WEIGHT) == 0)
+        {
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < 2 * STREAM_SCHED_TEST_NB_STREAMS; i++)
+    {
+        int stream_index = stream_sched_test_next(cnx, &consumed);
+
+        if (stream_index < 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            nb_bytes[stream_index] += consumed;
+
+            switch (scheduler)
+            {
+            case picoquic_stream_scheduler_round_robin:
+                /* Each stream is served in turn */
+                if (stream_index != i % STREAM_SCHED_TEST_NB_STREAMS)
+                {
+                    ret = -1;
+                }
+                break;
+            case picoquic_stream_scheduler_fifo:
+                /* The first stream is served until it completes */
+                if (stream_index != 0)
+                {
+                    ret = -1;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    if (ret == 0 && scheduler == picoquic_stream_scheduler_weighted)
+    {
+        /* Serve the equivalent of a few rounds, then compare the shares */
+        for (int i = 0; ret == 0 && i < 18; i++)
+        {
+            int stream_index = stream_sched_test_next(cnx, &consumed);
+
+            if (stream_index < 0)
+            {
+                ret = -1;
+            }
+            else
+            {
+                nb_bytes[stream_index] += consumed;
+            }
+        }
+
+        if (ret == 0 && (nb_bytes[0] <= 2 * nb_bytes[1] || nb_bytes[1] <= nb_bytes[2] || nb_bytes[2] == 0))
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        ret = stream_sched_test_drain(cnx);
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+int stream_scheduler_test()
+{
+    int ret = stream_sched_one_test(picoquic_stream_scheduler_round_robin);
+
+    if (ret == 0)
+    {
+        ret = stream_sched_one_test(picoquic_stream_scheduler_weighted);
+    }
+
+    if (ret == 0)
+    {
+        ret = stream_sched_one_test(picoquic_stream_scheduler_fifo);
+    }
+
+    return ret;
+}
+
+/*
+ * Streams blocked by flow control leave the ready list, and come back when the
+ * peer grants more credit. Reset requests are served even if no data is queued.
+ */
+
+int stream_ready_list_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    size_t consumed = 0;
+    uint8_t bytes[STREAM_SCHED_TEST_FRAME_SIZE];
+    uint8_t data[100];
+
+    memset(data, 0x5A, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx->remote_parameters.initial_max_stream_data = 0;
+
+        if (picoquic_add_to_stream(cnx, 4, data, sizeof(data), 0) != 0 ||
+            (stream = picoquic_find_stream(cnx, 4, 0)) == NULL ||
+            cnx->first_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != NULL ||
+            picoquic_find_ready_stream(cnx, 0) != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+    {
+        cnx->remote_parameters.initial_max_stream_data = 50;
+        picoquic_update_stream_initial_remote(cnx);
+
+        if (cnx->first_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != stream ||
+            picoquic_find_ready_stream(cnx, 0) != stream ||
+            picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+            stream->sent_offset != 50 || cnx->first_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* A reset is sent even though the stream is blocked */
+    if (ret == 0 && (picoquic_reset_stream(cnx, 4, 1) != 0 ||
+        picoquic_find_ready_stream(cnx, 0) != stream ||
+        picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed == 0 || bytes[0] != picoquic_frame_type_reset_stream ||
+        cnx->first_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != NULL ||
+        picoquic_find_ready_stream(cnx, 0) != NULL))
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Stream priorities. The urgent streams that are not incremental are sent one
+ * after the other, before the incremental streams of lower urgency, which are
+ * interleaved.
+ */
+
+int stream_priority_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    size_t consumed = 0;
+    uint8_t bytes[STREAM_SCHED_TEST_FRAME_SIZE];
+    uint8_t data[2 * STREAM_SCHED_TEST_FRAME_SIZE];
+    const uint64_t stream_id[4] = { 4, 8, 12, 16 };
+    /* Expected order: 16 and 12 drained in turn, then 4 and 8 interleaved */
+    const uint64_t expected_id[12] = { 16, 16, 16, 12, 12, 12, 4, 8, 4, 8, 4, 8 };
+
+    memset(data, 0x5A, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < 4; i++)
+    {
+        ret = picoquic_add_to_stream(cnx, stream_id[i], data, sizeof(data), 1);
+    }
+
+    if (ret == 0)
+    {
+        /* Stream 16 becomes urgent first, so it is served before stream 12 */
+        if (picoquic_set_stream_priority(cnx, 16, 1, 0) != 0 ||
+            picoquic_set_stream_priority(cnx, 12, 1, 0) != 0 ||
+            picoquic_set_stream_priority(cnx, 0, 1, 0) == 0 ||
+            picoquic_set_stream_priority(cnx, 20, 1, 0) == 0)
+        {
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < 12; i++)
+    {
+        stream = picoquic_find_ready_stream(cnx, 0);
+
+        if (stream == NULL || stream->stream_id != expected_id[i] ||
+            picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+            consumed == 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && cnx->ready_urgency_mask != 0)
+    {
+        ret = -1;
+    }
+
+    if (ret == 0)
+    {
+        for (int urgency = 0; ret == 0 && urgency <= PICOQUIC_STREAM_URGENCY_MAX; urgency++)
+        {
+            if (cnx->first_ready_stream[urgency] != NULL || cnx->last_ready_stream[urgency] != NULL)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Data queued by reference. The buffers are handed back once all their data
+ * was sent, when the stream is reset, or when the connection is deleted, and
+ * the data is sent in order with the copied data.
+ */
+
+typedef struct st_stream_ref_test_ctx_t {
+    int nb_released;
+    const uint8_t * last_bytes;
+    size_t last_length;
+} stream_ref_test_ctx_t;
+
+static void stream_ref_test_release(void * release_ctx, const uint8_t * bytes, size_t length)
+{
+    stream_ref_test_ctx_t * ctx = (stream_ref_test_ctx_t *)release_ctx;
+
+    ctx->nb_released++;
+    ctx->last_bytes = bytes;
+    ctx->last_length = length;
+}
+
+int stream_send_ref_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    stream_ref_test_ctx_t ctx;
+    uint8_t buffer_a[1200];
+    uint8_t buffer_b[300];
+    uint8_t copied[100];
+    uint8_t bytes[STREAM_SCHED_TEST_FRAME_SIZE];
+    size_t consumed = 0;
+    size_t total = 0;
+    uint64_t stream_id = 0;
+    uint64_t offset = 0;
+    size_t data_length = 0;
+    int fin = 0;
+    size_t header_length = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    /* The stream content is a simple function of the offset */
+    for (size_t i = 0; i < sizeof(buffer_a); i++)
+    {
+        buffer_a[i] = (uint8_t)i;
+    }
+    for (size_t i = 0; i < sizeof(copied); i++)
+    {
+        copied[i] = (uint8_t)(sizeof(buffer_a) + i);
+    }
+    for (size_t i = 0; i < sizeof(buffer_b); i++)
+    {
+        buffer_b[i] = (uint8_t)(sizeof(buffer_a) + sizeof(copied) + i);
+    }
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+
+    if (ret == 0 && (
+        picoquic_add_to_stream_ref(cnx, 4, buffer_a, sizeof(buffer_a), 0, stream_ref_test_release, &ctx) != 0 ||
+        picoquic_add_to_stream(cnx, 4, copied, sizeof(copied), 0) != 0 ||
+        picoquic_add_to_stream_ref(cnx, 4, buffer_b, sizeof(buffer_b), 1, stream_ref_test_release, &ctx) != 0 ||
+        (stream = picoquic_find_stream(cnx, 4, 0)) == NULL ||
+        stream->send_queue->bytes != buffer_a ||
+        stream->send_queue_last->bytes != buffer_b ||
+        ctx.nb_released != 0))
+    {
+        ret = -1;
+    }
+
+    /* A failed call does not release the buffer, an empty buffer is released at once */
+    if (ret == 0 && (
+        picoquic_add_to_stream_ref(cnx, 5, buffer_a, sizeof(buffer_a), 0, stream_ref_test_release, &ctx) == 0 ||
+        ctx.nb_released != 0 ||
+        picoquic_add_to_stream_ref(cnx, 8, buffer_a, 0, 0, stream_ref_test_release, &ctx) != 0 ||
+        ctx.nb_released != 1))
+    {
+        ret = -1;
+    }
+
+    while (ret == 0 && total < sizeof(buffer_a) + sizeof(copied) + sizeof(buffer_b))
+    {
+        if (picoquic_find_ready_stream(cnx, 0) != stream ||
+            picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+            picoquic_parse_stream_header(bytes, consumed, &stream_id, &offset, &data_length, &fin, &header_length) != 0 ||
+            offset != total || data_length == 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            for (size_t i = 0; ret == 0 && i < data_length; i++)
+            {
+                if (bytes[header_length + i] != (uint8_t)(offset + i))
+                {
+                    ret = -1;
+                }
+            }
+
+            total += data_length;
+
+            /* Buffer A is released once all its bytes were sent */
+            if (ret == 0 && (ctx.nb_released > 1) != (total >= sizeof(buffer_a)))
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0 && (ctx.nb_released != 3 || ctx.last_bytes != buffer_b ||
+        ctx.last_length != sizeof(buffer_b) || fin == 0 ||
+        stream->send_queue != NULL || stream->send_queue_last != NULL))
+    {
+        ret = -1;
+    }
+
+    /* Resetting a stream releases the buffers that were not sent */
+    if (ret == 0 && (
+        picoquic_add_to_stream_ref(cnx, 8, buffer_a, sizeof(buffer_a), 0, stream_ref_test_release, &ctx) != 0 ||
+        picoquic_reset_stream(cnx, 8, 1) != 0 ||
+        (stream = picoquic_find_ready_stream(cnx, 0)) == NULL ||
+        picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+        bytes[0] != picoquic_frame_type_reset_stream ||
+        ctx.nb_released != 4 || ctx.last_bytes != buffer_a))
+    {
+        ret = -1;
+    }
+
+    /* Deleting the connection releases the pending buffers */
+    if (ret == 0 && picoquic_add_to_stream_ref(cnx, 12, buffer_b, sizeof(buffer_b), 0,
+        stream_ref_test_release, &ctx) != 0)
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    if (ret == 0 && (ctx.nb_released != 5 || ctx.last_bytes != buffer_b))
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Pull mode. The application provides the data of an active stream when the
+ * frame is prepared, directly in the packet. The first frame is one byte short
+ * of the available space, which requires padding instead of a length field.
+ */
+
+#define STREAM_PULL_TEST_LENGTH 3000
+
+typedef struct st_stream_pull_test_ctx_t {
+    size_t provided;
+    int nb_calls;
+} stream_pull_test_ctx_t;
+
+static void stream_pull_test_callback(picoquic_cnx_t * cnx,
+    uint64_t stream_id, uint8_t * bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void * callback_ctx)
+{
+    stream_pull_test_ctx_t * ctx = (stream_pull_test_ctx_t *)callback_ctx;
+
+    if (fin_or_event == picoquic_callback_prepare_to_send && stream_id == 4)
+    {
+        size_t available = STREAM_PULL_TEST_LENGTH - ctx->provided;
+        size_t nb_bytes = (ctx->nb_calls == 0) ? length - 1 : length;
+        int is_fin = 0;
+        uint8_t * buffer;
+
+        if (nb_bytes >= available)
+        {
+            nb_bytes = available;
+            is_fin = 1;
+        }
+
+        buffer = picoquic_provide_stream_data_buffer(bytes, nb_bytes, is_fin, 1);
+
+        if (buffer != NULL)
+        {
+            for (size_t i = 0; i < nb_bytes; i++)
+            {
+                buffer[i] = (uint8_t)(ctx->provided + i);
+            }
+            ctx->provided += nb_bytes;
+        }
+        ctx->nb_calls++;
+    }
+}
+
+int stream_pull_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream = NULL;
+    stream_pull_test_ctx_t ctx;
+    uint8_t bytes[STREAM_SCHED_TEST_FRAME_SIZE];
+    size_t consumed = 0;
+    size_t total = 0;
+    uint64_t stream_id = 0;
+    uint64_t offset = 0;
+    size_t data_length = 0;
+    int fin = 0;
+    size_t header_length = 0;
+    int nb_frames = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        picoquic_set_callback(cnx, stream_pull_test_callback, &ctx);
+
+        if (picoquic_mark_active_stream(cnx, 4, 1) != 0 ||
+            (stream = picoquic_find_stream(cnx, 4, 0)) == NULL ||
+            picoquic_find_ready_stream(cnx, 0) != stream ||
+            picoquic_mark_active_stream(cnx, 0, 1) == 0)
+        {
+            ret = -1;
+        }
+    }
+
+    while (ret == 0 && (stream = picoquic_find_ready_stream(cnx, 0)) != NULL)
+    {
+        size_t start = 0;
+
+        if (picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed) != 0 ||
+            ++nb_frames > STREAM_PULL_TEST_LENGTH)
+        {
+            ret = -1;
+            break;
+        }
+
+        while (start < consumed && bytes[start] == picoquic_frame_type_padding)
+        {
+            start++;
+        }
+
+        if ((nb_frames == 1) != (start > 0) ||
+            picoquic_parse_stream_header(bytes + start, consumed - start, &stream_id, &offset, &data_length, &fin, &header_length) != 0 ||
+            stream_id != 4 || offset != total || start + header_length + data_length != consumed)
+        {
+            ret = -1;
+        }
+        else
+        {
+            for (size_t i = 0; ret == 0 && i < data_length; i++)
+            {
+                if (bytes[start + header_length + i] != (uint8_t)(offset + i))
+                {
+                    ret = -1;
+                }
+            }
+            total += data_length;
+        }
+    }
+
+    stream = (ret == 0) ? picoquic_find_stream(cnx, 4, 0) : NULL;
+
+    if (ret == 0 && (stream == NULL || total != STREAM_PULL_TEST_LENGTH || fin == 0 ||
+        stream->is_active || stream->sent_offset != STREAM_PULL_TEST_LENGTH ||
+        cnx->data_sent < STREAM_PULL_TEST_LENGTH ||
+        (stream->stream_flags&picoquic_stream_flag_fin_sent) == 0 ||
+        picoquic_mark_active_stream(cnx, 4, 1) == 0))
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Packing test. Small amounts of data queued on several streams are sent as
+ * several frames in the same packet, all but the last carrying a length.
+ */
+
+#define STREAM_PACKING_TEST_PACKET_SIZE 1200
+
+typedef struct st_stream_packing_test_frame_t {
+    uint64_t stream_id;
+    size_t data_length;
+    int fin;
+} stream_packing_test_frame_t;
+
+/* Parse the frames in a packet, and compare them to the expected list */
+static int stream_packing_test_check(uint8_t * bytes, size_t length,
+    const stream_packing_test_frame_t * expected, size_t nb_expected)
+{
+    int ret = 0;
+    size_t byte_index = 0;
+    size_t nb_frames = 0;
+
+    while (ret == 0 && byte_index < length)
+    {
+        uint64_t stream_id = 0;
+        uint64_t offset = 0;
+        size_t data_length = 0;
+        int fin = 0;
+        size_t header_length = 0;
+
+        if (nb_frames >= nb_expected ||
+            picoquic_parse_stream_header(bytes + byte_index, length - byte_index,
+                &stream_id, &offset, &data_length, &fin, &header_length) != 0 ||
+            stream_id != expected[nb_frames].stream_id ||
+            data_length != expected[nb_frames].data_length ||
+            fin != expected[nb_frames].fin)
+        {
+            ret = -1;
+        }
+        else
+        {
+            byte_index += header_length + data_length;
+            nb_frames++;
+        }
+    }
+
+    if (ret == 0 && nb_frames != nb_expected)
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int stream_packing_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    uint8_t data[2 * STREAM_PACKING_TEST_PACKET_SIZE];
+    uint8_t bytes[STREAM_PACKING_TEST_PACKET_SIZE];
+    size_t consumed = 0;
+    static const stream_packing_test_frame_t first_packet[] = {
+        { 4, 100, 1 }, { 8, 200, 1 }, { 12, 300, 0 } };
+    static const stream_packing_test_frame_t second_packet[] = {
+        { 12, 0, 1 }, { 16, 50, 0 } };
+
+    memset(data, 0x33, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+
+    /* Three small responses fit in a single packet */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 4, data, 100, 1) != 0 ||
+        picoquic_add_to_stream(cnx, 8, data, 200, 1) != 0 ||
+        picoquic_add_to_stream(cnx, 12, data, 300, 0) != 0 ||
+        picoquic_prepare_stream_frames(cnx, picoquic_find_ready_stream(cnx, 0), 0,
+            bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed >= sizeof(bytes) ||
+        stream_packing_test_check(bytes, consumed, first_packet, 3) != 0 ||
+        picoquic_find_ready_stream(cnx, 0) != NULL))
+    {
+        ret = -1;
+    }
+
+    /* A fin without data is followed by the next stream */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 12, NULL, 0, 1) != 0 ||
+        picoquic_add_to_stream(cnx, 16, data, 50, 0) != 0 ||
+        picoquic_prepare_stream_frames(cnx, picoquic_find_ready_stream(cnx, 0), 0,
+            bytes, sizeof(bytes), &consumed) != 0 ||
+        stream_packing_test_check(bytes, consumed, second_packet, 2) != 0))
+    {
+        ret = -1;
+    }
+
+    /* A large amount of data fills the packet with one frame, without length */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 20, data, sizeof(data), 0) != 0 ||
+        picoquic_prepare_stream_frames(cnx, picoquic_find_ready_stream(cnx, 0), 0,
+            bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed != sizeof(bytes) || (bytes[0] & 2) != 0))
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Send buffer limits. Adding data fails once a high mark is reached, and the
+ * application is told when the stream can be written again.
+ */
+
+typedef struct st_stream_writable_test_ctx_t {
+    int nb_writable[4];
+    int nb_other;
+} stream_writable_test_ctx_t;
+
+static void stream_writable_test_callback(picoquic_cnx_t * cnx,
+    uint64_t stream_id, uint8_t * bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void * callback_ctx)
+{
+    stream_writable_test_ctx_t * ctx = (stream_writable_test_ctx_t *)callback_ctx;
+
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+#endif
+
+    if (fin_or_event == picoquic_callback_stream_writable && stream_id < 16 && (stream_id & 3) == 0)
+    {
+        ctx->nb_writable[stream_id / 4]++;
+    }
+    else
+    {
+        ctx->nb_other++;
+    }
+}
+
+static int stream_writable_test_send(picoquic_cnx_t * cnx, stream_writable_test_ctx_t * ctx,
+    int nb_frames, int s4, int s8, int s12)
+{
+    int ret = 0;
+    size_t consumed = 0;
+
+    for (int i = 0; ret == 0 && i < nb_frames; i++)
+    {
+        if (stream_sched_test_next(cnx, &consumed) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (ctx->nb_writable[1] != s4 || ctx->nb_writable[2] != s8 ||
+        ctx->nb_writable[3] != s12 || ctx->nb_other != 0))
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int stream_send_buffer_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    stream_writable_test_ctx_t ctx;
+    uint8_t data[800];
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(data, 0x77, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        picoquic_set_callback(cnx, stream_writable_test_callback, &ctx);
+    }
+
+    /* Stream limit: the second call goes beyond the high mark, the third fails */
+    if (ret == 0 && (
+        picoquic_set_stream_send_buffer_limits(cnx, 4, 1000, 400) != 0 ||
+        picoquic_add_to_stream(cnx, 4, data, 600, 0) != 0 ||
+        picoquic_add_to_stream(cnx, 4, data, 600, 0) != 0 ||
+        picoquic_add_to_stream(cnx, 4, data, 10, 0) != PICOQUIC_ERROR_SEND_BUFFER_FULL ||
+        cnx->send_queued != 1200))
+    {
+        ret = -1;
+    }
+
+    /* Frames do not span queued buffers: 702, 600, then 102 bytes remain. The
+     * event comes once the queue is at or below the low mark, only once. */
+    if (ret == 0 && (
+        stream_writable_test_send(cnx, &ctx, 2, 0, 0, 0) != 0 ||
+        stream_writable_test_send(cnx, &ctx, 1, 1, 0, 0) != 0 ||
+        stream_writable_test_send(cnx, &ctx, 1, 1, 0, 0) != 0 ||
+        cnx->send_queued != 0))
+    {
+        ret = -1;
+    }
+
+    /* Connection limit: both streams are blocked, and notified when it drains */
+    if (ret == 0)
+    {
+        picoquic_set_send_buffer_limits(cnx, 1000, 0);
+
+        if (picoquic_add_to_stream(cnx, 8, data, 800, 0) != 0 ||
+            picoquic_add_to_stream(cnx, 12, data, 300, 0) != 0 ||
+            picoquic_add_to_stream(cnx, 12, data, 1, 0) != PICOQUIC_ERROR_SEND_BUFFER_FULL ||
+            picoquic_add_to_stream(cnx, 8, data, 1, 0) != PICOQUIC_ERROR_SEND_BUFFER_FULL ||
+            stream_writable_test_send(cnx, &ctx, 2, 1, 0, 0) != 0 ||
+            stream_writable_test_send(cnx, &ctx, 1, 1, 1, 1) != 0 ||
+            cnx->send_queued != 0 ||
+            picoquic_add_to_stream(cnx, 8, data, 100, 1) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Posted stream data is not dropped when the send buffer is full: it stays on
+ * the stream until the stream is writable, and is discarded if the stream is reset.
+ */
+
+int stream_posted_data_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream4 = NULL;
+    picoquic_stream_head * stream8 = NULL;
+    size_t consumed = 0;
+    int nb_frames = 0;
+    uint8_t data[600];
+
+    memset(data, 0x77, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+
+    /* The third data command and the FIN after it are deferred on stream 4 */
+    if (ret == 0 && (
+        picoquic_set_stream_send_buffer_limits(cnx, 4, 1000, 400) != 0 ||
+        picoquic_set_stream_send_buffer_limits(cnx, 8, 1000, 400) != 0 ||
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 4, data, 600, 0) != 0 ||
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 4, data, 600, 0) != 0 ||
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 4, data, 10, 0) != 0 ||
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 4, NULL, 0, 1) != 0 ||
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 8, data, 600, 0) != 0 ||
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 8, data, 600, 0) != 0 ||
+        picoquic_post_stream_data(quic, picoquic_get_initial_cnxid(cnx), 8, data, 10, 0) != 0 ||
+        picoquic_post_reset_stream(quic, picoquic_get_initial_cnxid(cnx), 8, 1) != 0 ||
+        picoquic_process_commands(quic) != 8))
+    {
+        ret = -1;
+    }
+
+    if (ret == 0)
+    {
+        stream4 = picoquic_find_stream(cnx, 4, 0);
+        stream8 = picoquic_find_stream(cnx, 8, 0);
+
+        if (stream4 == NULL || stream8 == NULL ||
+            stream4->send_queued != 1200 || stream4->first_deferred_command == NULL ||
+            (stream4->stream_flags&picoquic_stream_flag_fin_notified) != 0 ||
+            stream8->first_deferred_command == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* Stream 4 gets all its data and the FIN, the reset drops the data of stream 8 */
+    while (ret == 0 && stream_sched_test_next(cnx, &consumed) >= 0)
+    {
+        if (++nb_frames > 16)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (
+        stream4->sent_offset != 1210 ||
+        (stream4->stream_flags&picoquic_stream_flag_fin_sent) == 0 ||
+        stream4->first_deferred_command != NULL ||
+        (stream8->stream_flags&picoquic_stream_flag_reset_sent) == 0 ||
+        stream8->first_deferred_command != NULL))
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Streams that only have new data to send leave the ready lists while the
+ * connection is blocked by MAX_DATA, so they are not skipped for each packet,
+ * and come back in the same order when a MAX_DATA frame brings credit.
+ */
+
+int stream_credit_blocked_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picoquic_stream_head * stream4 = NULL;
+    picoquic_stream_head * stream8 = NULL;
+    picoquic_stream_head * stream12 = NULL;
+    size_t consumed = 0;
+    uint8_t bytes[STREAM_SCHED_TEST_FRAME_SIZE];
+    uint8_t data[100];
+    size_t length = 0;
+
+    memset(data, 0x5A, sizeof(data));
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    if (quic == NULL || (cnx = stream_sched_test_cnx(quic, picoquic_stream_scheduler_round_robin)) == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx->maxdata_remote = cnx->data_sent;
+
+        if (picoquic_add_to_stream(cnx, 4, data, sizeof(data), 0) != 0 ||
+            picoquic_add_to_stream(cnx, 8, data, sizeof(data), 0) != 0 ||
+            picoquic_add_to_stream(cnx, 12, data, sizeof(data), 0) != 0 ||
+            picoquic_reset_stream(cnx, 12, 1) != 0 ||
+            (stream4 = picoquic_find_stream(cnx, 4, 0)) == NULL ||
+            (stream8 = picoquic_find_stream(cnx, 8, 0)) == NULL ||
+            (stream12 = picoquic_find_stream(cnx, 12, 0)) == NULL)
+        {
+            ret = -1;
+        }
+    }
+
+    /* The reset is sent, the data streams are moved to the blocked list */
+    if (ret == 0 && (
+        picoquic_find_ready_stream(cnx, 0) != stream12 ||
+        cnx->first_blocked_stream != stream4 || cnx->last_blocked_stream != stream8 ||
+        picoquic_prepare_stream_frame(cnx, stream12, bytes, sizeof(bytes), &consumed) != 0 ||
+        consumed == 0 || bytes[0] != picoquic_frame_type_reset_stream ||
+        picoquic_find_ready_stream(cnx, 0) != NULL ||
+        cnx->ready_urgency_mask != 0))
+    {
+        ret = -1;
+    }
+
+    /* Adding data checks the stream again, and blocks it again */
+    if (ret == 0 && (
+        picoquic_add_to_stream(cnx, 4, data, sizeof(data), 0) != 0 ||
+        stream4->is_credit_blocked ||
+        picoquic_find_ready_stream(cnx, 0) != NULL ||
+        cnx->first_blocked_stream != stream8 || cnx->last_blocked_stream != stream4))
+    {
+        ret = -1;
+    }
+
+    /* Credit brings the streams back to the ready list, in the same order */
+    if (ret == 0)
+    {
+        bytes[length++] = picoquic_frame_type_max_data;
+        length += picoquic_varint_encode(&bytes[length], sizeof(bytes) - length, cnx->data_sent + 1000);
+
+        if (picoquic_decode_frames(cnx, bytes, length, 0, 0) != 0 ||
+            cnx->first_blocked_stream != NULL ||
+            stream8->is_credit_blocked || stream4->is_credit_blocked ||
+            cnx->first_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != stream8 ||
+            cnx->last_ready_stream[PICOQUIC_DEFAULT_STREAM_URGENCY] != stream4 ||
+            picoquic_find_ready_stream(cnx, 0) != stream8)
+        {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
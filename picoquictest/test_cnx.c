@@ -0,0 +1,124 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2017, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquictest_internal.h"
+
+/*
+ * Connection set up shared by the tests that drive the sender and the ACK logic
+ * directly, without a handshake. The connection is forced in the client ready
+ * state, with an empty retransmit queue and a clear stream zero.
+ */
+
+int picoquictest_create_ready_cnx(uint64_t current_time, picoquic_quic_t ** p_quic, picoquic_cnx_t ** p_cnx)
+{
+    int ret = 0;
+    picoquic_cnx_t * cnx = NULL;
+    struct sockaddr_in test_addr;
+
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+    test_addr.sin_port = 4433;
+
+    *p_quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, current_time, NULL, NULL, NULL, 0);
+    if (*p_quic == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        cnx = picoquic_create_cnx(*p_quic, 0, (struct sockaddr *)&test_addr, current_time, 0, NULL, NULL);
+        if (cnx == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            /* Start from a clean queue, without the client initial */
+            while (cnx->retransmit_newest != NULL)
+            {
+                picoquic_dequeue_retransmit_packet(cnx, cnx->retransmit_newest, 1);
+            }
+            cnx->cnx_state = picoquic_state_client_ready;
+            picoquic_clear_stream(&cnx->first_stream);
+        }
+    }
+
+    *p_cnx = cnx;
+
+    return ret;
+}
+
+/*
+ * Queue a packet that only carries a PING frame
+ */
+
+int picoquictest_queue_ping_packet(picoquic_cnx_t * cnx, uint64_t current_time)
+{
+    int ret = 0;
+    size_t header_length = 8;
+    picoquic_packet * p = picoquic_alloc_packet(cnx->quic);
+
+    if (p == NULL)
+    {
+        ret = -1;
+    }
+    else
+    {
+        memset(p->bytes, 0, header_length);
+        p->sequence_number = cnx->send_sequence++;
+        p->send_time = current_time;
+        p->bytes[header_length] = picoquic_frame_type_ping;
+        p->length = header_length + 1;
+
+        picoquic_queue_for_retransmit(cnx, p, header_length, p->length, current_time);
+
+        if (p->length == 0)
+        {
+            picoquic_recycle_packet(cnx->quic, p);
+            ret = -1;
+        }
+        else if (cnx->retransmit_newest != p)
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Receive an ACK frame acknowledging a single range of packets
+ */
+
+int picoquictest_receive_ack(picoquic_cnx_t * cnx, uint64_t low, uint64_t high, uint64_t current_time)
+{
+    uint8_t ack[64];
+    size_t consumed = 0;
+    test_ack_range_t range;
+
+    range.start_of_sack_range = low;
+    range.end_of_sack_range = high;
+
+    return picoquic_decode_ack_frame(cnx, ack, build_test_ack(&range, 1, ack, sizeof(ack), 0),
+        &consumed, current_time);
+}
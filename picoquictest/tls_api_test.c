@@ -509,7 +509,7 @@ static int verify_sni(picoquic_cnx_t * cnx_client, picoquic_cnx_t * cnx_server,
 
 	if (sni == NULL)
 	{
-		if (cnx_client->sni != NULL)
+		if (cnx_client->cold->sni != NULL)
 		{
 			ret = -1;
 		}
@@ -524,7 +524,7 @@ static int verify_sni(picoquic_cnx_t * cnx_client, picoquic_cnx_t * cnx_server,
 	}
 	else
 	{
-		if (cnx_client->sni == NULL)
+		if (cnx_client->cold->sni == NULL)
 		{
 			ret = -1;
 		}
@@ -536,7 +536,7 @@ static int verify_sni(picoquic_cnx_t * cnx_client, picoquic_cnx_t * cnx_server,
 		{
 			ret = -1;
 		}
-		else if (strcmp(cnx_client->sni, sni) != 0)
+		else if (strcmp(cnx_client->cold->sni, sni) != 0)
 		{
 			ret = -1;
 		}
@@ -562,7 +562,7 @@ static int verify_alpn(picoquic_cnx_t * cnx_client, picoquic_cnx_t * cnx_server,
 
 	if (alpn == NULL)
 	{
-		if (cnx_client->alpn != NULL)
+		if (cnx_client->cold->alpn != NULL)
 		{
 			ret = -1;
 		}
@@ -577,7 +577,7 @@ static int verify_alpn(picoquic_cnx_t * cnx_client, picoquic_cnx_t * cnx_server,
 	}
 	else
 	{
-		if (cnx_client->alpn == NULL)
+		if (cnx_client->cold->alpn == NULL)
 		{
 			ret = -1;
 		}
@@ -589,7 +589,7 @@ static int verify_alpn(picoquic_cnx_t * cnx_client, picoquic_cnx_t * cnx_server,
 		{
 			ret = -1;
 		}
-		else if (strcmp(cnx_client->alpn, alpn) != 0)
+		else if (strcmp(cnx_client->cold->alpn, alpn) != 0)
 		{
 			ret = -1;
 		}
@@ -801,7 +801,7 @@ static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx,
 		if (packet->length == 0)
 		{
 			/* check whether the client has something to send */
-			picoquic_packet * p = picoquic_create_packet();
+			picoquic_packet * p = picoquic_alloc_packet(test_ctx->qclient);
 
 			if (p == NULL)
 			{
@@ -822,7 +822,7 @@ static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx,
 
 				if (ret == 0)
 				{
-					if (p->length > 0)
+					if (packet->length > 0)
 					{
 						/* queue in c_to_s */
 						target_link = test_ctx->c_to_s_link;
@@ -832,13 +832,20 @@ static int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t * test_ctx,
 					{
 						ret = picoquic_prepare_packet(test_ctx->cnx_server, p, *simulated_time,
 							packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &packet->length);
-						if (ret == 0 && p->length > 0)
+						if (ret == 0 && packet->length > 0)
 						{
 							/* copy and queue in s to c */
 							target_link = test_ctx->s_to_c_link;
 						}
 					}
 				}
+
+				if (ret == 0 && p->length == 0)
+				{
+					/* The packet was not queued, either because nothing was sent or
+					 * because it only carried acknowledgements */
+					picoquic_recycle_packet(test_ctx->qclient, p);
+				}
 			}
 		}
 
@@ -1289,8 +1296,8 @@ int tls_api_server_reset_test()
 
 	 /* verify that client and server have the same reset secret */
 	 if (ret == 0 &&
-		 memcmp(test_ctx->cnx_client->reset_secret,
-			 test_ctx->cnx_server->reset_secret,
+		 memcmp(test_ctx->cnx_client->cold->reset_secret,
+			 test_ctx->cnx_server->cold->reset_secret,
 			 PICOQUIC_RESET_SECRET_SIZE) != 0)
 	 {
 		 ret = -1;
@@ -1847,11 +1854,11 @@ int zero_rtt_test()
         /* Verify that the 0RTT data was sent and acknowledged */
         if (ret == 0 && i == 1)
         {
-            if (test_ctx->cnx_client->nb_zero_rtt_sent == 0)
+            if (test_ctx->cnx_client->cold->nb_zero_rtt_sent == 0)
             {
                 ret = -1;
             }
-            else if (test_ctx->cnx_client->nb_zero_rtt_acked != test_ctx->cnx_client->nb_zero_rtt_sent)
+            else if (test_ctx->cnx_client->cold->nb_zero_rtt_acked != test_ctx->cnx_client->cold->nb_zero_rtt_sent)
             {
                 ret = -1;
             }
@@ -114,19 +114,22 @@ int transport_param_one_test(int mode, uint32_t version, uint32_t proposed_versi
 	int ret = 0;
     picoquic_quic_t quic_ctx;
 	picoquic_cnx_t test_cnx;
+	picoquic_cnx_cold_t test_cold;
 	uint8_t buffer[256];
 	size_t encoded, decoded;
 
     memset(&quic_ctx, 0, sizeof(quic_ctx));
 	memset(&test_cnx, 0, sizeof(picoquic_cnx_t));
+    memset(&test_cold, 0, sizeof(test_cold));
     test_cnx.quic = &quic_ctx;
+    test_cnx.cold = &test_cold;
 
 	/* initialize the connection object to the test parameters */
 	memcpy(&test_cnx.local_parameters, param, sizeof(picoquic_transport_parameters));
 	// test_cnx.version = version;
     test_cnx.version_index = picoquic_get_version_index(version);
 	test_cnx.proposed_version = proposed_version;
-	memcpy(test_cnx.reset_secret, transport_param_reset_secret, PICOQUIC_RESET_SECRET_SIZE);
+	memcpy(test_cnx.cold->reset_secret, transport_param_reset_secret, PICOQUIC_RESET_SECRET_SIZE);
 
 	ret = picoquic_prepare_transport_extensions(&test_cnx, mode, buffer, sizeof(buffer), &encoded);
 
@@ -171,11 +174,14 @@ int transport_param_decode_test(int mode, uint32_t version, uint32_t proposed_ve
     int ret = 0;
     picoquic_quic_t quic_ctx;
     picoquic_cnx_t test_cnx;
+    picoquic_cnx_cold_t test_cold;
     size_t decoded;
 
     memset(&quic_ctx, 0, sizeof(quic_ctx));
     memset(&test_cnx, 0, sizeof(picoquic_cnx_t));
+    memset(&test_cold, 0, sizeof(test_cold));
     test_cnx.quic = &quic_ctx;
+    test_cnx.cold = &test_cold;
 
     // picoquic_init_transport_parameters(&test_cnx.remote_parameters);
     
@@ -205,13 +211,16 @@ int transport_param_fuzz_test(int mode, uint32_t version, uint32_t proposed_vers
 	int fuzz_ret = 0;
     picoquic_quic_t quic_ctx;
 	picoquic_cnx_t test_cnx;
+	picoquic_cnx_cold_t test_cold;
 	uint8_t buffer[256];
 	size_t decoded;
 	uint8_t fuzz_byte = 1;
 
     memset(&quic_ctx, 0, sizeof(quic_ctx));
     memset(&test_cnx, 0, sizeof(picoquic_cnx_t));
+    memset(&test_cold, 0, sizeof(test_cold));
     test_cnx.quic = &quic_ctx;
+    test_cnx.cold = &test_cold;
 
 	/* test for valid arguments */
 	if (target_length < 8 || target_length > sizeof(buffer))
@@ -0,0 +1,293 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2018, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../picoquic/picoquic_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Wake time heap unit test
+ * - Create a QUIC context and a set of connections.
+ * - Assign pseudo random wake times, and verify after each update
+ *   that the earliest connection is found at the root of the heap.
+ * - Delete connections, and verify that the heap and the connection
+ *   list remain consistent.
+ */
+
+#define WAKE_TIME_TEST_NB_CNX 67
+
+static int wake_time_test_verify(picoquic_quic_t * quic, size_t nb_expected, uint64_t current_time)
+{
+    int ret = 0;
+    size_t nb_cnx = 0;
+    picoquic_cnx_t * earliest = NULL;
+    picoquic_cnx_t * cnx = picoquic_get_first_cnx(quic);
+
+    while (cnx != NULL)
+    {
+        if (earliest == NULL || cnx->next_wake_time < earliest->next_wake_time)
+        {
+            earliest = cnx;
+        }
+        nb_cnx++;
+        cnx = picoquic_get_next_cnx(cnx);
+    }
+
+    if (nb_cnx != nb_expected || quic->wake_heap_count != nb_expected)
+    {
+        ret = -1;
+    }
+    else if (nb_cnx == 0)
+    {
+        if (picoquic_get_earliest_cnx_to_wake(quic) != NULL ||
+            picoquic_get_next_wake_delay(quic, current_time, 1000000) != 1000000)
+        {
+            ret = -1;
+        }
+    }
+    else
+    {
+        cnx = picoquic_get_earliest_cnx_to_wake(quic);
+
+        if (cnx == NULL || cnx->next_wake_time != earliest->next_wake_time)
+        {
+            ret = -1;
+        }
+        else if (earliest->next_wake_time > current_time &&
+            picoquic_get_next_wake_delay(quic, current_time, 0x7FFFFFFF) !=
+            (int64_t)(earliest->next_wake_time - current_time))
+        {
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < quic->wake_heap_count; i++)
+    {
+        if (quic->wake_heap[i]->wake_heap_index != i ||
+            (i > 0 && quic->wake_heap[(i - 1) / 2]->next_wake_time > quic->wake_heap[i]->next_wake_time))
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int wake_time_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * test_cnx[WAKE_TIME_TEST_NB_CNX];
+    struct sockaddr_in test_addr;
+    uint64_t current_time = 1000000;
+    uint64_t random_state = 0xDEADBEEFCAFEBABEull;
+    size_t nb_cnx = 0;
+
+    memset(test_cnx, 0, sizeof(test_cnx));
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, current_time, NULL, NULL, NULL, 0);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+
+    /* Create more connections than the initial size of the heap */
+    for (int i = 0; ret == 0 && i < WAKE_TIME_TEST_NB_CNX; i++)
+    {
+        test_addr.sin_port = (uint16_t)(1000 + i);
+        test_cnx[i] = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, current_time, 0, NULL, NULL);
+        if (test_cnx[i] == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            nb_cnx++;
+        }
+    }
+
+    /* Verify that the connection list preserves the creation order */
+    if (ret == 0)
+    {
+        picoquic_cnx_t * cnx = picoquic_get_first_cnx(quic);
+
+        for (int i = 0; ret == 0 && i < WAKE_TIME_TEST_NB_CNX; i++)
+        {
+            if (cnx != test_cnx[i])
+            {
+                ret = -1;
+            }
+            else
+            {
+                cnx = picoquic_get_next_cnx(cnx);
+            }
+        }
+    }
+
+    /* Move the connections around in the heap */
+    for (int i = 0; ret == 0 && i < 8 * WAKE_TIME_TEST_NB_CNX; i++)
+    {
+        int x = i % WAKE_TIME_TEST_NB_CNX;
+
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+
+        test_cnx[x]->next_wake_time = current_time + (random_state % 10000000);
+        picoquic_reinsert_by_wake_time(quic, test_cnx[x]);
+
+        ret = wake_time_test_verify(quic, nb_cnx, current_time);
+    }
+
+    /* Delete connections first, middle, last, then all the others */
+    for (int i = 0; ret == 0 && i < WAKE_TIME_TEST_NB_CNX; i += 3)
+    {
+        picoquic_delete_cnx(test_cnx[i]);
+        test_cnx[i] = NULL;
+        nb_cnx--;
+
+        ret = wake_time_test_verify(quic, nb_cnx, current_time);
+    }
+
+    for (int i = 0; ret == 0 && i < WAKE_TIME_TEST_NB_CNX; i++)
+    {
+        if (test_cnx[i] != NULL)
+        {
+            picoquic_delete_cnx(test_cnx[i]);
+            test_cnx[i] = NULL;
+            nb_cnx--;
+
+            ret = wake_time_test_verify(quic, nb_cnx, current_time);
+        }
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Ready set unit test
+ * - Create a set of connections with staggered wake times.
+ * - Verify that only the connections that are due are returned, and
+ *   that servicing them removes them from the ready set.
+ * - Verify that queuing data or closing makes a connection ready.
+ */
+
+#define READY_CNX_TEST_NB_CNX 32
+
+int ready_cnx_test()
+{
+    int ret = 0;
+    picoquic_quic_t * quic = NULL;
+    picoquic_cnx_t * test_cnx[READY_CNX_TEST_NB_CNX];
+    picoquic_cnx_t * cnx;
+    struct sockaddr_in test_addr;
+    uint64_t current_time = 1000000;
+    uint64_t ready_time = current_time + 10500;
+    const uint8_t test_data[] = { 'h', 'e', 'l', 'l', 'o' };
+    int nb_ready = 0;
+
+    memset(test_cnx, 0, sizeof(test_cnx));
+    memset(&test_addr, 0, sizeof(test_addr));
+    test_addr.sin_family = AF_INET;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, current_time, NULL, NULL, NULL, 0);
+    if (quic == NULL)
+    {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < READY_CNX_TEST_NB_CNX; i++)
+    {
+        test_addr.sin_port = (uint16_t)(1000 + i);
+        test_cnx[i] = picoquic_create_cnx(quic, 0, (struct sockaddr *)&test_addr, current_time, 0, NULL, NULL);
+        if (test_cnx[i] == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            /* Insert in reverse order of wake time */
+            test_cnx[i]->next_wake_time = current_time + 1000 * (READY_CNX_TEST_NB_CNX - 1 - i);
+            picoquic_reinsert_by_wake_time(quic, test_cnx[i]);
+        }
+    }
+
+    /* Service the ready connections, in wake time order */
+    while (ret == 0 && (cnx = picoquic_get_next_ready_cnx(quic, ready_time)) != NULL)
+    {
+        if (cnx->next_wake_time > ready_time || cnx->next_wake_time < current_time + 1000 * nb_ready)
+        {
+            ret = -1;
+        }
+        else
+        {
+            cnx->next_wake_time = ready_time + 1000000;
+            picoquic_reinsert_by_wake_time(quic, cnx);
+            nb_ready++;
+        }
+    }
+
+    if (ret == 0 && nb_ready != 11)
+    {
+        ret = -1;
+    }
+
+    /* New data and close requests make idle connections ready */
+    if (ret == 0 && (picoquic_add_to_stream(test_cnx[2], 0, test_data, sizeof(test_data), 0) != 0 ||
+        picoquic_close(test_cnx[5], 0) != 0))
+    {
+        ret = -1;
+    }
+
+    nb_ready = 0;
+    while (ret == 0 && (cnx = picoquic_get_next_ready_cnx(quic, ready_time)) != NULL)
+    {
+        if (cnx != test_cnx[2] && cnx != test_cnx[5])
+        {
+            ret = -1;
+        }
+        else
+        {
+            cnx->next_wake_time = ready_time + 1000000;
+            picoquic_reinsert_by_wake_time(quic, cnx);
+            nb_ready++;
+        }
+    }
+
+    if (ret == 0 && nb_ready != 2)
+    {
+        ret = -1;
+    }
+
+    if (quic != NULL)
+    {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}